@@ -0,0 +1,846 @@
+//
+//  main.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+/*
+ Load generator for IQHTTPServer and IQTransferManager.
+
+ Runs a set of scenarios against an in-process server (or a local server started with -serve YES)
+ and prints the results as JSON, or as one line of text per scenario with -format text. Options are
+ given as "-name value" pairs:
+
+   -scenarios        Comma separated list of closed, open and transfer (default: all of them)
+   -connections      Number of client connections (16)
+   -keepAlive        NO to open a new connection for every request (YES)
+   -pipeline         Requests in flight per connection (1)
+   -requestBodySize  POST bodies of this size to /echo instead of GET /response (0)
+   -responseSize     Size of the responses served by the in-process server (1024)
+   -rate             Requests per second of the open-loop scenario (10000)
+   -transferSize     Size of the downloads of the transfer scenario (8 MB)
+   -transfers        Concurrent downloads of the transfer scenario (4)
+   -duration         Seconds measured per scenario (5)
+   -warmup           Seconds run before measuring (1)
+   -workers          Worker threads of the in-process server (0)
+   -port             Use the server listening on this local port instead of an in-process one
+   -serve            YES to only run the server, on -port (8080), for use by another process
+   -countAllocations NO to turn off the allocation counting (YES)
+
+ The closed-loop scenario sends a new request as soon as a response is complete, so it measures
+ the capacity of the server. The open-loop scenario sends requests at a fixed rate regardless of
+ how fast the responses come back, and measures the latency from the time each request was due, so
+ that queueing delays are not hidden (coordinated omission).
+
+ CPU time and allocations are counted for the entire process. With an in-process server, the CPU
+ time of the load generator thread is reported separately and subtracted from the per-request
+ figure. Allocations are counted by hooking the default malloc zone, which the load generator does
+ not use while measuring.
+ */
+
+#import <Foundation/Foundation.h>
+#import <IQNetworking/IQNetworking.h>
+#import <sys/socket.h>
+#import <sys/resource.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <arpa/inet.h>
+#import <poll.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <mach/mach.h>
+#import <mach/mach_time.h>
+#import <malloc/malloc.h>
+#import <libkern/OSAtomic.h>
+
+#define kBenchReadBufferSize 65536
+#define kBenchMaxPipeline 64
+
+#pragma mark - Measurement
+
+static uint64_t BenchMicroseconds(void)
+{
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        mach_timebase_info(&timebase);
+    });
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+}
+
+static double BenchProcessCPU(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static double BenchThreadCPU(void)
+{
+    mach_port_t thread = mach_thread_self();
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    kern_return_t result = thread_info(thread, THREAD_BASIC_INFO, (thread_info_t)&info, &count);
+    mach_port_deallocate(mach_task_self(), thread);
+    if(result != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.user_time.seconds + info.user_time.microseconds / 1e6 + info.system_time.seconds + info.system_time.microseconds / 1e6;
+}
+
+static volatile int64_t BenchAllocations;
+static void* (*BenchSystemMalloc)(struct _malloc_zone_t* zone, size_t size);
+static void* (*BenchSystemCalloc)(struct _malloc_zone_t* zone, size_t count, size_t size);
+static void* (*BenchSystemRealloc)(struct _malloc_zone_t* zone, void* ptr, size_t size);
+
+static void* BenchMalloc(struct _malloc_zone_t* zone, size_t size)
+{
+    OSAtomicIncrement64(&BenchAllocations);
+    return BenchSystemMalloc(zone, size);
+}
+
+static void* BenchCalloc(struct _malloc_zone_t* zone, size_t count, size_t size)
+{
+    OSAtomicIncrement64(&BenchAllocations);
+    return BenchSystemCalloc(zone, count, size);
+}
+
+static void* BenchRealloc(struct _malloc_zone_t* zone, void* ptr, size_t size)
+{
+    OSAtomicIncrement64(&BenchAllocations);
+    return BenchSystemRealloc(zone, ptr, size);
+}
+
+static void BenchCountAllocations(void)
+{
+    malloc_zone_t* zone = malloc_default_zone();
+    // The zone functions are write protected on recent systems
+    vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(malloc_zone_t), 0, VM_PROT_READ | VM_PROT_WRITE);
+    BenchSystemMalloc = zone->malloc;
+    BenchSystemCalloc = zone->calloc;
+    BenchSystemRealloc = zone->realloc;
+    zone->malloc = BenchMalloc;
+    zone->calloc = BenchCalloc;
+    zone->realloc = BenchRealloc;
+    vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(malloc_zone_t), 0, VM_PROT_READ);
+}
+
+/**
+ Resource use over a measured interval.
+ */
+typedef struct {
+    uint64_t time;
+    double cpu;
+    double threadCPU;
+    int64_t allocations;
+} BenchUsage;
+
+static BenchUsage BenchCurrentUsage(void)
+{
+    BenchUsage usage;
+    usage.time = BenchMicroseconds();
+    usage.cpu = BenchProcessCPU();
+    usage.threadCPU = BenchThreadCPU();
+    usage.allocations = OSAtomicAdd64(0, &BenchAllocations);
+    return usage;
+}
+
+/**
+ Latencies in microseconds. Every sample is kept, so percentiles are exact.
+ */
+typedef struct {
+    uint32_t* values;
+    size_t count, capacity;
+} BenchSamples;
+
+static void BenchSamplesAdd(BenchSamples* samples, uint64_t micros)
+{
+    if(samples->count == samples->capacity) {
+        samples->capacity = MAX(samples->capacity * 2, 65536);
+        samples->values = realloc(samples->values, samples->capacity * sizeof(uint32_t));
+    }
+    samples->values[samples->count++] = (uint32_t)MIN(micros, (uint64_t)UINT32_MAX);
+}
+
+static int BenchCompareSamples(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static NSDictionary* BenchLatencySummary(BenchSamples* samples)
+{
+    if(samples->count == 0) {
+        return @{};
+    }
+    qsort(samples->values, samples->count, sizeof(uint32_t), BenchCompareSamples);
+    double sum = 0;
+    for(size_t i = 0; i < samples->count; i++) {
+        sum += samples->values[i];
+    }
+    NSMutableDictionary* summary = [NSMutableDictionary dictionaryWithCapacity:5];
+    double percentiles[] = {0.5, 0.99, 0.999};
+    NSString* names[] = {@"p50", @"p99", @"p999"};
+    for(int i = 0; i < 3; i++) {
+        size_t index = (size_t)ceil(percentiles[i] * samples->count);
+        summary[names[i]] = [NSNumber numberWithUnsignedInt:samples->values[MAX(index, 1) - 1]];
+    }
+    summary[@"max"] = [NSNumber numberWithUnsignedInt:samples->values[samples->count - 1]];
+    summary[@"mean"] = [NSNumber numberWithDouble:round(sum / samples->count)];
+    return summary;
+}
+
+static void BenchAddUsage(NSMutableDictionary* result, BenchUsage start, BenchUsage end, unsigned long long count, BOOL separateThread)
+{
+    if(count == 0) {
+        return;
+    }
+    double cpu = end.cpu - start.cpu;
+    double threadCPU = end.threadCPU - start.threadCPU;
+    if(separateThread) {
+        // The load generator runs on this thread, the rest is the server
+        result[@"clientCpuPerRequest"] = [NSNumber numberWithDouble:threadCPU * 1e6 / count];
+        cpu -= threadCPU;
+    }
+    result[@"cpuPerRequest"] = [NSNumber numberWithDouble:cpu * 1e6 / count];
+    result[@"allocationsPerRequest"] = [NSNumber numberWithDouble:(double)(end.allocations - start.allocations) / count];
+}
+
+#pragma mark - Load generator
+
+typedef struct {
+    int fd;
+    // Incremented whenever the socket is replaced, as the new one may get the same descriptor
+    unsigned generation;
+    BOOL connecting;
+    uint8_t* readBuffer;
+    size_t readLength;
+    BOOL inBody;
+    long long bodyRemaining;
+    int status;
+    // Requests assigned to the connection that have not been completely written
+    NSUInteger unwritten;
+    size_t writeOffset;
+    // The start times of the requests in flight, oldest first
+    uint64_t starts[kBenchMaxPipeline];
+    NSUInteger first, count;
+} BenchConnection;
+
+typedef struct {
+    struct sockaddr_in address;
+    NSUInteger connectionCount;
+    NSUInteger pipeline;
+    BOOL keepAlive;
+    BOOL openLoop;
+    double rate;
+    const uint8_t* request;
+    size_t requestLength;
+    BenchConnection* connections;
+    uint64_t measureStart, end;
+    BOOL measuring;
+    BenchUsage startUsage;
+    BenchSamples samples;
+    unsigned long long completed, errors, bytesIn, bytesOut;
+} BenchLoad;
+
+static void BenchConnectionOpen(BenchLoad* load, BenchConnection* c)
+{
+    c->generation++;
+    c->readLength = 0;
+    c->inBody = NO;
+    c->writeOffset = 0;
+    c->connecting = YES;
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(c->fd < 0) {
+        return;
+    }
+    int value = 1;
+    setsockopt(c->fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(value));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    if(connect(c->fd, (const struct sockaddr*)&load->address, sizeof(load->address)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void BenchConnectionClose(BenchConnection* c)
+{
+    if(c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void BenchAssign(BenchLoad* load, BenchConnection* c, uint64_t start)
+{
+    c->starts[(c->first + c->count) % kBenchMaxPipeline] = start;
+    c->count++;
+    c->unwritten++;
+}
+
+/**
+ In the closed loop, every connection keeps its pipeline full for as long as the run lasts.
+ */
+static void BenchRefill(BenchLoad* load, BenchConnection* c, uint64_t now)
+{
+    if(load->openLoop || now >= load->end) {
+        return;
+    }
+    while(c->count < load->pipeline) {
+        BenchAssign(load, c, now);
+    }
+}
+
+/**
+ Drops the requests in flight on a connection that failed, and connects again.
+ */
+static void BenchConnectionFailed(BenchLoad* load, BenchConnection* c, uint64_t now)
+{
+    if(load->measuring) {
+        load->errors += c->count;
+    }
+    c->count = 0;
+    c->unwritten = 0;
+    BenchConnectionClose(c);
+    BenchConnectionOpen(load, c);
+    BenchRefill(load, c, now);
+}
+
+static void BenchResponseComplete(BenchLoad* load, BenchConnection* c, uint64_t now)
+{
+    uint64_t start = c->starts[c->first];
+    c->first = (c->first + 1) % kBenchMaxPipeline;
+    c->count--;
+    if(load->measuring) {
+        if(c->status == 200) {
+            load->completed++;
+            BenchSamplesAdd(&load->samples, now > start ? now - start : 0);
+        } else {
+            load->errors++;
+        }
+    }
+    if(!load->keepAlive) {
+        BenchConnectionClose(c);
+        BenchConnectionOpen(load, c);
+    }
+    BenchRefill(load, c, now);
+}
+
+/**
+ Parses a response head. Returns 0 if more data is needed, -1 if the response cannot be handled.
+ */
+static int BenchParseHead(const uint8_t* bytes, size_t length, size_t* headLength, long long* contentLength, int* status)
+{
+    const uint8_t* end = memmem(bytes, length, "\r\n\r\n", 4);
+    if(!end) {
+        return 0;
+    }
+    *headLength = (size_t)(end - bytes) + 4;
+    if(*headLength < 16 || memcmp(bytes, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    *status = (bytes[9] - '0') * 100 + (bytes[10] - '0') * 10 + (bytes[11] - '0');
+    *contentLength = 0;
+    const uint8_t* line = (const uint8_t*)memchr(bytes, '\n', (size_t)(end - bytes) + 2) + 1;
+    while(line < end) {
+        const uint8_t* lineEnd = memchr(line, '\r', (size_t)(end - line) + 1);
+        size_t lineLength = (size_t)(lineEnd - line);
+        if(lineLength > 15 && strncasecmp((const char*)line, "Content-Length:", 15) == 0) {
+            long long value = 0;
+            for(const uint8_t* p = line + 15; p < lineEnd; p++) {
+                if(*p >= '0' && *p <= '9') value = value * 10 + (*p - '0');
+            }
+            *contentLength = value;
+        } else if(lineLength > 18 && strncasecmp((const char*)line, "Transfer-Encoding:", 18) == 0) {
+            // The benchmark routes always respond with a known length
+            return -1;
+        }
+        line = lineEnd + 2;
+    }
+    return 1;
+}
+
+static void BenchRead(BenchLoad* load, BenchConnection* c, uint64_t now)
+{
+    ssize_t n = recv(c->fd, c->readBuffer + c->readLength, kBenchReadBufferSize - c->readLength, 0);
+    if(n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if(n <= 0) {
+        BenchConnectionFailed(load, c, now);
+        return;
+    }
+    if(load->measuring) load->bytesIn += (unsigned long long)n;
+    c->readLength += (size_t)n;
+    size_t offset = 0;
+    unsigned generation = c->generation;
+    while(offset < c->readLength && c->generation == generation) {
+        if(c->inBody) {
+            size_t take = (size_t)MIN((long long)(c->readLength - offset), c->bodyRemaining);
+            offset += take;
+            c->bodyRemaining -= (long long)take;
+            if(c->bodyRemaining == 0) {
+                c->inBody = NO;
+                BenchResponseComplete(load, c, now);
+            }
+            continue;
+        }
+        size_t headLength;
+        long long contentLength;
+        int result = BenchParseHead(c->readBuffer + offset, c->readLength - offset, &headLength, &contentLength, &c->status);
+        if(result == 0) {
+            if(offset == 0 && c->readLength == kBenchReadBufferSize) {
+                BenchConnectionFailed(load, c, now);
+            }
+            break;
+        }
+        if(result < 0 || c->count == 0) {
+            BenchConnectionFailed(load, c, now);
+            return;
+        }
+        offset += headLength;
+        if(contentLength > 0) {
+            c->inBody = YES;
+            c->bodyRemaining = contentLength;
+        } else {
+            BenchResponseComplete(load, c, now);
+        }
+    }
+    if(c->generation != generation) {
+        // The connection was replaced, whatever is left belonged to the old one
+        return;
+    }
+    memmove(c->readBuffer, c->readBuffer + offset, c->readLength - offset);
+    c->readLength -= offset;
+}
+
+static void BenchWrite(BenchLoad* load, BenchConnection* c, uint64_t now)
+{
+    while(c->unwritten > 0) {
+        ssize_t n = send(c->fd, load->request + c->writeOffset, load->requestLength - c->writeOffset, 0);
+        if(n < 0) {
+            if(errno != EAGAIN && errno != EINTR) {
+                BenchConnectionFailed(load, c, now);
+            }
+            return;
+        }
+        if(load->measuring) load->bytesOut += (unsigned long long)n;
+        c->writeOffset += (size_t)n;
+        if(c->writeOffset == load->requestLength) {
+            c->writeOffset = 0;
+            c->unwritten--;
+        }
+    }
+}
+
+static NSMutableDictionary* BenchRunLoad(BenchLoad* load, NSTimeInterval warmup, NSTimeInterval duration, BOOL inProcess)
+{
+    uint64_t begin = BenchMicroseconds();
+    load->measureStart = begin + (uint64_t)(warmup * 1e6);
+    load->end = load->measureStart + (uint64_t)(duration * 1e6);
+    load->pipeline = load->keepAlive ? MIN(MAX(load->pipeline, 1), kBenchMaxPipeline) : 1;
+    load->connections = calloc(load->connectionCount, sizeof(BenchConnection));
+    struct pollfd* fds = calloc(load->connectionCount, sizeof(struct pollfd));
+    unsigned* generations = calloc(load->connectionCount, sizeof(unsigned));
+    for(NSUInteger i = 0; i < load->connectionCount; i++) {
+        BenchConnection* c = &load->connections[i];
+        c->readBuffer = malloc(kBenchReadBufferSize);
+        BenchConnectionOpen(load, c);
+        BenchRefill(load, c, begin);
+    }
+    // Grow the sample buffer up front rather than while measuring
+    size_t expected = (size_t)(duration * (load->openLoop ? load->rate : 100000));
+    load->samples.capacity = MAX(expected, 65536);
+    load->samples.values = malloc(load->samples.capacity * sizeof(uint32_t));
+    uint64_t interval = load->openLoop ? (uint64_t)MAX(1e6 / MAX(load->rate, 1), 1) : 0;
+    uint64_t scheduled = 0;
+    NSUInteger nextConnection = 0;
+    BenchUsage endUsage = {0};
+
+    while(YES) {
+        uint64_t now = BenchMicroseconds();
+        if(!load->measuring && now >= load->measureStart && !endUsage.time) {
+            load->measuring = YES;
+            load->startUsage = BenchCurrentUsage();
+        }
+        if(load->measuring && now >= load->end) {
+            load->measuring = NO;
+            endUsage = BenchCurrentUsage();
+        }
+        if(now >= load->end) {
+            break;
+        }
+        if(load->openLoop) {
+            // Request i is due at begin + i * interval. Due requests go to connections with room in
+            // their pipeline, the others wait (and their latency keeps growing).
+            NSUInteger full = 0;
+            while(begin + scheduled * interval <= now && full < load->connectionCount) {
+                BenchConnection* c = &load->connections[nextConnection++ % load->connectionCount];
+                if(c->fd >= 0 && c->count < load->pipeline) {
+                    BenchAssign(load, c, begin + scheduled * interval);
+                    scheduled++;
+                    full = 0;
+                } else {
+                    full++;
+                }
+            }
+        }
+        for(NSUInteger i = 0; i < load->connectionCount; i++) {
+            BenchConnection* c = &load->connections[i];
+            if(c->fd < 0) {
+                BenchConnectionFailed(load, c, now);
+            }
+            fds[i].fd = c->fd;
+            generations[i] = c->generation;
+            fds[i].events = POLLIN;
+            if(c->connecting || c->unwritten > 0) fds[i].events |= POLLOUT;
+            fds[i].revents = 0;
+        }
+        int timeout = 100;
+        if(load->openLoop) {
+            uint64_t due = begin + scheduled * interval;
+            timeout = due > now ? (int)MIN((due - now) / 1000, 100) : 0;
+        }
+        if(poll(fds, (nfds_t)load->connectionCount, timeout) <= 0) {
+            continue;
+        }
+        now = BenchMicroseconds();
+        for(NSUInteger i = 0; i < load->connectionCount; i++) {
+            BenchConnection* c = &load->connections[i];
+            short revents = fds[i].revents;
+            if(!revents || c->generation != generations[i]) {
+                continue;
+            }
+            if(c->connecting && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+                    BenchConnectionFailed(load, c, now);
+                    continue;
+                }
+                c->connecting = NO;
+            }
+            if(revents & POLLOUT) {
+                BenchWrite(load, c, now);
+            }
+            if(c->generation == generations[i] && (revents & (POLLIN | POLLHUP | POLLERR))) {
+                BenchRead(load, c, now);
+            }
+        }
+    }
+
+    for(NSUInteger i = 0; i < load->connectionCount; i++) {
+        BenchConnectionClose(&load->connections[i]);
+        free(load->connections[i].readBuffer);
+    }
+    free(load->connections);
+    free(fds);
+    free(generations);
+
+    double seconds = (endUsage.time - load->startUsage.time) / 1e6;
+    NSMutableDictionary* result = [NSMutableDictionary dictionary];
+    result[@"scenario"] = load->openLoop ? @"open" : @"closed";
+    result[@"connections"] = [NSNumber numberWithUnsignedInteger:load->connectionCount];
+    result[@"pipeline"] = [NSNumber numberWithUnsignedInteger:load->pipeline];
+    result[@"keepAlive"] = [NSNumber numberWithBool:load->keepAlive];
+    if(load->openLoop) {
+        result[@"targetRate"] = [NSNumber numberWithDouble:load->rate];
+    }
+    result[@"duration"] = [NSNumber numberWithDouble:seconds];
+    result[@"requests"] = [NSNumber numberWithUnsignedLongLong:load->completed];
+    result[@"errors"] = [NSNumber numberWithUnsignedLongLong:load->errors];
+    result[@"requestsPerSecond"] = [NSNumber numberWithDouble:round(load->completed / seconds)];
+    result[@"bytesPerSecond"] = [NSNumber numberWithDouble:round((load->bytesIn + load->bytesOut) / seconds)];
+    result[@"latencyMicroseconds"] = BenchLatencySummary(&load->samples);
+    BenchAddUsage(result, load->startUsage, endUsage, load->completed, inProcess);
+    free(load->samples.values);
+    return result;
+}
+
+#pragma mark - Transfer manager
+
+/**
+ Keeps a number of downloads going until the time is up, then waits for the last ones. The
+ handlers are called on the main queue, which is run here.
+ */
+static void BenchTransfers(NSURL* url, NSUInteger concurrency, NSTimeInterval duration, BenchSamples* samples, unsigned long long* bytes, unsigned long long* errors)
+{
+    IQTransferManager* manager = [IQTransferManager new];
+    manager.maxConcurrentTransfers = concurrency;
+    uint64_t end = BenchMicroseconds() + (uint64_t)(duration * 1e6);
+    __block NSUInteger inFlight = 0;
+    __block void (^start)(void);
+    start = ^{
+        uint64_t began = BenchMicroseconds();
+        inFlight++;
+        [manager downloadDataFromURL:url handler:^(NSData *data) {
+            uint64_t now = BenchMicroseconds();
+            inFlight--;
+            if(samples) BenchSamplesAdd(samples, now - began);
+            *bytes += data.length;
+            if(now < end) start();
+        } errorHandler:^(NSError *error) {
+            inFlight--;
+            (*errors)++;
+            if(BenchMicroseconds() < end) start();
+        }];
+    };
+    for(NSUInteger i = 0; i < concurrency; i++) {
+        start();
+    }
+    while(inFlight > 0) {
+        @autoreleasepool {
+            [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+        }
+    }
+    // Break the reference cycle of the block
+    start = nil;
+}
+
+static NSMutableDictionary* BenchRunTransfers(NSURL* url, NSUInteger concurrency, long long size, NSTimeInterval warmup, NSTimeInterval duration)
+{
+    unsigned long long bytes = 0, errors = 0;
+    BenchTransfers(url, concurrency, warmup, NULL, &bytes, &errors);
+
+    BenchSamples samples = {0};
+    samples.capacity = 65536;
+    samples.values = malloc(samples.capacity * sizeof(uint32_t));
+    bytes = 0;
+    errors = 0;
+    BenchUsage start = BenchCurrentUsage();
+    BenchTransfers(url, concurrency, duration, &samples, &bytes, &errors);
+    BenchUsage end = BenchCurrentUsage();
+
+    double seconds = (end.time - start.time) / 1e6;
+    NSMutableDictionary* result = [NSMutableDictionary dictionary];
+    result[@"scenario"] = @"transfer";
+    result[@"concurrency"] = [NSNumber numberWithUnsignedInteger:concurrency];
+    result[@"transferSize"] = [NSNumber numberWithLongLong:size];
+    result[@"duration"] = [NSNumber numberWithDouble:seconds];
+    result[@"requests"] = [NSNumber numberWithUnsignedLong:samples.count];
+    result[@"errors"] = [NSNumber numberWithUnsignedLongLong:errors];
+    result[@"requestsPerSecond"] = [NSNumber numberWithDouble:samples.count / seconds];
+    result[@"bytesPerSecond"] = [NSNumber numberWithDouble:round(bytes / seconds)];
+    result[@"latencyMicroseconds"] = BenchLatencySummary(&samples);
+    BenchAddUsage(result, start, end, samples.count, NO);
+    free(samples.values);
+    return result;
+}
+
+#pragma mark - Server
+
+/**
+ Runs the in-process server on a thread of its own, so that the load generator can block in poll.
+ */
+@interface BenchServerThread : NSObject {
+@public
+    NSRunLoop* runLoop;
+}
+- (void) run:(dispatch_semaphore_t)started;
+@end
+
+@implementation BenchServerThread
+
+- (void) run:(dispatch_semaphore_t)started
+{
+    @autoreleasepool {
+        runLoop = [NSRunLoop currentRunLoop];
+        // The port keeps the run loop from exiting before the server socket has been added
+        [runLoop addPort:[NSPort port] forMode:NSDefaultRunLoopMode];
+        dispatch_semaphore_signal(started);
+        while(YES) {
+            @autoreleasepool {
+                [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+            }
+        }
+    }
+}
+
+@end
+
+static NSData* BenchPayload(long long size)
+{
+    NSMutableData* data = [NSMutableData dataWithLength:(NSUInteger)size];
+    uint8_t* bytes = data.mutableBytes;
+    for(long long i = 0; i < size; i++) {
+        bytes[i] = (uint8_t)('a' + i % 26);
+    }
+    return data;
+}
+
+static IQHTTPServer* BenchServer(UInt16 port, NSUInteger workers, long long responseSize, long long transferSize)
+{
+    NSData* response = BenchPayload(responseSize);
+    NSData* transfer = BenchPayload(transferSize);
+    IQHTTPServer* server = [[IQHTTPServer alloc] initWithAddress:@"127.0.0.1" port:port workers:workers];
+    server.compressionEnabled = NO;
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/response" options:0 error:nil] method:@"GET" callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request setValue:@"application/octet-stream" forResponseHeaderField:@"Content-Type"];
+        [request writeData:response];
+        [request done];
+    }];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/transfer" options:0 error:nil] method:@"GET" callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request setValue:@"application/octet-stream" forResponseHeaderField:@"Content-Type"];
+        [request writeData:transfer];
+        [request done];
+    }];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/echo" options:0 error:nil] method:@"POST" callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request readRequestBody:^(IQHTTPServerRequest *request, NSData *data) {
+            [request setValue:@"application/octet-stream" forResponseHeaderField:@"Content-Type"];
+            [request writeData:response];
+            [request done];
+        } atomic:YES];
+    }];
+    [server addMetricsURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/metrics" options:0 error:nil]];
+    return server;
+}
+
+static NSData* BenchRequest(long long bodySize, BOOL keepAlive)
+{
+    NSMutableString* head = [NSMutableString stringWithString:bodySize > 0 ? @"POST /echo HTTP/1.1\r\n" : @"GET /response HTTP/1.1\r\n"];
+    [head appendString:@"Host: 127.0.0.1\r\n"];
+    if(!keepAlive) {
+        [head appendString:@"Connection: close\r\n"];
+    }
+    if(bodySize > 0) {
+        [head appendFormat:@"Content-Type: application/octet-stream\r\nContent-Length: %lld\r\n", bodySize];
+    }
+    [head appendString:@"\r\n"];
+    NSMutableData* request = [[head dataUsingEncoding:NSASCIIStringEncoding] mutableCopy];
+    if(bodySize > 0) {
+        [request appendData:BenchPayload(bodySize)];
+    }
+    return request;
+}
+
+#pragma mark - Main
+
+int main(int argc, const char * argv[])
+{
+    @autoreleasepool {
+        NSUserDefaults* options = [NSUserDefaults standardUserDefaults];
+        [options registerDefaults:@{
+            @"scenarios": @"closed,open,transfer",
+            @"connections": @16,
+            @"keepAlive": @YES,
+            @"pipeline": @1,
+            @"requestBodySize": @0,
+            @"responseSize": @1024,
+            @"rate": @10000,
+            @"transferSize": @(8*1024*1024),
+            @"transfers": @4,
+            @"duration": @5,
+            @"warmup": @1,
+            @"workers": @0,
+            @"port": @0,
+            @"serve": @NO,
+            @"countAllocations": @YES,
+            @"format": @"json",
+        }];
+        long long responseSize = [[options objectForKey:@"responseSize"] longLongValue];
+        long long transferSize = [[options objectForKey:@"transferSize"] longLongValue];
+        UInt16 port = (UInt16)[options integerForKey:@"port"];
+
+        if([options boolForKey:@"serve"]) {
+            IQHTTPServer* server = BenchServer(port ? port : 8080, [options integerForKey:@"workers"], responseSize, transferSize);
+            server.started = YES;
+            if(!server.started) {
+                fprintf(stderr, "Could not start the server\n");
+                return 1;
+            }
+            fprintf(stderr, "Serving on 127.0.0.1:%d\n", server.port);
+            [[NSRunLoop currentRunLoop] run];
+            return 0;
+        }
+
+        IQHTTPServer* server = nil;
+        if(port == 0) {
+            BenchServerThread* serverThread = [BenchServerThread new];
+            dispatch_semaphore_t started = dispatch_semaphore_create(0);
+            [NSThread detachNewThreadSelector:@selector(run:) toTarget:serverThread withObject:started];
+            dispatch_semaphore_wait(started, DISPATCH_TIME_FOREVER);
+            server = BenchServer(0, [options integerForKey:@"workers"], responseSize, transferSize);
+            server.runLoop = serverThread->runLoop;
+            server.started = YES;
+            if(!server.started) {
+                fprintf(stderr, "Could not start the server\n");
+                return 1;
+            }
+            port = server.port;
+        }
+        if([options boolForKey:@"countAllocations"]) {
+            BenchCountAllocations();
+        }
+
+        NSMutableArray* results = [NSMutableArray array];
+        NSTimeInterval warmup = [options doubleForKey:@"warmup"];
+        NSTimeInterval duration = [options doubleForKey:@"duration"];
+        for(NSString* scenario in [[options stringForKey:@"scenarios"] componentsSeparatedByString:@","]) {
+            NSMutableDictionary* result = nil;
+            if([scenario isEqualToString:@"closed"] || [scenario isEqualToString:@"open"]) {
+                long long bodySize = [[options objectForKey:@"requestBodySize"] longLongValue];
+                NSData* request = BenchRequest(bodySize, [options boolForKey:@"keepAlive"]);
+                BenchLoad load;
+                memset(&load, 0, sizeof(load));
+                load.address.sin_len = sizeof(load.address);
+                load.address.sin_family = AF_INET;
+                load.address.sin_port = htons(port);
+                load.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                load.connectionCount = MAX([options integerForKey:@"connections"], 1);
+                load.pipeline = [options integerForKey:@"pipeline"];
+                load.keepAlive = [options boolForKey:@"keepAlive"];
+                load.openLoop = [scenario isEqualToString:@"open"];
+                load.rate = [options doubleForKey:@"rate"];
+                load.request = request.bytes;
+                load.requestLength = request.length;
+                result = BenchRunLoad(&load, warmup, duration, server != nil);
+                result[@"requestBodySize"] = [NSNumber numberWithLongLong:bodySize];
+                result[@"responseSize"] = [NSNumber numberWithLongLong:responseSize];
+            } else if([scenario isEqualToString:@"transfer"]) {
+                NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/transfer", port]];
+                result = BenchRunTransfers(url, MAX([options integerForKey:@"transfers"], 1), transferSize, warmup, duration);
+            } else {
+                fprintf(stderr, "Unknown scenario '%s'\n", scenario.UTF8String);
+                return 1;
+            }
+            result[@"server"] = server ? @"in-process" : @"local";
+            [results addObject:result];
+        }
+
+        if([[options stringForKey:@"format"] isEqualToString:@"text"]) {
+            for(NSDictionary* result in results) {
+                NSMutableArray* fields = [NSMutableArray array];
+                for(NSString* key in [[result allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+                    id value = result[key];
+                    if([value isKindOfClass:[NSDictionary class]]) {
+                        for(NSString* subkey in [[value allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+                            [fields addObject:[NSString stringWithFormat:@"%@.%@=%@", key, subkey, value[subkey]]];
+                        }
+                    } else {
+                        [fields addObject:[NSString stringWithFormat:@"%@=%@", key, value]];
+                    }
+                }
+                printf("%s\n", [[fields componentsJoinedByString:@" "] UTF8String]);
+            }
+        } else {
+            NSData* json = [NSJSONSerialization dataWithJSONObject:@{@"benchmark": @"IQNetworking", @"results": results} options:NSJSONWritingPrettyPrinted error:nil];
+            fwrite(json.bytes, 1, json.length, stdout);
+            printf("\n");
+        }
+        server.started = NO;
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+//
+//  IQHTTPClient.h
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+@class IQHTTPClientTask;
+
+typedef void (^IQHTTPClientResponseHandler)(NSInteger statusCode, NSDictionary* headers);
+typedef BOOL (^IQHTTPClientDataHandler)(NSData* data);
+typedef void (^IQHTTPClientCompletionHandler)(NSError* error);
+
+/**
+ An HTTP/1.1 client using plain sockets. Connections are kept open after a response and reused
+ for later requests to the same host, so a series of small requests pays for TCP connection
+ setup only once per connection. Host names are resolved once and the result is reused for
+ dnsCacheTimeout seconds.
+
+ Requests beyond the connection limits wait for a connection to become available. All sockets
+ are scheduled on the run loop given when the client was created, and all handlers are called
+ on its thread.
+
+ Only plain http URLs are supported (see canHandleRequest:).
+ */
+@interface IQHTTPClient : NSObject
+
+/**
+ Creates a client scheduled on the main run loop.
+ */
+- (id) init;
+- (id) initWithRunLoop:(NSRunLoop*)runLoop;
+
+/**
+ YES if the request can be sent by this client (plain http without authentication in the URL).
+ */
++ (BOOL) canHandleRequest:(NSURLRequest*)request;
+
+/**
+ Sends a request. The response handler is called when the response head has been received, the
+ data handler for each part of the body (return NO to cancel the request), and the completion
+ handler when the response is complete or the request has failed. Errors are in the
+ NSURLErrorDomain. A cancelled request gets no more callbacks.
+
+ The request body may be given as HTTPBody or HTTPBodyStream (sent with chunked transfer
+ encoding). The timeoutInterval of the request applies to each wait for the server.
+
+ This method may be called from any thread.
+ */
+- (IQHTTPClientTask*) sendRequest:(NSURLRequest*)request responseHandler:(IQHTTPClientResponseHandler)responseHandler dataHandler:(IQHTTPClientDataHandler)dataHandler completionHandler:(IQHTTPClientCompletionHandler)completionHandler;
+
+/**
+ Closes the connections that are not currently used by a request.
+ */
+- (void) closeIdleConnections;
+
+/**
+ The maximum number of connections to a single host (and port). The default is 6.
+ */
+@property (nonatomic) NSUInteger maxConnectionsPerHost;
+
+/**
+ The maximum number of connections in total. When the limit is reached, idle connections to
+ other hosts are closed to make room for new ones. The default is 32.
+ */
+@property (nonatomic) NSUInteger maxConnections;
+
+/**
+ Set to YES to send idempotent requests (GET and HEAD) on a busy connection without waiting for
+ the previous response, when all connections to the host are in use. Requests are only pipelined
+ on connections that have already completed a response, and are resent on a new connection if
+ the server closes the connection before responding. The default is NO.
+ */
+@property (nonatomic) BOOL pipeliningEnabled;
+
+/**
+ The maximum number of requests in flight on one connection when pipelining. The default is 4.
+ */
+@property (nonatomic) NSUInteger maxPipelineDepth;
+
+/**
+ Connections that have been idle for this long are closed. The default is 5 seconds, which is below the
+ keep-alive timeout of most servers.
+ */
+@property (nonatomic) NSTimeInterval idleTimeout;
+
+/**
+ The time resolved host addresses are reused. The default is 60 seconds.
+ */
+@property (nonatomic) NSTimeInterval dnsCacheTimeout;
+
+/**
+ The number of currently open connections.
+ */
+@property (nonatomic, readonly) NSUInteger connectionCount;
+
+/**
+ The total number of connections opened by this client.
+ */
+@property (nonatomic, readonly) NSUInteger connectionsOpened;
+
+@end
+
+/**
+ A request sent with IQHTTPClient.
+ */
+@interface IQHTTPClientTask : NSObject
+@property (nonatomic, readonly) NSURLRequest* request;
+
+/**
+ Cancels the request. If the response is being received, its connection is closed.
+ */
+- (void) cancel;
+@end
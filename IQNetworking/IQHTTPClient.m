@@ -0,0 +1,1023 @@
+//
+//  IQHTTPClient.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "IQHTTPClient.h"
+#import "IQHTTPParser.h"
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <netdb.h>
+#import <fcntl.h>
+
+// The initial size of the read buffer of a connection. It grows when a response head does not fit.
+#define kIQHTTPClientReadBufferSize 16384
+#define kIQHTTPClientMaxHeaderSize 65536
+#define kIQHTTPClientMaxHeaderCount 128
+// The size of the chunks read from request body streams
+#define kIQHTTPClientStreamChunkSize 65536
+// How often connections are checked for timeouts
+#define kIQHTTPClientTimerInterval 0.5
+// The number of times a request is resent when a kept-alive connection is closed before the response
+#define kIQHTTPClientMaxRetries 1
+
+@class _IQHTTPClientConnection;
+
+/**
+ The connections to one host and port, and the requests waiting for one of them.
+ */
+@interface _IQHTTPClientHostPool : NSObject {
+@public
+    NSString* key;
+    NSString* host;
+    UInt16 port;
+    NSMutableArray* connections;
+    NSMutableArray* pending;
+    BOOL resolving;
+}
+@end
+
+/**
+ A resolved host address, reused until it expires.
+ */
+@interface _IQHTTPClientAddress : NSObject {
+@public
+    NSData* address;
+    CFAbsoluteTime expires;
+}
+@end
+
+@interface IQHTTPClientTask () {
+@public
+    IQHTTPClient* client;
+    NSURLRequest* request;
+    NSString* hostKey;
+    // The serialized request head, followed by the body unless it is streamed
+    NSData* head;
+    NSInputStream* bodyStream;
+    IQHTTPClientResponseHandler responseHandler;
+    IQHTTPClientDataHandler dataHandler;
+    IQHTTPClientCompletionHandler completionHandler;
+    _IQHTTPClientConnection* connection;
+    // GET and HEAD requests may be pipelined, and resent if the connection is lost before the response
+    BOOL idempotent;
+    BOOL noResponseBody;
+    BOOL responseStarted;
+    BOOL cancelled;
+    int retries;
+}
+- (id) initWithRequest:(NSURLRequest*)request client:(IQHTTPClient*)client;
+- (void) _finishWithError:(NSError*)error;
+@end
+
+/**
+ A connection to a host. Requests are written in order, and their responses are read in the same
+ order. Connections are only touched from the run loop of the client.
+ */
+@interface _IQHTTPClientConnection : NSObject {
+@public
+    __unsafe_unretained IQHTTPClient* client;
+    _IQHTTPClientHostPool* pool;
+    CFSocketNativeHandle fd;
+    CFSocketRef socketRef;
+    BOOL connected;
+    BOOL reusable;
+    NSUInteger responsesReceived;
+    // Requests sent (or being sent) on this connection. The first one is receiving its response.
+    NSMutableArray* tasks;
+    NSMutableData* output;
+    NSUInteger outputOffset;
+    NSInputStream* bodyStream;
+    uint8_t* readBuffer;
+    size_t readBufferSize, readLength, readOffset;
+    IQHTTPParser parser;
+    IQHTTPHeaderField* fields;
+    // Framing of the response being received
+    BOOL headComplete;
+    BOOL chunked;
+    BOOL untilClose;
+    long long remainingBody;
+    IQHTTPChunkDecoder chunkDecoder;
+    CFAbsoluteTime lastActivity;
+}
+- (id) initWithClient:(IQHTTPClient*)client pool:(_IQHTTPClientHostPool*)pool address:(NSData*)address;
+- (BOOL) canPipelineTask:(IQHTTPClientTask*)task;
+- (void) sendTask:(IQHTTPClientTask*)task;
+- (void) cancelTask:(IQHTTPClientTask*)task;
+- (void) close;
+- (void) closeWithError:(NSError*)error retry:(BOOL)retry;
+@end
+
+@interface IQHTTPClient () {
+@public
+    CFRunLoopRef runLoop;
+    NSMutableDictionary* pools;
+    NSMutableDictionary* addresses;
+    NSTimer* timer;
+    NSUInteger connectionCount;
+    NSUInteger connectionsOpened;
+    BOOL scheduling, rescheduleNeeded;
+}
+- (void) _perform:(dispatch_block_t)block;
+- (void) _scheduleAll;
+- (void) _connectionClosed:(_IQHTTPClientConnection*)connection;
+- (void) _retryTask:(IQHTTPClientTask*)task;
+- (void) _cancelTask:(IQHTTPClientTask*)task;
+@end
+
+static NSError* IQHTTPClientError(NSInteger code, NSURLRequest* request)
+{
+    NSDictionary* userInfo = request.URL ? @{NSURLErrorFailingURLErrorKey: request.URL} : nil;
+    return [NSError errorWithDomain:NSURLErrorDomain code:code userInfo:userInfo];
+}
+
+static NSString* IQHTTPClientStringFromSpan(const uint8_t* bytes, IQHTTPSpan span)
+{
+    NSString* string = [[NSString alloc] initWithBytes:bytes+span.offset length:span.length encoding:NSUTF8StringEncoding];
+    if(!string) {
+        string = [[NSString alloc] initWithBytes:bytes+span.offset length:span.length encoding:NSISOLatin1StringEncoding];
+    }
+    return string;
+}
+
+static Boolean IQHTTPHeaderNameEqual(const void* a, const void* b)
+{
+    return CFStringCompare((CFStringRef)a, (CFStringRef)b, kCFCompareCaseInsensitive) == kCFCompareEqualTo;
+}
+
+static CFHashCode IQHTTPHeaderNameHash(const void* value)
+{
+    return [[(__bridge NSString*)value lowercaseString] hash];
+}
+
+/**
+ Returns a dictionary with case insensitive keys, so that header fields can be looked up
+ regardless of the case used by the server.
+ */
+static NSMutableDictionary* IQHTTPHeaderDictionary(NSUInteger capacity)
+{
+    CFDictionaryKeyCallBacks keyCallBacks = kCFTypeDictionaryKeyCallBacks;
+    keyCallBacks.equal = IQHTTPHeaderNameEqual;
+    keyCallBacks.hash = IQHTTPHeaderNameHash;
+    return CFBridgingRelease(CFDictionaryCreateMutable(kCFAllocatorDefault, capacity, &keyCallBacks, &kCFTypeDictionaryValueCallBacks));
+}
+
+/**
+ Resolves a host name (or parses a numeric address, if numericOnly is YES) into a socket address.
+ */
+static NSData* IQHTTPClientResolve(NSString* host, UInt16 port, BOOL numericOnly)
+{
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = numericOnly ? AI_NUMERICHOST : AI_ADDRCONFIG;
+    char service[8];
+    snprintf(service, sizeof(service), "%u", (unsigned)port);
+    if(getaddrinfo([host UTF8String], service, &hints, &result) != 0 || !result) {
+        return nil;
+    }
+    NSData* address = [NSData dataWithBytes:result->ai_addr length:result->ai_addrlen];
+    freeaddrinfo(result);
+    return address;
+}
+
+@implementation IQHTTPClient
+@synthesize maxConnectionsPerHost, maxConnections, pipeliningEnabled, maxPipelineDepth, idleTimeout, dnsCacheTimeout;
+
+- (id) init
+{
+    return [self initWithRunLoop:[NSRunLoop mainRunLoop]];
+}
+
+- (id) initWithRunLoop:(NSRunLoop*)rl
+{
+    self = [super init];
+    if(self) {
+        runLoop = (CFRunLoopRef)CFRetain([rl getCFRunLoop]);
+        pools = [NSMutableDictionary dictionaryWithCapacity:4];
+        addresses = [NSMutableDictionary dictionaryWithCapacity:4];
+        maxConnectionsPerHost = 6;
+        maxConnections = 32;
+        maxPipelineDepth = 4;
+        idleTimeout = 5.0;
+        dnsCacheTimeout = 60.0;
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    CFRelease(runLoop);
+}
+
++ (BOOL) canHandleRequest:(NSURLRequest*)request
+{
+    NSURL* url = request.URL;
+    return [[url.scheme lowercaseString] isEqualToString:@"http"] && url.host.length > 0 && !url.user;
+}
+
+- (NSUInteger) connectionCount
+{
+    return connectionCount;
+}
+
+- (NSUInteger) connectionsOpened
+{
+    return connectionsOpened;
+}
+
+- (void) _perform:(dispatch_block_t)block
+{
+    if(CFRunLoopGetCurrent() == runLoop) {
+        block();
+    } else {
+        CFRunLoopPerformBlock(runLoop, kCFRunLoopCommonModes, block);
+        CFRunLoopWakeUp(runLoop);
+    }
+}
+
+- (IQHTTPClientTask*) sendRequest:(NSURLRequest*)request responseHandler:(IQHTTPClientResponseHandler)responseHandler dataHandler:(IQHTTPClientDataHandler)dataHandler completionHandler:(IQHTTPClientCompletionHandler)completionHandler
+{
+    IQHTTPClientTask* task = [[IQHTTPClientTask alloc] initWithRequest:request client:self];
+    task->responseHandler = [responseHandler copy];
+    task->dataHandler = [dataHandler copy];
+    task->completionHandler = [completionHandler copy];
+    [self _perform:^{
+        [self _enqueueTask:task atFront:NO];
+    }];
+    return task;
+}
+
+- (void) closeIdleConnections
+{
+    [self _perform:^{
+        for(_IQHTTPClientHostPool* pool in [pools allValues]) {
+            for(_IQHTTPClientConnection* connection in [pool->connections copy]) {
+                if(connection->tasks.count == 0) {
+                    [connection close];
+                }
+            }
+        }
+    }];
+}
+
+#pragma mark - Scheduling
+
+- (void) _enqueueTask:(IQHTTPClientTask*)task atFront:(BOOL)front
+{
+    if(task->cancelled) {
+        return;
+    }
+    _IQHTTPClientHostPool* pool = pools[task->hostKey];
+    if(!pool) {
+        NSURL* url = task->request.URL;
+        pool = [_IQHTTPClientHostPool new];
+        pool->key = task->hostKey;
+        pool->host = url.host;
+        pool->port = url.port ? [url.port unsignedShortValue] : 80;
+        pool->connections = [NSMutableArray arrayWithCapacity:MAX(maxConnectionsPerHost, 1)];
+        pool->pending = [NSMutableArray arrayWithCapacity:4];
+        pools[pool->key] = pool;
+    }
+    if(front) {
+        [pool->pending insertObject:task atIndex:0];
+    } else {
+        [pool->pending addObject:task];
+    }
+    [self _scheduleAll];
+}
+
+- (void) _retryTask:(IQHTTPClientTask*)task
+{
+    task->connection = nil;
+    task->retries++;
+    [self _enqueueTask:task atFront:YES];
+}
+
+- (void) _cancelTask:(IQHTTPClientTask*)task
+{
+    if(task->cancelled) {
+        return;
+    }
+    task->cancelled = YES;
+    if(task->connection) {
+        [task->connection cancelTask:task];
+    } else {
+        _IQHTTPClientHostPool* pool = pools[task->hostKey];
+        [pool->pending removeObjectIdenticalTo:task];
+        [task _finishWithError:nil];
+    }
+}
+
+/**
+ Hands out waiting requests to connections: an idle connection if there is one, otherwise a new
+ connection if the limits allow it, otherwise a busy connection if the request can be pipelined.
+ Re-entrant calls (from closing connections or from handlers) are folded into the running one.
+ */
+- (void) _scheduleAll
+{
+    if(scheduling) {
+        rescheduleNeeded = YES;
+        return;
+    }
+    scheduling = YES;
+    do {
+        rescheduleNeeded = NO;
+        for(_IQHTTPClientHostPool* pool in [pools allValues]) {
+            [self _schedulePool:pool];
+        }
+    } while(rescheduleNeeded);
+    scheduling = NO;
+    [self _updateTimer];
+}
+
+- (void) _schedulePool:(_IQHTTPClientHostPool*)pool
+{
+    while(pool->pending.count > 0) {
+        IQHTTPClientTask* task = pool->pending[0];
+        _IQHTTPClientConnection* connection = nil;
+        _IQHTTPClientConnection* pipelined = nil;
+        for(_IQHTTPClientConnection* c in pool->connections) {
+            if(c->tasks.count == 0) {
+                connection = c;
+                break;
+            }
+            if([c canPipelineTask:task] && (!pipelined || c->tasks.count < pipelined->tasks.count)) {
+                pipelined = c;
+            }
+        }
+        if(!connection && pool->connections.count < MAX(maxConnectionsPerHost, 1)) {
+            if(connectionCount >= MAX(maxConnections, 1)) {
+                [self _closeIdleConnectionExcept:pool];
+            }
+            if(connectionCount < MAX(maxConnections, 1)) {
+                NSData* address = [self _addressForPool:pool];
+                if(address) {
+                    connection = [[_IQHTTPClientConnection alloc] initWithClient:self pool:pool address:address];
+                    if(!connection) {
+                        [pool->pending removeObjectAtIndex:0];
+                        [task _finishWithError:IQHTTPClientError(NSURLErrorCannotConnectToHost, task->request)];
+                        continue;
+                    }
+                    [pool->connections addObject:connection];
+                    connectionCount++;
+                    connectionsOpened++;
+                }
+            }
+        }
+        if(!connection) {
+            connection = pipelined;
+        }
+        if(!connection) {
+            break;
+        }
+        [pool->pending removeObjectAtIndex:0];
+        [connection sendTask:task];
+    }
+}
+
+- (void) _closeIdleConnectionExcept:(_IQHTTPClientHostPool*)except
+{
+    for(_IQHTTPClientHostPool* pool in [pools allValues]) {
+        if(pool == except) continue;
+        for(_IQHTTPClientConnection* connection in pool->connections) {
+            if(connection->tasks.count == 0) {
+                [connection close];
+                return;
+            }
+        }
+    }
+}
+
+- (void) _connectionClosed:(_IQHTTPClientConnection*)connection
+{
+    _IQHTTPClientHostPool* pool = connection->pool;
+    if([pool->connections containsObject:connection]) {
+        [pool->connections removeObject:connection];
+        connectionCount--;
+    }
+    // A connection slot became available
+    [self _scheduleAll];
+}
+
+#pragma mark - Host resolution
+
+/**
+ Returns the address of the host of a pool, or nil if it is being resolved. The pool is scheduled
+ again once the address is known.
+ */
+- (NSData*) _addressForPool:(_IQHTTPClientHostPool*)pool
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    _IQHTTPClientAddress* cached = addresses[pool->key];
+    if(cached && cached->expires > now) {
+        return cached->address;
+    }
+    NSData* numeric = IQHTTPClientResolve(pool->host, pool->port, YES);
+    if(numeric) {
+        cached = [_IQHTTPClientAddress new];
+        cached->address = numeric;
+        cached->expires = DBL_MAX;
+        addresses[pool->key] = cached;
+        return numeric;
+    }
+    if(!pool->resolving) {
+        pool->resolving = YES;
+        NSString* host = pool->host;
+        UInt16 port = pool->port;
+        // getaddrinfo blocks, so it is called on another thread
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            NSData* address = IQHTTPClientResolve(host, port, NO);
+            [self _perform:^{
+                [self _pool:pool resolvedAddress:address];
+            }];
+        });
+    }
+    return nil;
+}
+
+- (void) _pool:(_IQHTTPClientHostPool*)pool resolvedAddress:(NSData*)address
+{
+    pool->resolving = NO;
+    if(!address) {
+        NSArray* failed = pool->pending;
+        pool->pending = [NSMutableArray arrayWithCapacity:4];
+        for(IQHTTPClientTask* task in failed) {
+            [task _finishWithError:IQHTTPClientError(NSURLErrorCannotFindHost, task->request)];
+        }
+        return;
+    }
+    _IQHTTPClientAddress* cached = [_IQHTTPClientAddress new];
+    cached->address = address;
+    cached->expires = CFAbsoluteTimeGetCurrent() + dnsCacheTimeout;
+    addresses[pool->key] = cached;
+    [self _scheduleAll];
+}
+
+#pragma mark - Timeouts
+
+- (void) _updateTimer
+{
+    if(connectionCount > 0 && !timer) {
+        timer = [NSTimer timerWithTimeInterval:kIQHTTPClientTimerInterval target:self selector:@selector(_checkTimeouts:) userInfo:nil repeats:YES];
+        CFRunLoopAddTimer(runLoop, (__bridge CFRunLoopTimerRef)timer, kCFRunLoopCommonModes);
+    } else if(connectionCount == 0 && timer) {
+        [timer invalidate];
+        timer = nil;
+    }
+}
+
+/**
+ Fails requests that have not heard from the server within their timeout interval, and closes
+ connections that have been idle for idleTimeout.
+ */
+- (void) _checkTimeouts:(NSTimer*)t
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    NSMutableArray* expired = nil;
+    for(_IQHTTPClientHostPool* pool in [pools allValues]) {
+        for(_IQHTTPClientConnection* connection in pool->connections) {
+            IQHTTPClientTask* task = connection->tasks.firstObject;
+            NSTimeInterval limit = task ? task->request.timeoutInterval : idleTimeout;
+            if(limit > 0 && now - connection->lastActivity > limit) {
+                if(!expired) expired = [NSMutableArray arrayWithCapacity:1];
+                [expired addObject:connection];
+            }
+        }
+    }
+    for(_IQHTTPClientConnection* connection in expired) {
+        IQHTTPClientTask* task = connection->tasks.firstObject;
+        if(task) {
+            [connection closeWithError:IQHTTPClientError(NSURLErrorTimedOut, task->request) retry:NO];
+        } else {
+            [connection close];
+        }
+    }
+}
+
+@end
+
+@implementation _IQHTTPClientHostPool
+@end
+
+@implementation _IQHTTPClientAddress
+@end
+
+@implementation IQHTTPClientTask
+
+- (id) initWithRequest:(NSURLRequest*)r client:(IQHTTPClient*)c
+{
+    self = [super init];
+    if(self) {
+        client = c;
+        request = [r copy];
+        NSURL* url = request.URL.absoluteURL;
+        NSString* method = request.HTTPMethod ? [request.HTTPMethod uppercaseString] : @"GET";
+        idempotent = [method isEqualToString:@"GET"] || [method isEqualToString:@"HEAD"];
+        noResponseBody = [method isEqualToString:@"HEAD"];
+        NSString* host = url.host;
+        NSNumber* port = url.port;
+        hostKey = [NSString stringWithFormat:@"%@:%d", [host lowercaseString], port ? [port intValue] : 80];
+
+        // The path and query are sent as they appear in the URL, with their percent escapes
+        NSString* path = CFBridgingRelease(CFURLCopyPath((__bridge CFURLRef)url));
+        NSString* query = CFBridgingRelease(CFURLCopyQueryString((__bridge CFURLRef)url, NULL));
+        NSMutableString* h = [NSMutableString stringWithCapacity:256];
+        [h appendFormat:@"%@ %@%@%@ HTTP/1.1\r\n", method, path.length > 0 ? path : @"/", query ? @"?" : @"", query ? query : @""];
+        NSString* hostField = [host rangeOfString:@":"].length > 0 ? [NSString stringWithFormat:@"[%@]", host] : host;
+        if(port) {
+            hostField = [hostField stringByAppendingFormat:@":%d", [port intValue]];
+        }
+        [h appendFormat:@"Host: %@\r\n", hostField];
+        NSDictionary* headers = request.allHTTPHeaderFields;
+        for(NSString* name in headers) {
+            // The framing of the request is decided here
+            if([name caseInsensitiveCompare:@"Host"] == NSOrderedSame ||
+               [name caseInsensitiveCompare:@"Content-Length"] == NSOrderedSame ||
+               [name caseInsensitiveCompare:@"Transfer-Encoding"] == NSOrderedSame ||
+               [name caseInsensitiveCompare:@"Connection"] == NSOrderedSame) {
+                continue;
+            }
+            [h appendFormat:@"%@: %@\r\n", name, headers[name]];
+        }
+        NSData* body = request.HTTPBody;
+        if(!body && request.HTTPBodyStream) {
+            // A stream can only be sent once
+            bodyStream = request.HTTPBodyStream;
+            idempotent = NO;
+            [h appendString:@"Transfer-Encoding: chunked\r\n"];
+        } else if(body.length > 0 || !idempotent) {
+            [h appendFormat:@"Content-Length: %lu\r\n", (unsigned long)body.length];
+        }
+        [h appendString:@"\r\n"];
+        NSMutableData* data = [[h dataUsingEncoding:NSUTF8StringEncoding] mutableCopy];
+        if(body) {
+            [data appendData:body];
+        }
+        head = data;
+    }
+    return self;
+}
+
+- (NSURLRequest*) request
+{
+    return request;
+}
+
+- (void) cancel
+{
+    IQHTTPClient* c = client;
+    [c _perform:^{
+        [c _cancelTask:self];
+    }];
+}
+
+- (void) _finishWithError:(NSError*)error
+{
+    IQHTTPClientCompletionHandler handler = completionHandler;
+    // Break the reference cycles through the handlers
+    responseHandler = nil;
+    dataHandler = nil;
+    completionHandler = nil;
+    connection = nil;
+    if(handler && !cancelled) {
+        handler(error);
+    }
+}
+
+@end
+
+@implementation _IQHTTPClientConnection
+
+static void IQHTTPClientSocketCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
+{
+    // Hold a reference for ARC, the connection may be closed from within the callback
+    _IQHTTPClientConnection* connection = (__bridge _IQHTTPClientConnection*)info;
+    switch(type) {
+        case kCFSocketReadCallBack:
+            [connection _canRead];
+            break;
+        case kCFSocketWriteCallBack:
+            [connection _canWrite];
+            break;
+        default:
+            break;
+    }
+}
+
+- (id) initWithClient:(IQHTTPClient*)c pool:(_IQHTTPClientHostPool*)p address:(NSData*)address
+{
+    self = [super init];
+    if(self) {
+        client = c;
+        pool = p;
+        const struct sockaddr* sa = (const struct sockaddr*)address.bytes;
+        fd = socket(sa->sa_family, SOCK_STREAM, 0);
+        if(fd < 0) {
+            return nil;
+        }
+        int value = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&value, sizeof(int));
+        // Requests are small and written in one go, there is nothing to gain from delaying them
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&value, sizeof(int));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        if(connect(fd, sa, (socklen_t)address.length) != 0 && errno != EINPROGRESS) {
+            close(fd);
+            fd = -1;
+            return nil;
+        }
+        // The write callback signals that the connection has been established (or has failed)
+        CFSocketContext ctx = {0, (__bridge void *)(self), 0, 0, 0};
+        socketRef = CFSocketCreateWithNative(kCFAllocatorDefault, fd, kCFSocketReadCallBack | kCFSocketWriteCallBack, IQHTTPClientSocketCallback, &ctx);
+        if(!socketRef) {
+            close(fd);
+            fd = -1;
+            return nil;
+        }
+        CFRunLoopSourceRef runLoopSource = CFSocketCreateRunLoopSource(kCFAllocatorDefault, socketRef, 0);
+        CFRunLoopAddSource(c->runLoop, runLoopSource, kCFRunLoopCommonModes);
+        CFRelease(runLoopSource);
+
+        reusable = YES;
+        tasks = [NSMutableArray arrayWithCapacity:1];
+        output = [NSMutableData dataWithCapacity:1024];
+        readBufferSize = kIQHTTPClientReadBufferSize;
+        readBuffer = malloc(readBufferSize);
+        fields = malloc(kIQHTTPClientMaxHeaderCount * sizeof(IQHTTPHeaderField));
+        IQHTTPParserInitResponse(&parser, fields, kIQHTTPClientMaxHeaderCount, kIQHTTPClientMaxHeaderSize);
+        lastActivity = CFAbsoluteTimeGetCurrent();
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    if(socketRef) {
+        // Invalidating the CFSocket also closes the native socket
+        CFSocketInvalidate(socketRef);
+        CFRelease(socketRef);
+    }
+    free(readBuffer);
+    free(fields);
+}
+
+- (void) close
+{
+    [self closeWithError:nil retry:YES];
+}
+
+/**
+ Closes the connection. Requests that have not received any part of their response are sent again
+ on another connection if retry is YES and they are idempotent, the others fail with the error.
+ */
+- (void) closeWithError:(NSError*)error retry:(BOOL)retry
+{
+    if(!socketRef) {
+        return;
+    }
+    CFSocketInvalidate(socketRef);
+    CFRelease(socketRef);
+    socketRef = NULL;
+    fd = -1;
+    [bodyStream close];
+    bodyStream = nil;
+    NSArray* inFlight = tasks;
+    tasks = [NSMutableArray array];
+    [client _connectionClosed:self];
+    for(IQHTTPClientTask* task in inFlight) {
+        if(!task->cancelled && retry && connected && !task->responseStarted && task->idempotent && task->retries < kIQHTTPClientMaxRetries) {
+            [client _retryTask:task];
+        } else {
+            [task _finishWithError:error ? error : IQHTTPClientError(NSURLErrorNetworkConnectionLost, task->request)];
+        }
+    }
+}
+
+- (BOOL) canPipelineTask:(IQHTTPClientTask*)task
+{
+    // Only pipeline on connections known to be kept alive by the server
+    if(!client.pipeliningEnabled || !reusable || !connected || responsesReceived == 0 || !task->idempotent || bodyStream) {
+        return NO;
+    }
+    if(tasks.count >= MAX(client.maxPipelineDepth, 1)) {
+        return NO;
+    }
+    for(IQHTTPClientTask* t in tasks) {
+        if(!t->idempotent) return NO;
+    }
+    return YES;
+}
+
+- (void) sendTask:(IQHTTPClientTask*)task
+{
+    task->connection = self;
+    [tasks addObject:task];
+    [output appendData:task->head];
+    if(task->bodyStream) {
+        bodyStream = task->bodyStream;
+        if(bodyStream.streamStatus == NSStreamStatusNotOpen) {
+            [bodyStream open];
+        }
+    }
+    if(tasks.count == 1) {
+        lastActivity = CFAbsoluteTimeGetCurrent();
+    }
+    if(connected) {
+        [self _flush];
+    }
+}
+
+- (void) cancelTask:(IQHTTPClientTask*)task
+{
+    if(tasks.firstObject == task && headComplete) {
+        // The rest of the response cannot be skipped without reading it
+        [self closeWithError:nil retry:YES];
+    }
+    // Otherwise the response is read and discarded when it arrives
+}
+
+- (BOOL) _checkConnected
+{
+    if(connected) {
+        return YES;
+    }
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+        [self closeWithError:IQHTTPClientError(NSURLErrorCannotConnectToHost, [tasks.firstObject request]) retry:NO];
+        return NO;
+    }
+    connected = YES;
+    return YES;
+}
+
+- (void) _canWrite
+{
+    if([self _checkConnected]) {
+        [self _flush];
+    }
+}
+
+/**
+ Appends the next chunk of the streamed request body to the output.
+ */
+- (void) _readBodyStream
+{
+    NSMutableData* chunk = [NSMutableData dataWithLength:kIQHTTPClientStreamChunkSize];
+    NSInteger n = [bodyStream read:chunk.mutableBytes maxLength:chunk.length];
+    if(n > 0) {
+        char header[24];
+        int headerLength = snprintf(header, sizeof(header), "%lx\r\n", (unsigned long)n);
+        [output appendBytes:header length:headerLength];
+        [output appendBytes:chunk.bytes length:n];
+        [output appendBytes:"\r\n" length:2];
+    } else {
+        [bodyStream close];
+        bodyStream = nil;
+        [output appendBytes:"0\r\n\r\n" length:5];
+    }
+}
+
+- (void) _flush
+{
+    while(fd >= 0) {
+        if(outputOffset == output.length) {
+            [output setLength:0];
+            outputOffset = 0;
+            if(!bodyStream) {
+                return;
+            }
+            [self _readBodyStream];
+            continue;
+        }
+        ssize_t n = send(fd, (const uint8_t*)output.bytes + outputOffset, output.length - outputOffset, 0);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EINTR) {
+                CFSocketEnableCallBacks(socketRef, kCFSocketWriteCallBack);
+                return;
+            }
+            // Typically a kept-alive connection that the server has closed
+            [self closeWithError:nil retry:YES];
+            return;
+        }
+        outputOffset += n;
+    }
+}
+
+- (void) _canRead
+{
+    if(![self _checkConnected]) {
+        return;
+    }
+    while(fd >= 0) {
+        if(readLength == readBufferSize) {
+            if(readOffset > 0) {
+                memmove(readBuffer, readBuffer+readOffset, readLength-readOffset);
+                readLength -= readOffset;
+                readOffset = 0;
+            } else if(readBufferSize < kIQHTTPClientMaxHeaderSize) {
+                // A response head that does not fit yet
+                readBufferSize *= 2;
+                readBuffer = realloc(readBuffer, readBufferSize);
+            } else {
+                [self closeWithError:IQHTTPClientError(NSURLErrorBadServerResponse, [tasks.firstObject request]) retry:NO];
+                return;
+            }
+        }
+        size_t space = readBufferSize - readLength;
+        ssize_t n = recv(fd, readBuffer+readLength, space, 0);
+        if(n > 0) {
+            readLength += n;
+            lastActivity = CFAbsoluteTimeGetCurrent();
+            [self _processInput];
+            if(n < space) {
+                // A short read means that the socket has no more data for now
+                return;
+            }
+        } else if(n == 0) {
+            [self _endOfStream];
+            return;
+        } else {
+            if(errno != EAGAIN && errno != EINTR) {
+                [self closeWithError:nil retry:YES];
+            }
+            return;
+        }
+    }
+}
+
+- (void) _endOfStream
+{
+    if(tasks.count > 0 && headComplete && untilClose) {
+        // The end of the body is signaled by closing the connection
+        remainingBody = 0;
+        [self _completeTask];
+        return;
+    }
+    [self closeWithError:nil retry:YES];
+}
+
+- (NSDictionary*) _headersFromBytes:(const uint8_t*)bytes
+{
+    NSMutableDictionary* headers = IQHTTPHeaderDictionary(parser.fieldCount);
+    for(NSUInteger i = 0; i < parser.fieldCount; i++) {
+        NSString* name = IQHTTPClientStringFromSpan(bytes, fields[i].name);
+        NSString* value = IQHTTPClientStringFromSpan(bytes, fields[i].value);
+        NSString* existing = headers[name];
+        // Repeated fields are combined into a comma separated list
+        headers[name] = existing ? [NSString stringWithFormat:@"%@, %@", existing, value] : value;
+    }
+    return headers;
+}
+
+/**
+ Passes a part of the response body to the data handler of a task.
+
+ @return NO if the connection was closed by the handler.
+ */
+- (BOOL) _deliver:(const uint8_t*)bytes length:(size_t)length task:(IQHTTPClientTask*)task
+{
+    if(task->cancelled || !task->dataHandler) {
+        return YES;
+    }
+    if(!task->dataHandler([NSData dataWithBytes:bytes length:length])) {
+        task->cancelled = YES;
+        [self closeWithError:nil retry:YES];
+        return NO;
+    }
+    return fd >= 0;
+}
+
+/**
+ Parses response heads and passes response bodies to the requests, in the order the requests
+ were sent.
+ */
+- (void) _processInput
+{
+    while(fd >= 0 && tasks.count > 0) {
+        IQHTTPClientTask* task = tasks[0];
+        const uint8_t* bytes = readBuffer + readOffset;
+        size_t available = readLength - readOffset;
+        if(!headComplete) {
+            IQHTTPParserStatus status = IQHTTPParserExecute(&parser, bytes, available);
+            if(status == IQHTTPParserNeedMoreData) {
+                break;
+            }
+            if(status != IQHTTPParserHeadComplete) {
+                [self closeWithError:IQHTTPClientError(NSURLErrorBadServerResponse, task->request) retry:NO];
+                return;
+            }
+            NSInteger statusCode = parser.statusCode;
+            if(statusCode < 200) {
+                // Interim response, such as 100 Continue
+                readOffset += parser.position;
+                IQHTTPParserReset(&parser);
+                continue;
+            }
+            NSDictionary* headers = [self _headersFromBytes:bytes];
+            readOffset += parser.position;
+            headComplete = YES;
+            chunked = NO;
+            untilClose = NO;
+            if(task->noResponseBody || statusCode == 204 || statusCode == 304) {
+                remainingBody = 0;
+            } else if(parser.chunked) {
+                chunked = YES;
+                remainingBody = -1;
+                IQHTTPChunkDecoderInit(&chunkDecoder);
+            } else if(parser.contentLength >= 0) {
+                remainingBody = parser.contentLength;
+            } else {
+                untilClose = YES;
+                remainingBody = -1;
+            }
+            if(!parser.keepAlive || untilClose) {
+                reusable = NO;
+            }
+            task->responseStarted = YES;
+            if(task->cancelled) {
+                if(remainingBody != 0) {
+                    [self closeWithError:nil retry:YES];
+                    return;
+                }
+            } else if(task->responseHandler) {
+                task->responseHandler(statusCode, headers);
+            }
+            continue;
+        }
+        if(chunked) {
+            size_t used = 0;
+            while(used < available && remainingBody != 0) {
+                size_t consumed;
+                IQHTTPSpan span;
+                IQHTTPParserStatus status = IQHTTPChunkDecoderExecute(&chunkDecoder, bytes+used, available-used, &consumed, &span);
+                if(status == IQHTTPParserBadRequest) {
+                    [self closeWithError:IQHTTPClientError(NSURLErrorBadServerResponse, task->request) retry:NO];
+                    return;
+                }
+                if(span.length > 0 && ![self _deliver:bytes+used+span.offset length:span.length task:task]) {
+                    return;
+                }
+                used += consumed;
+                if(status == IQHTTPParserBodyComplete) {
+                    remainingBody = 0;
+                } else if(consumed == 0) {
+                    break;
+                }
+            }
+            readOffset += used;
+        } else if(remainingBody != 0) {
+            size_t n = untilClose ? available : (size_t)MIN((long long)available, remainingBody);
+            readOffset += n;
+            if(!untilClose) {
+                remainingBody -= n;
+            }
+            if(n > 0 && ![self _deliver:bytes length:n task:task]) {
+                return;
+            }
+        }
+        if(remainingBody != 0) {
+            break;
+        }
+        [self _completeTask];
+    }
+    if(readOffset == readLength) {
+        readOffset = readLength = 0;
+    }
+}
+
+- (void) _completeTask
+{
+    IQHTTPClientTask* task = tasks[0];
+    [tasks removeObjectAtIndex:0];
+    responsesReceived++;
+    headComplete = NO;
+    IQHTTPParserReset(&parser);
+    lastActivity = CFAbsoluteTimeGetCurrent();
+    if(!reusable) {
+        // Pipelined requests behind this one are sent again on another connection
+        [self closeWithError:nil retry:YES];
+    }
+    [task _finishWithError:nil];
+    if(fd >= 0 && tasks.count == 0) {
+        // The connection is idle, hand it the next waiting request
+        [client _scheduleAll];
+    }
+}
+
+@end
@@ -0,0 +1,123 @@
+//
+//  IQHTTPParser.h
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+/*
+ Incremental HTTP/1.x message head parser used by IQHTTPServer for requests, and by IQHTTPClient
+ for responses.
+
+ The parser never copies or allocates. It is fed the bytes of a request head as they arrive
+ (always the full buffer from the start of the request, which may grow between calls) and
+ resumes scanning where it left off. The request line and header fields are recorded as
+ offsets into that buffer, and are only turned into strings by the caller when needed.
+ */
+
+#define kIQHTTPParserDefaultMaxHeaderSize 8192
+#define kIQHTTPParserDefaultMaxHeaderCount 64
+
+typedef enum {
+    IQHTTPParserNeedMoreData = 0,
+    IQHTTPParserHeadComplete,
+    IQHTTPParserBadRequest,
+    IQHTTPParserHeaderTooLarge,
+    IQHTTPParserTooManyHeaders,
+    IQHTTPParserBodyComplete
+} IQHTTPParserStatus;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} IQHTTPSpan;
+
+typedef struct {
+    IQHTTPSpan name;
+    IQHTTPSpan value;
+} IQHTTPHeaderField;
+
+typedef struct {
+    // Limits
+    size_t maxHeaderSize;
+    NSUInteger maxHeaderCount;
+
+    // Scanning state
+    int state;
+    size_t position;
+    BOOL response; // Parse a status line rather than a request line
+
+    // Results (valid once IQHTTPParserHeadComplete is returned). position is then the length of the head.
+    IQHTTPSpan method;
+    IQHTTPSpan target;
+    int statusCode; // Responses only
+    int versionMajor, versionMinor;
+    IQHTTPHeaderField* fields;
+    NSUInteger fieldCount;
+    long long contentLength; // -1 if there is no Content-Length header
+    BOOL chunked;
+    BOOL keepAlive;
+} IQHTTPParser;
+
+/**
+ Initializes a parser. The fields array is provided by the caller and must have room for
+ maxHeaderCount entries.
+ */
+void IQHTTPParserInit(IQHTTPParser* parser, IQHTTPHeaderField* fields, NSUInteger maxHeaderCount, size_t maxHeaderSize);
+
+/**
+ Initializes a parser for response heads. The status code is found in statusCode, and the
+ reason phrase in target.
+ */
+void IQHTTPParserInitResponse(IQHTTPParser* parser, IQHTTPHeaderField* fields, NSUInteger maxHeaderCount, size_t maxHeaderSize);
+
+/**
+ Resets the parser to parse a new head, keeping the limits, the mode and field storage.
+ */
+void IQHTTPParserReset(IQHTTPParser* parser);
+
+/**
+ Continues parsing the request head in buffer. length is the total number of bytes
+ received for this request so far.
+ */
+IQHTTPParserStatus IQHTTPParserExecute(IQHTTPParser* parser, const uint8_t* buffer, size_t length);
+
+/**
+ Decoder state for a chunked request body (Transfer-Encoding: chunked).
+ */
+typedef struct {
+    int state;
+    unsigned long long remaining;
+    size_t lineLength;
+} IQHTTPChunkDecoder;
+
+void IQHTTPChunkDecoderInit(IQHTTPChunkDecoder* decoder);
+
+/**
+ Decodes the next part of a chunked body. Stops after each run of payload bytes, which is
+ returned as a span relative to buffer (with length 0 if there is none). consumed is set to the
+ number of input bytes used, which may be less than length.
+ 
+ @return IQHTTPParserBodyComplete once the last chunk and the trailer have been read,
+         IQHTTPParserBadRequest for malformed input, otherwise IQHTTPParserNeedMoreData.
+ */
+IQHTTPParserStatus IQHTTPChunkDecoderExecute(IQHTTPChunkDecoder* decoder, const uint8_t* buffer, size_t length, size_t* consumed, IQHTTPSpan* data);
+
+/**
+ Finds a header field by (case-insensitive) name. Returns the index of the first match at or
+ after startIndex, or NSNotFound.
+ */
+NSUInteger IQHTTPParserFindField(const IQHTTPHeaderField* fields, NSUInteger fieldCount, const uint8_t* buffer, const char* name, size_t nameLength, NSUInteger startIndex);
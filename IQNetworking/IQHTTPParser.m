@@ -0,0 +1,346 @@
+//
+//  IQHTTPParser.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "IQHTTPParser.h"
+
+enum {
+    kIQHTTPParserStateRequestLine = 0,
+    kIQHTTPParserStateHeaders,
+    kIQHTTPParserStateComplete
+};
+
+enum {
+    kIQHTTPChunkStateSize = 0,
+    kIQHTTPChunkStateExtension,
+    kIQHTTPChunkStateSizeLF,
+    kIQHTTPChunkStateData,
+    kIQHTTPChunkStateDataCR,
+    kIQHTTPChunkStateDataLF,
+    kIQHTTPChunkStateTrailer,
+    kIQHTTPChunkStateComplete
+};
+
+// Chunk extensions and trailer lines are skipped, but not without limit
+#define kIQHTTPChunkMaxLineLength 4096
+
+static inline BOOL IQHTTPIsWhitespace(uint8_t c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static BOOL IQHTTPSpanEquals(const uint8_t* buffer, IQHTTPSpan span, const char* str, size_t len)
+{
+    return span.length == len && strncasecmp((const char*)buffer + span.offset, str, len) == 0;
+}
+
+/**
+ Checks if a comma separated header value contains the given token (case-insensitive).
+ */
+static BOOL IQHTTPSpanContainsToken(const uint8_t* buffer, IQHTTPSpan span, const char* token, size_t len)
+{
+    const uint8_t* p = buffer + span.offset;
+    const uint8_t* end = p + span.length;
+    while(p < end) {
+        while(p < end && (IQHTTPIsWhitespace(*p) || *p == ',')) p++;
+        const uint8_t* start = p;
+        while(p < end && *p != ',') p++;
+        const uint8_t* tokenEnd = p;
+        while(tokenEnd > start && IQHTTPIsWhitespace(tokenEnd[-1])) tokenEnd--;
+        if(tokenEnd - start == len && strncasecmp((const char*)start, token, len) == 0) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+static BOOL IQHTTPParseRequestLine(IQHTTPParser* parser, const uint8_t* buffer, size_t start, size_t end)
+{
+    const uint8_t* line = buffer + start;
+    size_t len = end - start;
+    const uint8_t* sp1 = memchr(line, ' ', len);
+    if(!sp1 || sp1 == line) return NO;
+    const uint8_t* target = sp1 + 1;
+    const uint8_t* sp2 = memchr(target, ' ', len - (target - line));
+    if(!sp2 || sp2 == target) return NO;
+    const uint8_t* version = sp2 + 1;
+    if(line + len - version != 8 || memcmp(version, "HTTP/", 5) != 0 || version[6] != '.' ||
+       !isdigit(version[5]) || !isdigit(version[7])) {
+        return NO;
+    }
+    parser->method = (IQHTTPSpan){(uint32_t)start, (uint32_t)(sp1 - line)};
+    parser->target = (IQHTTPSpan){(uint32_t)(target - buffer), (uint32_t)(sp2 - target)};
+    parser->versionMajor = version[5] - '0';
+    parser->versionMinor = version[7] - '0';
+    return YES;
+}
+
+static BOOL IQHTTPParseStatusLine(IQHTTPParser* parser, const uint8_t* buffer, size_t start, size_t end)
+{
+    // HTTP/1.1 200 OK
+    const uint8_t* line = buffer + start;
+    size_t len = end - start;
+    if(len < 12 || memcmp(line, "HTTP/", 5) != 0 || line[6] != '.' || !isdigit(line[5]) || !isdigit(line[7]) ||
+       line[8] != ' ' || !isdigit(line[9]) || !isdigit(line[10]) || !isdigit(line[11]) || (len > 12 && line[12] != ' ')) {
+        return NO;
+    }
+    parser->versionMajor = line[5] - '0';
+    parser->versionMinor = line[7] - '0';
+    parser->statusCode = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+    parser->target = len > 13 ? (IQHTTPSpan){(uint32_t)(start + 13), (uint32_t)(len - 13)} : (IQHTTPSpan){(uint32_t)end, 0};
+    return YES;
+}
+
+static IQHTTPParserStatus IQHTTPParseHeaderLine(IQHTTPParser* parser, const uint8_t* buffer, size_t start, size_t end)
+{
+    if(parser->fieldCount >= parser->maxHeaderCount) {
+        return IQHTTPParserTooManyHeaders;
+    }
+    const uint8_t* line = buffer + start;
+    const uint8_t* colon = memchr(line, ':', end - start);
+    if(!colon || colon == line || IQHTTPIsWhitespace(colon[-1])) {
+        return IQHTTPParserBadRequest;
+    }
+    size_t valueStart = colon + 1 - buffer;
+    size_t valueEnd = end;
+    while(valueStart < valueEnd && IQHTTPIsWhitespace(buffer[valueStart])) valueStart++;
+    while(valueEnd > valueStart && IQHTTPIsWhitespace(buffer[valueEnd-1])) valueEnd--;
+    IQHTTPHeaderField* field = &parser->fields[parser->fieldCount++];
+    field->name = (IQHTTPSpan){(uint32_t)start, (uint32_t)(colon - line)};
+    field->value = (IQHTTPSpan){(uint32_t)valueStart, (uint32_t)(valueEnd - valueStart)};
+    return IQHTTPParserNeedMoreData;
+}
+
+/**
+ Extracts the framing and connection information from the parsed header fields.
+ */
+static IQHTTPParserStatus IQHTTPParserFinish(IQHTTPParser* parser, const uint8_t* buffer)
+{
+    BOOL keepAlive = parser->versionMajor > 1 || (parser->versionMajor == 1 && parser->versionMinor >= 1);
+    for(NSUInteger i = 0; i < parser->fieldCount; i++) {
+        IQHTTPHeaderField* field = &parser->fields[i];
+        if(IQHTTPSpanEquals(buffer, field->name, "Content-Length", 14)) {
+            if(field->value.length == 0 || field->value.length > 18) return IQHTTPParserBadRequest;
+            long long value = 0;
+            for(uint32_t j = 0; j < field->value.length; j++) {
+                uint8_t c = buffer[field->value.offset + j];
+                if(!isdigit(c)) return IQHTTPParserBadRequest;
+                value = value * 10 + (c - '0');
+            }
+            if(parser->contentLength >= 0 && parser->contentLength != value) return IQHTTPParserBadRequest;
+            parser->contentLength = value;
+        } else if(IQHTTPSpanEquals(buffer, field->name, "Transfer-Encoding", 17)) {
+            parser->chunked = IQHTTPSpanContainsToken(buffer, field->value, "chunked", 7);
+        } else if(IQHTTPSpanEquals(buffer, field->name, "Connection", 10)) {
+            if(IQHTTPSpanContainsToken(buffer, field->value, "close", 5)) {
+                keepAlive = NO;
+            } else if(IQHTTPSpanContainsToken(buffer, field->value, "keep-alive", 10)) {
+                keepAlive = YES;
+            }
+        }
+    }
+    if(parser->chunked) {
+        // Transfer-Encoding overrides Content-Length
+        parser->contentLength = -1;
+    }
+    parser->keepAlive = keepAlive;
+    parser->state = kIQHTTPParserStateComplete;
+    return IQHTTPParserHeadComplete;
+}
+
+void IQHTTPParserInit(IQHTTPParser* parser, IQHTTPHeaderField* fields, NSUInteger maxHeaderCount, size_t maxHeaderSize)
+{
+    memset(parser, 0, sizeof(IQHTTPParser));
+    parser->fields = fields;
+    parser->maxHeaderCount = maxHeaderCount;
+    parser->maxHeaderSize = maxHeaderSize;
+    parser->contentLength = -1;
+}
+
+void IQHTTPParserInitResponse(IQHTTPParser* parser, IQHTTPHeaderField* fields, NSUInteger maxHeaderCount, size_t maxHeaderSize)
+{
+    IQHTTPParserInit(parser, fields, maxHeaderCount, maxHeaderSize);
+    parser->response = YES;
+}
+
+void IQHTTPParserReset(IQHTTPParser* parser)
+{
+    BOOL response = parser->response;
+    IQHTTPParserInit(parser, parser->fields, parser->maxHeaderCount, parser->maxHeaderSize);
+    parser->response = response;
+}
+
+IQHTTPParserStatus IQHTTPParserExecute(IQHTTPParser* parser, const uint8_t* buffer, size_t length)
+{
+    if(parser->state == kIQHTTPParserStateComplete) {
+        return IQHTTPParserHeadComplete;
+    }
+    while(parser->position < length) {
+        const uint8_t* nl = memchr(buffer + parser->position, '\n', length - parser->position);
+        if(!nl) {
+            break;
+        }
+        size_t next = nl - buffer + 1;
+        if(next > parser->maxHeaderSize) {
+            return IQHTTPParserHeaderTooLarge;
+        }
+        size_t start = parser->position;
+        size_t end = nl - buffer;
+        if(end > start && buffer[end-1] == '\r') end--;
+
+        if(parser->state == kIQHTTPParserStateRequestLine) {
+            // Empty lines before the request line are ignored (RFC 7230, section 3.5)
+            if(end > start) {
+                BOOL valid = parser->response ? IQHTTPParseStatusLine(parser, buffer, start, end) : IQHTTPParseRequestLine(parser, buffer, start, end);
+                if(!valid) {
+                    return IQHTTPParserBadRequest;
+                }
+                parser->state = kIQHTTPParserStateHeaders;
+            }
+        } else if(end == start) {
+            parser->position = next;
+            return IQHTTPParserFinish(parser, buffer);
+        } else if(IQHTTPIsWhitespace(buffer[start])) {
+            // Obsolete line folding is rejected (RFC 7230, section 3.2.4)
+            return IQHTTPParserBadRequest;
+        } else {
+            IQHTTPParserStatus status = IQHTTPParseHeaderLine(parser, buffer, start, end);
+            if(status != IQHTTPParserNeedMoreData) {
+                return status;
+            }
+        }
+        parser->position = next;
+    }
+    if(length > parser->maxHeaderSize) {
+        return IQHTTPParserHeaderTooLarge;
+    }
+    return IQHTTPParserNeedMoreData;
+}
+
+NSUInteger IQHTTPParserFindField(const IQHTTPHeaderField* fields, NSUInteger fieldCount, const uint8_t* buffer, const char* name, size_t nameLength, NSUInteger startIndex)
+{
+    for(NSUInteger i = startIndex; i < fieldCount; i++) {
+        if(IQHTTPSpanEquals(buffer, fields[i].name, name, nameLength)) {
+            return i;
+        }
+    }
+    return NSNotFound;
+}
+
+void IQHTTPChunkDecoderInit(IQHTTPChunkDecoder* decoder)
+{
+    memset(decoder, 0, sizeof(IQHTTPChunkDecoder));
+}
+
+static inline int IQHTTPHexValue(uint8_t c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+IQHTTPParserStatus IQHTTPChunkDecoderExecute(IQHTTPChunkDecoder* d, const uint8_t* buffer, size_t length, size_t* consumed, IQHTTPSpan* data)
+{
+    size_t i = 0;
+    *data = (IQHTTPSpan){0, 0};
+    while(i < length) {
+        uint8_t c = buffer[i];
+        switch(d->state) {
+            case kIQHTTPChunkStateSize: {
+                int v = IQHTTPHexValue(c);
+                if(v >= 0) {
+                    if(d->remaining >> 56) return IQHTTPParserBadRequest;
+                    d->remaining = d->remaining * 16 + v;
+                    d->lineLength++;
+                    i++;
+                    break;
+                }
+                if(d->lineLength == 0) return IQHTTPParserBadRequest;
+                if(c == ';' || IQHTTPIsWhitespace(c)) {
+                    d->state = kIQHTTPChunkStateExtension;
+                    i++;
+                } else if(c == '\r') {
+                    d->state = kIQHTTPChunkStateSizeLF;
+                    i++;
+                } else if(c == '\n') {
+                    d->state = kIQHTTPChunkStateSizeLF;
+                } else {
+                    return IQHTTPParserBadRequest;
+                }
+                break;
+            }
+            case kIQHTTPChunkStateExtension:
+                if(c == '\r' || c == '\n') {
+                    d->state = kIQHTTPChunkStateSizeLF;
+                    if(c == '\r') i++;
+                } else if(++d->lineLength > kIQHTTPChunkMaxLineLength) {
+                    return IQHTTPParserBadRequest;
+                } else {
+                    i++;
+                }
+                break;
+            case kIQHTTPChunkStateSizeLF:
+                if(c != '\n') return IQHTTPParserBadRequest;
+                i++;
+                d->lineLength = 0;
+                d->state = d->remaining > 0 ? kIQHTTPChunkStateData : kIQHTTPChunkStateTrailer;
+                break;
+            case kIQHTTPChunkStateData: {
+                size_t n = (size_t)MIN(d->remaining, (unsigned long long)(length - i));
+                *data = (IQHTTPSpan){(uint32_t)i, (uint32_t)n};
+                i += n;
+                d->remaining -= n;
+                if(d->remaining == 0) {
+                    d->state = kIQHTTPChunkStateDataCR;
+                }
+                *consumed = i;
+                return IQHTTPParserNeedMoreData;
+            }
+            case kIQHTTPChunkStateDataCR:
+                if(c == '\r') {
+                    d->state = kIQHTTPChunkStateDataLF;
+                    i++;
+                    break;
+                }
+                // Fall through, a bare LF is accepted as well
+            case kIQHTTPChunkStateDataLF:
+                if(c != '\n') return IQHTTPParserBadRequest;
+                i++;
+                d->state = kIQHTTPChunkStateSize;
+                break;
+            case kIQHTTPChunkStateTrailer:
+                i++;
+                if(c == '\n') {
+                    if(d->lineLength == 0) {
+                        d->state = kIQHTTPChunkStateComplete;
+                        *consumed = i;
+                        return IQHTTPParserBodyComplete;
+                    }
+                    d->lineLength = 0;
+                } else if(c != '\r' && ++d->lineLength > kIQHTTPChunkMaxLineLength) {
+                    return IQHTTPParserBadRequest;
+                }
+                break;
+            default:
+                *consumed = 0;
+                return IQHTTPParserBodyComplete;
+        }
+    }
+    *consumed = i;
+    return IQHTTPParserNeedMoreData;
+}
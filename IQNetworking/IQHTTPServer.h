@@ -17,24 +17,65 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "IQMultipartParser.h"
 
 @class IQHTTPServerRequest;
+@class IQMIMEType;
+@class IQHTTPServerMetrics;
+@class IQHTTPResponseCache;
+@class IQHTTPRequestBody;
 
 typedef void (^IQHTTPRequestCallback)(IQHTTPServerRequest* request, NSInteger sequence);
 typedef void (^IQHTTPRequestReader)(IQHTTPServerRequest* request, NSData* data);
+typedef void (^IQHTTPRequestBodyHandler)(IQHTTPServerRequest* request, IQHTTPRequestBody* body);
+typedef void (^IQHTTPMultipartCompletion)(IQHTTPServerRequest* request, BOOL valid);
 typedef void (^IQHTTPResponseReader)(IQHTTPServerRequest* request, NSMutableData* data, NSUInteger neededBytes);
+typedef void (^IQHTTPWritableHandler)(IQHTTPServerRequest* request);
 
 /**
  A simple but efficient web server using asynchronous sockets, which makes it able to process
  a large number of requests in parallel using only one thread.
+ 
+ Optionally, the server can spread its connections over a pool of worker threads (see the
+ workerCount property) to make use of more than one CPU core.
  */
 @interface IQHTTPServer : NSObject
 
 - (id) init;
 - (id) initWithPort:(UInt16)port;
 - (id) initWithAddress:(NSString*)address port:(UInt16)port;
+- (id) initWithAddress:(NSString*)address port:(UInt16)port workers:(NSUInteger)workerCount;
 
+/**
+ Adds a URL pattern. The pattern must match the entire resource of a request. If several patterns
+ match, the first one added is used.
+ 
+ Patterns are indexed by the literal text they start with (for example "/api/items/" in
+ "/api/items/([0-9]+)"), so only the few patterns whose literal prefix matches the resource
+ are evaluated for each request. Patterns starting with a wildcard, using alternation ("|") or
+ the case insensitive option are evaluated for every request.
+ */
 - (void) addURLPattern:(NSRegularExpression*)pattern callback:(IQHTTPRequestCallback)callback;
+/**
+ Adds a URL pattern that only matches requests with the given method (such as GET or POST). A nil
+ method matches all methods. If a pattern matches the resource but no pattern matches both the
+ resource and the method, the server responds with 405 ("Method not allowed").
+ */
+- (void) addURLPattern:(NSRegularExpression*)pattern method:(NSString*)method callback:(IQHTTPRequestCallback)callback;
+/**
+ Adds a URL pattern whose responses are kept in a response cache. While a cached response is
+ fresh, GET and HEAD requests for the same resource are answered with the stored bytes without
+ calling the callback. Requests that arrive while the callback is producing a response wait for
+ it rather than calling the callback themselves. See IQHTTPResponseCache for what is cached.
+ 
+ A cache may be shared by several patterns.
+ */
+- (void) addURLPattern:(NSRegularExpression*)pattern method:(NSString*)method cache:(IQHTTPResponseCache*)cache callback:(IQHTTPRequestCallback)callback;
+/**
+ Serves static files from a directory. The path of the file is taken from the first capture
+ group of the pattern if there is one, otherwise from the entire resource. See
+ IQHTTPServerRequest serveFileAtPath: for details.
+ */
 - (void) addURLPattern:(NSRegularExpression*)pattern directory:(NSString*)staticFileDirectory;
 
 /**
@@ -64,13 +105,83 @@ typedef void (^IQHTTPResponseReader)(IQHTTPServerRequest* request, NSMutableData
  */
 @property (nonatomic) BOOL started;
 
+/**
+ The number of worker threads used to serve connections.
+ 
+ If 0 (the default), all connections are served on the run loop of the server (see the runLoop
+ property). If > 0, the server starts this number of worker threads, each with its own run loop
+ and its own set of connections. Incoming connections are accepted on the server run loop and
+ handed out to the workers in a round-robin fashion. A connection stays on the same worker for
+ its entire lifetime, so all callbacks for a given request are made on the same thread, but
+ callbacks for different requests may be made concurrently on different threads.
+ 
+ URL patterns should be added before the server is started when using worker threads.
+ */
+@property (nonatomic) NSUInteger workerCount;
+
+/**
+ The number of currently open connections, across all workers.
+ */
+@property (nonatomic, readonly) NSUInteger connectionCount;
+
 /**
  Keep-alive timeout value in seconds.
  If > 0 (the default is 10.0), allows keep-alive connections if the client requests them. A
- keep-alive connection is kept open to serve multiple requests.
+ keep-alive connection is kept open to serve multiple requests, and is closed when it has been
+ idle for this long.
  */
 @property (nonatomic) NSTimeInterval keepAliveTimeout;
 
+/**
+ The time in seconds a client has to send a complete request head, counted from the first byte of
+ the head (or from the connection being opened, for the first request). Sending the head slowly
+ does not extend it. The connection is closed when it expires. The default is 30.0, 0 disables it.
+ */
+@property (nonatomic) NSTimeInterval requestHeaderTimeout;
+
+/**
+ The time in seconds the server waits for more of a request body before closing the connection.
+ The timeout starts over whenever body data arrives, and does not run while the server itself
+ holds back reading. The default is 60.0, 0 disables it.
+ */
+@property (nonatomic) NSTimeInterval requestBodyTimeout;
+
+/**
+ The maximum number of open connections, across all workers. Connections beyond this limit are
+ answered with a preformatted 503 ("Service unavailable") response and closed right away, without
+ reading the request. The default is 0, no limit.
+ */
+@property (nonatomic) NSUInteger maxConnections;
+
+/**
+ The maximum number of open connections from a single client IP address. Connections beyond the
+ limit are refused in the same way as beyond maxConnections. Clients are counted in a fixed
+ number of hash buckets, so distinct clients occasionally share a limit. The default is 0, no limit.
+ */
+@property (nonatomic) NSUInteger maxConnectionsPerClient;
+
+/**
+ The maximum number of pipelined requests handled at the same time on a keep-alive connection.
+ All requests up to this limit are parsed and dispatched as soon as they arrive, and their
+ responses are written back in the order the requests were received. Further requests are not
+ read from the connection until a response has been completed.
+ 
+ The default is 16.
+ */
+@property (nonatomic) NSUInteger maxPipelineDepth;
+
+/**
+ Request bodies read with IQHTTPServerRequest spoolRequestBody: are kept in memory up to this
+ size, larger ones are written to a temporary file as they arrive. The default is 64 KB.
+ */
+@property (nonatomic) NSUInteger requestBodyMemoryLimit;
+
+/**
+ The directory of the temporary files of spooled request bodies. The default is
+ NSTemporaryDirectory().
+ */
+@property (nonatomic, retain) NSString* requestBodySpoolDirectory;
+
 /**
  The default buffer limit. See IQHTTPServerRequest.writeBufferLimit.
  
@@ -78,6 +189,68 @@ typedef void (^IQHTTPResponseReader)(IQHTTPServerRequest* request, NSMutableData
  */
 @property (nonatomic) NSUInteger writeBufferLimit;
 
+/**
+ The maximum number of static files kept open (along with their file attributes) between requests.
+ Repeated requests for a cached file do not touch the file system, except for a periodic check
+ that the file has not been modified. Set to 0 to disable caching.
+ 
+ The default is 64.
+ */
+@property (nonatomic) NSUInteger staticFileCacheSize;
+
+/**
+ The size of the per-connection read buffer. Request heads are parsed in place in this buffer,
+ so a request head can never be larger than this.
+
+ The default is 8192 bytes.
+ */
+@property (nonatomic) NSUInteger readBufferSize;
+
+/**
+ The maximum size of a request head (request line and header fields). Larger requests are
+ rejected with status 431. The default is 8192 bytes.
+ */
+@property (nonatomic) NSUInteger maxRequestHeaderSize;
+
+/**
+ The maximum number of header fields in a request. Requests with more fields are rejected with
+ status 431. The default is 64.
+ */
+@property (nonatomic) NSUInteger maxRequestHeaderCount;
+
+/**
+ Set to YES to compress responses for clients that accept it (see the Accept-Encoding request
+ header). Responses are compressed with gzip or deflate as they are written, if their
+ Content-Type matches one of the compressibleTypes and they are at least compressionMinimumSize
+ bytes long (responses of unknown length are always compressed). Responses that already have a
+ Content-Encoding are sent as they are.
+
+ Static files are served from a precompressed sibling file with a ".gz" extension if there is
+ one that is newer than the file itself. Otherwise the file is compressed once and the result is
+ kept in compressedFileCacheDirectory, so repeated requests are served from there with sendfile.
+
+ The default is NO.
+ */
+@property (nonatomic) BOOL compressionEnabled;
+
+/**
+ Responses shorter than this are not compressed. The default is 1024 bytes.
+ */
+@property (nonatomic) NSUInteger compressionMinimumSize;
+
+/**
+ The set of IQMIMEType instances eligible for compression. A subtype of "*" matches all subtypes
+ of the type. The default contains text/*, application/json, application/javascript,
+ application/xml, application/xhtml+xml and image/svg+xml.
+ */
+@property (nonatomic, copy) NSSet* compressibleTypes;
+
+/**
+ The directory where compressed copies of static files are kept. The directory is created when
+ needed. The default is a directory in NSTemporaryDirectory().
+ */
+@property (nonatomic, copy) NSString* compressedFileCacheDirectory;
+
 /**
  Closes idle or all incoming connections to this server.
  @param force If YES, close all connections (even the ones currently
@@ -86,6 +259,18 @@ typedef void (^IQHTTPResponseReader)(IQHTTPServerRequest* request, NSMutableData
  */
 - (void) closeAllConnectionsForce:(BOOL)force;
 
+/**
+ A snapshot of the request statistics and connection gauges of the server. The counters are kept
+ with atomic operations and only summed up here, so collecting them costs next to nothing.
+ */
+@property (nonatomic, readonly) IQHTTPServerMetrics* metrics;
+
+/**
+ Adds a URL pattern that serves the metrics of the server in the Prometheus text format, for
+ GET requests.
+ */
+- (void) addMetricsURLPattern:(NSRegularExpression*)pattern;
+
 @end
 
 
@@ -102,17 +287,52 @@ typedef void (^IQHTTPResponseReader)(IQHTTPServerRequest* request, NSMutableData
 @property (nonatomic, readonly) NSString* resource;
 
 /**
- Reads the request body asynchronously.
+ The request method, such as GET or POST.
+ */
+@property (nonatomic, readonly) NSString* method;
+
+/**
+ Reads the request body asynchronously. Both Content-Length and chunked request bodies are
+ supported; chunked bodies are decoded as they arrive.
  @param atomic Enables buffering of the content body, and calls the reader
                callback once the entire body has been read.
  */
 - (void) readRequestBody:(IQHTTPRequestReader)reader atomic:(BOOL)atomic;
+
+/**
+ Reads the entire request body, in memory or, beyond the requestBodyMemoryLimit of the server, into
+ a temporary file, so that the memory used does not depend on the size of the body. The handler
+ is called once the body is complete, with nil if it could not be stored. Use instead of
+ readRequestBody:atomic:.
+ */
+- (void) spoolRequestBody:(IQHTTPRequestBodyHandler)handler;
+
+/**
+ Reads a multipart request body (such as a multipart/form-data upload) part by part, as it
+ arrives. The part handler is called for the header of every part and returns the reader for its
+ content (see IQMultipartParser). The completion is called once the body has been read, with
+ valid set to NO if the request is not multipart or the body is malformed or incomplete. Use
+ instead of readRequestBody:atomic:.
+ */
+- (void) readMultipartRequestBody:(IQMultipartPartHandler)partHandler completion:(IQHTTPMultipartCompletion)completion;
+
+/**
+ The length of the request body, or -1 if the body is sent with chunked transfer encoding and
+ the length is not known in advance.
+ */
 @property (nonatomic, readonly) long long requestBodyLength;
 
 - (NSString*) valueForRequestHeaderField:(NSString*)field;
 
 - (NSString*) valueForUrlPatternGroup:(NSInteger)patternGroupIndex;
 
+/**
+ The one of the given IQMIMEType instances (in order of preference of the handler) that the
+ Accept header of the request ranks highest, or nil if the client accepts none of them. See
+ IQMIMEType preferredMIMETypeAmong:forAcceptHeader:.
+ */
+- (IQMIMEType*) preferredContentTypeAmong:(NSArray*)types;
+
 /**
  Close connection immediately and cancel the request.
  */
@@ -126,9 +346,11 @@ typedef void (^IQHTTPResponseReader)(IQHTTPServerRequest* request, NSMutableData
 @property (nonatomic) NSInteger statusCode;
 
 /**
- The maximum size of the write buffer. If writing data faster than the client
- can receive and this buffer is overrun, an exception will be raised. Set to
- zero to disable buffering. A write operation will never block.
+ The high watermark of the write buffer. Output that the client cannot receive right away is
+ queued, and once the queue holds this many bytes, writeBufferFull becomes YES. The application
+ should then stop writing until the writableHandler is called. Writes are never rejected, so
+ ignoring the limit only costs memory. Set to zero to disable buffering. A write operation will
+ never block.
  
  The recommendation is to enable buffering for simplicity when handling small 
  requests such as generated strings, and to disable buffering when serving large
@@ -138,6 +360,29 @@ typedef void (^IQHTTPResponseReader)(IQHTTPServerRequest* request, NSMutableData
  */
 @property (nonatomic) NSUInteger writeBufferLimit;
 
+/**
+ YES if the queued output has reached writeBufferLimit.
+ */
+@property (nonatomic, readonly) BOOL writeBufferFull;
+
+/**
+ The number of bytes queued for sending.
+ */
+@property (nonatomic, readonly) NSUInteger bufferedLength;
+
+/**
+ Called when the write buffer has drained to half of writeBufferLimit after having been full. Use
+ this to resume writing after writeBufferFull became YES.
+ */
+@property (nonatomic, copy) IQHTTPWritableHandler writableHandler;
+
+/**
+ Sets a response header field. Headers must be set before the first part of the response is sent.
+ 
+ If no Content-Length has been set when the first part of the response is sent, the response is
+ sent with chunked transfer encoding (or, to HTTP/1.0 clients, delimited by closing the
+ connection). Responses completed within the first callback get a Content-Length automatically.
+ */
 - (void) setValue:(NSString*)value forResponseHeaderField:(NSString *)field;
 - (NSString*) valueForResponseHeaderField:(NSString*)field;
 
@@ -151,19 +396,36 @@ typedef void (^IQHTTPResponseReader)(IQHTTPServerRequest* request, NSMutableData
 - (void) writeString:(NSString*)string;
 
 /**
- Writes data to the client.
+ Writes data to the client. If buffering is enabled, data that cannot be sent right away is
+ queued by reference (without copying) unless it is mutable.
  
  @return The number of bytes handled (buffered or sent).
  */
 - (NSInteger) writeData:(NSData*)data;
 
+/**
+ Writes the contents of a stream to the client. The stream is read as the client receives the
+ data, keeping at most writeBufferLimit bytes queued. Call done to complete the request once
+ the stream has been sent.
+ */
 - (void) writeStream:(NSInputStream*)stream;
 
+/**
+ Responds with the contents of a file and completes the request. The file is sent directly from
+ the file system to the socket without being copied through the write buffer.
+ 
+ Handles HEAD requests, conditional requests (If-None-Match and If-Modified-Since), and single
+ byte ranges (Range and If-Range). The Content-Type is derived from the file extension. If
+ compression is enabled for the server, a gzip compressed copy of the file is sent to clients
+ that accept it (see IQHTTPServer compressionEnabled).
+ */
+- (void) serveFileAtPath:(NSString*)path;
+
 /**
  Writes a block of bytes to the client. This method will never block. If buffering
  is disabled, the method will return the number of bytes sent. If buffering is enabled,
- the method will accept all bytes up to the maximum buffer limit (in which case an exception
- is raised).
+ the method accepts all bytes, and the bytes that could not be sent right away are queued
+ (see writeBufferFull).
  
  @return The number of bytes handled (buffered or sent). Important: Unlike the NSOutputStream counterpart,
          this method can actually return zero even if the stream will eventually accept more data. This
@@ -172,3 +434,149 @@ typedef void (^IQHTTPResponseReader)(IQHTTPServerRequest* request, NSMutableData
 - (NSInteger) write:(const uint8_t *)buffer maxLength:(NSUInteger)len;
 - (BOOL) hasSpaceAvailable;
 @end
+
+
+/**
+ A request body read with IQHTTPServerRequest spoolRequestBody:. Small bodies are kept in memory,
+ large ones in a temporary file that is removed when the body is deallocated (unless it has been
+ moved with moveToPath:error:).
+ */
+@interface IQHTTPRequestBody : NSObject
+@property (nonatomic, readonly) unsigned long long length;
+/**
+ The path of the temporary file, or nil if the body is in memory.
+ */
+@property (nonatomic, readonly) NSString* path;
+/**
+ The body. A body in a file is memory mapped rather than read.
+ */
+@property (nonatomic, readonly) NSData* data;
+/**
+ A new stream reading the body from the start.
+ */
+- (NSInputStream*) inputStream;
+/**
+ Moves the temporary file to path, or writes the body there if it is in memory. The body then
+ refers to the new file, which is not removed.
+ */
+- (BOOL) moveToPath:(NSString*)path error:(NSError**)error;
+@end
+
+/**
+ An in-memory cache of complete responses, for URL patterns whose responses are the same for many
+ requests (see IQHTTPServer addURLPattern:method:cache:callback:). Responses are cached by method,
+ resource (including the query) and the values of the varyHeaderFields, as well as the content
+ coding when compression is enabled.
+ 
+ A response is only cached if it is complete when its headers are sent (it is not streamed), has
+ one of the status codes 200, 203, 204, 301, 404 or 410, and has no Set-Cookie header and no
+ Cache-Control header with no-store, no-cache or private. HTTP/1.0 requests and requests with a
+ body are never answered from the cache.
+ */
+@interface IQHTTPResponseCache : NSObject
+- (id) initWithTimeToLive:(NSTimeInterval)timeToLive;
+/**
+ How long a response is served from the cache after it was produced.
+ */
+@property (nonatomic) NSTimeInterval timeToLive;
+/**
+ How long after expiring a response may still be served to other requests while one request calls
+ the callback for a new response (stale-while-revalidate). The default is 0.
+ */
+@property (nonatomic) NSTimeInterval staleTimeToLive;
+/**
+ The request header fields that select between different responses for the same resource.
+ */
+@property (nonatomic, copy) NSArray* varyHeaderFields;
+/**
+ The total size of the cached responses, beyond which the least recently used ones are evicted.
+ The default is 4 MB.
+ */
+@property (nonatomic) NSUInteger sizeLimit;
+/**
+ Responses larger than this (headers and body) are not cached. The default is 256 KB.
+ */
+@property (nonatomic) NSUInteger maxResponseSize;
+/**
+ The number of requests answered from the cache, including the ones that waited for another
+ request to produce the response.
+ */
+@property (nonatomic, readonly) NSUInteger hitCount;
+/**
+ The number of requests for which the callback was called.
+ */
+@property (nonatomic, readonly) NSUInteger missCount;
+- (void) removeAllResponses;
+@end
+
+/**
+ The statistics of the requests handled by one URL pattern. Latencies are recorded in logarithmic
+ buckets (in the manner of HdrHistogram) with a precision of 1/8 of the value, from one microsecond
+ to about an hour.
+ */
+@interface IQHTTPServerRouteMetrics : NSObject
+/**
+ The URL pattern, or nil for the requests that did not match a pattern (including the ones handled
+ by the default callback and the malformed ones).
+ */
+@property (nonatomic, readonly) NSString* pattern;
+/**
+ The method the pattern was added for, or nil if it matches all methods.
+ */
+@property (nonatomic, readonly) NSString* method;
+@property (nonatomic, readonly) unsigned long long requestCount;
+@property (nonatomic, readonly) unsigned long long bytesReceived;
+@property (nonatomic, readonly) unsigned long long bytesSent;
+/**
+ The time from the start of a request until the first byte of the response was written to the
+ socket, at the given percentile (0-100).
+ */
+- (NSTimeInterval) timeToFirstByteAtPercentile:(double)percentile;
+/**
+ The time from the start of a request until the last byte of the response was written to the
+ socket (or the connection was closed), at the given percentile (0-100).
+ */
+- (NSTimeInterval) durationAtPercentile:(double)percentile;
+@property (nonatomic, readonly) NSTimeInterval meanDuration;
+@end
+
+/**
+ A snapshot of the metrics of a server, see IQHTTPServer metrics.
+ */
+@interface IQHTTPServerMetrics : NSObject
+/**
+ IQHTTPServerRouteMetrics for every URL pattern in the order they were added, followed by the
+ statistics of the requests that did not match any pattern.
+ */
+@property (nonatomic, readonly) NSArray* routes;
+/**
+ Connections with a request in progress.
+ */
+@property (nonatomic, readonly) NSUInteger activeConnectionCount;
+/**
+ Keep-alive connections waiting for the next request.
+ */
+@property (nonatomic, readonly) NSUInteger idleConnectionCount;
+/**
+ The response bytes queued on all connections, waiting for the clients to read them.
+ */
+@property (nonatomic, readonly) unsigned long long bufferedOutputBytes;
+/**
+ The number of times a write filled the socket send buffer, so that the response had to wait for
+ the client.
+ */
+@property (nonatomic, readonly) unsigned long long writeStallCount;
+/**
+ The number of connections refused because of maxConnections or maxConnectionsPerClient.
+ */
+@property (nonatomic, readonly) unsigned long long rejectedConnectionCount;
+/**
+ The number of connections closed because a request head, request body or keep-alive timeout
+ expired.
+ */
+@property (nonatomic, readonly) unsigned long long timedOutConnectionCount;
+/**
+ The metrics in the Prometheus text exposition format.
+ */
+- (NSString*) textRepresentation;
+@end
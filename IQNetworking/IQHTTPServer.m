@@ -17,74 +17,486 @@
 //
 
 #import "IQHTTPServer.h"
+#import "IQHTTPParser.h"
 #import "IQMIMEType.h"
 #import <sys/socket.h>
 #import <netinet/in.h>
 #import <netinet6/in6.h>
 #import <arpa/inet.h>
+#import <sys/stat.h>
+#import <sys/mman.h>
+#import <sys/uio.h>
+#import <fcntl.h>
+#import <xlocale.h>
+#import <libkern/OSAtomic.h>
+#import <mach/mach_time.h>
+#import <zlib.h>
+
+@class _IQHTTPServerConnection, _IQHTTPRouteNode, _IQHTTPURLHandler;
+
+// Cached static file entries are trusted for this long before being checked against the file system again
+#define kIQHTTPStaticFileRecheckInterval 2.0
+// The maximum number of output segments passed to a single writev call
+#define kIQHTTPMaxWriteVectors 64
+// Small writes are appended to the last output segment rather than queued separately, up to this size
+#define kIQHTTPCoalesceSegmentSize 16384
+// The size of the chunks read from streams passed to writeStream:
+#define kIQHTTPStreamChunkSize 65536
+// The size of the output blocks produced by response compression
+#define kIQHTTPCompressionBufferSize 16384
+// Latency histograms split every power of two (in microseconds) into this many linear buckets,
+// which bounds the relative error of a recorded latency to 1/8
+#define kIQHTTPHistogramSubBits 3
+#define kIQHTTPHistogramSubBuckets (1 << kIQHTTPHistogramSubBits)
+// Enough buckets for latencies up to 2^32 microseconds (about 70 minutes), longer ones go in the last
+#define kIQHTTPHistogramBuckets ((32 - kIQHTTPHistogramSubBits + 1) * kIQHTTPHistogramSubBuckets)
+// The resolution in seconds of the timer wheel that runs the connection timeouts of a worker
+#define kIQHTTPTimerWheelTick 0.25
+// The number of slots of a timer wheel. Timeouts longer than a revolution (64 seconds) go around more than once.
+#define kIQHTTPTimerWheelSlots 256
+// Client addresses are counted in this many hash buckets for maxConnectionsPerClient
+#define kIQHTTPClientBuckets 1024
+// How long a refused connection is kept open to read what the client sends before it is closed
+#define kIQHTTPRejectLingerTime 1.0
+
+/**
+ The timeout a connection is waiting for, depending on what it is reading.
+ */
+typedef enum {
+    _IQHTTPTimeoutNone,
+    _IQHTTPTimeoutHeader,
+    _IQHTTPTimeoutBody,
+    _IQHTTPTimeoutKeepAlive
+} _IQHTTPTimeoutKind;
+
+/**
+ A latency histogram with logarithmic buckets, in the manner of HdrHistogram. Recording is a single
+ atomic increment, so histograms can be shared by all workers without locking.
+ */
+typedef struct {
+    volatile int64_t counts[kIQHTTPHistogramBuckets];
+    volatile int64_t sum;
+} _IQHTTPHistogram;
+
+/**
+ The counters kept for each URL pattern. A request adds to them once, when it is complete.
+ */
+typedef struct {
+    volatile int64_t requests;
+    volatile int64_t bytesIn;
+    volatile int64_t bytesOut;
+    _IQHTTPHistogram firstByte;
+    _IQHTTPHistogram total;
+} _IQHTTPRouteStats;
+
+@interface _IQHTTPStaticFile : NSObject {
+@public
+    NSString* path;
+    int fd;
+    off_t size;
+    time_t mtime;
+    ino_t inode;
+    NSString* etag;
+    NSString* lastModified;
+    NSString* contentType;
+    CFAbsoluteTime checkedAt;
+    NSUInteger lastUsed;
+    // The gzip compressed representation of the file, if it has been looked up
+    _IQHTTPStaticFile* gzipVariant;
+    CFAbsoluteTime gzipCheckedAt;
+}
+- (id) initWithPath:(NSString*)path;
+@end
+
+/**
+ A part of a queued response: a block of memory (owned by the segment or shared with the
+ caller), or a region of a static file.
+ */
+@interface _IQHTTPOutputSegment : NSObject {
+@public
+    NSData* data;
+    _IQHTTPStaticFile* file;
+    off_t offset;
+    off_t length;
+    BOOL appendable;
+}
+@end
 
 @interface IQHTTPServer () {
 @public
     CFSocketRef serverSocket;
     NSRunLoop* actualRunLoop;
-    NSMutableSet* connections;
+    NSMutableArray* workers;
+    NSUInteger nextWorker;
     NSMutableArray* urlPatterns;
+    _IQHTTPRouteNode* routes;
+    NSMutableDictionary* staticFiles;
+    NSUInteger staticFileClock;
+    // Statistics for the requests that did not match any URL pattern
+    _IQHTTPRouteStats unroutedStats;
+    // Admission control. Connections are counted when accepted, before being handed to a worker.
+    volatile int32_t admittedConnections;
+    volatile int32_t clientConnections[kIQHTTPClientBuckets];
+    volatile int64_t rejectedConnections;
+}
+- (void) _releaseConnectionFromClient:(NSInteger)bucket;
+- (_IQHTTPStaticFile*) _staticFileAtPath:(NSString*)path;
+- (_IQHTTPStaticFile*) _gzipVariantOfFile:(_IQHTTPStaticFile*)file;
+- (BOOL) _isCompressibleType:(NSString*)contentType;
+- (_IQHTTPURLHandler*) _handlerForResource:(NSString*)resource method:(NSString*)method result:(NSTextCheckingResult**)result allowedMethods:(NSMutableSet*)allowedMethods;
+@end
+
+/**
+ A worker owns a run loop and the connections scheduled on it. Connections are only ever
+ touched from the thread of their worker, so no per-connection locking is needed.
+ */
+@interface _IQHTTPServerWorker : NSObject {
+@public
+    // Weak, as sockets handed to the worker may still be waiting on its run loop when the server goes away
+    __weak IQHTTPServer* server;
+    NSThread* thread;
+    NSRunLoop* runLoop;
+    NSMutableSet* connections;
+    volatile int32_t connectionCount;
+    // Gauges and counters of the worker, merged when the metrics are read
+    volatile int32_t busyConnectionCount;
+    volatile int64_t bufferedBytes;
+    volatile int64_t writeStalls;
+    volatile int64_t timeouts;
+    BOOL stopping;
+    // The connection timeouts, in a single timer wheel: every slot is a list of the connections
+    // whose timeout expires on a tick that maps to the slot. One run loop timer advances the wheel
+    // while any timeout is scheduled.
+    __unsafe_unretained _IQHTTPServerConnection* timerWheel[kIQHTTPTimerWheelSlots];
+    uint64_t timerWheelTick;
+    NSUInteger scheduledTimeouts;
+    CFRunLoopTimerRef timerWheelTimer;
 }
+
+- (id) initWithServer:(IQHTTPServer*)server runLoop:(NSRunLoop*)runLoop;
+- (void) acceptSocket:(CFSocketNativeHandle)socket client:(NSInteger)bucket;
+- (void) _scheduleTimeout:(NSTimeInterval)timeout forConnection:(_IQHTTPServerConnection*)connection;
+- (void) _advanceTimerWheel;
+- (void) closeAllConnectionsForce:(BOOL)force;
+- (void) stop;
+- (void) _connectionClosed:(_IQHTTPServerConnection*)connection;
 @end
 
-@interface _IQHTTPURLHandler : NSObject
+@interface _IQHTTPURLHandler : NSObject {
+@public
+    NSUInteger index;
+    _IQHTTPRouteStats stats;
+}
 @property (nonatomic, retain) NSRegularExpression* regexp;
 @property (nonatomic, copy) IQHTTPRequestCallback callback;
+@property (nonatomic, retain) NSString* method;
+@property (nonatomic, retain) IQHTTPResponseCache* cache;
+@end
+
+/**
+ A response in a response cache: the serialized head, without the blank line that ends it, and the
+ body. While a request is producing the response, the requests for the same key wait in waiters.
+ */
+@interface _IQHTTPCacheEntry : NSObject {
+@public
+    NSString* key;
+    NSData* head;
+    NSData* body;
+    NSUInteger size;
+    NSUInteger lastUsed;
+    CFAbsoluteTime expires;
+    CFAbsoluteTime staleUntil;
+    BOOL filling;
+    NSMutableArray* waiters;
+}
+@end
+
+@interface IQHTTPResponseCache () {
+@public
+    // All state is guarded by @synchronized on the cache
+    NSMutableDictionary* entries;
+    NSUInteger totalSize;
+    NSUInteger clock;
+    NSUInteger hitCount, missCount;
+}
+- (NSString*) _keyForRequest:(IQHTTPServerRequest*)request;
+- (_IQHTTPCacheEntry*) _entryForKey:(NSString*)key;
+- (void) _finishFill:(_IQHTTPCacheEntry*)entry head:(NSData*)head body:(NSData*)body;
+@end
+
+@interface IQHTTPRequestBody () {
+    // The body while it fits in memory, after that the open temporary file
+    NSMutableData* buffer;
+    int fd;
+    NSUInteger memoryLimit;
+    NSString* directory;
+    NSData* data;
+    BOOL temporary;
+    BOOL failed;
+}
+- (id) _initWithMemoryLimit:(NSUInteger)limit expectedLength:(long long)expectedLength directory:(NSString*)directory;
+- (BOOL) _openFile;
+- (void) _appendBytes:(const uint8_t*)bytes length:(NSUInteger)length;
+- (BOOL) _finish;
+@end
+
+/**
+ A node in the route index, a trie over the literal prefixes of the URL patterns. The handlers
+ of a node are the ones whose prefix ends at the node, in the order they were added.
+ */
+@interface _IQHTTPRouteNode : NSObject {
+@public
+    NSMutableDictionary* children;
+    NSMutableArray* handlers;
+}
 @end
 
 @interface _IQHTTPServerConnection : NSObject {
 @public
     CFSocketNativeHandle socket;
-    NSInputStream* input;
-    NSOutputStream* output;
-    IQHTTPServerRequest* currentRequest;
+    CFSocketRef socketRef;
+    BOOL canWrite;
+    BOOL readClosed;
+    // Requests waiting for (or writing) their response, in the order they were received. Only the
+    // first request writes to the socket, the others buffer their output until it is their turn.
+    NSMutableArray* requests;
+    // The request currently being read from the socket
+    IQHTTPServerRequest* inputRequest;
     IQHTTPServer* server;
+    _IQHTTPServerWorker* worker;
     BOOL keepAlive;
-    NSMutableData* backBuffer;
-    CFHTTPMessageRef dispatchOnOpen;
+    BOOL receivedRequest;
+    // The hash bucket of the client address, or -1
+    NSInteger clientBucket;
+    // The timeout the connection is waiting for, and its place in the timer wheel of the worker
+    _IQHTTPTimeoutKind timeoutKind;
+    BOOL timeoutScheduled;
+    uint64_t timeoutTick;
+    __unsafe_unretained _IQHTTPServerConnection* timeoutNext;
+    __unsafe_unretained _IQHTTPServerConnection* timeoutPrev;
+    uint8_t* readBuffer;
+    size_t readBufferSize, readLength, readOffset;
+    BOOL readPaused, processingInput;
+    // Whether the connection is counted as busy by its worker
+    BOOL countedBusy;
+    IQHTTPParser parser;
+    IQHTTPHeaderField* parserFields;
 }
 
-- (id) initWithSocket:(CFSocketNativeHandle)socket runLoop:(NSRunLoop*)runLoop server:(IQHTTPServer*)server;
+- (id) initWithSocket:(CFSocketNativeHandle)socket worker:(_IQHTTPServerWorker*)worker;
 - (void) close;
+- (NSInteger) read:(uint8_t *)buffer maxLength:(NSUInteger)len;
+- (NSInteger) write:(const uint8_t *)buffer maxLength:(NSUInteger)len;
+- (NSInteger) writeVectors:(const struct iovec*)iov count:(int)count;
+- (off_t) sendFile:(int)fd offset:(off_t)offset length:(off_t)length;
+- (void) _canRead;
+- (void) _canWrite;
+- (void) _stopReading;
+- (void) _requestRead;
+- (void) _requestDone:(IQHTTPServerRequest*)request;
+- (void) _updateBusy;
+- (void) _updateTimeout;
+- (void) _timedOut;
+@property (nonatomic, readonly) IQHTTPServerRequest* activeRequest;
 @property (nonatomic, readonly) BOOL isIdle;
+@property (nonatomic, readonly) BOOL hasSpaceAvailable;
 @end
 
 @interface IQHTTPServerRequest () {
     CFSocketNativeHandle socket;
     _IQHTTPServerConnection* connection;
-    CFHTTPMessageRef requestHeaders, responseHeaders;
+    CFHTTPMessageRef responseHeaders;
+@public
+    // The request head is kept as a single block: the header field table followed by the raw bytes
+    void* head;
+    const uint8_t* headBytes;
+    IQHTTPHeaderField* headFields;
+    NSUInteger headFieldCount;
+    IQHTTPSpan methodSpan, targetSpan;
     long long remainingBody;
     long long contentLength;
     BOOL headerWasComplete;
+    BOOL closeConnection;
+    BOOL http10;
+    BOOL chunkedBody;
+    IQHTTPChunkDecoder chunkDecoder;
+    // Metrics, added to the statistics of the route when the request is complete
+    _IQHTTPRouteStats* routeStats;
+    uint64_t startTime, firstByteTime;
+    unsigned long long bytesIn, bytesOut;
+    NSUInteger reportedLength;
+    BOOL metricsRecorded;
+@private
+    // Set while the response of this request is to be stored in a response cache
+    IQHTTPResponseCache* responseCache;
+    _IQHTTPCacheEntry* cacheEntry;
+    BOOL chunkedResponse;
+    BOOL lastChunkQueued;
+    BOOL deferHeaders;
+    NSString* method;
     IQHTTPRequestReader bodyReader;
     BOOL readBodyAtomic;
     NSMutableData* requestBodyBuffer;
+    // Receives the body in place, without an NSData per read, and is told when the body is complete
+    void (^bodySink)(const uint8_t* bytes, NSUInteger length);
+    void (^bodyEnd)(IQHTTPServerRequest* request);
     BOOL headersSent;
+    // Set once the headers of a HEAD response have been sent, after which the body is dropped
+    BOOL discardBody;
     NSStringEncoding encoding;
     BOOL didSetContentType;
     NSInputStream* writeStream;
-    NSMutableData* writeBuffer;
+    // The queued output, drained from the front with writev/sendfile
+    NSMutableArray* outputQueue;
+    NSUInteger queuedLength;
+    BOOL writeBufferWasFull;
+    // Compresses the response body when Content-Encoding has been negotiated
+    z_stream* compressor;
+    BOOL compressorFinished;
+    BOOL compressionDisabled;
     IQHTTPRequestCallback currentCallback;
     NSTextCheckingResult* currentResult;
     NSString* resourceSpecifier;
     NSInteger seq;
     BOOL isDone;
+    // Set while the request waits for another request to produce the cached response
+    BOOL waitingForCache;
 }
 
 - (id) initWithConnection:(_IQHTTPServerConnection*)connection;
-- (void) _readRequest;
+- (void) _respondWithStatus:(NSInteger)status message:(NSString*)message;
+- (void) _setHead:(const uint8_t*)bytes parser:(IQHTTPParser*)parser;
+- (NSUInteger) _readBody:(const uint8_t*)bytes length:(NSUInteger)length;
+- (BOOL) _bodyComplete;
+- (void) _checkBodyEnd;
 - (void) _sendHeaders;
-- (void) _dispatchRequest:(CFHTTPMessageRef)msg;
+- (void) _dispatchRequest;
 - (void) _handleRequest;
+- (void) _reportBufferedLength;
+- (void) _recordMetrics;
+- (BOOL) _serveFromCache:(IQHTTPResponseCache*)cache;
+- (void) _cachedResponseReady:(NSData*)cachedHead body:(NSData*)body;
+@end
+
+@interface IQHTTPServerRouteMetrics () {
+@public
+    NSString* pattern;
+    NSString* method;
+    unsigned long long requestCount, bytesReceived, bytesSent;
+    _IQHTTPHistogram firstByte, total;
+}
+@end
+
+@interface IQHTTPServerMetrics () {
+@public
+    NSArray* routes;
+    NSUInteger activeConnectionCount, idleConnectionCount;
+    unsigned long long bufferedOutputBytes, writeStallCount;
+    unsigned long long rejectedConnectionCount, timedOutConnectionCount;
+}
 @end
 
+/**
+ A monotonic clock in microseconds, used to time requests.
+ */
+static uint64_t IQHTTPMicroseconds(void)
+{
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        mach_timebase_info(&timebase);
+    });
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+}
+
+static inline NSUInteger IQHTTPHistogramIndex(uint64_t micros)
+{
+    if(micros < kIQHTTPHistogramSubBuckets) {
+        return (NSUInteger)micros;
+    }
+    // The highest set bit selects the power of two, the bits below it the linear bucket within it
+    unsigned shift = 63 - __builtin_clzll(micros) - kIQHTTPHistogramSubBits;
+    NSUInteger index = (shift + 1) * kIQHTTPHistogramSubBuckets + (NSUInteger)((micros >> shift) & (kIQHTTPHistogramSubBuckets - 1));
+    return MIN(index, kIQHTTPHistogramBuckets - 1);
+}
+
+/**
+ The smallest value (in microseconds) counted in a histogram bucket.
+ */
+static uint64_t IQHTTPHistogramLowerBound(NSUInteger index)
+{
+    if(index < kIQHTTPHistogramSubBuckets) {
+        return index;
+    }
+    unsigned shift = (unsigned)(index / kIQHTTPHistogramSubBuckets) - 1;
+    return (uint64_t)(kIQHTTPHistogramSubBuckets + index % kIQHTTPHistogramSubBuckets) << shift;
+}
+
+static inline void IQHTTPHistogramRecord(_IQHTTPHistogram* histogram, uint64_t micros)
+{
+    OSAtomicIncrement64(&histogram->counts[IQHTTPHistogramIndex(micros)]);
+    OSAtomicAdd64((int64_t)micros, &histogram->sum);
+}
+
+static void IQHTTPHistogramCopy(_IQHTTPHistogram* to, _IQHTTPHistogram* from)
+{
+    // Atomic reads, as 64 bit loads may tear on 32 bit devices
+    for(NSUInteger i = 0; i < kIQHTTPHistogramBuckets; i++) {
+        to->counts[i] = OSAtomicAdd64(0, &from->counts[i]);
+    }
+    to->sum = OSAtomicAdd64(0, &from->sum);
+}
+
+static int64_t IQHTTPHistogramCount(const _IQHTTPHistogram* histogram)
+{
+    int64_t count = 0;
+    for(NSUInteger i = 0; i < kIQHTTPHistogramBuckets; i++) {
+        count += histogram->counts[i];
+    }
+    return count;
+}
+
+/**
+ Returns the value at the given percentile (0-100) in seconds. As with HdrHistogram, this is the
+ highest value that falls in the same bucket as the value at that rank.
+ */
+static NSTimeInterval IQHTTPHistogramPercentile(const _IQHTTPHistogram* histogram, double percentile)
+{
+    int64_t count = IQHTTPHistogramCount(histogram);
+    if(count == 0) {
+        return 0;
+    }
+    int64_t rank = (int64_t)ceil(MAX(MIN(percentile, 100.0), 0.0) / 100.0 * count);
+    if(rank < 1) rank = 1;
+    int64_t seen = 0;
+    for(NSUInteger i = 0; i < kIQHTTPHistogramBuckets; i++) {
+        seen += histogram->counts[i];
+        if(seen >= rank) {
+            return (IQHTTPHistogramLowerBound(i + 1) - 1) / 1000000.0;
+        }
+    }
+    return IQHTTPHistogramLowerBound(kIQHTTPHistogramBuckets - 1) / 1000000.0;
+}
+
+static IQHTTPServerRouteMetrics* IQHTTPRouteMetrics(_IQHTTPRouteStats* stats, NSString* pattern, NSString* method)
+{
+    IQHTTPServerRouteMetrics* metrics = [IQHTTPServerRouteMetrics new];
+    metrics->pattern = pattern;
+    metrics->method = method;
+    metrics->requestCount = (unsigned long long)OSAtomicAdd64(0, &stats->requests);
+    metrics->bytesReceived = (unsigned long long)OSAtomicAdd64(0, &stats->bytesIn);
+    metrics->bytesSent = (unsigned long long)OSAtomicAdd64(0, &stats->bytesOut);
+    IQHTTPHistogramCopy(&metrics->firstByte, &stats->firstByte);
+    IQHTTPHistogramCopy(&metrics->total, &stats->total);
+    return metrics;
+}
+
 @implementation IQHTTPServer
-@synthesize port, address, runLoop, callback, keepAliveTimeout, writeBufferLimit;
+@synthesize port, address, runLoop, callback, keepAliveTimeout, writeBufferLimit, workerCount, staticFileCacheSize;
+@synthesize readBufferSize, maxRequestHeaderSize, maxRequestHeaderCount, maxPipelineDepth;
+@synthesize requestHeaderTimeout, requestBodyTimeout, maxConnections, maxConnectionsPerClient;
+@synthesize requestBodyMemoryLimit, requestBodySpoolDirectory;
+@synthesize compressionEnabled, compressionMinimumSize, compressibleTypes, compressedFileCacheDirectory;
 
 - (id) init
 {
@@ -96,23 +508,168 @@
     return [self initWithAddress:nil port:p];
 }
 - (id) initWithAddress:(NSString*)a port:(UInt16)p
+{
+    return [self initWithAddress:a port:p workers:0];
+}
+
+- (id) initWithAddress:(NSString*)a port:(UInt16)p workers:(NSUInteger)wc
 {
     self = [super init];
     if(self) {
         self->writeBufferLimit = 1024*1024;
+        self->staticFileCacheSize = 64;
+        self->keepAliveTimeout = 10.0;
+        self->requestHeaderTimeout = 30.0;
+        self->requestBodyTimeout = 60.0;
+        self->maxPipelineDepth = 16;
+        self->requestBodyMemoryLimit = 64*1024;
+        self->requestBodySpoolDirectory = NSTemporaryDirectory();
+        self->readBufferSize = 8192;
+        self->maxRequestHeaderSize = kIQHTTPParserDefaultMaxHeaderSize;
+        self->maxRequestHeaderCount = kIQHTTPParserDefaultMaxHeaderCount;
+        self->compressionMinimumSize = 1024;
+        self->compressibleTypes = [NSSet setWithObjects:
+                                   [IQMIMEType MIMETypeWithType:@"text" subtype:@"*"],
+                                   [IQMIMEType MIMETypeWithType:@"application" subtype:@"json"],
+                                   [IQMIMEType MIMETypeWithType:@"application" subtype:@"javascript"],
+                                   [IQMIMEType MIMETypeWithType:@"application" subtype:@"xml"],
+                                   [IQMIMEType MIMETypeWithType:@"application" subtype:@"xhtml+xml"],
+                                   [IQMIMEType MIMETypeWithType:@"image" subtype:@"svg+xml"],
+                                   nil];
+        self->compressedFileCacheDirectory = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IQHTTPServer-gzip"];
+        self->staticFiles = [NSMutableDictionary dictionaryWithCapacity:16];
         self->port = p;
         self->address = a;
-        self->connections = [NSMutableSet setWithCapacity:120];
+        self->workerCount = wc;
     }
     return self;
 }
 
+/**
+ Maps the IP address of a client to one of the buckets its connections are counted in, or -1.
+ */
+static NSInteger IQHTTPClientBucket(CFDataRef address)
+{
+    if(!address || CFDataGetLength(address) < (CFIndex)sizeof(struct sockaddr)) {
+        return -1;
+    }
+    const struct sockaddr* sa = (const struct sockaddr*)CFDataGetBytePtr(address);
+    const uint8_t* bytes;
+    size_t length;
+    if(sa->sa_family == AF_INET) {
+        bytes = (const uint8_t*)&((const struct sockaddr_in*)sa)->sin_addr;
+        length = 4;
+    } else if(sa->sa_family == AF_INET6 && CFDataGetLength(address) >= (CFIndex)sizeof(struct sockaddr_in6)) {
+        bytes = (const uint8_t*)&((const struct sockaddr_in6*)sa)->sin6_addr;
+        length = 16;
+    } else {
+        return -1;
+    }
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash % kIQHTTPClientBuckets;
+}
+
+static dispatch_queue_t IQHTTPRejectQueue()
+{
+    static dispatch_queue_t queue;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        queue = dispatch_queue_create("IQHTTPServer.reject", DISPATCH_QUEUE_SERIAL);
+    });
+    return queue;
+}
+
+/**
+ Answers a connection the server has no room for and closes it. The response is preformatted, so
+ refusing a connection costs a single send. Closing a socket with unread input resets the
+ connection, which could discard the response before the client reads it, so the request is read
+ and dropped until the client closes its end or kIQHTTPRejectLingerTime has passed.
+ */
+static void IQHTTPRejectSocket(CFSocketNativeHandle sock)
+{
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"
+                                   "Retry-After: 1\r\nConnection: close\r\n\r\n";
+    int value = 1;
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (void *)&value, sizeof(int));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    send(sock, response, sizeof(response) - 1, 0);
+    shutdown(sock, SHUT_WR);
+    dispatch_queue_t queue = IQHTTPRejectQueue();
+    // Cleared when cancelled, which breaks the cycle between the source and its handler
+    __block dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, sock, 0, queue);
+    dispatch_source_set_event_handler(source, ^{
+        char buf[1024];
+        ssize_t n;
+        while((n = recv(sock, buf, sizeof(buf), 0)) > 0);
+        if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            dispatch_source_cancel(source);
+        }
+    });
+    dispatch_source_set_cancel_handler(source, ^{
+        close(sock);
+        source = nil;
+    });
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kIQHTTPRejectLingerTime * NSEC_PER_SEC)), queue, ^{
+        if(source) {
+            dispatch_source_cancel(source);
+        }
+    });
+    dispatch_resume(source);
+}
+
 static void ListenSocketCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
 {
     CFSocketNativeHandle peerSocket = *(CFSocketNativeHandle *)data;
     IQHTTPServer* server = (__bridge IQHTTPServer*)info;
-    _IQHTTPServerConnection* connection = [[_IQHTTPServerConnection alloc] initWithSocket:peerSocket runLoop:server->actualRunLoop server:server];
-    [server->connections addObject:connection];
+    NSInteger bucket = IQHTTPClientBucket(address);
+    int32_t total = OSAtomicIncrement32(&server->admittedConnections);
+    int32_t fromClient = bucket >= 0 ? OSAtomicIncrement32(&server->clientConnections[bucket]) : 0;
+    NSUInteger maxConnections = server.maxConnections, maxPerClient = server.maxConnectionsPerClient;
+    if((maxConnections > 0 && (NSUInteger)total > maxConnections) || (maxPerClient > 0 && (NSUInteger)fromClient > maxPerClient)) {
+        [server _releaseConnectionFromClient:bucket];
+        OSAtomicIncrement64(&server->rejectedConnections);
+        IQHTTPRejectSocket(peerSocket);
+        return;
+    }
+    // Round-robin hand-off to the workers. With a single worker, this is the server run loop itself.
+    _IQHTTPServerWorker* worker = server->workers[server->nextWorker++ % server->workers.count];
+    [worker acceptSocket:peerSocket client:bucket];
+}
+
+- (void) _releaseConnectionFromClient:(NSInteger)bucket
+{
+    OSAtomicDecrement32(&admittedConnections);
+    if(bucket >= 0) {
+        OSAtomicDecrement32(&clientConnections[bucket]);
+    }
+}
+
+- (void) _startWorkers
+{
+    if(workers.count > 0) {
+        return;
+    }
+    if(workerCount == 0) {
+        workers = [NSMutableArray arrayWithObject:[[_IQHTTPServerWorker alloc] initWithServer:self runLoop:actualRunLoop]];
+    } else {
+        workers = [NSMutableArray arrayWithCapacity:workerCount];
+        for(NSUInteger i = 0; i < workerCount; i++) {
+            [workers addObject:[[_IQHTTPServerWorker alloc] initWithServer:self runLoop:nil]];
+        }
+    }
+    nextWorker = 0;
+}
+
+- (void) _stopWorkers
+{
+    for(_IQHTTPServerWorker* worker in workers) {
+        [worker stop];
+    }
+    workers = nil;
 }
 
 - (NSData*) _addressIPV4:(NSString*)a port:(UInt16)p
@@ -190,25 +747,72 @@ static void ListenSocketCallback(CFSocketRef s, CFSocketCallBackType type, CFDat
         }
         CFRelease(data);
         
-        CFRunLoopSourceRef runLoopSource = CFSocketCreateRunLoopSource(kCFAllocatorDefault, serverSocket, 1);
         actualRunLoop = runLoop ? runLoop : [NSRunLoop currentRunLoop];
+        [self _startWorkers];
+        
+        CFRunLoopSourceRef runLoopSource = CFSocketCreateRunLoopSource(kCFAllocatorDefault, serverSocket, 1);
         CFRunLoopAddSource([actualRunLoop getCFRunLoop], runLoopSource, kCFRunLoopCommonModes);
         CFRelease(runLoopSource);
     } else if(!newStarted && serverSocket) {
-        [self closeAllConnectionsForce:NO];
         CFSocketInvalidate(serverSocket);
         CFRelease(serverSocket);
         serverSocket = nil;
+        // Workers close their idle connections and exit once the remaining ones are done
+        [self _stopWorkers];
     }
 }
 
 - (void) closeAllConnectionsForce:(BOOL)force
 {
-    for(_IQHTTPServerConnection* connection in connections) {
-        if(force || connection.isIdle) {
-            [connection close];
-        }
+    for(_IQHTTPServerWorker* worker in workers) {
+        [worker closeAllConnectionsForce:force];
+    }
+}
+
+- (NSUInteger) connectionCount
+{
+    NSUInteger count = 0;
+    for(_IQHTTPServerWorker* worker in workers) {
+        count += worker->connectionCount;
+    }
+    return count;
+}
+
+- (IQHTTPServerMetrics*) metrics
+{
+    IQHTTPServerMetrics* metrics = [IQHTTPServerMetrics new];
+    NSUInteger connections = 0, busy = 0;
+    int64_t buffered = 0, stalls = 0, timeouts = 0;
+    for(_IQHTTPServerWorker* worker in workers) {
+        connections += worker->connectionCount;
+        busy += worker->busyConnectionCount;
+        buffered += OSAtomicAdd64(0, &worker->bufferedBytes);
+        stalls += OSAtomicAdd64(0, &worker->writeStalls);
+        timeouts += OSAtomicAdd64(0, &worker->timeouts);
     }
+    metrics->activeConnectionCount = MIN(busy, connections);
+    metrics->idleConnectionCount = connections - metrics->activeConnectionCount;
+    metrics->bufferedOutputBytes = (unsigned long long)MAX(buffered, 0);
+    metrics->writeStallCount = (unsigned long long)stalls;
+    metrics->timedOutConnectionCount = (unsigned long long)timeouts;
+    metrics->rejectedConnectionCount = (unsigned long long)OSAtomicAdd64(0, &rejectedConnections);
+    NSMutableArray* routeMetrics = [NSMutableArray arrayWithCapacity:urlPatterns.count + 1];
+    for(_IQHTTPURLHandler* handler in urlPatterns) {
+        [routeMetrics addObject:IQHTTPRouteMetrics(&handler->stats, handler.regexp.pattern, handler.method)];
+    }
+    [routeMetrics addObject:IQHTTPRouteMetrics(&unroutedStats, nil, nil)];
+    metrics->routes = routeMetrics;
+    return metrics;
+}
+
+- (void) addMetricsURLPattern:(NSRegularExpression*)pattern
+{
+    __weak IQHTTPServer* weakSelf = self;
+    [self addURLPattern:pattern method:@"GET" callback:^(IQHTTPServerRequest* request, NSInteger sequence) {
+        [request setValue:@"text/plain; version=0.0.4" forResponseHeaderField:@"Content-Type"];
+        [request writeString:[weakSelf.metrics textRepresentation]];
+        [request done];
+    }];
 }
 
 - (BOOL) started
@@ -233,6 +837,18 @@ static void ListenSocketCallback(CFSocketRef s, CFSocketCallBackType type, CFDat
     }
 }
 
+- (void) setWorkerCount:(NSUInteger)wc
+{
+    BOOL wasStarted = self.started;
+    if(wasStarted) {
+        self.started = NO;
+    }
+    self->workerCount = wc;
+    if(wasStarted) {
+        self.started = YES;
+    }
+}
+
 - (void) setPort:(UInt16)p
 {
     BOOL wasStarted = self.started;
@@ -258,7 +874,69 @@ static void ListenSocketCallback(CFSocketRef s, CFSocketCallBackType type, CFDat
     }
 }
 
+/**
+ Returns the literal text that every match of the pattern must start with. Returns an empty string
+ when that cannot be determined with certainty, in which case the pattern is tried for all requests.
+ */
+static NSString* IQHTTPLiteralPrefix(NSRegularExpression* regexp)
+{
+    NSString* pattern = regexp.pattern;
+    if(regexp.options & NSRegularExpressionIgnoreMetacharacters) {
+        return pattern;
+    }
+    if(regexp.options & (NSRegularExpressionCaseInsensitive | NSRegularExpressionAllowCommentsAndWhitespace)) {
+        return @"";
+    }
+    NSUInteger length = pattern.length;
+    // Alternatives may start with different text
+    for(NSUInteger i = 0; i < length; i++) {
+        unichar c = [pattern characterAtIndex:i];
+        if(c == '\\') {
+            i++;
+        } else if(c == '|') {
+            return @"";
+        }
+    }
+    NSMutableString* prefix = [NSMutableString string];
+    NSUInteger i = 0;
+    if(length > 0 && [pattern characterAtIndex:0] == '^') i++;
+    while(i < length) {
+        unichar c = [pattern characterAtIndex:i];
+        if(c == '\\') {
+            // Only escaped punctuation is literal, letters and digits are character classes and such
+            if(i+1 >= length) break;
+            unichar next = [pattern characterAtIndex:i+1];
+            if([[NSCharacterSet alphanumericCharacterSet] characterIsMember:next]) break;
+            c = next;
+            i += 2;
+        } else if(c < 128 && strchr(".^$|?*+()[]{}", c)) {
+            break;
+        } else {
+            i++;
+        }
+        if(i < length) {
+            unichar quantifier = [pattern characterAtIndex:i];
+            if(quantifier == '?' || quantifier == '*' || quantifier == '{') {
+                // The character is optional (or repeated a variable number of times)
+                break;
+            }
+        }
+        [prefix appendFormat:@"%C", c];
+    }
+    return prefix;
+}
+
 - (void) addURLPattern:(NSRegularExpression*)pattern callback:(IQHTTPRequestCallback)cb
+{
+    [self addURLPattern:pattern method:nil callback:cb];
+}
+
+- (void) addURLPattern:(NSRegularExpression*)pattern method:(NSString*)method callback:(IQHTTPRequestCallback)cb
+{
+    [self addURLPattern:pattern method:method cache:nil callback:cb];
+}
+
+- (void) addURLPattern:(NSRegularExpression*)pattern method:(NSString*)method cache:(IQHTTPResponseCache*)cache callback:(IQHTTPRequestCallback)cb
 {
     if(pattern == nil) {
         NSLog(@"Warning: nil URL pattern -- ignoring");
@@ -266,550 +944,2628 @@ static void ListenSocketCallback(CFSocketRef s, CFSocketCallBackType type, CFDat
     }
     if(!urlPatterns) {
         urlPatterns = [NSMutableArray array];
+        routes = [_IQHTTPRouteNode new];
     }
     _IQHTTPURLHandler* uh = [[_IQHTTPURLHandler alloc] init];
     uh.regexp = pattern;
     uh.callback = cb;
+    uh.cache = cache;
+    uh.method = [method uppercaseString];
+    uh->index = urlPatterns.count;
     [urlPatterns addObject:uh];
+    
+    // Index the pattern by its literal prefix
+    NSString* prefix = IQHTTPLiteralPrefix(pattern);
+    _IQHTTPRouteNode* node = routes;
+    for(NSUInteger i = 0; i < prefix.length; i++) {
+        NSNumber* key = @([prefix characterAtIndex:i]);
+        _IQHTTPRouteNode* child = node->children[key];
+        if(!child) {
+            child = [_IQHTTPRouteNode new];
+            if(!node->children) node->children = [NSMutableDictionary dictionaryWithCapacity:2];
+            node->children[key] = child;
+        }
+        node = child;
+    }
+    if(!node->handlers) node->handlers = [NSMutableArray arrayWithCapacity:1];
+    [node->handlers addObject:uh];
+}
+
+/**
+ Finds the first added handler whose pattern matches the entire resource. Only the patterns whose
+ literal prefix matches the resource are evaluated.
+ */
+- (_IQHTTPURLHandler*) _handlerForResource:(NSString*)resource method:(NSString*)method result:(NSTextCheckingResult**)result allowedMethods:(NSMutableSet*)allowedMethods
+{
+    if(!routes) {
+        return nil;
+    }
+    NSUInteger length = resource.length;
+    unichar stackBuffer[256];
+    unichar* chars = length <= 256 ? stackBuffer : malloc(length * sizeof(unichar));
+    [resource getCharacters:chars range:NSMakeRange(0, length)];
+    
+    NSMutableArray* candidates = nil;
+    NSUInteger nodesWithHandlers = 0;
+    _IQHTTPRouteNode* node = routes;
+    for(NSUInteger i = 0; node; i++) {
+        if(node->handlers) {
+            if(!candidates) candidates = [NSMutableArray arrayWithCapacity:4];
+            [candidates addObjectsFromArray:node->handlers];
+            nodesWithHandlers++;
+        }
+        node = i < length ? node->children[@(chars[i])] : nil;
+    }
+    if(chars != stackBuffer) free(chars);
+    if(nodesWithHandlers > 1) {
+        // Keep the order in which the patterns were added
+        [candidates sortUsingComparator:^NSComparisonResult(_IQHTTPURLHandler* a, _IQHTTPURLHandler* b) {
+            return a->index < b->index ? NSOrderedAscending : NSOrderedDescending;
+        }];
+    }
+    
+    NSRange range = NSMakeRange(0, length);
+    for(_IQHTTPURLHandler* handler in candidates) {
+        NSTextCheckingResult* match = [handler.regexp firstMatchInString:resource options:NSMatchingAnchored range:range];
+        if(match && match.range.location == 0 && match.range.length == length) {
+            if(handler.method && ![handler.method isEqualToString:method]) {
+                [allowedMethods addObject:handler.method];
+                continue;
+            }
+            *result = match;
+            return handler;
+        }
+    }
+    return nil;
 }
 - (void) addURLPattern:(NSRegularExpression*)pattern directory:(NSString*)staticFileDirectory
 {
+    NSString* root = [staticFileDirectory stringByStandardizingPath];
+    BOOL hasGroup = pattern.numberOfCaptureGroups > 0;
     [self addURLPattern:pattern callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
-        //
+        // The first capture group (or the entire resource) is the path relative to the directory
+        NSString* relative = hasGroup ? [request valueForUrlPatternGroup:1] : request.resource;
+        NSRange query = [relative rangeOfCharacterFromSet:[NSCharacterSet characterSetWithCharactersInString:@"?#"]];
+        if(query.length > 0) {
+            relative = [relative substringToIndex:query.location];
+        }
+        relative = [relative stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+        if(!relative || [relative.pathComponents containsObject:@".."]) {
+            [request _respondWithStatus:404 message:@"The file was not found"];
+            return;
+        }
+        [request serveFileAtPath:[root stringByAppendingPathComponent:relative]];
     }];
 }
 
-@end
-
-@implementation _IQHTTPServerConnection
-
+#pragma mark - Static file cache
 
-- (id) initWithSocket:(CFSocketNativeHandle)sock runLoop:(NSRunLoop*)rl server:(IQHTTPServer*)srv
+- (_IQHTTPStaticFile*) _staticFileAtPath:(NSString*)path
 {
-    self = [super init];
-    if(self) {
-        CFReadStreamRef readStream = nil;
-        CFWriteStreamRef writeStream = nil;
-        CFStreamCreatePairWithSocket(kCFAllocatorDefault, sock, &readStream, &writeStream);
-        input = objc_unretainedObject(readStream);
-        output = objc_unretainedObject(writeStream);
-        input.delegate = (id<NSStreamDelegate>)self;
-        output.delegate = (id<NSStreamDelegate>)self;
-        [input scheduleInRunLoop:rl forMode:NSRunLoopCommonModes];
-        [output scheduleInRunLoop:rl forMode:NSRunLoopCommonModes];
-        [input open];
-        [output open];
-        socket = sock;
-        server = srv;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    _IQHTTPStaticFile* file = nil;
+    @synchronized(staticFiles) {
+        file = staticFiles[path];
+        if(file && now - file->checkedAt < kIQHTTPStaticFileRecheckInterval) {
+            // Recently checked, no need to touch the file system at all
+            file->lastUsed = ++staticFileClock;
+            return file;
+        }
     }
-    return self;
-}
-
-- (void) dealloc
-{
-    if(socket) {
-        close(socket);
-        socket = 0;
+    struct stat st;
+    if(stat([path fileSystemRepresentation], &st) != 0) {
+        @synchronized(staticFiles) {
+            [staticFiles removeObjectForKey:path];
+        }
+        return nil;
     }
-}
-
-- (void) close
-{
-    currentRequest = nil;
-    [input close];
-    [output close];
-    if(socket) {
-        close(socket);
-        socket = 0;
+    if(S_ISDIR(st.st_mode)) {
+        return [self _staticFileAtPath:[path stringByAppendingPathComponent:@"index.html"]];
+    }
+    if(!S_ISREG(st.st_mode)) {
+        return nil;
+    }
+    if(file && file->inode == st.st_ino && file->size == st.st_size && file->mtime == st.st_mtime) {
+        file->checkedAt = now;
+    } else {
+        file = [[_IQHTTPStaticFile alloc] initWithPath:path];
+        if(!file) {
+            return nil;
+        }
     }
-    input = nil;
-    output = nil;
-    [server->connections removeObject:self];
+    @synchronized(staticFiles) {
+        if(staticFileCacheSize > 0) {
+            if(!staticFiles[path] && staticFiles.count >= staticFileCacheSize) {
+                // Evict the least recently used entry. The descriptor is closed once no request uses it.
+                NSString* oldest = nil;
+                NSUInteger oldestUse = NSUIntegerMax;
+                for(NSString* key in staticFiles) {
+                    _IQHTTPStaticFile* f = staticFiles[key];
+                    if(f->lastUsed < oldestUse) {
+                        oldestUse = f->lastUsed;
+                        oldest = key;
+                    }
+                }
+                if(oldest) [staticFiles removeObjectForKey:oldest];
+            }
+            staticFiles[path] = file;
+        }
+        file->lastUsed = ++staticFileClock;
+    }
+    return file;
 }
 
-- (BOOL) isIdle
-{
-    return (currentRequest == nil);
-}
+#pragma mark - Compression
 
-- (void) _requestDone
+/**
+ Writes a gzip compressed copy of a file. The copy is written to a temporary file which is then
+ renamed, so a partially written copy is never served.
+ */
+static BOOL IQHTTPGzipFile(int fd, NSString* destination)
 {
-    currentRequest = nil;
-    if(!keepAlive) [self close];
+    NSString* temporary = [destination stringByAppendingFormat:@".%@.tmp", [[NSProcessInfo processInfo] globallyUniqueString]];
+    int out = open([temporary fileSystemRepresentation], O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(out < 0) {
+        return NO;
+    }
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // The result is reused for every request, so it is worth spending time on a better ratio
+    if(deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        close(out);
+        unlink([temporary fileSystemRepresentation]);
+        return NO;
+    }
+    uint8_t* input = malloc(kIQHTTPStreamChunkSize + kIQHTTPCompressionBufferSize);
+    uint8_t* output = input + kIQHTTPStreamChunkSize;
+    BOOL ok = YES;
+    off_t offset = 0;
+    int flush = Z_NO_FLUSH;
+    while(ok && flush != Z_FINISH) {
+        // The descriptor is shared with requests on other threads, so the file position is not used
+        ssize_t n = pread(fd, input, kIQHTTPStreamChunkSize, offset);
+        if(n < 0) {
+            ok = NO;
+            break;
+        }
+        offset += n;
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = input;
+        z.avail_in = (uInt)n;
+        do {
+            z.next_out = output;
+            z.avail_out = kIQHTTPCompressionBufferSize;
+            deflate(&z, flush);
+            ssize_t have = kIQHTTPCompressionBufferSize - z.avail_out;
+            if(have > 0 && write(out, output, have) != have) {
+                ok = NO;
+                break;
+            }
+        } while(z.avail_out == 0);
+    }
+    free(input);
+    deflateEnd(&z);
+    close(out);
+    if(!ok || rename([temporary fileSystemRepresentation], [destination fileSystemRepresentation]) != 0) {
+        unlink([temporary fileSystemRepresentation]);
+        return NO;
+    }
+    return YES;
 }
 
-- (void) _requestRead
+/**
+ Returns the gzip compressed representation of a static file: a precompressed ".gz" sibling that
+ is at least as new as the file, or a copy compressed once and kept in the cache directory.
+ */
+- (_IQHTTPStaticFile*) _gzipVariantOfFile:(_IQHTTPStaticFile*)file
 {
-    if(!keepAlive) [input close];
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    // Concurrent requests for a file that has not been compressed yet wait for the first one
+    @synchronized(file) {
+        if(file->gzipVariant && now - file->gzipCheckedAt < kIQHTTPStaticFileRecheckInterval) {
+            return file->gzipVariant;
+        }
+        struct stat st;
+        NSString* variantPath = [file->path stringByAppendingPathExtension:@"gz"];
+        if(stat([variantPath fileSystemRepresentation], &st) != 0 || !S_ISREG(st.st_mode) || st.st_mtime < file->mtime) {
+            // The name identifies the version of the file, so a modified file is compressed again
+            NSString* directory = self.compressedFileCacheDirectory;
+            NSString* name = [NSString stringWithFormat:@"%lx-%llx-%llx-%lx.gz", (unsigned long)file->path.hash, (unsigned long long)file->inode, (unsigned long long)file->size, (long)file->mtime];
+            variantPath = [directory stringByAppendingPathComponent:name];
+            if(stat([variantPath fileSystemRepresentation], &st) != 0) {
+                [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:nil];
+                if(!IQHTTPGzipFile(file->fd, variantPath) || stat([variantPath fileSystemRepresentation], &st) != 0) {
+                    return nil;
+                }
+            }
+        }
+        _IQHTTPStaticFile* variant = file->gzipVariant;
+        if(!variant || ![variant->path isEqualToString:variantPath] || variant->inode != st.st_ino || variant->size != st.st_size) {
+            variant = [[_IQHTTPStaticFile alloc] initWithPath:variantPath];
+            if(!variant) {
+                return nil;
+            }
+            // Apart from the encoding, this is the same representation as the original file
+            variant->etag = [NSString stringWithFormat:@"%@-gzip\"", [file->etag substringToIndex:file->etag.length-1]];
+            variant->mtime = file->mtime;
+            variant->lastModified = file->lastModified;
+            variant->contentType = file->contentType;
+            file->gzipVariant = variant;
+        }
+        file->gzipCheckedAt = now;
+        return variant;
+    }
 }
 
-
-- (void)stream:(NSStream *)aStream handleEvent:(NSStreamEvent)eventCode
+- (BOOL) _isCompressibleType:(NSString*)contentType
 {
-    if(aStream == input) {
-        switch(eventCode) {
-            case NSStreamEventHasBytesAvailable:
-                if(currentRequest == nil) {
-                    currentRequest = [[IQHTTPServerRequest alloc] initWithConnection:self];
-                }
-                [currentRequest _readRequest];
-                break;
-            case NSStreamEventEndEncountered:
-                break;
-            case NSStreamEventErrorOccurred:
-                NSLog(@"Read error");
-                break;
-            default:
-                break;
-        }
-    } else if(aStream == output) {
-        //NSLog(@"Output event, %d", (int)eventCode);
-        switch(eventCode) {
-            case NSStreamEventHasSpaceAvailable:
-                if(dispatchOnOpen) {
-                    [self->currentRequest _dispatchRequest:dispatchOnOpen];
-                    CFRelease(dispatchOnOpen);
-                    dispatchOnOpen = nil;
-                } else if(self->currentRequest) {
-                    [self->currentRequest _handleRequest];
-                }
-                break;
-            case NSStreamEventEndEncountered:
-                break;
-            case NSStreamEventErrorOccurred:
-                NSLog(@"Write error");
-                break;
-            default:
-                break;
+    if(!contentType) {
+        return NO;
+    }
+    NSRange parameters = [contentType rangeOfString:@";"];
+    NSString* essence = parameters.length > 0 ? [contentType substringToIndex:parameters.location] : contentType;
+    NSRange slash = [essence rangeOfString:@"/"];
+    if(slash.length == 0) {
+        return NO;
+    }
+    NSCharacterSet* whitespace = [NSCharacterSet whitespaceCharacterSet];
+    NSString* type = [[essence substringToIndex:slash.location] stringByTrimmingCharactersInSet:whitespace];
+    NSString* subtype = [[essence substringFromIndex:slash.location+1] stringByTrimmingCharactersInSet:whitespace];
+    for(IQMIMEType* candidate in compressibleTypes) {
+        if([candidate.type caseInsensitiveCompare:type] == NSOrderedSame &&
+           ([candidate.subtype isEqualToString:@"*"] || [candidate.subtype caseInsensitiveCompare:subtype] == NSOrderedSame)) {
+            return YES;
         }
     }
+    return NO;
 }
 
 @end
 
-@implementation IQHTTPServerRequest
-@synthesize statusCode, writeBufferLimit;
+@implementation _IQHTTPServerWorker
 
-- (id) initWithConnection:(_IQHTTPServerConnection*)conn
+- (id) initWithServer:(IQHTTPServer*)srv runLoop:(NSRunLoop*)rl
 {
     self = [super init];
     if(self) {
-        connection = conn;
-        writeBufferLimit = conn->server.writeBufferLimit;
-        encoding = NSUTF8StringEncoding; // Default to UTF-8 (We always write encoding type explicitly)
+        server = srv;
+        connections = [NSMutableSet setWithCapacity:120];
+        if(rl) {
+            runLoop = rl;
+        } else {
+            dispatch_semaphore_t started = dispatch_semaphore_create(0);
+            thread = [[NSThread alloc] initWithTarget:self selector:@selector(_run:) object:started];
+            thread.name = @"IQHTTPServer worker";
+            [thread start];
+            // Wait for the run loop of the worker thread to become available
+            dispatch_semaphore_wait(started, DISPATCH_TIME_FOREVER);
+        }
     }
     return self;
 }
 
-- (void) dealloc
+- (void) _run:(dispatch_semaphore_t)started
 {
-    if(requestHeaders) {
-        CFRelease(requestHeaders);
-        requestHeaders = nil;
+    @autoreleasepool {
+        runLoop = [NSRunLoop currentRunLoop];
+        // The port keeps the run loop from exiting while there are no connections
+        NSPort* port = [NSPort port];
+        [runLoop addPort:port forMode:NSDefaultRunLoopMode];
+        dispatch_semaphore_signal(started);
+        while(!stopping || connections.count > 0) {
+            @autoreleasepool {
+                [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+            }
+        }
+        [runLoop removePort:port forMode:NSDefaultRunLoopMode];
     }
-    if(responseHeaders) {
-        CFRelease(responseHeaders);
-        responseHeaders = nil;
+}
+
+- (void) acceptSocket:(CFSocketNativeHandle)sock client:(NSInteger)bucket
+{
+    if(thread && thread != [NSThread currentThread]) {
+        CFRunLoopRef rl = [runLoop getCFRunLoop];
+        CFRunLoopPerformBlock(rl, kCFRunLoopCommonModes, ^{
+            [self _acceptSocket:sock client:bucket];
+        });
+        CFRunLoopWakeUp(rl);
+    } else {
+        [self _acceptSocket:sock client:bucket];
     }
 }
 
-- (void) _dispatchRequest:(CFHTTPMessageRef)msg
+- (void) _acceptSocket:(CFSocketNativeHandle)sock client:(NSInteger)bucket
 {
-    if(!connection->output.hasSpaceAvailable) {
-        connection->dispatchOnOpen = (CFHTTPMessageRef)CFRetain(msg);
+    IQHTTPServer* s = server;
+    if(stopping || !s) {
+        close(sock);
+        [s _releaseConnectionFromClient:bucket];
         return;
     }
-    NSURL* url = CFBridgingRelease(CFHTTPMessageCopyRequestURL(msg));
-    NSString* resourceSpec = url.resourceSpecifier;
-    NSRange sr = NSMakeRange(0, resourceSpec.length);
-    
-    self->currentCallback = nil;
-    
-    BOOL hasMatch = NO;
-    if(!resourceSpec) {
-        NSLog(@"Bad request");
-        self.statusCode = 400;
-        [self done];
+    _IQHTTPServerConnection* connection = [[_IQHTTPServerConnection alloc] initWithSocket:sock worker:self];
+    if(!connection) {
+        [s _releaseConnectionFromClient:bucket];
         return;
     }
-    self->resourceSpecifier = resourceSpec;
-    for(_IQHTTPURLHandler* handler in self.server->urlPatterns) {
-        NSTextCheckingResult* result = [handler.regexp firstMatchInString:resourceSpec options:NSMatchingAnchored range:sr];
-        if(result && result.range.location == 0 && result.range.length == resourceSpec.length) {
-            hasMatch = YES;
-            self->currentCallback = handler.callback;
-            self->currentResult = result;
-            break;
-        }
+    connection->clientBucket = bucket;
+    [connections addObject:connection];
+    OSAtomicIncrement32(&connectionCount);
+    // Start the timeout for the first request head
+    [connection _updateTimeout];
+}
+
+- (void) _connectionClosed:(_IQHTTPServerConnection*)connection
+{
+    if([connections containsObject:connection]) {
+        [connections removeObject:connection];
+        OSAtomicDecrement32(&connectionCount);
+        [server _releaseConnectionFromClient:connection->clientBucket];
     }
-    if(!hasMatch) {
-        if(self.server.callback) {
-            self->currentCallback = self.server.callback;
-        } else {
-            self.writeBufferLimit = 1024;
-            self.statusCode = 404;
-            [self setValue:@"text/plain" forResponseHeaderField:@"Content-Type"];
-            [self writeString:@"The file was not found"];
-            [self done];
-            return;
-        }
+    if(stopping && thread && connections.count == 0) {
+        CFRunLoopStop([runLoop getCFRunLoop]);
     }
-    [self _handleRequest];
 }
 
-- (BOOL) _drainBuffers
+- (void) closeAllConnectionsForce:(BOOL)force
 {
-    if(writeBuffer.length > 0) {
-        NSInteger written = [connection->output write:writeBuffer.bytes maxLength:writeBuffer.length];
-        if(written < 0) {
-            [self cancel];
-            return NO;
-        } else if(written == writeBuffer.length) {
-            [writeBuffer setLength:0];
-            if(writeBufferLimit == 0) {
-                writeBuffer = nil; // No longer needed
-            }
-            return YES;
-        } else if(written > 0) {
-            NSInteger newLength = writeBuffer.length - written;
-            [writeBuffer replaceBytesInRange:NSMakeRange(0, newLength) withBytes:(char*)writeBuffer.bytes+written];
-            return NO;
-        }
+    if(thread && thread != [NSThread currentThread]) {
+        [self performSelector:@selector(_closeAllConnections:) onThread:thread withObject:@(force) waitUntilDone:NO];
+    } else {
+        [self _closeAllConnections:@(force)];
     }
-    return YES;
 }
 
-- (void) _handleRequest
+- (void) _closeAllConnections:(NSNumber*)force
 {
-    if(isDone) {
-        if(connection->currentRequest == self) {
-            [connection _requestDone];
-        }
-        return;
-    }
-    if(self.hasSpaceAvailable) {
-        if(writeStream != nil) {
-            [self writeStream:writeStream];
-        }
-        // Drain any buffer first
-        if(![self _drainBuffers]) {
-            // Buffer draining choked the output stream for now.
-            return;
-        }
-        if(seq == 0 || writeBufferLimit == 0) {
-            // Callback is called at least once, but may be called subsequently if buffering is turned off
-            // Disabling buffering introduces more complexity at the application level, but reduces the memory
-            // use and buffer copies so in some cases it may be useful (such as when serving static content from
-            // application memory or files).
-            self->currentCallback(self, seq++);
+    // Closing a connection removes it from the set, so iterate over a copy
+    for(_IQHTTPServerConnection* connection in [connections allObjects]) {
+        if([force boolValue] || connection.isIdle) {
+            [connection close];
         }
     }
 }
 
-- (void) _readChunk:(UInt8*)buf length:(CFIndex)len
+static uint64_t IQHTTPTimerWheelNow(void)
+{
+    return IQHTTPMicroseconds() / (uint64_t)(kIQHTTPTimerWheelTick * 1000000);
+}
+
+static void IQHTTPTimerWheelCallback(CFRunLoopTimerRef timer, void* info)
+{
+    [(__bridge _IQHTTPServerWorker*)info _advanceTimerWheel];
+}
+
+/**
+ Schedules the timeout of a connection, replacing the one it had. A timeout <= 0 only cancels it.
+ Scheduling and canceling are constant time, whatever the number of connections.
+ */
+- (void) _scheduleTimeout:(NSTimeInterval)timeout forConnection:(_IQHTTPServerConnection*)connection
 {
-    UInt8* sbuf = NULL;
-    sbuf = buf;
-    while(sbuf < buf+len) {
-        UInt8* nsbuf = NULL;
-        if(!headerWasComplete) {
-            // Read header line-by-line to allow pipelined requests
-            nsbuf = memchr(sbuf, '\n', len-(sbuf-buf));
-            if(nsbuf) nsbuf++;
+    if(connection->timeoutScheduled) {
+        _IQHTTPServerConnection* next = connection->timeoutNext;
+        _IQHTTPServerConnection* prev = connection->timeoutPrev;
+        if(prev) {
+            prev->timeoutNext = next;
+        } else {
+            timerWheel[connection->timeoutTick % kIQHTTPTimerWheelSlots] = next;
         }
-        if(!nsbuf) {
-            nsbuf = buf + len;
+        if(next) {
+            next->timeoutPrev = prev;
         }
-        if(!headerWasComplete) {
-            if(!CFHTTPMessageAppendBytes(requestHeaders, sbuf, nsbuf-sbuf)) {
-                NSLog(@"Unable to append bytes to message");
-                [self cancel];
-                return;
-            }
-            BOOL hc = CFHTTPMessageIsHeaderComplete(requestHeaders);
-            if(hc) {
-                headerWasComplete = YES;
-                CFStringRef str = CFHTTPMessageCopyHeaderFieldValue(requestHeaders, (__bridge CFStringRef)@"Content-Length");
-                if(str) {
-                    remainingBody = [(__bridge NSString*)str longLongValue];
-                    contentLength = remainingBody;
-                    CFRelease(str);
-                }
-                [self _dispatchRequest:requestHeaders];
-            }
-        } else {
-            if(remainingBody > 0) {
-                UInt8* endptr = nsbuf;
-                if(remainingBody < nsbuf-sbuf) {
-                    endptr = sbuf + remainingBody;
-                }
-                remainingBody -= endptr - sbuf;
-                if((readBodyAtomic && remainingBody > 0) || !bodyReader) {
-                    if(!requestBodyBuffer) {
-                        requestBodyBuffer = [NSMutableData dataWithCapacity:endptr-sbuf];
-                    }
-                    [requestBodyBuffer appendBytes:sbuf length:endptr-sbuf];
-                } else if(requestBodyBuffer.length > 0) {
-                    [requestBodyBuffer appendBytes:sbuf length:endptr-sbuf];
-                    bodyReader(self, requestBodyBuffer);
-                    requestBodyBuffer = nil;
-                } else {
-                    bodyReader(self, [NSData dataWithBytes:sbuf length:endptr-sbuf]);
-                }
-                if(remainingBody == 0) {
-                    if(endptr < buf + len) {
-                        if(!connection->backBuffer) {
-                            connection->backBuffer = [NSMutableData dataWithCapacity:buf+len-endptr];
-                        }
-                        [connection->backBuffer appendBytes:endptr length:buf+len-endptr];
-                        break;
-                    }
-                    if(connection->currentRequest == self) {
-                        [connection _requestRead];
-                    }
-                }
-            }
+        connection->timeoutNext = nil;
+        connection->timeoutPrev = nil;
+        connection->timeoutScheduled = NO;
+        scheduledTimeouts--;
+    }
+    if(timeout > 0) {
+        if(!timerWheelTimer) {
+            timerWheelTick = IQHTTPTimerWheelNow();
+            CFRunLoopTimerContext ctx = {0, (__bridge void *)(self), 0, 0, 0};
+            timerWheelTimer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + kIQHTTPTimerWheelTick, kIQHTTPTimerWheelTick, 0, 0, IQHTTPTimerWheelCallback, &ctx);
+            CFRunLoopAddTimer([runLoop getCFRunLoop], timerWheelTimer, kCFRunLoopCommonModes);
         }
-        sbuf = nsbuf;
+        // Round up, a timeout never expires early
+        uint64_t tick = IQHTTPTimerWheelNow() + (uint64_t)ceil(timeout / kIQHTTPTimerWheelTick);
+        connection->timeoutTick = MAX(tick, timerWheelTick + 1);
+        NSUInteger slot = connection->timeoutTick % kIQHTTPTimerWheelSlots;
+        connection->timeoutNext = timerWheel[slot];
+        if(connection->timeoutNext) {
+            connection->timeoutNext->timeoutPrev = connection;
+        }
+        timerWheel[slot] = connection;
+        connection->timeoutScheduled = YES;
+        scheduledTimeouts++;
+    } else if(scheduledTimeouts == 0 && timerWheelTimer) {
+        [self _stopTimerWheel];
     }
-    
 }
-- (NSString*) valueForRequestHeaderField:(NSString*)field
+
+- (void) _stopTimerWheel
 {
-    return objc_retainedObject(CFHTTPMessageCopyHeaderFieldValue(requestHeaders, (__bridge CFStringRef)field));
+    CFRunLoopTimerInvalidate(timerWheelTimer);
+    CFRelease(timerWheelTimer);
+    timerWheelTimer = nil;
 }
-- (NSString*) valueForResponseHeaderField:(NSString*)field
+
+/**
+ Expires the timeouts of the ticks that have passed since the wheel was last advanced.
+ */
+- (void) _advanceTimerWheel
 {
-    return objc_retainedObject(CFHTTPMessageCopyHeaderFieldValue(responseHeaders, (__bridge CFStringRef)field));
+    uint64_t now = IQHTTPTimerWheelNow();
+    if(now - timerWheelTick > kIQHTTPTimerWheelSlots) {
+        // Late by more than a revolution; visiting every slot once is enough
+        timerWheelTick = now - kIQHTTPTimerWheelSlots;
+    }
+    while(timerWheelTick < now && scheduledTimeouts > 0) {
+        timerWheelTick++;
+        _IQHTTPServerConnection* connection = timerWheel[timerWheelTick % kIQHTTPTimerWheelSlots];
+        while(connection) {
+            _IQHTTPServerConnection* next = connection->timeoutNext;
+            if(connection->timeoutTick <= timerWheelTick) {
+                [self _scheduleTimeout:0 forConnection:connection];
+                OSAtomicIncrement64(&timeouts);
+                [connection _timedOut];
+            }
+            connection = next;
+        }
+    }
+    timerWheelTick = now;
+    if(scheduledTimeouts == 0 && timerWheelTimer) {
+        [self _stopTimerWheel];
+    }
 }
 
-- (NSString*) valueForUrlPatternGroup:(NSInteger)patternGroupIndex
+- (void) stop
 {
-    NSRange range = [currentResult rangeAtIndex:patternGroupIndex];
-    if(range.length == 0) {
-        return nil;
+    if(thread && thread != [NSThread currentThread]) {
+        [self performSelector:@selector(_stop) onThread:thread withObject:nil waitUntilDone:NO];
+    } else {
+        [self _stop];
     }
-    return [self->resourceSpecifier substringWithRange:range];
 }
 
-- (NSString*) resource
+- (void) _stop
 {
-    return resourceSpecifier;
+    stopping = YES;
+    [self _closeAllConnections:@NO];
+    if(thread && connections.count == 0) {
+        CFRunLoopStop([runLoop getCFRunLoop]);
+    }
 }
 
-- (void) _readRequest
+@end
+
+@implementation _IQHTTPServerConnection
+
+static void ConnectionSocketCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
 {
-    IQHTTPServerRequest* current = self; // Hold a reference for ARC
-    if(!requestHeaders) {
-        requestHeaders = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, YES);
-        remainingBody = 0LL;
-    }
-    if(connection->backBuffer) {
-        [self _readChunk:(UInt8*)connection->backBuffer.bytes length:connection->backBuffer.length];
+    // Hold a reference for ARC, the connection may be closed from within the callback
+    _IQHTTPServerConnection* connection = (__bridge _IQHTTPServerConnection*)info;
+    switch(type) {
+        case kCFSocketReadCallBack:
+            [connection _canRead];
+            break;
+        case kCFSocketWriteCallBack:
+            [connection _canWrite];
+            break;
+        default:
+            break;
     }
-    while(connection->input.hasBytesAvailable) {
-        UInt8 buf[512];
-        CFIndex len = [connection->input read:buf maxLength:sizeof(buf)];
-        if(len < 0) {
-            [self cancel];
-            return;
-        }
-        if(len > 0) {
-            [self _readChunk:buf length:len];
+}
+
+- (id) initWithSocket:(CFSocketNativeHandle)sock worker:(_IQHTTPServerWorker*)w
+{
+    self = [super init];
+    if(self) {
+        socket = sock;
+        worker = w;
+        server = w->server;
+        keepAlive = YES;
+        clientBucket = -1;
+        requests = [NSMutableArray arrayWithCapacity:4];
+        
+        readBufferSize = MAX(server.readBufferSize, 1024);
+        readBuffer = malloc(readBufferSize);
+        NSUInteger maxHeaderCount = MAX(server.maxRequestHeaderCount, 1);
+        parserFields = malloc(maxHeaderCount * sizeof(IQHTTPHeaderField));
+        // The entire request head must fit in the read buffer
+        IQHTTPParserInit(&parser, parserFields, maxHeaderCount, MIN(server.maxRequestHeaderSize, readBufferSize));
+        
+        // The socket is used directly (rather than through a stream pair) to allow writev/sendfile
+        int value = 1;
+        setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (void *)&value, sizeof(int));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+        
+        CFSocketContext ctx = {0, (__bridge void *)(self), 0, 0, 0};
+        socketRef = CFSocketCreateWithNative(kCFAllocatorDefault, sock, kCFSocketReadCallBack | kCFSocketWriteCallBack, ConnectionSocketCallback, &ctx);
+        if(!socketRef) {
+            close(sock);
+            socket = 0;
+            return nil;
         }
+        CFRunLoopSourceRef runLoopSource = CFSocketCreateRunLoopSource(kCFAllocatorDefault, socketRef, 0);
+        CFRunLoopAddSource([w->runLoop getCFRunLoop], runLoopSource, kCFRunLoopCommonModes);
+        CFRelease(runLoopSource);
     }
-    current = nil;
+    return self;
 }
 
-- (IQHTTPServer*) server
+- (void) dealloc
 {
-    return connection->server;
+    if(socketRef) {
+        // Invalidating the CFSocket also closes the native socket
+        CFSocketInvalidate(socketRef);
+        CFRelease(socketRef);
+        socketRef = nil;
+        socket = 0;
+    }
+    free(readBuffer);
+    free(parserFields);
 }
 
-- (void) readRequestBody:(IQHTTPRequestReader)reader atomic:(BOOL)atomic
+- (void) close
 {
-    if(bodyReader) {
-        [NSException raise:@"MultipleReadsOnBody" format:@"Only one readRequestBody:atomic: call per requst is allowed"];
-        return;
+    for(IQHTTPServerRequest* request in requests) {
+        // Requests cut short still count, with the time until they were given up
+        [request _recordMetrics];
     }
-    bodyReader = reader;
-    readBodyAtomic = atomic;
-    if(bodyReader && (remainingBody == 0 || !readBodyAtomic) && requestBodyBuffer.length > 0) {
-        bodyReader(self, requestBodyBuffer);
-        requestBodyBuffer = nil;
+    [requests removeAllObjects];
+    inputRequest = nil;
+    timeoutKind = _IQHTTPTimeoutNone;
+    [worker _scheduleTimeout:0 forConnection:self];
+    if(socketRef) {
+        CFSocketInvalidate(socketRef);
+        CFRelease(socketRef);
+        socketRef = nil;
+        socket = 0;
     }
+    [self _updateBusy];
+    [worker _connectionClosed:self];
 }
 
-- (long long) requestBodyLength
+- (IQHTTPServerRequest*) activeRequest
 {
-    return contentLength;
+    return requests.count > 0 ? [requests objectAtIndex:0] : nil;
 }
 
-#pragma mark - Response
+- (BOOL) isIdle
+{
+    return requests.count == 0 && inputRequest == nil;
+}
 
-- (void) cancel
+/**
+ Keeps the count of busy connections of the worker up to date, for the connection gauges.
+ */
+- (void) _updateBusy
 {
-    isDone = YES;
-    if(connection->currentRequest == self) {
-        [connection _requestDone];
+    BOOL busy = socket && !self.isIdle;
+    if(busy != countedBusy) {
+        countedBusy = busy;
+        if(busy) {
+            OSAtomicIncrement32(&worker->busyConnectionCount);
+        } else {
+            OSAtomicDecrement32(&worker->busyConnectionCount);
+        }
     }
 }
 
-- (void) done
+/**
+ Schedules the timeout for what the connection is waiting for. The head timeout runs from the
+ first byte of a request head (or from accepting the connection) and the keep-alive timeout from
+ the end of the last response, so they are only scheduled when the connection enters that state.
+ The body timeout starts over whenever the connection makes progress.
+ */
+- (void) _updateTimeout
 {
-    isDone = YES;
-    [self _sendHeaders];
-    if(self.hasSpaceAvailable && [self _drainBuffers]) {
-        if(connection->currentRequest == self) {
-            [connection _requestDone];
+    _IQHTTPTimeoutKind kind = _IQHTTPTimeoutNone;
+    NSTimeInterval timeout = 0;
+    if(!socket) {
+        // Closed
+    } else if(inputRequest && inputRequest->headerWasComplete) {
+        if(!readPaused) {
+            // Not while the server holds back reading
+            kind = _IQHTTPTimeoutBody;
+            timeout = server.requestBodyTimeout;
         }
+    } else if(inputRequest || !receivedRequest) {
+        kind = _IQHTTPTimeoutHeader;
+        timeout = server.requestHeaderTimeout;
+    } else if(self.isIdle && readLength == 0) {
+        kind = _IQHTTPTimeoutKeepAlive;
+        timeout = server.keepAliveTimeout;
+    }
+    if(kind != timeoutKind || kind == _IQHTTPTimeoutBody) {
+        timeoutKind = kind;
+        [worker _scheduleTimeout:kind == _IQHTTPTimeoutNone ? 0 : timeout forConnection:self];
     }
 }
 
-- (void) setStatusCode:(NSInteger)sc
+- (void) _timedOut
 {
-    if(headersSent || responseHeaders) {
-        [NSException raise:@"ReadOnlyAtThisTime" format:@"Cannot set statusCode at this stage"];
-        return;
-    }
-    if(sc < 0 || sc >= 600) statusCode = 500;
-    self->statusCode = sc;
+    timeoutKind = _IQHTTPTimeoutNone;
+    [self close];
 }
 
-- (NSInteger) statusCode
+- (BOOL) hasSpaceAvailable
 {
-    if(statusCode == 0) return 200;
-    return statusCode;
+    return canWrite && socket;
 }
 
-- (void) _initHeaders
+- (void) _waitForSpace
 {
-    if(!responseHeaders) {
-        responseHeaders = CFHTTPMessageCreateResponse(kCFAllocatorDefault, self.statusCode, NULL, kCFHTTPVersion1_1);
+    if(canWrite) {
+        OSAtomicIncrement64(&worker->writeStalls);
+    }
+    canWrite = NO;
+    if(socketRef) {
+        CFSocketEnableCallBacks(socketRef, kCFSocketWriteCallBack);
     }
 }
 
-- (void) setValue:(NSString*)value forResponseHeaderField:(NSString *)field
+- (void) _stopReading
 {
-    if(headersSent || isDone) {
-        [NSException raise:@"HeadersAlreadySent" format:@"Headers are already sent. Cannot modify headers at this time."];
-        return;
-    }
-    [self _initHeaders];
-    if([value isEqualToString:@"Content-Type"]) {
-        IQMutableMIMEType* mime = [IQMutableMIMEType MIMETypeWithRFCString:value];
-        NSStringEncoding enc = mime.encoding;
-        if(enc == 0) {
-            if([mime.type isEqualToString:@"text"]) {
-                mime.encoding = self->encoding;
-                value = [mime RFCString];
-            }
-        } else {
-            self->encoding = enc;
-        }
-        didSetContentType = YES;
+    if(socketRef) {
+        CFSocketDisableCallBacks(socketRef, kCFSocketReadCallBack);
     }
-    CFHTTPMessageSetHeaderFieldValue(responseHeaders, (__bridge CFStringRef)field, (__bridge CFStringRef)value);
 }
 
-- (void) _sendHeaders
+- (void) _resumeReading
 {
-    if(!headersSent) {
-        [self _initHeaders];
-        // Check encoding
-        if(!didSetContentType) {
-            IQMutableMIMEType* mime = [IQMutableMIMEType MIMETextTypeWithSubtype:@"plain" encoding:encoding];
-            CFHTTPMessageSetHeaderFieldValue(responseHeaders, (__bridge CFStringRef)@"Content-Type", (__bridge CFStringRef)[mime RFCString]);
-        }
-        NSData* headerBuffer = CFBridgingRelease(CFHTTPMessageCopySerializedMessage(responseHeaders));
-        if(writeBuffer.length > 0) [NSException raise:@"InvalidHeaderState" format:@"Header buffer not empty"];
-        writeBuffer = [NSMutableData dataWithData:headerBuffer];
-        headersSent = YES;
-        CFRelease(responseHeaders);
-        responseHeaders = nil;
+    if(socketRef && !readClosed) {
+        CFSocketEnableCallBacks(socketRef, kCFSocketReadCallBack);
     }
 }
 
-- (void)writeString:(NSString*)string
+- (NSInteger) read:(uint8_t*)buffer maxLength:(NSUInteger)len
 {
-    [self writeData:[string dataUsingEncoding:encoding allowLossyConversion:YES]];
+    if(!socket || readClosed) return -1;
+    ssize_t r = recv(socket, buffer, len, 0);
+    if(r > 0) return r;
+    if(r == 0) {
+        // Orderly shutdown by the client. Finish the responses to the requests already received, then close.
+        readClosed = YES;
+        [self _stopReading];
+        return -1;
+    }
+    if(errno == EAGAIN || errno == EINTR) return 0;
+    return -1;
 }
 
-- (void)writeStream:(NSInputStream *)stream
+- (NSInteger) write:(const uint8_t *)buffer maxLength:(NSUInteger)len
 {
-    BOOL shouldDrainBuffers = NO;
-    if(writeStream != stream) {
-        writeStream = stream;
-        if(writeBufferLimit <= 0) {
-            writeBufferLimit = 4096;
-        } else if(writeBufferLimit > 102400) {
-            writeBufferLimit = 102400;
-        }
-        shouldDrainBuffers = YES;
+    if(!socket) return -1;
+    ssize_t written = send(socket, buffer, len, 0);
+    if(written < 0) {
+        if(errno != EAGAIN && errno != EINTR) return -1;
+        written = 0;
     }
-    if(!writeBuffer) writeBuffer = [NSMutableData dataWithCapacity:writeBufferLimit];
-    NSInteger currentLength = writeBuffer.length;
-    NSInteger remainingCapacity = writeBufferLimit-currentLength;
-    if(writeBuffer.length < writeBufferLimit) {
-        [writeBuffer setLength:writeBufferLimit];
+    if(written < len) {
+        [self _waitForSpace];
     }
-    NSInteger read = [writeStream read:((unsigned char*)writeBuffer.mutableBytes)+currentLength maxLength:remainingCapacity];
-    if(read < remainingCapacity) {
-        if(read <= 0) {
-            writeStream = nil;
-        }
-        [writeBuffer setLength:currentLength+read];
+    return written;
+}
+
+- (NSInteger) writeVectors:(const struct iovec*)iov count:(int)count
+{
+    if(!socket) return -1;
+    size_t total = 0;
+    for(int i = 0; i < count; i++) {
+        total += iov[i].iov_len;
     }
-    if(shouldDrainBuffers && self.hasSpaceAvailable) {
-        [self _drainBuffers];
+    ssize_t written = writev(socket, iov, count);
+    if(written < 0) {
+        if(errno != EAGAIN && errno != EINTR) return -1;
+        written = 0;
+    }
+    if(written < total) {
+        [self _waitForSpace];
     }
+    return written;
 }
 
-- (NSInteger)writeData:(NSData*)data
+- (off_t) sendFile:(int)fd offset:(off_t)offset length:(off_t)length
 {
-    return [self write:data.bytes maxLength:data.length];
+    if(!socket) return -1;
+    off_t sent = length;
+    if(sendfile(fd, socket, offset, &sent, NULL, 0) < 0) {
+        if(errno == ENOTSUP || errno == EOPNOTSUPP || errno == ENOTSOCK) {
+            // No sendfile support for this file; map the region and send it from the page cache
+            off_t pageOffset = offset & ~((off_t)getpagesize()-1);
+            size_t mapLength = (size_t)MIN(length, (off_t)1024*1024) + (size_t)(offset-pageOffset);
+            void* map = mmap(NULL, mapLength, PROT_READ, MAP_SHARED, fd, pageOffset);
+            if(map == MAP_FAILED) return -1;
+            NSInteger written = [self write:(const uint8_t*)map+(offset-pageOffset) maxLength:mapLength-(size_t)(offset-pageOffset)];
+            munmap(map, mapLength);
+            return written;
+        }
+        if(errno != EAGAIN && errno != EINTR) return -1;
+    }
+    if(sent < length) {
+        [self _waitForSpace];
+    }
+    return sent;
 }
 
-- (NSInteger)write:(const uint8_t *)buffer maxLength:(NSUInteger)len
+- (void) _requestDone:(IQHTTPServerRequest*)request
 {
-    NSInteger written = 0;
-    [self _sendHeaders];
-    
-    if(writeBuffer && writeBufferLimit == 0) {
-        if(!self.hasSpaceAvailable) return written;
-        if(![self _drainBuffers]) return written;
+    if(self.activeRequest != request) {
+        return;
     }
-    if(self.hasSpaceAvailable && writeBuffer.length == 0) {
-        written = [connection->output write:buffer maxLength:len];
-        if(written < 0) {
-            [self cancel];
-            return 0;
-        }
+    [request _recordMetrics];
+    [requests removeObjectAtIndex:0];
+    if(request->closeConnection || (worker->stopping && self.isIdle)) {
+        [self close];
+        return;
     }
-    if(written == len || writeBufferLimit == 0) return written;
-    
-    // Did not fit in socket buffer. Try to buffer in the request object instead.
-    NSInteger remainingCapacity = writeBufferLimit-writeBuffer.length;
-    if(remainingCapacity < len-written) {
-        [NSException raise:@"BufferOverrun" format:@"The application has overrun the write buffer limit for the connection. Limit throughput on the application side."];
-    } else {
-        if(!writeBuffer) writeBuffer = [NSMutableData dataWithCapacity:len-written];
-        [writeBuffer appendBytes:buffer+written length:len-written];
-        if(self.hasSpaceAvailable) {
-            [self _drainBuffers];
+    if(!processingInput) {
+        // Start on any requests that were held back by the pipeline depth limit
+        [self _processInput];
+        if(readPaused && readLength < readBufferSize) {
+            readPaused = NO;
+            [self _resumeReading];
         }
     }
-    return len;
+    IQHTTPServerRequest* next = self.activeRequest;
+    if(next) {
+        // Let the next response in line write its buffered output
+        [next _handleRequest];
+    } else if(readClosed && !processingInput) {
+        [self close];
+        return;
+    }
+    [self _updateBusy];
+    [self _updateTimeout];
 }
 
-- (BOOL) hasSpaceAvailable
+- (void) _requestRead
 {
-    if(connection->currentRequest != self) return NO;
-    return connection->output.hasSpaceAvailable;
+    inputRequest = nil;
+    if(!keepAlive) [self _stopReading];
 }
 
-@end
+- (void) _canRead
+{
+    while(socket && !readClosed && !readPaused) {
+        NSInteger len = [self read:readBuffer+readLength maxLength:readBufferSize-readLength];
+        if(len < 0) {
+            if(!readClosed || requests.count == 0) {
+                // Read error, or the client went away without waiting for a response
+                [self close];
+            }
+            return;
+        }
+        if(len == 0) {
+            return;
+        }
+        readLength += len;
+        BOOL drained = readLength < readBufferSize;
+        [self _processInput];
+        if(readLength == readBufferSize) {
+            // Nothing could be consumed from a full buffer. Stop reading until a request is done.
+            readPaused = YES;
+            [self _stopReading];
+            [self _updateTimeout];
+            return;
+        }
+        if(drained) {
+            // A short read means that the socket has no more data for now
+            return;
+        }
+    }
+}
 
-@implementation _IQHTTPURLHandler
-@synthesize regexp, callback;
-@end
\ No newline at end of file
+/**
+ Parses request heads and feeds request bodies from the read buffer. Every complete request head
+ is dispatched right away, so pipelined requests are handled concurrently while their responses
+ are written in order.
+ */
+- (void) _processInput
+{
+    processingInput = YES;
+    while(readOffset < readLength && socket) {
+        if(!inputRequest) {
+            if(!keepAlive || requests.count >= MAX(server.maxPipelineDepth, 1)) {
+                // Leave the remaining input in the buffer for now
+                break;
+            }
+            inputRequest = [[IQHTTPServerRequest alloc] initWithConnection:self];
+            IQHTTPParserReset(&parser);
+        }
+        IQHTTPServerRequest* request = inputRequest;
+        if(!request->headerWasComplete) {
+            IQHTTPParserStatus status = IQHTTPParserExecute(&parser, readBuffer+readOffset, readLength-readOffset);
+            if(status == IQHTTPParserNeedMoreData) {
+                break;
+            }
+            if(status != IQHTTPParserHeadComplete) {
+                // Malformed or oversized request. Respond (in turn) and close the connection.
+                keepAlive = NO;
+                receivedRequest = YES;
+                readOffset = readLength;
+                inputRequest = nil;
+                [self _stopReading];
+                request->closeConnection = YES;
+                [requests addObject:request];
+                if(status == IQHTTPParserBadRequest) {
+                    [request _respondWithStatus:400 message:@"Bad request"];
+                } else {
+                    [request _respondWithStatus:431 message:@"Request header fields too large"];
+                }
+                break;
+            }
+            [request _setHead:readBuffer+readOffset parser:&parser];
+            readOffset += parser.position;
+            receivedRequest = YES;
+            if(!parser.keepAlive || server.keepAliveTimeout <= 0) {
+                // This is the last request on this connection
+                request->closeConnection = YES;
+                keepAlive = NO;
+            }
+            [requests addObject:request];
+            if([request _bodyComplete]) {
+                [self _requestRead];
+            }
+            [request _dispatchRequest];
+        } else {
+            NSUInteger used = [request _readBody:readBuffer+readOffset length:readLength-readOffset];
+            if(used == NSNotFound) {
+                // Malformed chunked body, the connection cannot be used any more
+                [self close];
+                break;
+            }
+            request->bytesIn += used;
+            readOffset += used;
+            if([request _bodyComplete]) {
+                [self _requestRead];
+            } else if(used == 0) {
+                break;
+            }
+        }
+    }
+    if(readOffset > 0) {
+        memmove(readBuffer, readBuffer+readOffset, readLength-readOffset);
+        readLength -= readOffset;
+        readOffset = 0;
+    }
+    processingInput = NO;
+    [self _updateBusy];
+    [self _updateTimeout];
+}
+
+- (void) _canWrite
+{
+    canWrite = YES;
+    [self.activeRequest _handleRequest];
+}
+
+@end
+
+@implementation IQHTTPServerRequest
+@synthesize statusCode, writeBufferLimit, writableHandler;
+
+- (id) initWithConnection:(_IQHTTPServerConnection*)conn
+{
+    self = [super init];
+    if(self) {
+        connection = conn;
+        writeBufferLimit = conn->server.writeBufferLimit;
+        routeStats = &conn->server->unroutedStats;
+        startTime = IQHTTPMicroseconds();
+        encoding = NSUTF8StringEncoding; // Default to UTF-8 (We always write encoding type explicitly)
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    if(reportedLength > 0) {
+        OSAtomicAdd64(-(int64_t)reportedLength, &connection->worker->bufferedBytes);
+    }
+    if(cacheEntry) {
+        // The response was never produced, let the waiting requests call the callback themselves
+        [self _finishCacheFillWithHead:nil body:nil];
+    }
+    free(head);
+    if(compressor) {
+        deflateEnd(compressor);
+        free(compressor);
+    }
+    if(responseHeaders) {
+        CFRelease(responseHeaders);
+        responseHeaders = nil;
+    }
+}
+
+- (void) _setHead:(const uint8_t*)bytes parser:(IQHTTPParser*)p
+{
+    // One allocation holds everything needed to answer header queries for the lifetime of the request
+    size_t fieldsSize = p->fieldCount * sizeof(IQHTTPHeaderField);
+    head = malloc(fieldsSize + p->position);
+    headFields = (IQHTTPHeaderField*)head;
+    headFieldCount = p->fieldCount;
+    memcpy(headFields, p->fields, fieldsSize);
+    headBytes = (const uint8_t*)head + fieldsSize;
+    memcpy((uint8_t*)headBytes, bytes, p->position);
+    bytesIn = p->position;
+    methodSpan = p->method;
+    targetSpan = p->target;
+    http10 = p->versionMajor == 1 && p->versionMinor == 0;
+    contentLength = p->contentLength > 0 ? p->contentLength : 0;
+    remainingBody = contentLength;
+    if(p->chunked) {
+        // The length is not known until the last chunk has been read
+        chunkedBody = YES;
+        remainingBody = -1;
+        IQHTTPChunkDecoderInit(&chunkDecoder);
+    }
+    headerWasComplete = YES;
+}
+
+- (void) _dispatchRequest
+{
+    NSString* resourceSpec = self.resource;
+    
+    self->currentCallback = nil;
+    
+    if(!resourceSpec) {
+        NSLog(@"Bad request");
+        self.statusCode = 400;
+        [self done];
+        return;
+    }
+    NSMutableSet* allowedMethods = [NSMutableSet set];
+    NSTextCheckingResult* result = nil;
+    _IQHTTPURLHandler* handler = [self.server _handlerForResource:resourceSpec method:self.method result:&result allowedMethods:allowedMethods];
+    if(handler) {
+        self->routeStats = &handler->stats;
+        self->currentCallback = handler.callback;
+        self->currentResult = result;
+        if(handler.cache && [self _serveFromCache:handler.cache]) {
+            return;
+        }
+    } else {
+        if(allowedMethods.count > 0) {
+            // The resource exists, but not for this method
+            [self setValue:[[allowedMethods allObjects] componentsJoinedByString:@", "] forResponseHeaderField:@"Allow"];
+            [self _respondWithStatus:405 message:@"Method not allowed"];
+            return;
+        } else if(self.server.callback) {
+            self->currentCallback = self.server.callback;
+        } else {
+            [self _respondWithStatus:404 message:@"The file was not found"];
+            return;
+        }
+    }
+    [self _handleRequest];
+}
+
+#pragma mark - Response cache
+
+/**
+ Looks the request up in the response cache of its route. Returns YES if the request has been
+ answered from the cache or waits for another request to produce the response, NO if the callback
+ is to be called, in which case the response is stored in the cache.
+ */
+- (BOOL) _serveFromCache:(IQHTTPResponseCache*)cache
+{
+    if(http10 || contentLength > 0 || chunkedBody) {
+        return NO;
+    }
+    NSString* m = self.method;
+    if(![m isEqualToString:@"GET"] && ![m isEqualToString:@"HEAD"]) {
+        return NO;
+    }
+    NSString* key = [cache _keyForRequest:self];
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    NSData* cachedHead = nil;
+    NSData* cachedBody = nil;
+    _IQHTTPCacheEntry* entry = nil;
+    @synchronized(cache) {
+        entry = [cache _entryForKey:key];
+        if(entry->head && (now < entry->expires || (entry->filling && now < entry->staleUntil))) {
+            // Fresh, or stale while another request is producing a new response
+            cachedHead = entry->head;
+            cachedBody = entry->body;
+            cache->hitCount++;
+        } else if(entry->filling) {
+            if(!entry->waiters) entry->waiters = [NSMutableArray arrayWithCapacity:4];
+            [entry->waiters addObject:self];
+            waitingForCache = YES;
+            cache->hitCount++;
+            return YES;
+        } else {
+            entry->filling = YES;
+            cache->missCount++;
+        }
+    }
+    if(cachedHead) {
+        [self _sendCachedHead:cachedHead body:cachedBody];
+        return YES;
+    }
+    responseCache = cache;
+    cacheEntry = entry;
+    return NO;
+}
+
+static NSData* IQHTTPHeadTerminator(BOOL closeConnection)
+{
+    static NSData* terminator;
+    static NSData* closeTerminator;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        terminator = [NSData dataWithBytes:"\r\n" length:2];
+        closeTerminator = [NSData dataWithBytes:"Connection: close\r\n\r\n" length:21];
+    });
+    return closeConnection ? closeTerminator : terminator;
+}
+
+/**
+ Sends a cached response. The cached data is queued as it is, without copying.
+ */
+- (void) _sendCachedHead:(NSData*)cachedHead body:(NSData*)body
+{
+    headersSent = YES;
+    isDone = YES;
+    writableHandler = nil;
+    [self _enqueueData:cachedHead offset:0];
+    [self _enqueueData:IQHTTPHeadTerminator(closeConnection) offset:0];
+    if(body.length > 0) {
+        [self _enqueueData:body offset:0];
+    }
+    if(self.hasSpaceAvailable && [self _drainBuffers]) {
+        [connection _requestDone:self];
+    }
+}
+
+/**
+ Called when the request this one waited for has produced its response, with nil if that response
+ could not be cached.
+ */
+- (void) _cachedResponseReady:(NSData*)cachedHead body:(NSData*)body
+{
+    // Continue on the thread of the connection
+    CFRunLoopRef rl = [connection->worker->runLoop getCFRunLoop];
+    CFRunLoopPerformBlock(rl, kCFRunLoopCommonModes, ^{
+        if(![connection->requests containsObject:self]) {
+            // The connection has been closed
+            return;
+        }
+        waitingForCache = NO;
+        if(headersSent || isDone) {
+            return;
+        }
+        if(cachedHead) {
+            [self _sendCachedHead:cachedHead body:body];
+        } else {
+            [self _handleRequest];
+        }
+    });
+    CFRunLoopWakeUp(rl);
+}
+
+static BOOL IQHTTPIsCacheableResponse(CFHTTPMessageRef headers, NSInteger status)
+{
+    if(status != 200 && status != 203 && status != 204 && status != 301 && status != 404 && status != 410) {
+        return NO;
+    }
+    NSString* cookie = objc_retainedObject(CFHTTPMessageCopyHeaderFieldValue(headers, CFSTR("Set-Cookie")));
+    if(cookie) {
+        return NO;
+    }
+    NSString* cacheControl = objc_retainedObject(CFHTTPMessageCopyHeaderFieldValue(headers, CFSTR("Cache-Control")));
+    if(cacheControl) {
+        cacheControl = [cacheControl lowercaseString];
+        if([cacheControl rangeOfString:@"no-store"].length > 0 || [cacheControl rangeOfString:@"no-cache"].length > 0
+           || [cacheControl rangeOfString:@"private"].length > 0) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+- (void) _finishCacheFillWithHead:(NSData*)cachedHead body:(NSData*)body
+{
+    IQHTTPResponseCache* cache = responseCache;
+    _IQHTTPCacheEntry* entry = cacheEntry;
+    responseCache = nil;
+    cacheEntry = nil;
+    [cache _finishFill:entry head:cachedHead body:body];
+}
+
+/**
+ Stores the response in the cache, if it is complete and cacheable. Called when the headers are
+ about to be sent, with the entire body in the output queue.
+ */
+- (void) _storeCachedResponse
+{
+    NSData* cachedHead = nil;
+    NSMutableData* body = nil;
+    if(isDone && !writeStream && !chunkedResponse && IQHTTPIsCacheableResponse(responseHeaders, self.statusCode)) {
+        body = [NSMutableData dataWithCapacity:queuedLength];
+        for(_IQHTTPOutputSegment* segment in outputQueue) {
+            if(segment->file) {
+                body = nil;
+                break;
+            }
+            [body appendBytes:(const uint8_t*)segment->data.bytes + segment->offset length:(NSUInteger)segment->length];
+        }
+        if(body && body.length <= responseCache.maxResponseSize) {
+            NSData* message = objc_retainedObject(CFHTTPMessageCopySerializedMessage(responseHeaders));
+            // Without the blank line, so that a Connection header can be added to every response
+            if(message.length >= 2 && message.length - 2 + body.length <= responseCache.maxResponseSize) {
+                cachedHead = [message subdataWithRange:NSMakeRange(0, message.length - 2)];
+            }
+        }
+    }
+    [self _finishCacheFillWithHead:cachedHead body:cachedHead ? body : nil];
+}
+
+- (void) _respondWithStatus:(NSInteger)status message:(NSString*)message
+{
+    self.writeBufferLimit = 1024;
+    self.statusCode = status;
+    [self setValue:@"text/plain" forResponseHeaderField:@"Content-Type"];
+    [self setValue:[NSString stringWithFormat:@"%lu", (unsigned long)[message lengthOfBytesUsingEncoding:encoding]] forResponseHeaderField:@"Content-Length"];
+    [self writeString:message];
+    [self done];
+}
+
+- (void) _enqueueSegment:(_IQHTTPOutputSegment*)segment atFront:(BOOL)front
+{
+    if(!outputQueue) outputQueue = [NSMutableArray arrayWithCapacity:4];
+    if(front) {
+        [outputQueue insertObject:segment atIndex:0];
+    } else {
+        [outputQueue addObject:segment];
+    }
+    queuedLength += (NSUInteger)segment->length;
+    if(writeBufferLimit > 0 && queuedLength >= writeBufferLimit) {
+        writeBufferWasFull = YES;
+    }
+    [self _reportBufferedLength];
+}
+
+- (void) _enqueueData:(NSData*)data offset:(NSUInteger)offset
+{
+    _IQHTTPOutputSegment* segment = [_IQHTTPOutputSegment new];
+    segment->data = data;
+    segment->offset = offset;
+    segment->length = data.length - offset;
+    [self _enqueueSegment:segment atFront:NO];
+}
+
+- (void) _enqueueBytes:(const uint8_t*)bytes length:(NSUInteger)len
+{
+    _IQHTTPOutputSegment* last = outputQueue.lastObject;
+    if(last && last->appendable && last->length + len <= kIQHTTPCoalesceSegmentSize) {
+        [(NSMutableData*)last->data appendBytes:bytes length:len];
+        last->length += len;
+        queuedLength += len;
+        if(writeBufferLimit > 0 && queuedLength >= writeBufferLimit) {
+            writeBufferWasFull = YES;
+        }
+        [self _reportBufferedLength];
+        return;
+    }
+    _IQHTTPOutputSegment* segment = [_IQHTTPOutputSegment new];
+    segment->data = [NSMutableData dataWithCapacity:MAX(len, 1024)];
+    [(NSMutableData*)segment->data appendBytes:bytes length:len];
+    segment->length = len;
+    segment->appendable = YES;
+    [self _enqueueSegment:segment atFront:NO];
+}
+
+- (void) _enqueueFile:(_IQHTTPStaticFile*)file offset:(off_t)offset length:(off_t)length
+{
+    _IQHTTPOutputSegment* segment = [_IQHTTPOutputSegment new];
+    segment->file = file;
+    segment->offset = offset;
+    segment->length = length;
+    [self _enqueueSegment:segment atFront:NO];
+}
+
+- (void) _enqueueChunkHeader:(NSUInteger)len atFront:(BOOL)front
+{
+    char header[24];
+    int n = snprintf(header, sizeof(header), "%lx\r\n", (unsigned long)len);
+    if(front) {
+        _IQHTTPOutputSegment* segment = [_IQHTTPOutputSegment new];
+        segment->data = [NSData dataWithBytes:header length:n];
+        segment->length = n;
+        [self _enqueueSegment:segment atFront:YES];
+    } else {
+        [self _enqueueBytes:(const uint8_t*)header length:n];
+    }
+}
+
+/**
+ Queues a part of the response body, as a chunk if the response is chunked.
+ */
+- (void) _enqueueBody:(NSData*)data
+{
+    if(chunkedResponse) {
+        [self _enqueueChunkHeader:data.length atFront:NO];
+    }
+    [self _enqueueData:data offset:0];
+    if(chunkedResponse) {
+        [self _enqueueBytes:(const uint8_t*)"\r\n" length:2];
+    }
+}
+
+/**
+ Feeds a part of the response body to the compressor and queues whatever compressed output it
+ produces. Small writes usually produce no output until enough input has been collected.
+ */
+- (void) _compress:(const uint8_t*)bytes length:(NSUInteger)len finish:(BOOL)finish
+{
+    uint8_t buffer[kIQHTTPCompressionBufferSize];
+    NSMutableData* output = nil;
+    compressor->next_in = (Bytef*)bytes;
+    compressor->avail_in = (uInt)len;
+    do {
+        compressor->next_out = buffer;
+        compressor->avail_out = sizeof(buffer);
+        deflate(compressor, finish ? Z_FINISH : Z_NO_FLUSH);
+        NSUInteger produced = sizeof(buffer) - compressor->avail_out;
+        if(produced > 0) {
+            if(!output) output = [NSMutableData dataWithCapacity:produced];
+            [output appendBytes:buffer length:produced];
+        }
+    } while(compressor->avail_out == 0);
+    if(output) {
+        [self _enqueueBody:output];
+    }
+}
+
+- (void) _finishCompression
+{
+    if(compressor && !compressorFinished) {
+        compressorFinished = YES;
+        [self _compress:NULL length:0 finish:YES];
+    }
+}
+
+/**
+ Queues the end of the compressed output and the terminating chunk of a chunked response once
+ the entire body has been written.
+ */
+- (void) _finishBody
+{
+    if(!isDone || writeStream) {
+        return;
+    }
+    [self _finishCompression];
+    if(chunkedResponse && !lastChunkQueued) {
+        lastChunkQueued = YES;
+        [self _enqueueBytes:(const uint8_t*)"0\r\n\r\n" length:5];
+    }
+}
+
+/**
+ Moves the change in queued output since the last call to the buffered output gauge of the worker.
+ */
+- (void) _reportBufferedLength
+{
+    if(queuedLength != reportedLength) {
+        OSAtomicAdd64((int64_t)queuedLength - (int64_t)reportedLength, &connection->worker->bufferedBytes);
+        reportedLength = queuedLength;
+    }
+}
+
+/**
+ Adds the request to the statistics of its route. Called once, when the response is complete or
+ the connection is closed.
+ */
+- (void) _recordMetrics
+{
+    if(metricsRecorded) {
+        return;
+    }
+    metricsRecorded = YES;
+    uint64_t now = IQHTTPMicroseconds();
+    OSAtomicIncrement64(&routeStats->requests);
+    OSAtomicAdd64((int64_t)bytesIn, &routeStats->bytesIn);
+    OSAtomicAdd64((int64_t)bytesOut, &routeStats->bytesOut);
+    if(firstByteTime) {
+        IQHTTPHistogramRecord(&routeStats->firstByte, firstByteTime - startTime);
+    }
+    IQHTTPHistogramRecord(&routeStats->total, now - startTime);
+}
+
+/**
+ Removes the given number of sent bytes from the front of the output queue.
+ */
+- (void) _consumeOutput:(NSUInteger)sent
+{
+    if(sent > 0 && !firstByteTime) {
+        firstByteTime = IQHTTPMicroseconds();
+    }
+    bytesOut += sent;
+    queuedLength -= sent;
+    [self _reportBufferedLength];
+    while(sent > 0) {
+        _IQHTTPOutputSegment* segment = [outputQueue objectAtIndex:0];
+        if(sent < segment->length) {
+            segment->offset += sent;
+            segment->length -= sent;
+            segment->appendable = NO; // The data is now partly sent
+            return;
+        }
+        sent -= (NSUInteger)segment->length;
+        [outputQueue removeObjectAtIndex:0];
+    }
+}
+
+- (void) _readStream
+{
+    NSUInteger limit = MAX(writeBufferLimit, kIQHTTPStreamChunkSize);
+    while(writeStream && queuedLength < limit) {
+        NSMutableData* chunk = [NSMutableData dataWithLength:kIQHTTPStreamChunkSize];
+        NSInteger read = [writeStream read:chunk.mutableBytes maxLength:chunk.length];
+        if(read <= 0) {
+            writeStream = nil;
+            [self _finishBody];
+            break;
+        }
+        [chunk setLength:read];
+        if(compressor) {
+            [self _compress:chunk.bytes length:read finish:NO];
+        } else {
+            [self _enqueueBody:chunk];
+        }
+        if(!writeStream.hasBytesAvailable) {
+            break;
+        }
+    }
+}
+
+/**
+ Writes as much of the queued output as the socket accepts. Consecutive memory segments are sent
+ with a single writev call, file regions with sendfile.
+ 
+ @return YES if the queue was emptied.
+ */
+- (BOOL) _drainBuffers
+{
+    while(YES) {
+        if(writeStream && headersSent) {
+            [self _readStream];
+        }
+        if(outputQueue.count == 0) {
+            return YES;
+        }
+        _IQHTTPOutputSegment* first = [outputQueue objectAtIndex:0];
+        if(first->file) {
+            // Static file content goes straight from the file to the socket
+            off_t sent = [connection sendFile:first->file->fd offset:first->offset length:first->length];
+            if(sent < 0) {
+                [self cancel];
+                return NO;
+            }
+            [self _consumeOutput:(NSUInteger)sent];
+            if(outputQueue.count > 0 && [outputQueue objectAtIndex:0] == first) {
+                return NO;
+            }
+            continue;
+        }
+        struct iovec iov[kIQHTTPMaxWriteVectors];
+        int count = 0;
+        size_t total = 0;
+        for(_IQHTTPOutputSegment* segment in outputQueue) {
+            if(segment->file || count == kIQHTTPMaxWriteVectors) break;
+            iov[count].iov_base = (void*)((const uint8_t*)segment->data.bytes + segment->offset);
+            iov[count].iov_len = (size_t)segment->length;
+            total += iov[count].iov_len;
+            count++;
+        }
+        NSInteger written = [connection writeVectors:iov count:count];
+        if(written < 0) {
+            [self cancel];
+            return NO;
+        }
+        [self _consumeOutput:written];
+        if(written < total) {
+            return NO;
+        }
+    }
+}
+
+/**
+ Calls the writable handler if the queue has drained enough after having been full.
+ */
+- (void) _checkWritable
+{
+    if(writeBufferWasFull && queuedLength <= writeBufferLimit / 2) {
+        writeBufferWasFull = NO;
+        IQHTTPWritableHandler handler = writableHandler;
+        if(handler) handler(self);
+    }
+}
+
+- (void) _handleRequest
+{
+    if(waitingForCache) {
+        // _cachedResponseReady: answers it or calls the callback
+        return;
+    }
+    if(isDone) {
+        // Finish sending any buffered output before completing the request
+        if(self.hasSpaceAvailable && [self _drainBuffers]) {
+            [connection _requestDone:self];
+        }
+        return;
+    }
+    BOOL canWrite = self.hasSpaceAvailable;
+    if(canWrite) {
+        // Drain any buffer first
+        BOOL drained = [self _drainBuffers];
+        [self _checkWritable];
+        if(!drained) {
+            // Buffer draining choked the output stream for now.
+            return;
+        }
+    }
+    if(seq == 0 || (canWrite && writeBufferLimit == 0)) {
+        // Callback is called at least once, but may be called subsequently if buffering is turned off
+        // Disabling buffering introduces more complexity at the application level, but reduces the memory
+        // use and buffer copies so in some cases it may be useful (such as when serving static content from
+        // application memory or files).
+        // The first call is made right away, even for pipelined requests that have to wait for their turn
+        // to write. Headers are held back during that call so that a complete response gets a Content-Length.
+        deferHeaders = (seq == 0 && writeBufferLimit > 0);
+        self->currentCallback(self, seq++);
+        if(deferHeaders) {
+            deferHeaders = NO;
+            if(!isDone && queuedLength > 0) {
+                [self _sendHeaders];
+                if(self.hasSpaceAvailable) {
+                    [self _drainBuffers];
+                    [self _checkWritable];
+                }
+            }
+        }
+    }
+}
+
+- (void) _deliverBody:(const uint8_t*)buf length:(NSUInteger)len
+{
+    if(isDone && !bodyReader && !bodySink) {
+        // The response has already been sent, the body is of no use
+        return;
+    }
+    if(bodySink) {
+        if(len > 0) {
+            bodySink(buf, len);
+        }
+        [self _checkBodyEnd];
+        return;
+    }
+    if(!bodyReader || (readBodyAtomic && remainingBody != 0)) {
+        if(!requestBodyBuffer) {
+            requestBodyBuffer = [NSMutableData dataWithCapacity:chunkedBody ? 16384 : (NSUInteger)MIN(contentLength, 1024*1024)];
+        }
+        [requestBodyBuffer appendBytes:buf length:len];
+        return;
+    }
+    if(len == 0 && !readBodyAtomic) {
+        return;
+    }
+    NSData* data;
+    if(requestBodyBuffer) {
+        [requestBodyBuffer appendBytes:buf length:len];
+        data = requestBodyBuffer;
+        requestBodyBuffer = nil;
+    } else {
+        data = [NSData dataWithBytes:buf length:len];
+    }
+    bodyReader(self, data);
+}
+
+- (NSUInteger) _readBody:(const uint8_t*)buf length:(NSUInteger)len
+{
+    if(!chunkedBody) {
+        NSUInteger n = (NSUInteger)MIN((long long)len, remainingBody);
+        remainingBody -= n;
+        [self _deliverBody:buf length:n];
+        return n;
+    }
+    NSUInteger used = 0;
+    while(used < len && remainingBody != 0) {
+        size_t consumed;
+        IQHTTPSpan span;
+        IQHTTPParserStatus status = IQHTTPChunkDecoderExecute(&chunkDecoder, buf+used, len-used, &consumed, &span);
+        if(status == IQHTTPParserBadRequest) {
+            return NSNotFound;
+        }
+        if(span.length > 0) {
+            [self _deliverBody:buf+used+span.offset length:span.length];
+        }
+        used += consumed;
+        if(status == IQHTTPParserBodyComplete) {
+            remainingBody = 0;
+            [self _deliverBody:NULL length:0];
+        } else if(consumed == 0) {
+            break;
+        }
+    }
+    return used;
+}
+
+- (BOOL) _bodyComplete
+{
+    return remainingBody == 0;
+}
+
+static NSString* IQHTTPStringFromSpan(const uint8_t* bytes, IQHTTPSpan span)
+{
+    NSString* string = [[NSString alloc] initWithBytes:bytes+span.offset length:span.length encoding:NSUTF8StringEncoding];
+    if(!string) {
+        string = [[NSString alloc] initWithBytes:bytes+span.offset length:span.length encoding:NSISOLatin1StringEncoding];
+    }
+    return string;
+}
+
+- (NSString*) valueForRequestHeaderField:(NSString*)field
+{
+    char name[128];
+    if(!headFields || ![field getCString:name maxLength:sizeof(name) encoding:NSASCIIStringEncoding]) {
+        return nil;
+    }
+    size_t nameLength = strlen(name);
+    NSUInteger i = IQHTTPParserFindField(headFields, headFieldCount, headBytes, name, nameLength, 0);
+    if(i == NSNotFound) {
+        return nil;
+    }
+    NSString* value = IQHTTPStringFromSpan(headBytes, headFields[i].value);
+    // Repeated fields are combined into a comma separated list
+    while((i = IQHTTPParserFindField(headFields, headFieldCount, headBytes, name, nameLength, i+1)) != NSNotFound) {
+        value = [NSString stringWithFormat:@"%@, %@", value, IQHTTPStringFromSpan(headBytes, headFields[i].value)];
+    }
+    return value;
+}
+- (NSString*) valueForResponseHeaderField:(NSString*)field
+{
+    return objc_retainedObject(CFHTTPMessageCopyHeaderFieldValue(responseHeaders, (__bridge CFStringRef)field));
+}
+
+- (IQMIMEType*) preferredContentTypeAmong:(NSArray*)types
+{
+    return [IQMIMEType preferredMIMETypeAmong:types forAcceptHeader:[self valueForRequestHeaderField:@"Accept"]];
+}
+
+- (NSString*) valueForUrlPatternGroup:(NSInteger)patternGroupIndex
+{
+    NSRange range = [currentResult rangeAtIndex:patternGroupIndex];
+    if(range.length == 0) {
+        return nil;
+    }
+    return [self->resourceSpecifier substringWithRange:range];
+}
+
+- (NSString*) resource
+{
+    if(!resourceSpecifier && headBytes) {
+        resourceSpecifier = IQHTTPStringFromSpan(headBytes, targetSpan);
+    }
+    return resourceSpecifier;
+}
+
+- (NSString*) method
+{
+    if(!method && headBytes) {
+        // Avoid creating strings for the common methods
+        static const char* methods[] = {"GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH"};
+        static NSString* const methodStrings[] = {@"GET", @"HEAD", @"POST", @"PUT", @"DELETE", @"OPTIONS", @"PATCH"};
+        for(int i = 0; i < sizeof(methods)/sizeof(methods[0]); i++) {
+            if(methodSpan.length == strlen(methods[i]) && memcmp(headBytes+methodSpan.offset, methods[i], methodSpan.length) == 0) {
+                method = methodStrings[i];
+                break;
+            }
+        }
+        if(!method) {
+            method = IQHTTPStringFromSpan(headBytes, methodSpan);
+        }
+    }
+    return method;
+}
+
+- (IQHTTPServer*) server
+{
+    return connection->server;
+}
+
+- (void) readRequestBody:(IQHTTPRequestReader)reader atomic:(BOOL)atomic
+{
+    if(bodyReader || bodySink) {
+        [NSException raise:@"MultipleReadsOnBody" format:@"Only one readRequestBody:atomic: call per requst is allowed"];
+        return;
+    }
+    bodyReader = reader;
+    readBodyAtomic = atomic;
+    if(bodyReader && ((remainingBody == 0 && readBodyAtomic) || requestBodyBuffer.length > 0)) {
+        NSData* data = requestBodyBuffer ? requestBodyBuffer : [NSData data];
+        requestBodyBuffer = nil;
+        bodyReader(self, data);
+    }
+}
+
+- (void) _checkBodyEnd
+{
+    if(remainingBody == 0 && bodyEnd) {
+        void (^end)(IQHTTPServerRequest*) = bodyEnd;
+        bodyEnd = nil;
+        bodySink = nil;
+        end(self);
+    }
+}
+
+/**
+ Reads the request body into a sink that takes the bytes where they are, and calls end once the
+ body is complete. The blocks are passed the request rather than capture it, so that a request
+ whose body never completes is not kept alive by them.
+ */
+- (void) _readRequestBodyBytes:(void (^)(const uint8_t* bytes, NSUInteger length))sink end:(void (^)(IQHTTPServerRequest* request))end
+{
+    if(bodyReader || bodySink) {
+        [NSException raise:@"MultipleReadsOnBody" format:@"Only one read of the request body per request is allowed"];
+        return;
+    }
+    bodySink = sink;
+    bodyEnd = end;
+    if(requestBodyBuffer.length > 0) {
+        NSData* buffered = requestBodyBuffer;
+        requestBodyBuffer = nil;
+        sink(buffered.bytes, buffered.length);
+    }
+    requestBodyBuffer = nil;
+    [self _checkBodyEnd];
+}
+
+- (void) spoolRequestBody:(IQHTTPRequestBodyHandler)handler
+{
+    IQHTTPServer* server = self.server;
+    IQHTTPRequestBody* body = [[IQHTTPRequestBody alloc] _initWithMemoryLimit:server.requestBodyMemoryLimit expectedLength:self.requestBodyLength directory:server.requestBodySpoolDirectory];
+    [self _readRequestBodyBytes:^(const uint8_t* bytes, NSUInteger length) {
+        [body _appendBytes:bytes length:length];
+    } end:^(IQHTTPServerRequest* request) {
+        handler(request, [body _finish] ? body : nil);
+    }];
+}
+
+- (void) readMultipartRequestBody:(IQMultipartPartHandler)partHandler completion:(IQHTTPMultipartCompletion)completion
+{
+    NSString* boundary = [IQMultipartParser boundaryForContentType:[self valueForRequestHeaderField:@"Content-Type"]];
+    IQMultipartParser* parser = boundary ? [[IQMultipartParser alloc] initWithBoundary:boundary partHandler:partHandler] : nil;
+    __block BOOL valid = parser != nil;
+    [self _readRequestBodyBytes:^(const uint8_t* bytes, NSUInteger length) {
+        if(valid) {
+            valid = [parser appendBytes:bytes length:length];
+        }
+    } end:^(IQHTTPServerRequest* request) {
+        completion(request, valid && parser.isComplete);
+    }];
+}
+
+- (long long) requestBodyLength
+{
+    return chunkedBody ? -1 : contentLength;
+}
+
+#pragma mark - Response
+
+- (void) cancel
+{
+    if(cacheEntry) {
+        [self _finishCacheFillWithHead:nil body:nil];
+    }
+    isDone = YES;
+    writableHandler = nil;
+    [outputQueue removeAllObjects];
+    queuedLength = 0;
+    [self _reportBufferedLength];
+    writeStream = nil;
+    if([connection->requests containsObject:self]) {
+        [connection close];
+    }
+}
+
+- (void) done
+{
+    isDone = YES;
+    writableHandler = nil;
+    [self _sendHeaders];
+    [self _finishBody];
+    if(self.hasSpaceAvailable && [self _drainBuffers]) {
+        [connection _requestDone:self];
+    }
+}
+
+- (void) setStatusCode:(NSInteger)sc
+{
+    if(headersSent || responseHeaders) {
+        [NSException raise:@"ReadOnlyAtThisTime" format:@"Cannot set statusCode at this stage"];
+        return;
+    }
+    if(sc < 0 || sc >= 600) statusCode = 500;
+    self->statusCode = sc;
+}
+
+- (NSInteger) statusCode
+{
+    if(statusCode == 0) return 200;
+    return statusCode;
+}
+
+- (void) _initHeaders
+{
+    if(!responseHeaders) {
+        responseHeaders = CFHTTPMessageCreateResponse(kCFAllocatorDefault, self.statusCode, NULL, kCFHTTPVersion1_1);
+    }
+}
+
+- (void) setValue:(NSString*)value forResponseHeaderField:(NSString *)field
+{
+    if(headersSent || isDone) {
+        [NSException raise:@"HeadersAlreadySent" format:@"Headers are already sent. Cannot modify headers at this time."];
+        return;
+    }
+    [self _initHeaders];
+    if([field caseInsensitiveCompare:@"Content-Type"] == NSOrderedSame) {
+        // Usually an interned type, a copy is only made to add the charset
+        IQMIMEType* mime = [IQMIMEType MIMETypeWithRFCString:value];
+        NSStringEncoding enc = mime.encoding;
+        if(enc == 0) {
+            if([mime.type isEqualToString:@"text"]) {
+                IQMutableMIMEType* withCharset = [mime mutableCopy];
+                withCharset.encoding = self->encoding;
+                value = [withCharset RFCString];
+            }
+        } else {
+            self->encoding = enc;
+        }
+        didSetContentType = YES;
+    }
+    CFHTTPMessageSetHeaderFieldValue(responseHeaders, (__bridge CFStringRef)field, (__bridge CFStringRef)value);
+}
+
+/**
+ Picks the content coding for a response from an Accept-Encoding header: gzip or deflate, whichever
+ has the higher quality value (gzip if they are equal), or nil if neither is acceptable. Only gzip
+ is considered if allowDeflate is NO.
+ */
+static NSString* IQHTTPNegotiateEncoding(NSString* header, BOOL allowDeflate)
+{
+    if(!header) {
+        return nil;
+    }
+    NSCharacterSet* whitespace = [NSCharacterSet whitespaceCharacterSet];
+    float gzipQuality = -1, deflateQuality = -1, anyQuality = -1;
+    for(NSString* item in [header componentsSeparatedByString:@","]) {
+        NSArray* parts = [item componentsSeparatedByString:@";"];
+        NSString* coding = [parts[0] stringByTrimmingCharactersInSet:whitespace];
+        float q = 1;
+        for(NSUInteger i = 1; i < parts.count; i++) {
+            NSString* parameter = [parts[i] stringByTrimmingCharactersInSet:whitespace];
+            if([parameter hasPrefix:@"q="] || [parameter hasPrefix:@"Q="]) {
+                q = [[parameter substringFromIndex:2] floatValue];
+            }
+        }
+        if([coding caseInsensitiveCompare:@"gzip"] == NSOrderedSame || [coding caseInsensitiveCompare:@"x-gzip"] == NSOrderedSame) {
+            gzipQuality = q;
+        } else if([coding caseInsensitiveCompare:@"deflate"] == NSOrderedSame) {
+            deflateQuality = q;
+        } else if([coding isEqualToString:@"*"]) {
+            anyQuality = q;
+        }
+    }
+    // Codings that are not listed get the quality of "*", if any
+    if(gzipQuality < 0) gzipQuality = anyQuality;
+    if(deflateQuality < 0) deflateQuality = anyQuality;
+    if(!allowDeflate) deflateQuality = 0;
+    if(gzipQuality > 0 && gzipQuality >= deflateQuality) {
+        return @"gzip";
+    }
+    return deflateQuality > 0 ? @"deflate" : nil;
+}
+
+/**
+ Starts compressing the response body if compression is enabled for the server, the content type
+ is compressible, and the client accepts it. Output written while the headers were held back is
+ compressed right away.
+ */
+- (void) _setUpCompression:(BOOL)hasBody
+{
+    IQHTTPServer* server = self.server;
+    if(!server.compressionEnabled || compressionDisabled) {
+        return;
+    }
+    NSString* contentType = objc_retainedObject(CFHTTPMessageCopyHeaderFieldValue(responseHeaders, CFSTR("Content-Type")));
+    if(![server _isCompressibleType:contentType]) {
+        return;
+    }
+    // The response depends on the Accept-Encoding of the request, whether it is compressed or not
+    NSString* vary = objc_retainedObject(CFHTTPMessageCopyHeaderFieldValue(responseHeaders, CFSTR("Vary")));
+    if(!vary) {
+        CFHTTPMessageSetHeaderFieldValue(responseHeaders, CFSTR("Vary"), CFSTR("Accept-Encoding"));
+    } else if([vary rangeOfString:@"Accept-Encoding" options:NSCaseInsensitiveSearch].length == 0) {
+        CFHTTPMessageSetHeaderFieldValue(responseHeaders, CFSTR("Vary"), (__bridge CFStringRef)[vary stringByAppendingString:@", Accept-Encoding"]);
+    }
+    NSString* contentEncoding = objc_retainedObject(CFHTTPMessageCopyHeaderFieldValue(responseHeaders, CFSTR("Content-Encoding")));
+    if(!hasBody || self.statusCode == 206 || contentEncoding) {
+        return;
+    }
+    long long length = -1;
+    NSString* contentLength = objc_retainedObject(CFHTTPMessageCopyHeaderFieldValue(responseHeaders, CFSTR("Content-Length")));
+    if(contentLength) {
+        length = [contentLength longLongValue];
+    } else if(isDone && !writeStream) {
+        length = queuedLength;
+    }
+    if(length >= 0 && length < (long long)server.compressionMinimumSize) {
+        return;
+    }
+    NSString* coding = IQHTTPNegotiateEncoding([self valueForRequestHeaderField:@"Accept-Encoding"], YES);
+    if(!coding) {
+        return;
+    }
+    compressor = calloc(1, sizeof(z_stream));
+    // Window bits above 15 select the gzip format, otherwise the zlib format used by "deflate"
+    if(deflateInit2(compressor, Z_DEFAULT_COMPRESSION, Z_DEFLATED, [coding isEqualToString:@"gzip"] ? 15+16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(compressor);
+        compressor = NULL;
+        return;
+    }
+    CFHTTPMessageSetHeaderFieldValue(responseHeaders, CFSTR("Content-Encoding"), (__bridge CFStringRef)coding);
+    // The length is not known until the entire body has been compressed
+    CFHTTPMessageSetHeaderFieldValue(responseHeaders, CFSTR("Content-Length"), NULL);
+    NSArray* pending = outputQueue;
+    outputQueue = nil;
+    queuedLength = 0;
+    for(_IQHTTPOutputSegment* segment in pending) {
+        [self _compress:(const uint8_t*)segment->data.bytes + segment->offset length:(NSUInteger)segment->length finish:NO];
+    }
+    if(isDone && !writeStream) {
+        [self _finishCompression];
+    }
+}
+
+- (void) _sendHeaders
+{
+    if(!headersSent) {
+        [self _initHeaders];
+        // Check encoding
+        if(!didSetContentType) {
+            IQMutableMIMEType* mime = [IQMutableMIMEType MIMETextTypeWithSubtype:@"plain" encoding:encoding];
+            CFHTTPMessageSetHeaderFieldValue(responseHeaders, (__bridge CFStringRef)@"Content-Type", (__bridge CFStringRef)[mime RFCString]);
+        }
+        NSInteger status = self.statusCode;
+        BOOL isHead = [self.method isEqualToString:@"HEAD"];
+        BOOL hasBody = !(status < 200 || status == 204 || status == 304 || isHead);
+        [self _setUpCompression:hasBody];
+        // Framing. A response must have a known length for the connection to be reused.
+        NSString* length = objc_retainedObject(CFHTTPMessageCopyHeaderFieldValue(responseHeaders, CFSTR("Content-Length")));
+        if(isHead) {
+            if(!length && isDone && !writeStream && queuedLength > 0 && status >= 200 && status != 204 && status != 304) {
+                // The length the body would have had for a GET
+                NSString* value = [NSString stringWithFormat:@"%lu", (unsigned long)queuedLength];
+                CFHTTPMessageSetHeaderFieldValue(responseHeaders, CFSTR("Content-Length"), (__bridge CFStringRef)value);
+            }
+            // Anything written would be read as the start of the next response
+            discardBody = YES;
+            [outputQueue removeAllObjects];
+            queuedLength = 0;
+        }
+        if(hasBody && !length) {
+            if(isDone && !writeStream) {
+                // The entire response is in the write buffer
+                NSString* value = [NSString stringWithFormat:@"%lu", (unsigned long)queuedLength];
+                CFHTTPMessageSetHeaderFieldValue(responseHeaders, CFSTR("Content-Length"), (__bridge CFStringRef)value);
+            } else if(!http10) {
+                // Streamed response of unknown length. Anything written while the headers were held back
+                // becomes the first chunk.
+                CFHTTPMessageSetHeaderFieldValue(responseHeaders, CFSTR("Transfer-Encoding"), CFSTR("chunked"));
+                if(queuedLength > 0) {
+                    [self _enqueueChunkHeader:queuedLength atFront:YES];
+                    [self _enqueueBytes:(const uint8_t*)"\r\n" length:2];
+                }
+                chunkedResponse = YES;
+            } else {
+                // The end of the response is signaled by closing the connection
+                closeConnection = YES;
+                connection->keepAlive = NO;
+                [connection _stopReading];
+            }
+        }
+        if(cacheEntry) {
+            [self _storeCachedResponse];
+        }
+        if(closeConnection) {
+            CFHTTPMessageSetHeaderFieldValue(responseHeaders, CFSTR("Connection"), CFSTR("close"));
+        } else if(http10) {
+            CFHTTPMessageSetHeaderFieldValue(responseHeaders, CFSTR("Connection"), CFSTR("keep-alive"));
+        }
+        // The headers go before any body written while they were held back
+        NSData* headerBuffer = CFBridgingRelease(CFHTTPMessageCopySerializedMessage(responseHeaders));
+        _IQHTTPOutputSegment* segment = [_IQHTTPOutputSegment new];
+        segment->data = headerBuffer;
+        segment->length = headerBuffer.length;
+        [self _enqueueSegment:segment atFront:YES];
+        headersSent = YES;
+        CFRelease(responseHeaders);
+        responseHeaders = nil;
+    }
+}
+
+- (void)writeString:(NSString*)string
+{
+    [self writeData:[string dataUsingEncoding:encoding allowLossyConversion:YES]];
+}
+
+- (void)writeStream:(NSInputStream *)stream
+{
+    if(writeStream != stream) {
+        [self _sendHeaders];
+        if(discardBody) {
+            return;
+        }
+        writeStream = stream;
+        if(writeStream.streamStatus == NSStreamStatusNotOpen) {
+            [writeStream open];
+        }
+    }
+    if(self.hasSpaceAvailable) {
+        [self _drainBuffers];
+    } else {
+        [self _readStream];
+    }
+}
+
+- (NSInteger)writeData:(NSData*)data
+{
+    // Immutable data is queued by reference rather than copied
+    return [self _write:data.bytes length:data.length data:data];
+}
+
+- (NSInteger)write:(const uint8_t *)buffer maxLength:(NSUInteger)len
+{
+    return [self _write:buffer length:len data:nil];
+}
+
+- (NSInteger)_write:(const uint8_t *)buffer length:(NSUInteger)len data:(NSData*)data
+{
+    NSInteger written = 0;
+    if(!deferHeaders) {
+        [self _sendHeaders];
+    }
+    if(discardBody) {
+        return len;
+    }
+    if(compressor) {
+        // Compressed output is always queued, the compressor decides when there is something to send
+        [self _compress:buffer length:len finish:NO];
+        if(self.hasSpaceAvailable) {
+            [self _drainBuffers];
+        }
+        return len;
+    }
+    if(chunkedResponse) {
+        return [self _writeChunk:buffer length:len data:data];
+    }
+    if(self.hasSpaceAvailable && headersSent && (outputQueue.count == 0 || [self _drainBuffers])) {
+        written = [connection write:buffer maxLength:len];
+        if(written < 0) {
+            [self cancel];
+            return 0;
+        }
+    }
+    if(written == len || writeBufferLimit == 0) return written;
+    
+    // Did not fit in the socket buffer. Queue the rest, the application is expected to check writeBufferFull.
+    NSUInteger remaining = len - written;
+    if(data && remaining > kIQHTTPCoalesceSegmentSize) {
+        [self _enqueueData:[data copy] offset:written];
+    } else {
+        [self _enqueueBytes:buffer+written length:remaining];
+    }
+    return len;
+}
+
+- (NSInteger)_writeChunk:(const uint8_t *)buffer length:(NSUInteger)len data:(NSData*)data
+{
+    if(discardBody) {
+        return len;
+    }
+    if(len == 0) {
+        // An empty chunk would end the response
+        return 0;
+    }
+    if(writeBufferLimit == 0 && !(self.hasSpaceAvailable && [self _drainBuffers])) {
+        // Without buffering, a chunk is only accepted when the previous one has been sent
+        return 0;
+    }
+    [self _enqueueChunkHeader:len atFront:NO];
+    if(data && len > kIQHTTPCoalesceSegmentSize) {
+        [self _enqueueData:[data copy] offset:0];
+    } else {
+        [self _enqueueBytes:buffer length:len];
+    }
+    [self _enqueueBytes:(const uint8_t*)"\r\n" length:2];
+    if(self.hasSpaceAvailable) {
+        [self _drainBuffers];
+    }
+    return len;
+}
+
+- (NSUInteger) bufferedLength
+{
+    return queuedLength;
+}
+
+- (BOOL) writeBufferFull
+{
+    return writeBufferLimit > 0 && queuedLength >= writeBufferLimit;
+}
+
+- (BOOL) hasSpaceAvailable
+{
+    if(connection.activeRequest != self) return NO;
+    return connection.hasSpaceAvailable;
+}
+
+#pragma mark - Static files
+
+static NSString* IQHTTPFormatDate(time_t t)
+{
+    struct tm tm;
+    char buf[64];
+    gmtime_r(&t, &tm);
+    strftime_l(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm, NULL);
+    return [NSString stringWithUTF8String:buf];
+}
+
+static time_t IQHTTPParseDate(NSString* string)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* str = [string UTF8String];
+    if(!str || !strptime_l(str, "%a, %d %b %Y %H:%M:%S GMT", &tm, NULL)) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+static BOOL IQHTTPETagListMatches(NSString* list, NSString* etag)
+{
+    for(NSString* candidate in [list componentsSeparatedByString:@","]) {
+        NSString* tag = [candidate stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+        if([tag isEqualToString:@"*"]) return YES;
+        if([tag hasPrefix:@"W/"]) tag = [tag substringFromIndex:2];
+        if([tag isEqualToString:etag]) return YES;
+    }
+    return NO;
+}
+
+/**
+ Parses a single byte range ("bytes=a-b", "bytes=a-" or "bytes=-n"). Returns NO if the
+ header should be ignored, and sets *satisfiable to NO if the range is outside the file.
+ */
+static BOOL IQHTTPParseRange(NSString* header, off_t size, off_t* offset, off_t* length, BOOL* satisfiable)
+{
+    *satisfiable = YES;
+    if(![header hasPrefix:@"bytes="]) return NO;
+    NSString* spec = [[header substringFromIndex:6] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+    if([spec rangeOfString:@","].length > 0) return NO; // Multiple ranges are not supported, send the entire file
+    NSRange dash = [spec rangeOfString:@"-"];
+    if(dash.length == 0) return NO;
+    NSString* first = [spec substringToIndex:dash.location];
+    NSString* last = [spec substringFromIndex:dash.location+1];
+    off_t start, end;
+    if(first.length == 0) {
+        if(last.length == 0) return NO;
+        off_t suffix = [last longLongValue];
+        if(suffix <= 0) {
+            *satisfiable = NO;
+            return YES;
+        }
+        start = suffix >= size ? 0 : size - suffix;
+        end = size - 1;
+    } else {
+        start = [first longLongValue];
+        end = last.length > 0 ? [last longLongValue] : size - 1;
+        if(end < start) return NO;
+        if(start >= size) {
+            *satisfiable = NO;
+            return YES;
+        }
+        if(end >= size) end = size - 1;
+    }
+    *offset = start;
+    *length = end - start + 1;
+    return YES;
+}
+
+- (void) serveFileAtPath:(NSString*)path
+{
+    NSString* method = self.method;
+    BOOL isHead = [method isEqualToString:@"HEAD"];
+    if(!isHead && ![method isEqualToString:@"GET"]) {
+        self.statusCode = 405;
+        [self setValue:@"GET, HEAD" forResponseHeaderField:@"Allow"];
+        [self done];
+        return;
+    }
+    IQHTTPServer* server = self.server;
+    _IQHTTPStaticFile* file = [server _staticFileAtPath:path];
+    if(!file) {
+        [self _respondWithStatus:404 message:@"The file was not found"];
+        return;
+    }
+    
+    // Files are never compressed on the fly, they are served from a compressed copy instead
+    compressionDisabled = YES;
+    if(server.compressionEnabled && [server _isCompressibleType:file->contentType]) {
+        [self setValue:@"Accept-Encoding" forResponseHeaderField:@"Vary"];
+        if(file->size >= (off_t)server.compressionMinimumSize && IQHTTPNegotiateEncoding([self valueForRequestHeaderField:@"Accept-Encoding"], NO)) {
+            _IQHTTPStaticFile* variant = [server _gzipVariantOfFile:file];
+            // Ranges and validators refer to the compressed copy from here on
+            if(variant && variant->size < file->size) {
+                file = variant;
+                [self setValue:@"gzip" forResponseHeaderField:@"Content-Encoding"];
+            }
+        }
+    }
+    
+    // Conditional requests. If-None-Match takes precedence over If-Modified-Since.
+    BOOL notModified = NO;
+    NSString* ifNoneMatch = [self valueForRequestHeaderField:@"If-None-Match"];
+    if(ifNoneMatch) {
+        notModified = IQHTTPETagListMatches(ifNoneMatch, file->etag);
+    } else {
+        NSString* ifModifiedSince = [self valueForRequestHeaderField:@"If-Modified-Since"];
+        if(ifModifiedSince) {
+            time_t since = IQHTTPParseDate(ifModifiedSince);
+            notModified = since >= 0 && file->mtime <= since;
+        }
+    }
+    
+    off_t offset = 0, length = file->size;
+    NSInteger status = notModified ? 304 : 200;
+    NSString* rangeHeader = notModified ? nil : [self valueForRequestHeaderField:@"Range"];
+    if(rangeHeader) {
+        NSString* ifRange = [self valueForRequestHeaderField:@"If-Range"];
+        if(ifRange) {
+            // Only honor the range if the client has the current version of the file
+            if(![ifRange isEqualToString:file->etag] && IQHTTPParseDate(ifRange) != file->mtime) {
+                rangeHeader = nil;
+            }
+        }
+    }
+    BOOL satisfiable = YES;
+    if(rangeHeader && IQHTTPParseRange(rangeHeader, file->size, &offset, &length, &satisfiable)) {
+        status = satisfiable ? 206 : 416;
+    }
+    
+    self.statusCode = status;
+    [self setValue:file->etag forResponseHeaderField:@"ETag"];
+    [self setValue:file->lastModified forResponseHeaderField:@"Last-Modified"];
+    [self setValue:@"bytes" forResponseHeaderField:@"Accept-Ranges"];
+    if(status == 304) {
+        [self done];
+        return;
+    }
+    if(status == 416) {
+        [self setValue:[NSString stringWithFormat:@"bytes */%lld", (long long)file->size] forResponseHeaderField:@"Content-Range"];
+        [self setValue:@"0" forResponseHeaderField:@"Content-Length"];
+        [self done];
+        return;
+    }
+    if(status == 206) {
+        [self setValue:[NSString stringWithFormat:@"bytes %lld-%lld/%lld", (long long)offset, (long long)(offset+length-1), (long long)file->size] forResponseHeaderField:@"Content-Range"];
+    }
+    [self setValue:file->contentType forResponseHeaderField:@"Content-Type"];
+    [self setValue:[NSString stringWithFormat:@"%lld", (long long)length] forResponseHeaderField:@"Content-Length"];
+    if(!isHead && length > 0) {
+        [self _sendHeaders];
+        [self _enqueueFile:file offset:offset length:length];
+    }
+    [self done];
+}
+
+@end
+
+@implementation _IQHTTPStaticFile
+
+- (id) initWithPath:(NSString*)p
+{
+    self = [super init];
+    if(self) {
+        fd = open([p fileSystemRepresentation], O_RDONLY);
+        if(fd < 0) {
+            return nil;
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            close(fd);
+            fd = -1;
+            return nil;
+        }
+        path = p;
+        size = st.st_size;
+        mtime = st.st_mtime;
+        inode = st.st_ino;
+        etag = [NSString stringWithFormat:@"\"%llx-%llx-%lx\"", (unsigned long long)inode, (unsigned long long)size, (long)mtime];
+        lastModified = IQHTTPFormatDate(mtime);
+        IQMIMEType* mime = [IQMIMEType MIMETypeForPathExtension:p.pathExtension];
+        contentType = mime ? mime.RFCString : @"application/octet-stream";
+        checkedAt = CFAbsoluteTimeGetCurrent();
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    if(fd >= 0) {
+        close(fd);
+    }
+}
+
+@end
+
+@implementation _IQHTTPOutputSegment
+@end
+
+@implementation _IQHTTPURLHandler
+@synthesize regexp, callback, method, cache;
+@end
+
+@implementation _IQHTTPCacheEntry
+@end
+
+@implementation IQHTTPResponseCache
+@synthesize timeToLive, staleTimeToLive, varyHeaderFields, sizeLimit, maxResponseSize;
+
+- (id) init
+{
+    return [self initWithTimeToLive:1];
+}
+
+- (id) initWithTimeToLive:(NSTimeInterval)ttl
+{
+    self = [super init];
+    if(self) {
+        timeToLive = ttl;
+        sizeLimit = 4 * 1024 * 1024;
+        maxResponseSize = 256 * 1024;
+        entries = [NSMutableDictionary dictionaryWithCapacity:64];
+    }
+    return self;
+}
+
+- (NSUInteger) hitCount
+{
+    @synchronized(self) {
+        return hitCount;
+    }
+}
+
+- (NSUInteger) missCount
+{
+    @synchronized(self) {
+        return missCount;
+    }
+}
+
+- (NSString*) _keyForRequest:(IQHTTPServerRequest*)request
+{
+    NSMutableString* key = [NSMutableString stringWithFormat:@"%@ %@", request.method, request.resource];
+    for(NSString* field in varyHeaderFields) {
+        NSString* value = [request valueForRequestHeaderField:field];
+        [key appendFormat:@"\n%@", value ? value : @""];
+    }
+    if(request.server.compressionEnabled) {
+        // The response depends on the content coding negotiated with the client
+        NSString* coding = IQHTTPNegotiateEncoding([request valueForRequestHeaderField:@"Accept-Encoding"], YES);
+        [key appendFormat:@"\n%@", coding ? coding : @"identity"];
+    }
+    return key;
+}
+
+- (_IQHTTPCacheEntry*) _entryForKey:(NSString*)key
+{
+    _IQHTTPCacheEntry* entry = [entries objectForKey:key];
+    if(!entry) {
+        entry = [[_IQHTTPCacheEntry alloc] init];
+        entry->key = key;
+        [entries setObject:entry forKey:key];
+    }
+    entry->lastUsed = ++clock;
+    return entry;
+}
+
+- (void) _finishFill:(_IQHTTPCacheEntry*)entry head:(NSData*)head body:(NSData*)body
+{
+    NSArray* waiters;
+    @synchronized(self) {
+        waiters = entry->waiters;
+        entry->waiters = nil;
+        entry->filling = NO;
+        _IQHTTPCacheEntry* current = [entries objectForKey:entry->key];
+        BOOL present = current == entry;
+        if(head && current && !present) {
+            // Removed while filling and since replaced, the waiters still get this response
+        } else if(head) {
+            if(present) totalSize -= entry->size;
+            entry->head = head;
+            entry->body = body;
+            entry->size = head.length + body.length;
+            entry->expires = CFAbsoluteTimeGetCurrent() + timeToLive;
+            entry->staleUntil = entry->expires + staleTimeToLive;
+            if(!present) {
+                // Removed while filling, put it back
+                [entries setObject:entry forKey:entry->key];
+            }
+            totalSize += entry->size;
+            // Evict the least recently used responses, the ones being produced have no size
+            while(totalSize > sizeLimit) {
+                _IQHTTPCacheEntry* oldest = nil;
+                for(_IQHTTPCacheEntry* e in [entries objectEnumerator]) {
+                    if(e != entry && e->head && !e->filling && (!oldest || e->lastUsed < oldest->lastUsed)) {
+                        oldest = e;
+                    }
+                }
+                if(!oldest) break;
+                totalSize -= oldest->size;
+                [entries removeObjectForKey:oldest->key];
+            }
+        } else if(present && !entry->head) {
+            // Nothing cached for this key, do not keep the placeholder
+            [entries removeObjectForKey:entry->key];
+        }
+    }
+    for(IQHTTPServerRequest* request in waiters) {
+        [request _cachedResponseReady:head body:body];
+    }
+}
+
+- (void) removeAllResponses
+{
+    @synchronized(self) {
+        for(_IQHTTPCacheEntry* entry in [entries objectEnumerator]) {
+            // Entries being filled will be added again when they are done
+            entry->size = 0;
+        }
+        [entries removeAllObjects];
+        totalSize = 0;
+    }
+}
+
+@end
+
+@implementation IQHTTPRequestBody
+@synthesize length, path;
+
+- (id) _initWithMemoryLimit:(NSUInteger)limit expectedLength:(long long)expectedLength directory:(NSString*)dir
+{
+    self = [super init];
+    if(self) {
+        fd = -1;
+        memoryLimit = limit;
+        directory = dir ? dir : NSTemporaryDirectory();
+        if(expectedLength > (long long)limit) {
+            // Known to be too large, go straight to the file
+            failed = ![self _openFile];
+        } else {
+            buffer = [NSMutableData dataWithCapacity:expectedLength >= 0 ? (NSUInteger)expectedLength : MIN(limit, 16384)];
+        }
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    if(fd >= 0) {
+        close(fd);
+    }
+    if(temporary && path) {
+        unlink([path fileSystemRepresentation]);
+    }
+}
+
+- (BOOL) _openFile
+{
+    NSString* template = [directory stringByAppendingPathComponent:@"IQHTTPBody.XXXXXX"];
+    char* name = strdup([template fileSystemRepresentation]);
+    fd = mkstemp(name);
+    if(fd >= 0) {
+        path = [[NSFileManager defaultManager] stringWithFileSystemRepresentation:name length:strlen(name)];
+        temporary = YES;
+    }
+    free(name);
+    return fd >= 0;
+}
+
+- (BOOL) _writeBytes:(const uint8_t*)bytes length:(NSUInteger)len
+{
+    while(len > 0) {
+        ssize_t written = write(fd, bytes, len);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return NO;
+        }
+        bytes += written;
+        len -= written;
+    }
+    return YES;
+}
+
+- (void) _appendBytes:(const uint8_t*)bytes length:(NSUInteger)len
+{
+    if(failed) {
+        return;
+    }
+    length += len;
+    if(buffer && buffer.length + len <= memoryLimit) {
+        [buffer appendBytes:bytes length:len];
+        return;
+    }
+    if(buffer) {
+        // Over the limit, move what has been read so far to a file
+        if(![self _openFile] || ![self _writeBytes:buffer.bytes length:buffer.length]) {
+            failed = YES;
+        }
+        buffer = nil;
+    }
+    if(!failed && ![self _writeBytes:bytes length:len]) {
+        failed = YES;
+    }
+}
+
+- (BOOL) _finish
+{
+    if(fd >= 0) {
+        if(close(fd) != 0) failed = YES;
+        fd = -1;
+    }
+    if(failed) {
+        buffer = nil;
+        if(temporary && path) {
+            unlink([path fileSystemRepresentation]);
+        }
+        path = nil;
+    }
+    return !failed;
+}
+
+- (NSData*) data
+{
+    if(buffer) {
+        return buffer;
+    }
+    if(!data && path) {
+        data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedAlways error:NULL];
+    }
+    return data;
+}
+
+- (NSInputStream*) inputStream
+{
+    return path ? [NSInputStream inputStreamWithFileAtPath:path] : [NSInputStream inputStreamWithData:buffer];
+}
+
+- (BOOL) moveToPath:(NSString*)newPath error:(NSError**)error
+{
+    if(path) {
+        if(![[NSFileManager defaultManager] moveItemAtPath:path toPath:newPath error:error]) {
+            return NO;
+        }
+    } else if(![buffer writeToFile:newPath options:NSDataWritingAtomic error:error]) {
+        return NO;
+    }
+    buffer = nil;
+    data = nil;
+    path = newPath;
+    temporary = NO;
+    return YES;
+}
+
+@end
+
+@implementation _IQHTTPRouteNode
+@end
+@implementation IQHTTPServerRouteMetrics
+@synthesize pattern, method, requestCount, bytesReceived, bytesSent;
+
+- (NSTimeInterval) timeToFirstByteAtPercentile:(double)percentile
+{
+    return IQHTTPHistogramPercentile(&firstByte, percentile);
+}
+
+- (NSTimeInterval) durationAtPercentile:(double)percentile
+{
+    return IQHTTPHistogramPercentile(&total, percentile);
+}
+
+- (NSTimeInterval) meanDuration
+{
+    int64_t count = IQHTTPHistogramCount(&total);
+    return count > 0 ? total.sum / (double)count / 1000000.0 : 0;
+}
+
+@end
+
+@implementation IQHTTPServerMetrics
+@synthesize routes, activeConnectionCount, idleConnectionCount, bufferedOutputBytes, writeStallCount;
+@synthesize rejectedConnectionCount, timedOutConnectionCount;
+
+static NSString* IQHTTPMetricsLabels(IQHTTPServerRouteMetrics* route)
+{
+    NSMutableString* pattern = [NSMutableString stringWithString:route->pattern ? route->pattern : @""];
+    [pattern replaceOccurrencesOfString:@"\\" withString:@"\\\\" options:0 range:NSMakeRange(0, pattern.length)];
+    [pattern replaceOccurrencesOfString:@"\"" withString:@"\\\"" options:0 range:NSMakeRange(0, pattern.length)];
+    [pattern replaceOccurrencesOfString:@"\n" withString:@"\\n" options:0 range:NSMakeRange(0, pattern.length)];
+    return [NSString stringWithFormat:@"route=\"%@\",method=\"%@\"", pattern, route->method ? route->method : @""];
+}
+
+static void IQHTTPAppendHistogram(NSMutableString* text, NSString* name, NSString* labels, const _IQHTTPHistogram* histogram)
+{
+    // The fine buckets are summed up to boundaries at every other power of two, from 256us to 67s
+    int64_t cumulative = 0;
+    NSUInteger index = 0;
+    for(unsigned power = 8; power <= 26; power += 2) {
+        NSUInteger end = (power - kIQHTTPHistogramSubBits + 1) * kIQHTTPHistogramSubBuckets;
+        for(; index < end; index++) {
+            cumulative += histogram->counts[index];
+        }
+        [text appendFormat:@"%@_bucket{%@,le=\"%g\"} %lld\n", name, labels, (double)(1ull << power) / 1000000.0, cumulative];
+    }
+    for(; index < kIQHTTPHistogramBuckets; index++) {
+        cumulative += histogram->counts[index];
+    }
+    [text appendFormat:@"%@_bucket{%@,le=\"+Inf\"} %lld\n", name, labels, cumulative];
+    [text appendFormat:@"%@_sum{%@} %g\n", name, labels, histogram->sum / 1000000.0];
+    [text appendFormat:@"%@_count{%@} %lld\n", name, labels, cumulative];
+}
+
+- (NSString*) textRepresentation
+{
+    NSMutableString* text = [NSMutableString stringWithCapacity:1024 + routes.count * 2048];
+    NSMutableArray* labels = [NSMutableArray arrayWithCapacity:routes.count];
+    for(IQHTTPServerRouteMetrics* route in routes) {
+        [labels addObject:IQHTTPMetricsLabels(route)];
+    }
+    [text appendString:@"# HELP iqhttp_requests_total Completed requests.\n# TYPE iqhttp_requests_total counter\n"];
+    [routes enumerateObjectsUsingBlock:^(IQHTTPServerRouteMetrics* route, NSUInteger i, BOOL* stop) {
+        [text appendFormat:@"iqhttp_requests_total{%@} %llu\n", labels[i], route->requestCount];
+    }];
+    [text appendString:@"# HELP iqhttp_received_bytes_total Bytes received in request heads and bodies.\n# TYPE iqhttp_received_bytes_total counter\n"];
+    [routes enumerateObjectsUsingBlock:^(IQHTTPServerRouteMetrics* route, NSUInteger i, BOOL* stop) {
+        [text appendFormat:@"iqhttp_received_bytes_total{%@} %llu\n", labels[i], route->bytesReceived];
+    }];
+    [text appendString:@"# HELP iqhttp_sent_bytes_total Bytes sent in responses, including headers.\n# TYPE iqhttp_sent_bytes_total counter\n"];
+    [routes enumerateObjectsUsingBlock:^(IQHTTPServerRouteMetrics* route, NSUInteger i, BOOL* stop) {
+        [text appendFormat:@"iqhttp_sent_bytes_total{%@} %llu\n", labels[i], route->bytesSent];
+    }];
+    [text appendString:@"# HELP iqhttp_time_to_first_byte_seconds Time from the start of a request until the first byte of its response was sent.\n# TYPE iqhttp_time_to_first_byte_seconds histogram\n"];
+    [routes enumerateObjectsUsingBlock:^(IQHTTPServerRouteMetrics* route, NSUInteger i, BOOL* stop) {
+        IQHTTPAppendHistogram(text, @"iqhttp_time_to_first_byte_seconds", labels[i], &route->firstByte);
+    }];
+    [text appendString:@"# HELP iqhttp_request_duration_seconds Time from the start of a request until its response was sent.\n# TYPE iqhttp_request_duration_seconds histogram\n"];
+    [routes enumerateObjectsUsingBlock:^(IQHTTPServerRouteMetrics* route, NSUInteger i, BOOL* stop) {
+        IQHTTPAppendHistogram(text, @"iqhttp_request_duration_seconds", labels[i], &route->total);
+    }];
+    [text appendFormat:@"# HELP iqhttp_connections Open connections.\n# TYPE iqhttp_connections gauge\n"
+     "iqhttp_connections{state=\"active\"} %lu\niqhttp_connections{state=\"idle\"} %lu\n",
+     (unsigned long)activeConnectionCount, (unsigned long)idleConnectionCount];
+    [text appendFormat:@"# HELP iqhttp_buffered_output_bytes Response bytes waiting to be sent.\n# TYPE iqhttp_buffered_output_bytes gauge\n"
+     "iqhttp_buffered_output_bytes %llu\n", bufferedOutputBytes];
+    [text appendFormat:@"# HELP iqhttp_write_stalls_total Writes that filled the socket send buffer.\n# TYPE iqhttp_write_stalls_total counter\n"
+     "iqhttp_write_stalls_total %llu\n", writeStallCount];
+    [text appendFormat:@"# HELP iqhttp_connections_rejected_total Connections refused over the connection limits.\n# TYPE iqhttp_connections_rejected_total counter\n"
+     "iqhttp_connections_rejected_total %llu\n", rejectedConnectionCount];
+    [text appendFormat:@"# HELP iqhttp_connections_timed_out_total Connections closed by a request or keep-alive timeout.\n# TYPE iqhttp_connections_timed_out_total counter\n"
+     "iqhttp_connections_timed_out_total %llu\n", timedOutConnectionCount];
+    return text;
+}
+
+@end
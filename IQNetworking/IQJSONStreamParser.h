@@ -0,0 +1,73 @@
+//
+//  IQJSONStreamParser.h
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+#define kIQJSONDefaultMaxDepth 512
+
+/**
+ Receives an element of the top-level array as soon as it has been parsed.
+ */
+typedef void (^IQJSONElementHandler)(id element);
+
+/**
+ Incremental parser for JSON text (RFC 4627) in UTF-8.
+
+ The text is fed to the parser in pieces of any size as it arrives, and the objects are built as
+ it goes, so a response can be parsed while it is being received instead of being collected
+ first. Objects become NSMutableDictionary, arrays NSMutableArray, strings NSString, numbers
+ NSNumber and null NSNull. Only a value that spans pieces is buffered.
+ */
+@interface IQJSONStreamParser : NSObject
+
+/**
+ Parses the next piece of the text. Returns NO if the text is malformed, after which the parser
+ ignores any further input.
+ */
+- (BOOL) appendBytes:(const void*)bytes length:(NSUInteger)length;
+- (BOOL) appendData:(NSData*)data;
+
+/**
+ Ends the text. Returns NO if it was malformed or incomplete.
+ */
+- (BOOL) finish;
+
+/**
+ If set and the text is an array, every element is passed to the handler as soon as it has been
+ parsed instead of being added to the result, so the whole array is never kept in memory. The
+ handler is called on the thread that feeds the parser.
+ */
+@property (nonatomic, copy) IQJSONElementHandler elementHandler;
+
+/**
+ The maximum nesting of arrays and objects. The default is kIQJSONDefaultMaxDepth.
+ */
+@property (nonatomic) NSUInteger maxDepth;
+
+/**
+ The parsed value once all of it has been parsed, or nil. With an elementHandler, an array
+ result is left empty.
+ */
+@property (nonatomic, readonly) id result;
+
+/**
+ Describes why the text could not be parsed.
+ */
+@property (nonatomic, readonly) NSError* error;
+
+@end
@@ -0,0 +1,500 @@
+//
+//  IQJSONStreamParser.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "IQJSONStreamParser.h"
+#import <xlocale.h>
+#import <errno.h>
+
+typedef enum {
+    // Expecting a value
+    IQJSONStateValue,
+    // Expecting a value or the end of an array
+    IQJSONStateFirstValue,
+    // Expecting a member name
+    IQJSONStateKey,
+    // Expecting a member name or the end of an object
+    IQJSONStateFirstKey,
+    IQJSONStateColon,
+    // Expecting a comma or the end of the enclosing array or object
+    IQJSONStateAfterValue,
+    IQJSONStateString,
+    IQJSONStateEscape,
+    IQJSONStateUnicode,
+    IQJSONStateNumber,
+    IQJSONStateLiteral,
+    // The value is complete, only whitespace may follow
+    IQJSONStateDone,
+    IQJSONStateError
+} IQJSONState;
+
+static inline BOOL IQJSONIsWhitespace(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline BOOL IQJSONIsDigit(uint8_t c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline BOOL IQJSONIsNumberCharacter(uint8_t c)
+{
+    return IQJSONIsDigit(c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+static int IQJSONHexValue(uint8_t c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ Checks a number against the JSON grammar, which is stricter than strtod.
+ */
+static BOOL IQJSONIsValidNumber(const uint8_t* s, size_t length, BOOL* integer)
+{
+    size_t i = 0;
+    *integer = YES;
+    if(i < length && s[i] == '-') i++;
+    if(i >= length) return NO;
+    if(s[i] == '0') {
+        i++;
+    } else if(s[i] >= '1' && s[i] <= '9') {
+        while(i < length && IQJSONIsDigit(s[i])) i++;
+    } else {
+        return NO;
+    }
+    if(i < length && s[i] == '.') {
+        size_t start = ++i;
+        while(i < length && IQJSONIsDigit(s[i])) i++;
+        if(i == start) return NO;
+        *integer = NO;
+    }
+    if(i < length && (s[i] == 'e' || s[i] == 'E')) {
+        i++;
+        if(i < length && (s[i] == '+' || s[i] == '-')) i++;
+        size_t start = i;
+        while(i < length && IQJSONIsDigit(s[i])) i++;
+        if(i == start) return NO;
+        *integer = NO;
+    }
+    return i == length;
+}
+
+@interface IQJSONStreamParser () {
+    IQJSONState state;
+    // The arrays and objects being built, innermost last, and the names of the members whose
+    // values are being parsed
+    NSMutableArray* containers;
+    NSMutableArray* keys;
+    // A string, number or literal that may span pieces of the text
+    uint8_t* token;
+    size_t tokenLength, tokenCapacity;
+    BOOL tokenIsKey;
+    const char* literal;
+    size_t literalLength;
+    // A \u escape being parsed, and a high surrogate waiting for its low half
+    uint32_t escapeValue;
+    int escapeDigits;
+    uint32_t pendingSurrogate;
+    // The number of bytes before the current piece, for error messages
+    unsigned long long offset;
+}
+@end
+
+@implementation IQJSONStreamParser
+@synthesize elementHandler, maxDepth, result, error;
+
+- (id) init
+{
+    self = [super init];
+    if(self) {
+        state = IQJSONStateValue;
+        containers = [NSMutableArray array];
+        keys = [NSMutableArray array];
+        maxDepth = kIQJSONDefaultMaxDepth;
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    free(token);
+}
+
+- (void) _failWithMessage:(NSString*)message at:(unsigned long long)position
+{
+    state = IQJSONStateError;
+    NSString* description = [NSString stringWithFormat:@"%@ around character %llu.", message, position];
+    // The same domain and code as NSJSONSerialization uses for malformed text
+    error = [NSError errorWithDomain:NSCocoaErrorDomain code:3840 userInfo:[NSDictionary dictionaryWithObject:description forKey:NSLocalizedDescriptionKey]];
+    [containers removeAllObjects];
+    [keys removeAllObjects];
+}
+
+- (void) _appendToken:(const uint8_t*)bytes length:(size_t)length
+{
+    if(tokenLength + length > tokenCapacity) {
+        tokenCapacity = MAX(MAX(tokenCapacity * 2, tokenLength + length), 64);
+        token = realloc(token, tokenCapacity);
+    }
+    memcpy(token + tokenLength, bytes, length);
+    tokenLength += length;
+}
+
+- (void) _appendCodePoint:(uint32_t)cp
+{
+    uint8_t buf[4];
+    size_t length;
+    if(cp < 0x80) {
+        buf[0] = cp;
+        length = 1;
+    } else if(cp < 0x800) {
+        buf[0] = 0xC0 | (cp >> 6);
+        buf[1] = 0x80 | (cp & 0x3F);
+        length = 2;
+    } else if(cp < 0x10000) {
+        buf[0] = 0xE0 | (cp >> 12);
+        buf[1] = 0x80 | ((cp >> 6) & 0x3F);
+        buf[2] = 0x80 | (cp & 0x3F);
+        length = 3;
+    } else {
+        buf[0] = 0xF0 | (cp >> 18);
+        buf[1] = 0x80 | ((cp >> 12) & 0x3F);
+        buf[2] = 0x80 | ((cp >> 6) & 0x3F);
+        buf[3] = 0x80 | (cp & 0x3F);
+        length = 4;
+    }
+    [self _appendToken:buf length:length];
+}
+
+/**
+ A high surrogate that is not followed by a low one becomes a replacement character.
+ */
+- (void) _flushSurrogate
+{
+    if(pendingSurrogate) {
+        pendingSurrogate = 0;
+        [self _appendCodePoint:0xFFFD];
+    }
+}
+
+- (void) _escapedCodePoint:(uint32_t)cp
+{
+    if(pendingSurrogate && cp >= 0xDC00 && cp <= 0xDFFF) {
+        [self _appendCodePoint:0x10000 + ((pendingSurrogate - 0xD800) << 10) + (cp - 0xDC00)];
+        pendingSurrogate = 0;
+        return;
+    }
+    [self _flushSurrogate];
+    if(cp >= 0xD800 && cp <= 0xDBFF) {
+        pendingSurrogate = cp;
+    } else if(cp >= 0xDC00 && cp <= 0xDFFF) {
+        [self _appendCodePoint:0xFFFD];
+    } else {
+        [self _appendCodePoint:cp];
+    }
+}
+
+/**
+ Adds a complete value to the enclosing array or object, or makes it the result.
+ */
+- (void) _addValue:(id)value
+{
+    NSUInteger depth = containers.count;
+    if(depth == 0) {
+        result = value;
+        state = IQJSONStateDone;
+        return;
+    }
+    id container = [containers lastObject];
+    if([container isKindOfClass:[NSMutableDictionary class]]) {
+        [container setObject:value forKey:[keys lastObject]];
+        [keys removeLastObject];
+    } else if(depth == 1 && elementHandler) {
+        elementHandler(value);
+    } else {
+        [container addObject:value];
+    }
+    state = IQJSONStateAfterValue;
+}
+
+- (BOOL) _openContainer:(id)container at:(unsigned long long)position
+{
+    if(containers.count >= maxDepth) {
+        [self _failWithMessage:@"Too deeply nested" at:position];
+        return NO;
+    }
+    [containers addObject:container];
+    state = [container isKindOfClass:[NSMutableDictionary class]] ? IQJSONStateFirstKey : IQJSONStateFirstValue;
+    return YES;
+}
+
+- (BOOL) _closeContainer:(uint8_t)c at:(unsigned long long)position
+{
+    id container = [containers lastObject];
+    BOOL object = [container isKindOfClass:[NSMutableDictionary class]];
+    if(!container || object != (c == '}')) {
+        [self _failWithMessage:@"Unbalanced brackets" at:position];
+        return NO;
+    }
+    [containers removeLastObject];
+    [self _addValue:container];
+    return YES;
+}
+
+- (BOOL) _endString
+{
+    [self _flushSurrogate];
+    NSString* string = [[NSString alloc] initWithBytes:token length:tokenLength encoding:NSUTF8StringEncoding];
+    if(!string) {
+        return NO;
+    }
+    if(tokenIsKey) {
+        [keys addObject:string];
+        state = IQJSONStateColon;
+    } else {
+        [self _addValue:string];
+    }
+    return YES;
+}
+
+- (BOOL) _endNumber
+{
+    BOOL integer;
+    if(!IQJSONIsValidNumber(token, tokenLength, &integer)) {
+        return NO;
+    }
+    uint8_t terminator = 0;
+    [self _appendToken:&terminator length:1];
+    NSNumber* number = nil;
+    if(integer) {
+        errno = 0;
+        long long value = strtoll_l((const char*)token, NULL, 10, NULL);
+        if(errno != ERANGE) {
+            number = [NSNumber numberWithLongLong:value];
+        }
+    }
+    if(!number) {
+        // The NULL locale is the C locale, so the decimal point is always a period
+        number = [NSNumber numberWithDouble:strtod_l((const char*)token, NULL, NULL)];
+    }
+    [self _addValue:number];
+    return YES;
+}
+
+- (BOOL) appendData:(NSData*)data
+{
+    return [self appendBytes:data.bytes length:data.length];
+}
+
+- (BOOL) appendBytes:(const void*)bytes length:(NSUInteger)length
+{
+    const uint8_t* start = bytes;
+    const uint8_t* end = start + length;
+    const uint8_t* p = start;
+    while(p < end && state != IQJSONStateError) {
+        uint8_t c = *p;
+        unsigned long long position = offset + (p - start);
+        switch(state) {
+            case IQJSONStateValue:
+            case IQJSONStateFirstValue:
+                if(IQJSONIsWhitespace(c)) {
+                    p++;
+                } else if(c == '"') {
+                    tokenLength = 0;
+                    tokenIsKey = NO;
+                    state = IQJSONStateString;
+                    p++;
+                } else if(c == '[') {
+                    [self _openContainer:[NSMutableArray array] at:position];
+                    p++;
+                } else if(c == '{') {
+                    [self _openContainer:[NSMutableDictionary dictionary] at:position];
+                    p++;
+                } else if(c == '-' || IQJSONIsDigit(c)) {
+                    // The number state collects the character
+                    tokenLength = 0;
+                    state = IQJSONStateNumber;
+                } else if(c == 't' || c == 'f' || c == 'n') {
+                    literal = c == 't' ? "true" : c == 'f' ? "false" : "null";
+                    literalLength = 1;
+                    state = IQJSONStateLiteral;
+                    p++;
+                } else if(c == ']' && state == IQJSONStateFirstValue) {
+                    [self _closeContainer:c at:position];
+                    p++;
+                } else {
+                    [self _failWithMessage:@"Expected a value" at:position];
+                }
+                break;
+            case IQJSONStateKey:
+            case IQJSONStateFirstKey:
+                if(IQJSONIsWhitespace(c)) {
+                    p++;
+                } else if(c == '"') {
+                    tokenLength = 0;
+                    tokenIsKey = YES;
+                    state = IQJSONStateString;
+                    p++;
+                } else if(c == '}' && state == IQJSONStateFirstKey) {
+                    [self _closeContainer:c at:position];
+                    p++;
+                } else {
+                    [self _failWithMessage:@"Expected a member name" at:position];
+                }
+                break;
+            case IQJSONStateColon:
+                if(IQJSONIsWhitespace(c)) {
+                    p++;
+                } else if(c == ':') {
+                    state = IQJSONStateValue;
+                    p++;
+                } else {
+                    [self _failWithMessage:@"Expected a colon" at:position];
+                }
+                break;
+            case IQJSONStateAfterValue:
+                if(IQJSONIsWhitespace(c)) {
+                    p++;
+                } else if(c == ',') {
+                    state = [[containers lastObject] isKindOfClass:[NSMutableDictionary class]] ? IQJSONStateKey : IQJSONStateValue;
+                    p++;
+                } else if(c == ']' || c == '}') {
+                    [self _closeContainer:c at:position];
+                    p++;
+                } else {
+                    [self _failWithMessage:@"Expected a comma or the end of an array or object" at:position];
+                }
+                break;
+            case IQJSONStateString: {
+                // Copy everything up to the next quote, escape or control character at once
+                const uint8_t* run = p;
+                while(p < end && *p != '"' && *p != '\\' && *p >= 0x20) p++;
+                if(p > run) {
+                    [self _flushSurrogate];
+                    [self _appendToken:run length:p - run];
+                }
+                if(p == end) break;
+                c = *p;
+                position = offset + (p - start);
+                if(c == '"') {
+                    if(![self _endString]) {
+                        [self _failWithMessage:@"Invalid UTF-8 in string" at:position];
+                    }
+                } else if(c == '\\') {
+                    state = IQJSONStateEscape;
+                } else {
+                    [self _failWithMessage:@"Control character in string" at:position];
+                }
+                p++;
+                break;
+            }
+            case IQJSONStateEscape: {
+                uint8_t unescaped = 0;
+                switch(c) {
+                    case '"': case '\\': case '/': unescaped = c; break;
+                    case 'b': unescaped = '\b'; break;
+                    case 'f': unescaped = '\f'; break;
+                    case 'n': unescaped = '\n'; break;
+                    case 'r': unescaped = '\r'; break;
+                    case 't': unescaped = '\t'; break;
+                }
+                if(c == 'u') {
+                    escapeValue = 0;
+                    escapeDigits = 0;
+                    state = IQJSONStateUnicode;
+                } else if(unescaped) {
+                    [self _flushSurrogate];
+                    [self _appendToken:&unescaped length:1];
+                    state = IQJSONStateString;
+                } else {
+                    [self _failWithMessage:@"Invalid escape in string" at:position];
+                }
+                p++;
+                break;
+            }
+            case IQJSONStateUnicode: {
+                int digit = IQJSONHexValue(c);
+                if(digit < 0) {
+                    [self _failWithMessage:@"Invalid \\u escape in string" at:position];
+                    break;
+                }
+                escapeValue = (escapeValue << 4) | digit;
+                if(++escapeDigits == 4) {
+                    [self _escapedCodePoint:escapeValue];
+                    state = IQJSONStateString;
+                }
+                p++;
+                break;
+            }
+            case IQJSONStateNumber: {
+                const uint8_t* run = p;
+                while(p < end && IQJSONIsNumberCharacter(*p)) p++;
+                [self _appendToken:run length:p - run];
+                // The character after the number is handled in the state the number leaves
+                if(p < end && ![self _endNumber]) {
+                    [self _failWithMessage:@"Invalid number" at:offset + (run - start)];
+                }
+                break;
+            }
+            case IQJSONStateLiteral:
+                if(c != (uint8_t)literal[literalLength]) {
+                    [self _failWithMessage:@"Invalid literal" at:position];
+                    break;
+                }
+                p++;
+                if(literal[++literalLength] == 0) {
+                    if(literal[0] == 'n') {
+                        [self _addValue:[NSNull null]];
+                    } else {
+                        [self _addValue:[NSNumber numberWithBool:literal[0] == 't']];
+                    }
+                }
+                break;
+            case IQJSONStateDone:
+                if(!IQJSONIsWhitespace(c)) {
+                    [self _failWithMessage:@"Unexpected data after the value" at:position];
+                }
+                p++;
+                break;
+            case IQJSONStateError:
+                break;
+        }
+    }
+    offset += length;
+    return state != IQJSONStateError;
+}
+
+- (BOOL) finish
+{
+    if(state == IQJSONStateNumber && containers.count == 0 && ![self _endNumber]) {
+        [self _failWithMessage:@"Invalid number" at:offset];
+    }
+    if(state != IQJSONStateDone) {
+        if(state != IQJSONStateError) {
+            [self _failWithMessage:@"Unexpected end of JSON text" at:offset];
+        }
+        return NO;
+    }
+    return YES;
+}
+
+@end
@@ -19,14 +19,44 @@
 #import <Foundation/Foundation.h>
 #import "IQSerialization.h"
 
+/**
+ A MIME type, such as "text/html; charset=utf-8". Type, subtype and parameter names are lower case.
+ 
+ Instances of IQMIMEType are immutable. Parsed strings of common types are interned: parsing the
+ same string again returns the same shared instance without allocating anything.
+ */
 @interface IQMIMEType : NSObject <NSCopying, NSMutableCopying>
 + (id) MIMETypeWithMIMEType:(IQMIMEType*)other;
+/**
+ Parses a Content-Type style string in a single pass. Parameter values may be quoted strings.
+ Returns nil if the string is not a valid MIME type.
+ */
 + (id) MIMETypeWithRFCString:(NSString*)typeString;
 + (id) MIMETypeWithType:(NSString*)type subtype:(NSString*)subtype;
 + (id) MIMETypeWithType:(NSString*)type subtype:(NSString*)subtype parameters:(NSDictionary*)parameters;
 + (id) MIMETextTypeWithSubtype:(NSString*)subtype encoding:(NSStringEncoding)encoding;
 
 + (id) MIMETypeForSerializationFormat:(IQSerializationFormat)format;
+/**
+ Returns the MIME type commonly used for files with the given extension (such as "html" or "png"),
+ or nil if the extension is not known. The returned instances are shared and immutable.
+ */
++ (id) MIMETypeForPathExtension:(NSString*)extension;
+
+/**
+ The media ranges of an Accept header, most preferred first: by q value, then with specific types
+ before wildcards. Ranges with q=0 are left out, and the returned types have no parameters.
+ */
++ (NSArray*) MIMETypesWithAcceptHeader:(NSString*)accept;
+
+/**
+ The one of the given types (in order of preference of the caller) that the Accept header ranks
+ highest, or nil if the header rules all of them out. Each type gets the q value of the most
+ specific media range matching it. A missing Accept header accepts anything.
+ 
+ The header is parsed into a fixed buffer, so this is cheap enough to call for every request.
+ */
++ (IQMIMEType*) preferredMIMETypeAmong:(NSArray*)types forAcceptHeader:(NSString*)accept;
 
 - (id) initWithRFCString:(NSString*)typeString;
 - (id) initWithType:(NSString*)type subtype:(NSString*)subtype parameters:(NSDictionary*)parameters;
@@ -17,18 +17,243 @@
 //
 
 #import "IQMIMEType.h"
+#import <libkern/OSAtomic.h>
+
+// Strings up to this length are parsed without allocating a buffer
+#define kIQMIMEStackBufferLength 256
+// Parsed types are interned if they are at most this long...
+#define kIQMIMEInternMaxLength 64
+// ...until the table has this many entries
+#define kIQMIMEInternCapacity 256
+// The most media ranges of an Accept header that are considered
+#define kIQMIMEMaxMediaRanges 32
 
 @interface IQMIMEType () {
 @public
     NSString* type;
     NSString* subtype;
     NSDictionary* parameters;
+    NSStringEncoding encodingCache;
+    // Interned instances are shared between threads, so the flag is only set once the value is visible
+    volatile BOOL encodingCached;
 }
 
 - (BOOL) _parseString:(NSString*)string;
 - (void) _setParameters:(NSDictionary*)parameters;
 @end
 
+/**
+ Scans UTF-16 characters of a header in place. Tokens are lower cased and quoted strings are
+ unescaped in the buffer, so the scanner needs a writable copy of the string.
+ */
+typedef struct {
+    unichar* chars;
+    NSUInteger length, pos;
+} IQMIMEScanner;
+
+/**
+ A media range of an Accept header, as ranges of the scanned characters.
+ */
+typedef struct {
+    NSRange type, subtype;
+    // The q value times 1000
+    int quality;
+    // 0 for */*, 1 for type/*, 2 for type/subtype
+    int specificity;
+} IQMediaRange;
+
+static void IQMIMESkipSpace(IQMIMEScanner* s)
+{
+    while(s->pos < s->length) {
+        unichar c = s->chars[s->pos];
+        if(c != ' ' && c != '\t' && c != '\r' && c != '\n') break;
+        s->pos++;
+    }
+}
+
+static BOOL IQMIMEIsTokenChar(unichar c)
+{
+    if(c <= 32 || c >= 127) return NO;
+    switch(c) {
+        case '(': case ')': case '<': case '>': case '@': case ',': case ';': case ':': case '\\':
+        case '"': case '/': case '[': case ']': case '?': case '=': case '{': case '}':
+            return NO;
+        default:
+            return YES;
+    }
+}
+
+static NSRange IQMIMEScanToken(IQMIMEScanner* s)
+{
+    NSUInteger start = s->pos;
+    while(s->pos < s->length && IQMIMEIsTokenChar(s->chars[s->pos])) {
+        if(s->chars[s->pos] >= 'A' && s->chars[s->pos] <= 'Z') {
+            s->chars[s->pos] += 'a' - 'A';
+        }
+        s->pos++;
+    }
+    return NSMakeRange(start, s->pos - start);
+}
+
+/**
+ Scans a parameter value: a quoted string, or anything up to the next separator or white space
+ (to accept the unquoted values that are out there, such as charset=ISO-8859-1:1987).
+ */
+static BOOL IQMIMEScanValue(IQMIMEScanner* s, NSRange* value)
+{
+    unichar* chars = s->chars;
+    if(s->pos < s->length && chars[s->pos] == '"') {
+        NSUInteger start = ++s->pos, end = start;
+        while(s->pos < s->length && chars[s->pos] != '"') {
+            if(chars[s->pos] == '\\' && s->pos + 1 < s->length) {
+                s->pos++;
+            }
+            chars[end++] = chars[s->pos++];
+        }
+        if(s->pos >= s->length) {
+            return NO;
+        }
+        s->pos++;
+        *value = NSMakeRange(start, end - start);
+        return YES;
+    }
+    NSUInteger start = s->pos;
+    while(s->pos < s->length) {
+        unichar c = chars[s->pos];
+        if(c == ';' || c == ',' || c == ' ' || c == '\t') break;
+        s->pos++;
+    }
+    *value = NSMakeRange(start, s->pos - start);
+    return value->length > 0;
+}
+
+static NSString* IQMIMEString(const unichar* chars, NSRange range)
+{
+    return [[NSString alloc] initWithCharacters:chars + range.location length:range.length];
+}
+
+static int IQMIMEParseQuality(const unichar* c, NSUInteger length)
+{
+    if(length == 0 || (c[0] != '0' && c[0] != '1')) {
+        return 1000;
+    }
+    int quality = (c[0] - '0') * 1000;
+    if(length > 1 && c[1] == '.') {
+        int scale = 100;
+        for(NSUInteger i = 2; i < length && i < 5 && c[i] >= '0' && c[i] <= '9'; i++) {
+            quality += (c[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    return MIN(quality, 1000);
+}
+
+/**
+ Parses the media ranges of an Accept header, skipping invalid ones. Parameters other than q are
+ ignored.
+ */
+static NSUInteger IQMIMEParseAccept(unichar* chars, NSUInteger length, IQMediaRange* ranges, NSUInteger maxRanges)
+{
+    IQMIMEScanner s = {chars, length, 0};
+    NSUInteger count = 0;
+    while(s.pos < length && count < maxRanges) {
+        IQMediaRange range;
+        range.quality = 1000;
+        IQMIMESkipSpace(&s);
+        range.type = IQMIMEScanToken(&s);
+        BOOL valid = range.type.length > 0 && s.pos < length && chars[s.pos] == '/';
+        if(valid) {
+            s.pos++;
+            range.subtype = IQMIMEScanToken(&s);
+            valid = range.subtype.length > 0;
+        }
+        while(s.pos < length && chars[s.pos] != ',') {
+            if(chars[s.pos] != ';') {
+                s.pos++;
+                continue;
+            }
+            s.pos++;
+            IQMIMESkipSpace(&s);
+            NSRange name = IQMIMEScanToken(&s);
+            IQMIMESkipSpace(&s);
+            NSRange value;
+            if(s.pos < length && chars[s.pos] == '=') {
+                s.pos++;
+                IQMIMESkipSpace(&s);
+                if(IQMIMEScanValue(&s, &value) && name.length == 1 && chars[name.location] == 'q') {
+                    range.quality = IQMIMEParseQuality(chars + value.location, value.length);
+                }
+            }
+        }
+        s.pos++;
+        if(valid) {
+            if(range.type.length == 1 && chars[range.type.location] == '*') {
+                range.specificity = 0;
+            } else if(range.subtype.length == 1 && chars[range.subtype.location] == '*') {
+                range.specificity = 1;
+            } else {
+                range.specificity = 2;
+            }
+            ranges[count++] = range;
+        }
+    }
+    return count;
+}
+
+static BOOL IQMIMEEqualsString(const unichar* chars, NSRange range, NSString* string)
+{
+    if(range.length != string.length) return NO;
+    for(NSUInteger i = 0; i < range.length; i++) {
+        unichar c = [string characterAtIndex:i];
+        if(c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if(c != chars[range.location + i]) return NO;
+    }
+    return YES;
+}
+
+/**
+ The q value of the most specific media range that matches the type, or 0 if none does.
+ */
+static int IQMIMEQualityOfType(IQMIMEType* mime, const unichar* chars, const IQMediaRange* ranges, NSUInteger count)
+{
+    int specificity = -1, quality = 0;
+    for(NSUInteger i = 0; i < count; i++) {
+        const IQMediaRange* range = &ranges[i];
+        if(range->specificity <= specificity) continue;
+        if(range->specificity >= 1 && !IQMIMEEqualsString(chars, range->type, mime.type)) continue;
+        if(range->specificity == 2 && !IQMIMEEqualsString(chars, range->subtype, mime.subtype)) continue;
+        specificity = range->specificity;
+        quality = range->quality;
+    }
+    return quality;
+}
+
+static NSMutableDictionary* internedTypes = nil;
+static OSSpinLock internLock = OS_SPINLOCK_INIT;
+
+/**
+ Sets up the table of interned types with the most common ones.
+ */
+static void IQMIMEInitInternedTypes(void)
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        static NSString* const common[] = {
+            @"application/json", @"application/json; charset=utf-8", @"application/json; charset=UTF-8",
+            @"application/javascript", @"application/xml", @"application/octet-stream",
+            @"application/x-www-form-urlencoded", @"application/x-plist", @"text/html",
+            @"text/html; charset=utf-8", @"text/html; charset=UTF-8", @"text/plain",
+            @"text/plain; charset=utf-8", @"text/plain; charset=UTF-8", @"text/css", @"text/xml",
+            @"text/javascript", @"image/png", @"image/jpeg", @"image/gif", @"video/mp4", @"audio/mpeg"
+        };
+        NSMutableDictionary* table = [NSMutableDictionary dictionaryWithCapacity:kIQMIMEInternCapacity];
+        for(int i = 0; i < sizeof(common)/sizeof(common[0]); i++) {
+            [table setObject:[[IQMIMEType alloc] initWithRFCString:common[i]] forKey:common[i]];
+        }
+        internedTypes = table;
+    });
+}
+
 @implementation IQMIMEType
 @synthesize type, subtype;
 + (id) MIMETypeWithMIMEType:(IQMIMEType*)other
@@ -37,7 +262,25 @@
 }
 + (id) MIMETypeWithRFCString:(NSString*)typeString
 {
-    return [[IQMIMEType alloc] initWithRFCString:typeString];
+    if(!typeString) return nil;
+    IQMIMEInitInternedTypes();
+    OSSpinLockLock(&internLock);
+    IQMIMEType* mime = [internedTypes objectForKey:typeString];
+    OSSpinLockUnlock(&internLock);
+    if(mime) return mime;
+    mime = [[IQMIMEType alloc] initWithRFCString:typeString];
+    if(!mime) return nil;
+    // Types with parameters other than charset, such as multipart boundaries, are one-offs
+    NSUInteger count = mime->parameters.count;
+    if(typeString.length <= kIQMIMEInternMaxLength && (count == 0 || (count == 1 && [mime->parameters objectForKey:@"charset"]))) {
+        NSString* key = [typeString copy];
+        OSSpinLockLock(&internLock);
+        if(internedTypes.count < kIQMIMEInternCapacity) {
+            [internedTypes setObject:mime forKey:key];
+        }
+        OSSpinLockUnlock(&internLock);
+    }
+    return mime;
 }
 + (id) MIMETypeWithType:(NSString*)type subtype:(NSString*)subtype
 {
@@ -67,6 +310,88 @@
             return nil;
     }
 }
++ (id) MIMETypeForPathExtension:(NSString*)extension
+{
+    static NSDictionary* extensions = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        static const char* table[][3] = {
+            {"html", "text", "html"}, {"htm", "text", "html"}, {"css", "text", "css"},
+            {"txt", "text", "plain"}, {"csv", "text", "csv"}, {"xml", "application", "xml"},
+            {"js", "application", "javascript"}, {"json", "application", "json"},
+            {"png", "image", "png"}, {"jpg", "image", "jpeg"}, {"jpeg", "image", "jpeg"},
+            {"gif", "image", "gif"}, {"svg", "image", "svg+xml"}, {"ico", "image", "x-icon"},
+            {"webp", "image", "webp"}, {"pdf", "application", "pdf"}, {"zip", "application", "zip"},
+            {"gz", "application", "gzip"}, {"mp3", "audio", "mpeg"}, {"m4a", "audio", "mp4"},
+            {"aac", "audio", "aac"}, {"wav", "audio", "wav"}, {"mp4", "video", "mp4"},
+            {"m4v", "video", "x-m4v"}, {"mov", "video", "quicktime"}, {"webm", "video", "webm"},
+            {"m3u8", "application", "vnd.apple.mpegurl"}, {"ts", "video", "mp2t"},
+            {"woff", "application", "font-woff"}, {"ttf", "application", "x-font-ttf"},
+            {"plist", "application", "x-plist"}, {"yaml", "application", "x-yaml"}
+        };
+        NSMutableDictionary* d = [NSMutableDictionary dictionaryWithCapacity:sizeof(table)/sizeof(table[0])];
+        for(int i = 0; i < sizeof(table)/sizeof(table[0]); i++) {
+            d[@(table[i][0])] = [IQMIMEType MIMETypeWithType:@(table[i][1]) subtype:@(table[i][2])];
+        }
+        extensions = d;
+    });
+    if(!extension.length) return nil;
+    IQMIMEType* mime = extensions[extension];
+    if(!mime) mime = extensions[[extension lowercaseString]];
+    return mime;
+}
++ (NSArray*) MIMETypesWithAcceptHeader:(NSString*)accept
+{
+    NSUInteger length = accept.length;
+    unichar stackBuffer[kIQMIMEStackBufferLength];
+    unichar* chars = length <= kIQMIMEStackBufferLength ? stackBuffer : malloc(length * sizeof(unichar));
+    [accept getCharacters:chars range:NSMakeRange(0, length)];
+    IQMediaRange ranges[kIQMIMEMaxMediaRanges];
+    NSUInteger count = IQMIMEParseAccept(chars, length, ranges, kIQMIMEMaxMediaRanges);
+    // Stable insertion sort, the header order breaks ties
+    for(NSUInteger i = 1; i < count; i++) {
+        IQMediaRange range = ranges[i];
+        NSUInteger j = i;
+        while(j > 0 && (ranges[j-1].quality < range.quality || (ranges[j-1].quality == range.quality && ranges[j-1].specificity < range.specificity))) {
+            ranges[j] = ranges[j-1];
+            j--;
+        }
+        ranges[j] = range;
+    }
+    NSMutableArray* types = [NSMutableArray arrayWithCapacity:count];
+    for(NSUInteger i = 0; i < count && ranges[i].quality > 0; i++) {
+        [types addObject:[IQMIMEType MIMETypeWithType:IQMIMEString(chars, ranges[i].type) subtype:IQMIMEString(chars, ranges[i].subtype)]];
+    }
+    if(chars != stackBuffer) free(chars);
+    return types;
+}
++ (IQMIMEType*) preferredMIMETypeAmong:(NSArray*)types forAcceptHeader:(NSString*)accept
+{
+    if(types.count == 0) return nil;
+    NSUInteger length = accept.length;
+    if(length == 0) return [types objectAtIndex:0];
+    unichar stackBuffer[kIQMIMEStackBufferLength];
+    unichar* chars = length <= kIQMIMEStackBufferLength ? stackBuffer : malloc(length * sizeof(unichar));
+    [accept getCharacters:chars range:NSMakeRange(0, length)];
+    IQMediaRange ranges[kIQMIMEMaxMediaRanges];
+    NSUInteger count = IQMIMEParseAccept(chars, length, ranges, kIQMIMEMaxMediaRanges);
+    IQMIMEType* best = nil;
+    if(count == 0) {
+        // Nothing usable in the header
+        best = [types objectAtIndex:0];
+    } else {
+        int bestQuality = 0;
+        for(IQMIMEType* mime in types) {
+            int quality = IQMIMEQualityOfType(mime, chars, ranges, count);
+            if(quality > bestQuality) {
+                best = mime;
+                bestQuality = quality;
+            }
+        }
+    }
+    if(chars != stackBuffer) free(chars);
+    return best;
+}
 - (id) initWithRFCString:(NSString*)typeString
 {
     self = [super init];
@@ -91,31 +416,45 @@
 
 - (BOOL) _parseString:(NSString*)string
 {
-    int i = 0;
-    string = [string stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
-    if(!string.length) return NO;
-    NSString* tt, *st;
+    NSUInteger length = string.length;
+    unichar stackBuffer[kIQMIMEStackBufferLength];
+    unichar* chars = length <= kIQMIMEStackBufferLength ? stackBuffer : malloc(length * sizeof(unichar));
+    [string getCharacters:chars range:NSMakeRange(0, length)];
+    BOOL valid = [self _parseCharacters:chars length:length];
+    if(chars != stackBuffer) free(chars);
+    return valid;
+}
+
+- (BOOL) _parseCharacters:(unichar*)chars length:(NSUInteger)length
+{
+    IQMIMEScanner s = {chars, length, 0};
+    IQMIMESkipSpace(&s);
+    NSRange t = IQMIMEScanToken(&s);
+    if(!t.length || s.pos >= length || chars[s.pos] != '/') return NO;
+    s.pos++;
+    NSRange st = IQMIMEScanToken(&s);
+    if(!st.length) return NO;
     NSMutableDictionary* params = nil;
-    for(NSString* chunk in [string componentsSeparatedByString:@";"]) {
-        if(i == 0) {
-            NSArray* t = [chunk componentsSeparatedByString:@"/"];
-            if(t.count != 2) return NO;
-            tt = [[[t objectAtIndex:0] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]] lowercaseString];
-            st = [[[t objectAtIndex:1] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]] lowercaseString];
-            if(!tt.length || !st.length) return NO;
-        } else {
-            NSArray* t = [chunk componentsSeparatedByString:@"="];
-            if(t.count != 2) return NO;
-            if(!params) params = [NSMutableDictionary dictionary];
-            NSString* pk = [[[t objectAtIndex:0] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]] lowercaseString];
-            NSString* pv = [[t objectAtIndex:1] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
-            if(!pk.length || !pv.length) return NO;
-            [params setValue:pv forKey:pk];
-        }
-        i++;
+    IQMIMESkipSpace(&s);
+    while(s.pos < length) {
+        if(chars[s.pos] != ';') return NO;
+        s.pos++;
+        IQMIMESkipSpace(&s);
+        // Empty parameters, such as a trailing semicolon, are ignored
+        if(s.pos == length || chars[s.pos] == ';') continue;
+        NSRange name = IQMIMEScanToken(&s);
+        IQMIMESkipSpace(&s);
+        if(!name.length || s.pos >= length || chars[s.pos] != '=') return NO;
+        s.pos++;
+        IQMIMESkipSpace(&s);
+        NSRange value;
+        if(!IQMIMEScanValue(&s, &value)) return NO;
+        if(!params) params = [NSMutableDictionary dictionaryWithCapacity:1];
+        [params setObject:IQMIMEString(chars, value) forKey:IQMIMEString(chars, name)];
+        IQMIMESkipSpace(&s);
     }
-    type = tt;
-    subtype = st;
+    type = IQMIMEString(chars, t);
+    subtype = IQMIMEString(chars, st);
     [self _setParameters:params];
     return YES;
 }
@@ -123,6 +462,7 @@
 - (void) _setParameters:(NSDictionary *)p
 {
     parameters = [p copy];
+    encodingCached = NO;
 }
 
 - (NSString*) valueForParameter:(NSString*)parameter
@@ -132,11 +472,35 @@
 
 - (NSStringEncoding) encoding
 {
+    if(encodingCached) {
+        // Read the value after the flag
+        OSMemoryBarrier();
+        return encodingCache;
+    }
+    NSStringEncoding encoding = 0;
     NSString* charset = [self valueForParameter:@"charset"];
     if(charset && charset.length) {
-        return CFStringConvertEncodingToNSStringEncoding(CFStringConvertIANACharSetNameToEncoding((__bridge CFStringRef)charset));
+        encoding = CFStringConvertEncodingToNSStringEncoding(CFStringConvertIANACharSetNameToEncoding((__bridge CFStringRef)charset));
     }
-    return 0;
+    encodingCache = encoding;
+    OSMemoryBarrier();
+    encodingCached = YES;
+    return encoding;
+}
+
+/**
+ The value as a token, or as a quoted string if it is not one.
+ */
+static NSString* IQMIMEQuotedValue(NSString* value)
+{
+    NSUInteger length = value.length;
+    BOOL token = length > 0;
+    for(NSUInteger i = 0; i < length && token; i++) {
+        token = IQMIMEIsTokenChar([value characterAtIndex:i]);
+    }
+    if(token) return value;
+    NSString* escaped = [[value stringByReplacingOccurrencesOfString:@"\\" withString:@"\\\\"] stringByReplacingOccurrencesOfString:@"\"" withString:@"\\\""];
+    return [NSString stringWithFormat:@"\"%@\"", escaped];
 }
 
 - (NSString*) RFCString
@@ -148,7 +512,7 @@
         [c appendString:@"; "];
         [c appendString:param];
         [c appendString:@"="];
-        [c appendString:parameters[param]];
+        [c appendString:IQMIMEQuotedValue(parameters[param])];
     }
     return [tv stringByAppendingString:c];
 }
@@ -165,6 +529,10 @@
 
 - (id) copyWithZone:(NSZone *)zone
 {
+    if([self class] == [IQMIMEType class]) {
+        // Immutable
+        return self;
+    }
     IQMIMEType* mime = [IQMIMEType allocWithZone:zone];
     mime->type = type;
     mime->subtype = subtype;
@@ -251,12 +619,14 @@
 - (void) removeParameter:(NSString*)parameter
 {
     [(NSMutableDictionary*)self->parameters removeObjectForKey:parameter];
+    encodingCached = NO;
 }
 
 - (void) setValue:(NSString *)value forParameter:(NSString *)parameter
 {
     if(!parameters) parameters = [NSMutableDictionary dictionary];
     [(NSMutableDictionary*)self->parameters setObject:value forKey:parameter];
+    encodingCached = NO;
 }
 
 - (void) setEncoding:(NSStringEncoding)encoding
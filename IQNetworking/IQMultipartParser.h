@@ -0,0 +1,80 @@
+//
+//  IQMultipartParser.h
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+#define kIQMultipartDefaultMaxHeaderSize 16384
+
+/**
+ Receives the content of a part as it is parsed, and nil once the part is complete. The data
+ refers to the buffer passed to the parser and is only valid during the call; copy it to keep it.
+ */
+typedef void (^IQMultipartPartReader)(NSData* data);
+
+/**
+ Called when the header of a part has been parsed, with the header field names in lower case.
+ Returns the reader for the content of the part, or nil to skip it.
+ */
+typedef IQMultipartPartReader (^IQMultipartPartHandler)(NSDictionary* headers);
+
+/**
+ Incremental parser for multipart bodies (RFC 2046), such as multipart/form-data uploads.
+
+ The body is fed to the parser in pieces of any size as it arrives. The content of every part is
+ passed on to its reader without being buffered, so parsing takes the same amount of memory
+ whatever the size of the body. Only the header of one part at a time is kept.
+ */
+@interface IQMultipartParser : NSObject
+
+/**
+ The boundary parameter of a multipart Content-Type header value, or nil if the value is not a
+ multipart type with a valid boundary.
+ */
++ (NSString*) boundaryForContentType:(NSString*)contentType;
+
+/**
+ Returns the parameters of a header field value such as Content-Disposition, for example
+ "name" and "filename" of a form-data part. Parameter names are in lower case.
+ */
++ (NSDictionary*) parametersOfHeaderValue:(NSString*)value;
+
+- (id) initWithBoundary:(NSString*)boundary partHandler:(IQMultipartPartHandler)partHandler;
+
+/**
+ Parses the next piece of the body. Returns NO if the body is malformed, after which the
+ parser ignores any further input.
+ */
+- (BOOL) appendBytes:(const void*)bytes length:(NSUInteger)length;
+- (BOOL) appendData:(NSData*)data;
+
+/**
+ The maximum size of the header of a part. The default is kIQMultipartDefaultMaxHeaderSize.
+ */
+@property (nonatomic) NSUInteger maxHeaderSize;
+
+/**
+ YES once the closing boundary has been parsed. Anything after it is ignored.
+ */
+@property (nonatomic, readonly) BOOL isComplete;
+
+/**
+ The number of parts whose header has been parsed.
+ */
+@property (nonatomic, readonly) NSUInteger partCount;
+
+@end
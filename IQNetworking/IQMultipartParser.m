@@ -0,0 +1,339 @@
+//
+//  IQMultipartParser.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "IQMultipartParser.h"
+#import "IQMIMEType.h"
+
+typedef enum {
+    IQMultipartStatePreamble,
+    IQMultipartStateAfterBoundary,
+    IQMultipartStateAfterBoundaryDash,
+    IQMultipartStateAfterBoundaryCR,
+    IQMultipartStateHeader,
+    IQMultipartStateContent,
+    IQMultipartStateEpilogue,
+    IQMultipartStateError
+} IQMultipartState;
+
+@interface IQMultipartParser () {
+    IQMultipartPartHandler partHandler;
+    IQMultipartPartReader currentReader;
+    IQMultipartState state;
+    // The delimiter is CRLF, "--" and the boundary. failure[i] is the length of the longest proper
+    // prefix of the first i bytes of the delimiter that is also a suffix of them, so that a partial
+    // match can be resumed without going back in the input (Knuth-Morris-Pratt).
+    uint8_t* delimiter;
+    NSUInteger* failure;
+    NSUInteger delimiterLength;
+    // The number of delimiter bytes matched so far, and how many of those were in earlier input.
+    // Held bytes are always the first bytes of the delimiter, so they never need to be buffered.
+    NSUInteger matched, held;
+    NSMutableData* headerBuffer;
+}
+@end
+
+@implementation IQMultipartParser
+@synthesize maxHeaderSize, isComplete, partCount;
+
++ (NSString*) boundaryForContentType:(NSString*)contentType
+{
+    if(!contentType) {
+        return nil;
+    }
+    IQMIMEType* type = [IQMIMEType MIMETypeWithRFCString:contentType];
+    if(![type.type isEqualToString:@"multipart"]) {
+        return nil;
+    }
+    NSString* boundary = [type valueForParameter:@"boundary"];
+    if(boundary.length == 0 || boundary.length > 70) {
+        return nil;
+    }
+    return boundary;
+}
+
++ (NSDictionary*) parametersOfHeaderValue:(NSString*)value
+{
+    NSMutableDictionary* parameters = [NSMutableDictionary dictionary];
+    NSScanner* scanner = [NSScanner scannerWithString:value ? value : @""];
+    scanner.charactersToBeSkipped = [NSCharacterSet whitespaceCharacterSet];
+    NSCharacterSet* separators = [NSCharacterSet characterSetWithCharactersInString:@";"];
+    NSCharacterSet* nameEnd = [NSCharacterSet characterSetWithCharactersInString:@"=;"];
+    // Skip the value itself, such as "form-data"
+    [scanner scanUpToCharactersFromSet:separators intoString:NULL];
+    while([scanner scanString:@";" intoString:NULL]) {
+        NSString* name = nil;
+        if(![scanner scanUpToCharactersFromSet:nameEnd intoString:&name]) {
+            continue;
+        }
+        name = [[name stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] lowercaseString];
+        NSMutableString* parameter = [NSMutableString string];
+        if([scanner scanString:@"=" intoString:NULL]) {
+            if([scanner scanString:@"\"" intoString:NULL]) {
+                // Quoted string, with backslash escapes
+                NSString* part = nil;
+                NSCharacterSet* quoteEnd = [NSCharacterSet characterSetWithCharactersInString:@"\"\\"];
+                NSCharacterSet* skipped = scanner.charactersToBeSkipped;
+                scanner.charactersToBeSkipped = nil;
+                while(!scanner.isAtEnd) {
+                    if([scanner scanUpToCharactersFromSet:quoteEnd intoString:&part]) {
+                        [parameter appendString:part];
+                    }
+                    if([scanner scanString:@"\\" intoString:NULL]) {
+                        if(!scanner.isAtEnd) {
+                            [parameter appendString:[value substringWithRange:NSMakeRange(scanner.scanLocation, 1)]];
+                            scanner.scanLocation++;
+                        }
+                    } else {
+                        [scanner scanString:@"\"" intoString:NULL];
+                        break;
+                    }
+                }
+                scanner.charactersToBeSkipped = skipped;
+                [scanner scanUpToCharactersFromSet:separators intoString:NULL];
+            } else {
+                NSString* token = nil;
+                if([scanner scanUpToCharactersFromSet:separators intoString:&token]) {
+                    [parameter appendString:[token stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]]];
+                }
+            }
+        }
+        if(name.length > 0) {
+            [parameters setObject:parameter forKey:name];
+        }
+    }
+    return parameters;
+}
+
+- (id) initWithBoundary:(NSString*)boundary partHandler:(IQMultipartPartHandler)handler
+{
+    self = [super init];
+    if(self) {
+        NSData* boundaryData = [boundary dataUsingEncoding:NSUTF8StringEncoding];
+        if(boundaryData.length == 0) {
+            return nil;
+        }
+        partHandler = handler;
+        maxHeaderSize = kIQMultipartDefaultMaxHeaderSize;
+        delimiterLength = 4 + boundaryData.length;
+        delimiter = malloc(delimiterLength);
+        memcpy(delimiter, "\r\n--", 4);
+        memcpy(delimiter + 4, boundaryData.bytes, boundaryData.length);
+        failure = calloc(delimiterLength + 1, sizeof(NSUInteger));
+        NSUInteger k = 0;
+        for(NSUInteger i = 1; i < delimiterLength; i++) {
+            while(k > 0 && delimiter[i] != delimiter[k]) {
+                k = failure[k];
+            }
+            if(delimiter[i] == delimiter[k]) {
+                k++;
+            }
+            failure[i + 1] = k;
+        }
+        headerBuffer = [NSMutableData dataWithCapacity:256];
+        // The first boundary may start the body, without a line break before it; start as if there was one
+        state = IQMultipartStatePreamble;
+        matched = held = 2;
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    free(delimiter);
+    free(failure);
+}
+
+- (BOOL) _fail
+{
+    state = IQMultipartStateError;
+    currentReader = nil;
+    headerBuffer = nil;
+    return NO;
+}
+
+- (void) _emit:(const uint8_t*)bytes length:(NSUInteger)length
+{
+    if(length > 0 && currentReader) {
+        currentReader([NSData dataWithBytesNoCopy:(void*)bytes length:length freeWhenDone:NO]);
+    }
+}
+
+/**
+ Passes on content up to the next delimiter, and returns where scanning stopped. Bytes at the end
+ of the input that may be the start of a delimiter are held back until the next input decides.
+ */
+- (const uint8_t*) _scanContent:(const uint8_t*)p end:(const uint8_t*)end
+{
+    const uint8_t* run = p;
+    while(p < end) {
+        if(matched == 0) {
+            // A delimiter starts with CR
+            const uint8_t* cr = memchr(p, '\r', end - p);
+            if(!cr) {
+                p = end;
+                break;
+            }
+            p = cr;
+        }
+        uint8_t c = *p;
+        while(matched > 0 && delimiter[matched] != c) {
+            NSUInteger fallback = failure[matched];
+            if(held > 0) {
+                // Held bytes that turn out to be content come before anything in this input
+                NSUInteger n = MIN(held, matched - fallback);
+                [self _emit:delimiter length:n];
+                held -= n;
+            }
+            matched = fallback;
+        }
+        if(delimiter[matched] == c) {
+            matched++;
+        }
+        p++;
+        if(matched == delimiterLength) {
+            [self _emit:run length:(p - (delimiterLength - held)) - run];
+            matched = held = 0;
+            if(currentReader) {
+                IQMultipartPartReader reader = currentReader;
+                currentReader = nil;
+                reader(nil);
+            }
+            state = IQMultipartStateAfterBoundary;
+            return p;
+        }
+    }
+    [self _emit:run length:(end - run) - (matched - held)];
+    held = matched;
+    return end;
+}
+
+static NSString* IQMultipartString(const uint8_t* bytes, NSUInteger length)
+{
+    NSString* string = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+    if(!string) {
+        string = [[NSString alloc] initWithBytes:bytes length:length encoding:NSISOLatin1StringEncoding];
+    }
+    return string;
+}
+
+- (NSDictionary*) _parseHeader:(const uint8_t*)bytes length:(NSUInteger)length
+{
+    NSMutableDictionary* headers = [NSMutableDictionary dictionaryWithCapacity:4];
+    NSString* lastName = nil;
+    const uint8_t* p = bytes, *end = bytes + length;
+    while(p < end) {
+        const uint8_t* eol = p;
+        while(eol + 1 < end && !(eol[0] == '\r' && eol[1] == '\n')) eol++;
+        if(eol + 1 >= end) eol = end;
+        if((*p == ' ' || *p == '\t') && lastName) {
+            // Folded continuation of the previous field
+            NSString* more = [IQMultipartString(p, eol - p) stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+            [headers setObject:[NSString stringWithFormat:@"%@ %@", [headers objectForKey:lastName], more] forKey:lastName];
+        } else {
+            const uint8_t* colon = memchr(p, ':', eol - p);
+            if(!colon || colon == p) {
+                return nil;
+            }
+            lastName = [IQMultipartString(p, colon - p) lowercaseString];
+            NSString* value = [IQMultipartString(colon + 1, eol - colon - 1) stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+            NSString* previous = [headers objectForKey:lastName];
+            [headers setObject:previous ? [NSString stringWithFormat:@"%@, %@", previous, value] : value forKey:lastName];
+        }
+        p = eol + 2;
+    }
+    return headers;
+}
+
+- (BOOL) appendBytes:(const void*)bytes length:(NSUInteger)length
+{
+    const uint8_t* p = bytes;
+    const uint8_t* end = p + length;
+    while(p < end) {
+        switch(state) {
+            case IQMultipartStatePreamble:
+            case IQMultipartStateContent:
+                p = [self _scanContent:p end:end];
+                break;
+            case IQMultipartStateAfterBoundary:
+                if(*p == '-') {
+                    state = IQMultipartStateAfterBoundaryDash;
+                } else if(*p == '\r') {
+                    state = IQMultipartStateAfterBoundaryCR;
+                } else if(*p != ' ' && *p != '\t') {
+                    // Only linear white space may follow a boundary
+                    return [self _fail];
+                }
+                p++;
+                break;
+            case IQMultipartStateAfterBoundaryDash:
+                if(*p++ != '-') {
+                    return [self _fail];
+                }
+                isComplete = YES;
+                state = IQMultipartStateEpilogue;
+                break;
+            case IQMultipartStateAfterBoundaryCR:
+                if(*p++ != '\n') {
+                    return [self _fail];
+                }
+                // The line break ends the header if it is empty, so keep it in front of the header
+                [headerBuffer setLength:0];
+                [headerBuffer appendBytes:"\r\n" length:2];
+                state = IQMultipartStateHeader;
+                break;
+            case IQMultipartStateHeader: {
+                NSUInteger previous = headerBuffer.length;
+                NSUInteger n = MIN((NSUInteger)(end - p), maxHeaderSize + 4 - previous);
+                [headerBuffer appendBytes:p length:n];
+                const uint8_t* buffer = headerBuffer.bytes;
+                NSUInteger length = headerBuffer.length;
+                NSUInteger i = previous >= 3 ? previous - 3 : 0;
+                while(i + 3 < length && memcmp(buffer + i, "\r\n\r\n", 4) != 0) i++;
+                if(i + 3 >= length) {
+                    if(length >= maxHeaderSize + 4) {
+                        return [self _fail];
+                    }
+                    p += n;
+                    break;
+                }
+                p += i + 4 - previous;
+                NSDictionary* headers = i > 2 ? [self _parseHeader:buffer + 2 length:i - 2] : [NSDictionary dictionary];
+                if(!headers) {
+                    return [self _fail];
+                }
+                partCount++;
+                state = IQMultipartStateContent;
+                currentReader = partHandler ? partHandler(headers) : nil;
+                break;
+            }
+            case IQMultipartStateEpilogue:
+                p = end;
+                break;
+            case IQMultipartStateError:
+                return NO;
+        }
+    }
+    return state != IQMultipartStateError;
+}
+
+- (BOOL) appendData:(NSData*)data
+{
+    return [self appendBytes:data.bytes length:data.length];
+}
+
+@end
@@ -30,11 +30,14 @@
 typedef NSString* (^IQCacheFileNaming)(NSURL* url);
 typedef void (^IQSynchronizedFileOpener)(NSFileHandle* handle);
 typedef void (^IQSynchronizedFileNameCallback)(NSString* path);
+typedef void (^IQSynchronizationSummaryHandler)(NSUInteger unchanged, NSUInteger updated, NSUInteger failed);
 
 /**
  Manages a set of files synchronized against a server.
  
- Note: The implementation is currently not optimized for a huge set of files.
+ Files are looked up by URL, and changes to the sync state are appended to a journal in batches
+ rather than rewriting the whole state, so adding and refreshing files costs the same in a
+ folder of any size. The state is loaded when the folder is first used.
  */
 @interface IQNetworkSynchronizedFolder : NSObject
 
@@ -60,6 +63,28 @@ typedef void (^IQSynchronizedFileNameCallback)(NSString* path);
  */
 @property (nonatomic, assign) NSTimeInterval cacheCheckTimeout;
 
+/**
+ The maximum total size in bytes of the cached files. When the folder grows beyond it, the least
+ recently used files are removed in the background (until the folder is 10% below the limit).
+ Their entries remain, and are downloaded again when next synchronized. Pinned files are never
+ removed.
+ 
+ Default is 0, which means no limit.
+ */
+@property (nonatomic) unsigned long long maxSize;
+
+/**
+ The maximum number of cached files, enforced like maxSize.
+ 
+ Default is 0, which means no limit.
+ */
+@property (nonatomic) NSUInteger maxFileCount;
+
+/**
+ The total size in bytes of the cached files.
+ */
+@property (nonatomic, readonly) unsigned long long size;
+
 /**
  Allows the application to override how cached files are named.
  By default, a generated unique file name based on the original file name will be used.
@@ -67,19 +92,30 @@ typedef void (^IQSynchronizedFileNameCallback)(NSString* path);
 @property (nonatomic, copy) IQCacheFileNaming cacheFileNaming;
 
 /**
- Refreshes all cached items in this synchronized folder.
+ Refreshes all cached items in this synchronized folder, four at a time.
  If alwaysDownload is NO, checks with the server if the file has changed and only downloads files that have changed.
  If alwaysDownload is YES, redownloads all files regardless of if the changed status.
  */
 - (void) refresh:(BOOL)alwaysDownload;
 
+/**
+ Refreshes all cached items like refresh:, checking at most maxConcurrent files at a time, the
+ ones checked longest ago first. A file is only downloaded if the server reports it changed
+ since the cached version (using both its ETag and its Last-Modified date).
+ 
+ The completion handler is called once, when all files have been checked, with the number of
+ files that were unchanged, updated and failed.
+ */
+- (void) refresh:(BOOL)alwaysDownload maxConcurrent:(NSUInteger)maxConcurrent completion:(IQSynchronizationSummaryHandler)completion;
+
 /**
  Adds a cache item.
  */
 - (IQNetworkSynchronizedFile*) addFileWithURL:(NSURL*)url;
 
 /**
- Blocks execution until all pending synchronization is complete.
+ Blocks execution until all pending synchronization is complete, and the sync state has been
+ saved.
  
  Avoid using this in a production application (see the doneHandler property instead).
  Blocking a thread wastes resources. This method is primarily intended to support unit testing.
@@ -130,7 +166,22 @@ typedef enum {
 
 @property (nonatomic, readonly) NSString* path;
 @property (nonatomic, readonly) NSURL* url;
+/**
+ When the file was last checked with the server, kept across launches.
+ */
 @property (nonatomic, readonly) NSDate* lastChecked;
+/**
+ When the cached file was last used (synchronized or opened).
+ */
+@property (nonatomic, readonly) NSDate* lastAccessed;
+/**
+ The size in bytes of the cached file, or 0 if it is not cached.
+ */
+@property (nonatomic, readonly) long long size;
+/**
+ A pinned file is never removed to keep the folder within its limits. Default is NO.
+ */
+@property (nonatomic) BOOL pinned;
 
 /**
  Blocks execution until all pending synchronization is complete.
@@ -144,6 +195,7 @@ typedef enum {
  Refreshes this cached item.
  If alwaysDownload is NO, checks with the server if the file has changed and only downloads files that have changed.
  If alwaysDownload is YES, redownloads all files regardless of if the changed status.
+ If the file is already being refreshed, a refresh with alwaysDownload NO completes with it.
  
  Both completionHandler and errorHandler can be nil if the result of the refresh operation is not important.
  */
@@ -18,25 +18,126 @@
 
 #import "IQNetworkSynchronizedFolder.h"
 #import "IQTransferManager.h"
+#import <fcntl.h>
 
 static IQTransferManager* globalTransferManager = nil;
 
+// Changed entries are appended to the journal at most this often
+#define kIQSyncStateSaveDelay 0.5
+// The journal is merged into the state file when it has this many records, or as many as there are files if more
+#define kIQSyncStateMinCompaction 256
+// The number of files refresh: checks at a time
+#define kIQSyncDefaultConcurrency 4
+// Accesses closer together than this are not saved (the last one is still used for eviction)
+#define kIQSyncAccessResolution 60.0
+// Eviction removes files until the folder is this much below its limits, so it does not run again right away
+#define kIQSyncEvictionTarget 0.9
+
+typedef void (^IQSyncRefreshHandler)(BOOL updated, NSError* error);
+
 @interface IQNetworkSynchronizedFolder () {
-    NSMutableArray* files;
+    // URL string -> IQNetworkSynchronizedFile, loaded when first needed; guarded by self
+    NSMutableDictionary* files;
+    // Entries changed since the journal was last written
+    NSMutableSet* changedFiles;
+    NSUInteger journalRecords;
+    // Incremented every time the state file is written. Journal records of older generations are
+    // already in the state file.
+    uint32_t stateGeneration;
+    dispatch_queue_t stateQueue;
+    // The number of files being synchronized, and the threads waiting for it to reach zero
+    NSUInteger busyFiles;
+    NSMutableSet* waitingThreads;
+    // The total size and number of files with cached data
+    unsigned long long cachedSize;
+    NSUInteger cachedFiles;
+    BOOL evictionScheduled;
 @public
     IQTransferManager* transferManager;
 }
 - (NSString*) _pathForItem:(NSString*)name;
+- (void) _fileChanged:(IQNetworkSynchronizedFile*)file;
+- (void) _fileBusy:(BOOL)busy;
+- (void) _cachedSizeChangedFrom:(long long)oldSize to:(long long)newSize;
 @end
 
-@interface IQNetworkSynchronizedFile() {
-    int refreshCount;
-}
+@interface IQNetworkSynchronizedFile()
 + (IQNetworkSynchronizedFile*)_fileWithURL:(NSURL*)url localName:(NSString*)name inFolder:(IQNetworkSynchronizedFolder*)folder;
 + (IQNetworkSynchronizedFile*)_fileWithDictionary:(NSDictionary*)dictionary inFolder:(IQNetworkSynchronizedFolder*)folder;
 - (NSDictionary*) _dictionary;
+- (void) _refresh:(BOOL)alwaysDownload handler:(IQSyncRefreshHandler)handler;
+- (void) _refreshEnded:(IQTransferItem*)item updated:(BOOL)updated error:(NSError*)error;
+- (void) _accessed;
+- (void) _evict;
+@end
+
+/**
+ A refresh of all files in a folder, checking a limited number of them at a time.
+ */
+@interface _IQFolderRevalidation : NSObject {
+@public
+    NSArray* files;
+    NSUInteger next, running, maxConcurrent;
+    NSUInteger unchanged, updated, failed;
+    BOOL alwaysDownload;
+    IQSynchronizationSummaryHandler completion;
+}
+- (void) start;
+@end
+
+@implementation _IQFolderRevalidation
+
+/**
+ Starts checking files until maxConcurrent are running. Each one that ends starts the next.
+ */
+- (void) start
+{
+    NSMutableArray* starting = nil;
+    IQSynchronizationSummaryHandler finished = nil;
+    @synchronized(self) {
+        while(running < MAX(maxConcurrent, 1) && next < files.count) {
+            if(!starting) {
+                starting = [NSMutableArray arrayWithCapacity:maxConcurrent];
+            }
+            [starting addObject:files[next++]];
+            running++;
+        }
+        if(running == 0) {
+            finished = completion;
+            completion = nil;
+        }
+    }
+    for(IQNetworkSynchronizedFile* file in starting) {
+        [file _refresh:alwaysDownload handler:^(BOOL wasUpdated, NSError* error) {
+            @synchronized(self) {
+                running--;
+                if(error) {
+                    failed++;
+                } else if(wasUpdated) {
+                    updated++;
+                } else {
+                    unchanged++;
+                }
+            }
+            [self start];
+        }];
+    }
+    if(finished) {
+        finished(unchanged, updated, failed);
+    }
+}
+
 @end
 
+/**
+ The sync state is kept in two files. The state file (.syncstate) is a property list with its
+ generation and an entry per file. The journal (.syncjournal) has the entries changed since the
+ state file was written, each as a binary property list preceded by its length and the generation
+ of the state file it applies to (32 bits each, big endian). Changes are appended to the journal
+ in batches, so saving costs the same no matter how many files the folder has, and the journal is
+ merged into the state file once it has grown as large as it. If the journal could not be removed
+ after that, its records are of an older generation and are not replayed.
+ */
 @implementation IQNetworkSynchronizedFolder
 + (IQNetworkSynchronizedFolder*)folderWithName:(NSString*)name inParent:(NSString*)path
 {
@@ -55,7 +156,7 @@ static IQTransferManager* globalTransferManager = nil;
         self->_name = name;
         self->_localPath = [parent stringByAppendingPathComponent:name];
         self->_cacheCheckTimeout = 3600.0;
-        [self _loadState];
+        stateQueue = dispatch_queue_create("IQNetworkSynchronizedFolder.state", DISPATCH_QUEUE_SERIAL);
         if(!globalTransferManager) {
             // Use the same transfer manager for all folders by default
             globalTransferManager = [[IQTransferManager alloc] init];
@@ -65,30 +166,81 @@ static IQTransferManager* globalTransferManager = nil;
     return self;
 }
 
+- (NSString*)_statePath
+{
+    return [self->_localPath stringByAppendingPathComponent:@".syncstate"];
+}
+
+- (NSString*)_journalPath
+{
+    return [self->_localPath stringByAppendingPathComponent:@".syncjournal"];
+}
+
+/**
+ Loads the state file and replays the journal on top of it. Called with self locked.
+ */
 - (void)_loadState
 {
+    if(files) return;
+    files = [NSMutableDictionary dictionary];
     BOOL isDir = NO;
-    if([[NSFileManager defaultManager] fileExistsAtPath:self->_localPath isDirectory:&isDir]) {
-        if(!isDir) {
-            NSLog(@"The parent folder exists as a file. Future requests will fail...");
-        }
-        NSString* dictPath = [self->_localPath stringByAppendingPathComponent:@".syncstate"];
-        NSArray* syncState = [NSArray arrayWithContentsOfFile:dictPath];
-        if(syncState != nil) {
-            files = [NSMutableArray arrayWithCapacity:syncState.count];
-            for(NSDictionary* file in syncState) {
-                IQNetworkSynchronizedFile* f = [IQNetworkSynchronizedFile _fileWithDictionary:file inFolder:self];
-                if(f) {
-                    [files addObject:f];
-                }
+    if(![[NSFileManager defaultManager] fileExistsAtPath:self->_localPath isDirectory:&isDir]) {
+        return;
+    }
+    if(!isDir) {
+        NSLog(@"The parent folder exists as a file. Future requests will fail...");
+    }
+    NSDictionary* stateFile = [NSDictionary dictionaryWithContentsOfFile:[self _statePath]];
+    NSArray* syncState = stateFile[@"files"];
+    if(!stateFile) {
+        // Written before the state file had a generation
+        syncState = [NSArray arrayWithContentsOfFile:[self _statePath]];
+    }
+    if(syncState != nil) {
+        stateGeneration = [stateFile[@"generation"] unsignedIntValue];
+        files = [NSMutableDictionary dictionaryWithCapacity:syncState.count];
+        for(NSDictionary* file in syncState) {
+            IQNetworkSynchronizedFile* f = [IQNetworkSynchronizedFile _fileWithDictionary:file inFolder:self];
+            if(f) {
+                files[f.url.absoluteString] = f;
             }
-        } else {
-            NSLog(@"Unable to read sync state");
         }
     }
-    if(files == nil) {
-        files = [NSMutableArray array];
+    NSData* journal = [NSData dataWithContentsOfFile:[self _journalPath] options:NSDataReadingMappedIfSafe error:nil];
+    const uint8_t* bytes = journal.bytes;
+    NSUInteger offset = 0;
+    while(offset + 8 <= journal.length) {
+        uint32_t length, generation;
+        memcpy(&length, bytes + offset, 4);
+        memcpy(&generation, bytes + offset + 4, 4);
+        length = CFSwapInt32BigToHost(length);
+        generation = CFSwapInt32BigToHost(generation);
+        if(length > journal.length - offset - 8) {
+            // The last record was not completely written
+            break;
+        }
+        if(generation == stateGeneration) {
+            NSData* record = [NSData dataWithBytesNoCopy:(void*)(bytes + offset + 8) length:length freeWhenDone:NO];
+            NSDictionary* dict = [NSPropertyListSerialization propertyListWithData:record options:NSPropertyListImmutable format:NULL error:nil];
+            IQNetworkSynchronizedFile* f = [dict isKindOfClass:[NSDictionary class]] ? [IQNetworkSynchronizedFile _fileWithDictionary:dict inFolder:self] : nil;
+            if(f) {
+                // Later records replace earlier ones
+                files[f.url.absoluteString] = f;
+            }
+        }
+        journalRecords++;
+        offset += 8 + length;
     }
+    if(syncState == nil && journalRecords == 0) {
+        NSLog(@"Unable to read sync state");
+    }
+    for(IQNetworkSynchronizedFile* file in files.objectEnumerator) {
+        if(file.size > 0) {
+            cachedSize += file.size;
+            cachedFiles++;
+        }
+    }
+    [self _scheduleEvictionIfNeeded];
 }
 
 - (void)_ensureLocaldir
@@ -101,31 +253,106 @@ static IQTransferManager* globalTransferManager = nil;
     }
  }
 
+/**
+ Schedules the entry of a file to be saved. Changes made meanwhile are saved with it.
+ */
+- (void)_fileChanged:(IQNetworkSynchronizedFile*)file
+{
+    @synchronized(self) {
+        if(!changedFiles) {
+            changedFiles = [NSMutableSet set];
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kIQSyncStateSaveDelay * NSEC_PER_SEC)), stateQueue, ^{
+                [self _saveState];
+            });
+        }
+        [changedFiles addObject:file];
+    }
+}
+
+/**
+ Appends the changed entries to the journal, or writes a new state file if the journal has grown
+ too large. Called on the state queue.
+ */
 - (void)_saveState
 {
-    @synchronized(files) {
-        NSMutableArray* array = [NSMutableArray arrayWithCapacity:files.count];
-        for(IQNetworkSynchronizedFile* file in files) {
+    NSMutableArray* records = nil;
+    NSMutableArray* array = nil;
+    uint32_t generation;
+    @synchronized(self) {
+        if(!changedFiles) return;
+        records = [NSMutableArray arrayWithCapacity:changedFiles.count];
+        for(IQNetworkSynchronizedFile* file in changedFiles) {
             NSDictionary* dict = [file _dictionary];
             if(dict) {
-                [array addObject:dict];
+                [records addObject:dict];
+            }
+        }
+        changedFiles = nil;
+        if(journalRecords + records.count > MAX(files.count, kIQSyncStateMinCompaction)) {
+            array = [NSMutableArray arrayWithCapacity:files.count];
+            for(IQNetworkSynchronizedFile* file in files.objectEnumerator) {
+                NSDictionary* dict = [file _dictionary];
+                if(dict) {
+                    [array addObject:dict];
+                }
             }
+            journalRecords = 0;
+        } else {
+            journalRecords += records.count;
         }
-        [self _ensureLocaldir];
-        NSString* dictPath = [self->_localPath stringByAppendingPathComponent:@".syncstate"];
-        if(![array writeToFile:dictPath atomically:NO]) {
+        generation = stateGeneration;
+    }
+    [self _ensureLocaldir];
+    if(array) {
+        // The journal is only removed once the new state file is in place. Should that fail, the
+        // generation tells its records apart from the ones written after the state file.
+        generation++;
+        NSDictionary* stateFile = @{@"generation": @(generation), @"files": array};
+        if([stateFile writeToFile:[self _statePath] atomically:YES]) {
+            @synchronized(self) {
+                stateGeneration = generation;
+            }
+            [[NSFileManager defaultManager] removeItemAtPath:[self _journalPath] error:nil];
+        } else {
             NSLog(@"Unable to save sync state");
         }
+        return;
+    }
+    NSMutableData* data = [NSMutableData data];
+    uint32_t recordGeneration = CFSwapInt32HostToBig(generation);
+    for(NSDictionary* dict in records) {
+        NSData* record = [NSPropertyListSerialization dataWithPropertyList:dict format:NSPropertyListBinaryFormat_v1_0 options:0 error:nil];
+        uint32_t length = CFSwapInt32HostToBig((uint32_t)record.length);
+        [data appendBytes:&length length:4];
+        [data appendBytes:&recordGeneration length:4];
+        [data appendData:record];
+    }
+    int fd = open([[self _journalPath] fileSystemRepresentation], O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd < 0 || write(fd, data.bytes, data.length) != (ssize_t)data.length) {
+        NSLog(@"Unable to save sync state");
+    }
+    if(fd >= 0) {
+        close(fd);
     }
 }
 
+/**
+ Blocks until the pending changes to the sync state have been written.
+ */
+- (void)_flushState
+{
+    dispatch_sync(stateQueue, ^{
+        [self _saveState];
+    });
+}
+
 - (IQNetworkSynchronizedFile*) addFileWithURL:(NSURL*)url
 {
-    @synchronized(files) {
-        for(IQNetworkSynchronizedFile* file in self->files) {
-            if([file.url isEqual:url]) {
-                return file;
-            }
+    @synchronized(self) {
+        [self _loadState];
+        IQNetworkSynchronizedFile* existing = files[url.absoluteString];
+        if(existing) {
+            return existing;
         }
         NSString* name = nil;
         if(_cacheFileNaming) {
@@ -148,18 +375,167 @@ static IQTransferManager* globalTransferManager = nil;
             }
             name = [NSString stringWithFormat:@"%@_%08lx%@", fn, (unsigned long)url.hash, ext];
         }
-        NSString* localPath = [_localPath stringByAppendingPathComponent:name];
-        NSLog(@"Local Path: %@", localPath);
         IQNetworkSynchronizedFile* file = [IQNetworkSynchronizedFile _fileWithURL:url localName:name inFolder:self];
-        [self->files addObject:file];
-        [self _saveState];
+        files[url.absoluteString] = file;
+        [self _fileChanged:file];
         return file;
     }
 }
 - (void) refresh:(BOOL)alwaysDownload
 {
-    for(IQNetworkSynchronizedFile* file in files) {
-        [file refresh:alwaysDownload completion:nil errorHandler:nil];
+    [self refresh:alwaysDownload maxConcurrent:kIQSyncDefaultConcurrency completion:nil];
+}
+
+- (void) refresh:(BOOL)alwaysDownload maxConcurrent:(NSUInteger)maxConcurrent completion:(IQSynchronizationSummaryHandler)completion
+{
+    NSArray* all;
+    @synchronized(self) {
+        [self _loadState];
+        all = files.allValues;
+    }
+    _IQFolderRevalidation* revalidation = [_IQFolderRevalidation new];
+    // The files that were checked longest ago (or never) go first
+    revalidation->files = [all sortedArrayUsingComparator:^NSComparisonResult(IQNetworkSynchronizedFile* a, IQNetworkSynchronizedFile* b) {
+        NSDate* checkedA = a.lastChecked ? a.lastChecked : [NSDate distantPast];
+        NSDate* checkedB = b.lastChecked ? b.lastChecked : [NSDate distantPast];
+        return [checkedA compare:checkedB];
+    }];
+    revalidation->maxConcurrent = maxConcurrent;
+    revalidation->alwaysDownload = alwaysDownload;
+    revalidation->completion = completion;
+    [revalidation start];
+}
+
+- (BOOL) isBusy
+{
+    @synchronized(self) {
+        return busyFiles > 0;
+    }
+}
+
+/**
+ Counts the files being synchronized. When the last one is done, the doneHandler is called and
+ waitUntilSynchronized returns.
+ */
+- (void) _fileBusy:(BOOL)busy
+{
+    IQGenericCallback handler = nil;
+    NSSet* threads = nil;
+    @synchronized(self) {
+        if(busy) {
+            busyFiles++;
+            return;
+        }
+        if(busyFiles == 0 || --busyFiles > 0) return;
+        handler = _doneHandler;
+        threads = waitingThreads;
+        waitingThreads = nil;
+    }
+    if(handler) {
+        handler();
+    }
+    for(NSThread* thread in threads) {
+        [self performSelector:@selector(_wakeUp) onThread:thread withObject:nil waitUntilDone:NO];
+    }
+}
+
+- (void) _wakeUp
+{
+    // Only here to make the run loop of waitUntilSynchronized return
+}
+
+#pragma mark - Eviction
+
+- (void) setMaxSize:(unsigned long long)maxSize
+{
+    @synchronized(self) {
+        _maxSize = maxSize;
+        [self _scheduleEvictionIfNeeded];
+    }
+}
+
+- (void) setMaxFileCount:(NSUInteger)maxFileCount
+{
+    @synchronized(self) {
+        _maxFileCount = maxFileCount;
+        [self _scheduleEvictionIfNeeded];
+    }
+}
+
+- (unsigned long long) size
+{
+    @synchronized(self) {
+        [self _loadState];
+        return cachedSize;
+    }
+}
+
+- (BOOL) _isOverSize:(unsigned long long)size count:(NSUInteger)count
+{
+    return (_maxSize > 0 && size > _maxSize) || (_maxFileCount > 0 && count > _maxFileCount);
+}
+
+/**
+ Starts an eviction pass on the state queue if the folder has grown beyond its limits. Called
+ with self locked.
+ */
+- (void) _scheduleEvictionIfNeeded
+{
+    if(evictionScheduled || ![self _isOverSize:cachedSize count:cachedFiles]) return;
+    evictionScheduled = YES;
+    dispatch_async(stateQueue, ^{
+        [self _evictLeastRecentlyUsed];
+    });
+}
+
+- (void) _cachedSizeChangedFrom:(long long)oldSize to:(long long)newSize
+{
+    @synchronized(self) {
+        cachedSize = cachedSize + MAX(newSize, 0) - MAX(oldSize, 0);
+        if(oldSize <= 0 && newSize > 0) {
+            cachedFiles++;
+        } else if(oldSize > 0 && newSize <= 0) {
+            cachedFiles--;
+        }
+        [self _scheduleEvictionIfNeeded];
+    }
+}
+
+/**
+ Removes the cached data of the least recently used files until the folder is well below its
+ limits. Pinned files and files being synchronized are left alone.
+ */
+- (void) _evictLeastRecentlyUsed
+{
+    NSMutableArray* candidates = nil;
+    unsigned long long targetSize;
+    NSUInteger targetCount;
+    @synchronized(self) {
+        targetSize = (unsigned long long)(_maxSize * kIQSyncEvictionTarget);
+        targetCount = (NSUInteger)(_maxFileCount * kIQSyncEvictionTarget);
+        candidates = [NSMutableArray arrayWithCapacity:cachedFiles];
+        for(IQNetworkSynchronizedFile* file in files.objectEnumerator) {
+            if(file.size > 0 && !file.pinned && !file.isBusy) {
+                [candidates addObject:file];
+            }
+        }
+    }
+    [candidates sortUsingComparator:^NSComparisonResult(IQNetworkSynchronizedFile* a, IQNetworkSynchronizedFile* b) {
+        NSDate* accessedA = a.lastAccessed ? a.lastAccessed : [NSDate distantPast];
+        NSDate* accessedB = b.lastAccessed ? b.lastAccessed : [NSDate distantPast];
+        return [accessedA compare:accessedB];
+    }];
+    for(IQNetworkSynchronizedFile* file in candidates) {
+        @synchronized(self) {
+            BOOL overSize = _maxSize > 0 && cachedSize > targetSize;
+            BOOL overCount = _maxFileCount > 0 && cachedFiles > targetCount;
+            if(!overSize && !overCount) break;
+        }
+        [file _evict];
+    }
+    @synchronized(self) {
+        // The next change starts a new pass, if the folder is still too large
+        evictionScheduled = NO;
     }
 }
 
@@ -172,14 +548,19 @@ static IQTransferManager* globalTransferManager = nil;
 {
     while(true) {
         @synchronized(self) {
-            BOOL anyBusy = NO;
-            for(IQNetworkSynchronizedFile* file in files) {
-                anyBusy |= file.isBusy;
+            if(busyFiles == 0) break;
+            if(!waitingThreads) {
+                waitingThreads = [NSMutableSet setWithCapacity:1];
             }
-            if(!anyBusy) break;
+            [waitingThreads addObject:[NSThread currentThread]];
+        }
+        // Returns when the last file is done (see _fileBusy:), or another event was handled
+        if(![[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]) {
+            // No input sources to wait for on this run loop
+            [NSThread sleepForTimeInterval:0.01];
         }
-        [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
     }
+    [self _flushState];
 }
 @end
 
@@ -188,7 +569,10 @@ static IQTransferManager* globalTransferManager = nil;
     NSURL* url;
     NSString* name;
     NSString* etag;
+    NSString* lastModified;
     IQTransferItem* syncItem;
+    // Handlers of the refreshes that syncItem answers
+    NSMutableArray* refreshHandlers;
 }
 
 @end
@@ -210,10 +594,15 @@ static IQTransferManager* globalTransferManager = nil;
 {
     IQNetworkSynchronizedFile* file = [[IQNetworkSynchronizedFile alloc] init];
     if(file) {
+        file->_size = [dictionary[@"size"] longLongValue];
+        file->_lastAccessed = dictionary[@"lastAccessed"];
+        file->_pinned = [dictionary[@"pinned"] boolValue];
         file->folder = folder;
         file->url = [NSURL URLWithString:dictionary[@"url"]];
         file->name = dictionary[@"name"];
         file->etag = dictionary[@"etag"];
+        file->lastModified = dictionary[@"lastModified"];
+        file->_lastChecked = dictionary[@"lastChecked"];
         if(file->url == nil || file->name == nil) {
             // Bad record?
             return nil;
@@ -247,6 +636,7 @@ static IQTransferManager* globalTransferManager = nil;
                 break;
         }
         if(localPath) {
+            [self _accessed];
             if(fileHandler) {
                 fileHandler(localPath);
             }
@@ -335,19 +725,49 @@ static IQTransferManager* globalTransferManager = nil;
 }
 
 - (void) refresh:(BOOL)alwaysDownload completion:(IQGenericCallback)completionHandler errorHandler:(IQErrorHandler)errorHandler
+{
+    [self _refresh:alwaysDownload handler:^(BOOL updated, NSError* error) {
+        if(error) {
+            if(errorHandler) {
+                errorHandler(error);
+            }
+        } else if(completionHandler) {
+            completionHandler();
+        }
+    }];
+}
+
+/**
+ Checks the file with the server, and downloads it if it has changed (or always, if
+ alwaysDownload is YES). A refresh that does not need to download the file is answered by the
+ one already in progress, if any.
+ */
+- (void) _refresh:(BOOL)alwaysDownload handler:(IQSyncRefreshHandler)handler
 {
     @synchronized(self) {
+        if(!refreshHandlers) {
+            refreshHandlers = [NSMutableArray arrayWithCapacity:1];
+        }
+        if(handler) {
+            [refreshHandlers addObject:[handler copy]];
+        }
+        if(syncItem && !syncItem.isDone) {
+            if(!alwaysDownload) return;
+            // The new download takes over the temporary file, and the handlers
+            [syncItem cancel];
+        } else {
+            [folder _fileBusy:YES];
+        }
         __block IQNetworkSynchronizedFolder* strongFolder = folder;
         [folder _ensureLocaldir];
-        refreshCount ++;
-        NSString* tempFile = [self.path stringByAppendingString:[NSString stringWithFormat:@".%d.download", refreshCount]];
+        // A download that is interrupted continues where it was the next time
+        NSString* tempFile = [self.path stringByAppendingString:@".download"];
         __weak IQNetworkSynchronizedFile* weakSelf = self;
         __block IQTransferItem* item = nil;
-        item = [folder->transferManager downloadFromURL:url toPath:tempFile done:^{
+        item = [folder->transferManager resumableDownloadFromURL:url toPath:tempFile done:^{
             IQNetworkSynchronizedFile* s = weakSelf;
             if(item && s && s->syncItem == item) {
                 // The request is recent
-                s->syncItem = nil;
                 NSError* error = nil;
                 if([[NSFileManager defaultManager] fileExistsAtPath:s.path]) {
                     [[NSFileManager defaultManager] removeItemAtPath:s.path error:&error];
@@ -355,47 +775,57 @@ static IQTransferManager* globalTransferManager = nil;
                 if(!error) {
                     [[NSFileManager defaultManager] moveItemAtPath:tempFile toPath:s.path error:&error];
                 }
-                if(error) {
-                    if(errorHandler) {
-                        errorHandler(error);
-                    }
-                } else {
+                if(!error) {
                     s->_lastChecked = [NSDate date];
                     s->etag = [item valueForResponseHeaderField:@"ETag"];
-                    [s->folder _saveState];
-                    if(completionHandler) {
-                        completionHandler();
-                    }
+                    s->lastModified = [item valueForResponseHeaderField:@"Last-Modified"];
+                    s->_lastAccessed = s->_lastChecked;
+                    [s _setSize:(long long)[[[NSFileManager defaultManager] attributesOfItemAtPath:s.path error:nil] fileSize]];
+                    [s->folder _fileChanged:s];
                 }
-                strongFolder = nil;
+                [s _refreshEnded:item updated:YES error:error];
             }
+            strongFolder = nil;
         } errorHandler:^(NSError* error) {
             IQNetworkSynchronizedFile* s = weakSelf;
-            if(item && s && s->syncItem == item) {
-                s->syncItem = nil;
-            }
             if([error.domain isEqualToString:kIQTransferManagerErrorDomain] && error.code == 304) {
                 if(s) {
                     s->_lastChecked = [NSDate date];
-                    [s->folder _saveState];
-                }
-                if(completionHandler) {
-                    completionHandler();
-                }
-            } else {
-                if(errorHandler) {
-                    errorHandler(error);
+                    [s->folder _fileChanged:s];
                 }
+                error = nil;
             }
+            [s _refreshEnded:item updated:NO error:error];
             strongFolder = nil;
         }];
-        if(etag && !alwaysDownload) {
-            [item setValue:etag forRequestHeaderField:@"If-None-Match"];
+        if(!alwaysDownload) {
+            // Either validator lets the server answer 304 Not Modified instead of sending the file
+            if(etag) {
+                [item setValue:etag forRequestHeaderField:@"If-None-Match"];
+            }
+            if(lastModified) {
+                [item setValue:lastModified forRequestHeaderField:@"If-Modified-Since"];
+            }
         }
         syncItem = item;
     }
 }
 
+- (void) _refreshEnded:(IQTransferItem*)item updated:(BOOL)updated error:(NSError*)error
+{
+    NSArray* handlers = nil;
+    @synchronized(self) {
+        if(!item || syncItem != item) return;
+        syncItem = nil;
+        handlers = refreshHandlers;
+        refreshHandlers = nil;
+    }
+    for(IQSyncRefreshHandler handler in handlers) {
+        handler(updated, error);
+    }
+    [folder _fileBusy:NO];
+}
+
 - (NSString*)path
 {
     return [folder _pathForItem:name];
@@ -412,6 +842,55 @@ static IQTransferManager* globalTransferManager = nil;
     if(name) dict[@"name"] = name;
     if(url) dict[@"url"] = [url absoluteString];
     if(etag) dict[@"etag"] = etag;
+    if(lastModified) dict[@"lastModified"] = lastModified;
+    if(_lastChecked) dict[@"lastChecked"] = _lastChecked;
+    if(_size > 0) dict[@"size"] = @(_size);
+    if(_lastAccessed) dict[@"lastAccessed"] = _lastAccessed;
+    if(_pinned) dict[@"pinned"] = @YES;
     return dict;
 }
+
+- (void) setPinned:(BOOL)pinned
+{
+    if(_pinned != pinned) {
+        _pinned = pinned;
+        [folder _fileChanged:self];
+    }
+}
+
+/**
+ Records that the cached file was used, for eviction.
+ */
+- (void) _accessed
+{
+    NSDate* now = [NSDate date];
+    BOOL save = !_lastAccessed || [now timeIntervalSinceDate:_lastAccessed] > kIQSyncAccessResolution;
+    _lastAccessed = now;
+    if(save) {
+        [folder _fileChanged:self];
+    }
+}
+
+- (void) _setSize:(long long)size
+{
+    long long oldSize = _size;
+    _size = size;
+    [folder _cachedSizeChangedFrom:oldSize to:size];
+}
+
+/**
+ Removes the cached data. The validators go with it, so that the next refresh downloads the file.
+ */
+- (void) _evict
+{
+    @synchronized(self) {
+        if(self.isBusy || _pinned || _size <= 0) return;
+        [[NSFileManager defaultManager] removeItemAtPath:self.path error:nil];
+        etag = nil;
+        lastModified = nil;
+        _lastChecked = nil;
+        [self _setSize:0];
+    }
+    [folder _fileChanged:self];
+}
 @end
@@ -22,5 +22,8 @@
 #import "IQReachableStatus.h"
 #import "IQNetworkSynchronizedFolder.h"
 #import "IQMIMEType.h"
+#import "IQMultipartParser.h"
+#import "IQJSONStreamParser.h"
 #import "IQHTTPServer.h"
+#import "IQHTTPClient.h"
 #import "IQTransferManager.h"
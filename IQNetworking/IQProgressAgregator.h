@@ -30,6 +30,16 @@
 #define kIQProgressAggregatorProgressChanged @"kIQProgressAggregatorProgressChanged"
 #define kIQProgressibleProgressChanged @"kIQProgressibleProgressChanged"
 
+/**
+ Sums up the progress of a set of progressible objects, such as transfers.
+ 
+ The totals are kept up to date incrementally: an object is sampled when it is added and when its
+ state changes, and the bytes it transfers in between are added to the totals as they are
+ reported. Reading the totals is cheap regardless of the number of objects.
+ 
+ Instead of once per change, the aggregator posts kIQProgressAggregatorProgressChanged on the main
+ thread at a fixed rate (see updateInterval) while it is working, and once when it stops.
+ */
 @interface IQProgressAgregator : NSObject
 + (IQProgressAgregator*) globalAggregator;
 
@@ -37,16 +47,44 @@
  Posts a kIQProgressibleProgressChangedNotification notification. This notification is picked up
  by all objects listening to the progress of this progressible, as well as the global progress
  aggregator, which always listens to all progressible objects.
+ 
+ Call this when the state of the object changes (it starts, learns its size or completes), not
+ for every block of data, see progressible:didTransferBytes: for that.
  */
 + (void) progressChangedForObject:(id<IQProgressible>)object;
 
+/**
+ Adds bytes transferred by the object to the totals of the aggregators that follow it, without
+ posting any notification. Cheap enough to call for every block of data received. The bytesDone
+ of the object must have grown by the same amount.
+ */
++ (void) progressible:(id<IQProgressible>)object didTransferBytes:(long long)bytes;
+
 - (void) addProgressible:(id<IQProgressible>)object;
 
 #if TARGET_OS_IPHONE
 @property (nonatomic) BOOL manageNetworkIndicator;
 #endif
 
+/**
+ The time between progress notifications while the aggregator is working. Default is 0.25
+ seconds.
+ */
+@property (nonatomic) NSTimeInterval updateInterval;
+
 - (long long) totalBytes;
 - (long long) bytesDone;
 - (BOOL) working;
+
+/**
+ The transfer rate in bytes per second, smoothed over the last few seconds. Updated with every
+ progress notification, and 0 when the aggregator is not working.
+ */
+@property (nonatomic, readonly) double throughput;
+
+/**
+ The estimated number of seconds until the bytes left are done at the current throughput, or -1
+ if the throughput or the total size is not known.
+ */
+@property (nonatomic, readonly) NSTimeInterval estimatedTimeRemaining;
 @end
@@ -17,27 +17,59 @@
 //
 
 #import "IQProgressAgregator.h"
+#import <objc/runtime.h>
+#import <libkern/OSAtomic.h>
 #if TARGET_OS_IPHONE
 #import <UIKit/UIKit.h>
 #endif
 
+#define kIQProgressDefaultUpdateInterval 0.25
+// The time constant of the throughput smoothing, in seconds
+#define kIQProgressThroughputTimeConstant 2.0
+
 static IQProgressAgregator* globalAggregator = nil;
+// The key of the array of references of a progressible, one for each aggregator following it
+static char kIQProgressReferencesKey;
+static NSObject* referencesLock = nil;
+
 @interface IQProgressAgregator () {
     NSMapTable* progressObjects;
+    // The same references, which outlive their objects, so that the aggregator can take back
+    // what an object that went away without completing added to the totals
+    NSMutableSet* references;
+    volatile int64_t totalBytes, bytesDone;
+    // Every byte reported since the aggregator was created, for the throughput
+    volatile int64_t transferredBytes;
+    volatile int32_t tickScheduled;
+    int64_t lastTransferred;
+    CFAbsoluteTime lastTick;
 }
+- (void) _addBytes:(int64_t)bytes;
 @end
+
+/**
+ What an object has added to the totals of one aggregator.
+ */
 @interface _IQProgressibleReference : NSObject {
 @public
-    long long totalBytes, bytesDone;
-    BOOL done;
     __weak id<IQProgressible> object;
+    __weak IQProgressAgregator* aggregator;
+    volatile int64_t totalBytes, bytesDone;
 }
-- (id) initWithProgressible:(id<IQProgressible>)progressible;
-- (void) update;
+@end
+
+@implementation _IQProgressibleReference
 @end
 
 @implementation IQProgressAgregator
 
++ (void) initialize
+{
+    if(self == [IQProgressAgregator class]) {
+        referencesLock = [[NSObject alloc] init];
+    }
+}
+
 + (IQProgressAgregator*) globalAggregator
 {
     if(!globalAggregator) {
@@ -54,82 +86,195 @@ static IQProgressAgregator* globalAggregator = nil;
     [[NSNotificationCenter defaultCenter] postNotificationName:kIQProgressibleProgressChanged object:object];
 }
 
++ (void) progressible:(id<IQProgressible>)object didTransferBytes:(long long)bytes
+{
+    NSArray* refs = objc_getAssociatedObject(object, &kIQProgressReferencesKey);
+    for(_IQProgressibleReference* pref in refs) {
+        OSAtomicAdd64(bytes, &pref->bytesDone);
+        [pref->aggregator _addBytes:bytes];
+    }
+}
+
+- (id) init
+{
+    self = [super init];
+    if(self) {
+        self->_updateInterval = kIQProgressDefaultUpdateInterval;
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    for(_IQProgressibleReference* pref in references) {
+        [self _detachReference:pref];
+    }
+}
+
 - (void) addProgressible:(id<IQProgressible>)object
 {
-    if(!progressObjects) {
-        progressObjects = [NSMapTable weakToStrongObjectsMapTable];
-        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(_receivedProgressUpdate:) name:kIQProgressibleProgressChanged object:nil];
+    @synchronized(self) {
+        if(!progressObjects) {
+            progressObjects = [NSMapTable weakToStrongObjectsMapTable];
+            references = [NSMutableSet set];
+            if(self != globalAggregator) {
+                // The global aggregator is told directly
+                [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(_receivedProgressUpdate:) name:kIQProgressibleProgressChanged object:nil];
+            }
+        }
+        _IQProgressibleReference* pref = [progressObjects objectForKey:object];
+        if(!pref) {
+            if([object isDone]) return;
+            pref = [[_IQProgressibleReference alloc] init];
+            pref->object = object;
+            pref->aggregator = self;
+            [progressObjects setObject:pref forKey:object];
+            [references addObject:pref];
+            // The bytes done so far are sampled before attaching, so that bytes reported in between
+            // are not counted twice
+            if([object respondsToSelector:@selector(bytesDone)]) {
+                int64_t done = [object bytesDone];
+                OSAtomicAdd64(done, &pref->bytesDone);
+                OSAtomicAdd64(done, &bytesDone);
+            }
+            [self _attachReference:pref];
+        }
+        [self _updateProgressible:pref];
+    }
+    [self _scheduleTick];
+}
+
+/**
+ Makes the bytes reported for the object of the reference count for this aggregator.
+ */
+- (void) _attachReference:(_IQProgressibleReference*)pref
+{
+    id<IQProgressible> object = pref->object;
+    if(!object) return;
+    @synchronized(referencesLock) {
+        NSArray* refs = objc_getAssociatedObject(object, &kIQProgressReferencesKey);
+        refs = refs ? [refs arrayByAddingObject:pref] : [NSArray arrayWithObject:pref];
+        objc_setAssociatedObject(object, &kIQProgressReferencesKey, refs, OBJC_ASSOCIATION_RETAIN);
+    }
+}
+
+- (void) _detachReference:(_IQProgressibleReference*)pref
+{
+    id<IQProgressible> object = pref->object;
+    if(!object) return;
+    @synchronized(referencesLock) {
+        NSMutableArray* refs = [objc_getAssociatedObject(object, &kIQProgressReferencesKey) mutableCopy];
+        [refs removeObjectIdenticalTo:pref];
+        objc_setAssociatedObject(object, &kIQProgressReferencesKey, refs.count > 0 ? refs : nil, OBJC_ASSOCIATION_RETAIN);
     }
-    _IQProgressibleReference* pref = [[_IQProgressibleReference alloc] initWithProgressible:object];
-    [progressObjects setObject:pref forKey:object];
-    [self _updateProgressible:pref];
 }
 
+/**
+ Samples the size of the object, and removes it if it is done. Called with self locked.
+ */
 - (void) _updateProgressible:(_IQProgressibleReference*)pref
 {
-    [pref update];
-    if(pref->done) {
-        [progressObjects removeObjectForKey:pref->object];
+    id<IQProgressible> object = pref->object;
+    if(object && [object respondsToSelector:@selector(totalBytes)]) {
+        int64_t delta = [object totalBytes] - pref->totalBytes;
+        OSAtomicAdd64(delta, &pref->totalBytes);
+        OSAtomicAdd64(delta, &totalBytes);
     }
-    [[NSNotificationCenter defaultCenter] postNotificationName:kIQProgressAggregatorProgressChanged object:self];
-#if TARGET_OS_IPHONE
-    if(_manageNetworkIndicator) {
-        [[UIApplication sharedApplication] setNetworkActivityIndicatorVisible:self.working];
+    if(!object || [object isDone]) {
+        [self _detachReference:pref];
+        OSAtomicAdd64(-OSAtomicAdd64Barrier(0, &pref->totalBytes), &totalBytes);
+        OSAtomicAdd64(-OSAtomicAdd64Barrier(0, &pref->bytesDone), &bytesDone);
+        if(object) [progressObjects removeObjectForKey:object];
+        [references removeObject:pref];
     }
-#endif
 }
 
 - (void) _receivedProgressUpdate:(NSNotification*)notification
 {
-    _IQProgressibleReference* pref = [progressObjects objectForKey:notification.object];
-    if(pref) {
+    @synchronized(self) {
+        _IQProgressibleReference* pref = [progressObjects objectForKey:notification.object];
+        if(!pref) return;
         [self _updateProgressible:pref];
     }
+    [self _scheduleTick];
 }
 
-- (BOOL) working
+- (void) _addBytes:(int64_t)bytes
 {
-    return progressObjects.count > 0;
+    OSAtomicAdd64(bytes, &bytesDone);
+    OSAtomicAdd64(bytes, &transferredBytes);
 }
 
-- (long long) totalBytes
+- (void) _scheduleTick
 {
-    long long tb = 0;
-    for(_IQProgressibleReference* pref in progressObjects) {
-        tb += pref->totalBytes;
-    }
-    return tb;
+    if(!OSAtomicCompareAndSwap32Barrier(0, 1, &tickScheduled)) return;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_updateInterval * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        [self _tick];
+    });
 }
 
-- (long long) bytesDone
+/**
+ Updates the throughput and posts the progress. Repeats every updateInterval while working.
+ */
+- (void) _tick
 {
-    long long bd = 0;
-    for(_IQProgressibleReference* pref in progressObjects) {
-        bd += pref->bytesDone;
+    BOOL isWorking;
+    @synchronized(self) {
+        for(_IQProgressibleReference* pref in references.allObjects) {
+            if(!pref->object) [self _updateProgressible:pref];
+        }
+        isWorking = references.count > 0;
+    }
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    int64_t transferred = OSAtomicAdd64Barrier(0, &transferredBytes);
+    if(!isWorking) {
+        _throughput = 0;
+    } else if(lastTick > 0 && now > lastTick) {
+        double rate = (transferred - lastTransferred) / (now - lastTick);
+        double alpha = 1.0 - exp(-(now - lastTick) / kIQProgressThroughputTimeConstant);
+        _throughput = _throughput > 0 ? _throughput + alpha * (rate - _throughput) : rate;
+    }
+    lastTick = isWorking ? now : 0;
+    lastTransferred = transferred;
+    OSAtomicCompareAndSwap32Barrier(1, 0, &tickScheduled);
+    [[NSNotificationCenter defaultCenter] postNotificationName:kIQProgressAggregatorProgressChanged object:self];
+#if TARGET_OS_IPHONE
+    if(_manageNetworkIndicator) {
+        [[UIApplication sharedApplication] setNetworkActivityIndicatorVisible:isWorking];
+    }
+#endif
+    if(isWorking) {
+        [self _scheduleTick];
     }
-    return bd;
 }
 
-@end
+- (BOOL) working
+{
+    @synchronized(self) {
+        return references.count > 0;
+    }
+}
 
-@implementation _IQProgressibleReference
+- (long long) totalBytes
+{
+    return OSAtomicAdd64Barrier(0, &totalBytes);
+}
 
-- (id) initWithProgressible:(id<IQProgressible>)progressible
+- (long long) bytesDone
 {
-    self = [super init];
-    if(self) {
-        self->object = progressible;
-    }
-    return self;
+    return OSAtomicAdd64Barrier(0, &bytesDone);
 }
 
-- (void) update
+- (NSTimeInterval) estimatedTimeRemaining
 {
-    done = [object isDone];
-    if([object respondsToSelector:@selector(bytesDone)] && [object respondsToSelector:@selector(totalBytes)]) {
-        totalBytes = [object totalBytes];
-        bytesDone = [object bytesDone];
+    long long total = self.totalBytes;
+    long long left = total - self.bytesDone;
+    double rate = _throughput;
+    if(rate <= 0 || total <= 0 || left < 0) {
+        return -1;
     }
+    return left / rate;
 }
 
-@end
\ No newline at end of file
+@end
@@ -19,7 +19,20 @@
 #import <Foundation/Foundation.h>
 
 @class IQStreamingCachedItem;
+@class IQTransferManager;
 
+/**
+ A cache for media that is played while it downloads, such as audio and video.
+ 
+ Each cached item is exposed to the player through a local URL, served by an embedded HTTP server
+ that answers Range requests from a sparse, chunked copy of the media on disk. Chunks that are
+ not on disk yet are fetched from the origin with Range requests when the player asks for them,
+ and the chunks following the playback position are read ahead. Playback can start as soon as
+ the first chunk has arrived, a seek only fetches the chunks around the new position, and media
+ that has been played once is served entirely from disk.
+ 
+ The cache does all its work on the main thread.
+ */
 @interface IQStreamingMediaCache : NSObject
 /**
  For normal use, the one and only instance of the cache.
@@ -33,13 +46,62 @@
  is usually no need to.
  */
 - (id) initWithName:(NSString*)name;
+- (id) initWithName:(NSString*)name parent:(NSString*)parent;
 
+/**
+ The item caching the media at the given URL. The same item is returned for the same URL, and
+ the media already on disk from earlier sessions is reused.
+ */
 - (IQStreamingCachedItem*) cachedItemAtURL:(NSURL*)url;
 
 @property (nonatomic, readonly) NSString* name;
+@property (nonatomic, readonly) NSString* localPath;
+
+/**
+ The transfer manager used to fetch media from the origin. Default is a transfer manager of
+ the cache's own.
+ */
+@property (nonatomic, retain) IQTransferManager* transferManager;
+
+/**
+ The unit in which media is fetched and stored. Changing it only affects items that have no
+ media on disk yet.
+ 
+ Default is 256 KB.
+ */
+@property (nonatomic) NSUInteger chunkSize;
+
+/**
+ The most media fetched ahead of the playback position. Read-ahead starts at two chunks after a
+ seek and doubles up to this limit every time playback catches up with it.
+ 
+ Default is 4 MB.
+ */
+@property (nonatomic) NSUInteger maxReadAhead;
 @end
 
 @interface IQStreamingCachedItem : NSObject
 @property (nonatomic, readonly) NSURL* url;
-@property (nonatomic, readonly) IQStreamingMediaCache* cache;
+@property (nonatomic, readonly, weak) IQStreamingMediaCache* cache;
+
+/**
+ The URL to give to the player. Starts the server of the cache if it is not running. nil if the
+ server could not be started.
+ */
+@property (nonatomic, readonly) NSURL* localURL;
+
+/**
+ The size of the media, or -1 if it is not known yet.
+ */
+@property (nonatomic, readonly) long long length;
+
+/**
+ The number of bytes of the media on disk.
+ */
+@property (nonatomic, readonly) long long cachedLength;
+
+/**
+ YES if all of the media is on disk.
+ */
+@property (nonatomic, readonly) BOOL isComplete;
 @end
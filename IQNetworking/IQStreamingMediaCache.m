@@ -18,27 +18,123 @@
 
 #import "IQStreamingMediaCache.h"
 #import "IQHTTPServer.h"
+#import "IQTransferManager.h"
+#import <CommonCrypto/CommonDigest.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define kIQStreamingDefaultChunkSize (256*1024)
+#define kIQStreamingDefaultMaxReadAhead (4*1024*1024)
+// Read-ahead after a seek, in chunks
+#define kIQStreamingInitialReadAhead 2
+// The largest piece of media read from disk and written to the player at a time
+#define kIQStreamingReadSize (64*1024)
+
+typedef void (^IQStreamingWaiter)(BOOL available);
 
 @interface IQStreamingMediaCache () {
     IQHTTPServer* server;
+    // Cached items by key
+    NSMutableDictionary* items;
+}
+- (IQStreamingCachedItem*) _itemForKey:(NSString*)key;
+- (NSURL*) _localURLForItem:(IQStreamingCachedItem*)item;
+@end
+
+/**
+ A Range request for a run of chunks. Its data is written to the data file of the item as it
+ arrives, so each chunk becomes available as soon as it is complete.
+ */
+@interface _IQChunkFetch : NSObject {
+@public
+    IQTransferItem* transfer;
+    NSUInteger first, last;
+    // The file offset of the next byte received
+    long long offset;
+    BOOL started;
 }
+@end
 
+@implementation _IQChunkFetch
 @end
 
 @interface IQStreamingCachedItem () {
-    
+@public
+    NSString* key;
+    NSString* dataPath;
+    NSString* metadataPath;
+    int fd;
+    NSUInteger chunkSize;
+    // One bit per chunk on disk
+    NSMutableData* chunkMap;
+    NSString* validator;
+    NSString* contentType;
+    // The fetch of each chunk in progress, by chunk index
+    NSMutableDictionary* fetches;
+    // A fetch of the whole media (the origin answered with status 200), covering every chunk
+    _IQChunkFetch* wholeFetch;
+    // Blocks waiting for chunks, by chunk index
+    NSMutableDictionary* waiters;
+    NSMutableArray* lengthWaiters;
+    // Read-ahead in chunks, and the chunk last read by the player
+    NSUInteger readAhead;
+    NSUInteger lastRead;
+    // Increased when the media changes at the origin, ending the responses that use the old one
+    NSUInteger generation;
 }
-- (id) initWithURL:(NSURL*)url cache:(IQStreamingMediaCache*)cache;
+- (id) initWithURL:(NSURL*)url key:(NSString*)key cache:(IQStreamingMediaCache*)cache;
+- (void) _serve:(IQHTTPServerRequest*)request;
+- (BOOL) _hasChunk:(NSUInteger)chunk;
+- (void) _whenChunkAvailable:(NSUInteger)chunk handler:(IQStreamingWaiter)handler;
+- (void) _didRead:(NSUInteger)chunk;
 @end
 
+/**
+ Writes a range of an item to the player as its chunks become available, without queueing more
+ than the write buffer of the request holds.
+ */
+@interface _IQStreamingResponse : NSObject {
+@public
+    __weak IQHTTPServerRequest* request;
+    IQStreamingCachedItem* item;
+    long long position, end;
+    NSUInteger generation;
+    NSUInteger chunk;
+    BOOL waiting;
+}
+- (void) pump;
+@end
+
+static NSString* IQStreamingKey(NSURL* url)
+{
+    NSData* data = [url.absoluteString dataUsingEncoding:NSUTF8StringEncoding];
+    unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1(data.bytes, (CC_LONG)data.length, digest);
+    NSMutableString* key = [NSMutableString stringWithCapacity:2*CC_SHA1_DIGEST_LENGTH];
+    for(int i = 0; i < CC_SHA1_DIGEST_LENGTH; i++) {
+        [key appendFormat:@"%02x", digest[i]];
+    }
+    return key;
+}
+
 @implementation IQStreamingMediaCache
 
 static IQStreamingMediaCache* defaultCache = nil;
 static NSMutableDictionary* caches = nil;
 
++ (void) initialize
+{
+    if(self == [IQStreamingMediaCache class]) {
+        caches = [[NSMutableDictionary alloc] init];
+    }
+}
+
 + (IQStreamingMediaCache*) defaultCache
 {
-    if(!defaultCache) defaultCache = [[IQStreamingMediaCache alloc] init];
+    @synchronized(caches) {
+        if(!defaultCache) defaultCache = [[IQStreamingMediaCache alloc] init];
+    }
     return defaultCache;
 }
 
@@ -48,10 +144,20 @@ static NSMutableDictionary* caches = nil;
 }
 
 - (id) initWithName:(NSString *)name
+{
+    NSString* parent = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) lastObject];
+    return [self initWithName:name parent:parent];
+}
+
+- (id) initWithName:(NSString *)name parent:(NSString*)parent
 {
     self = [super init];
     if(self) {
         self->_name = name;
+        self->_localPath = [parent stringByAppendingPathComponent:name];
+        self->_chunkSize = kIQStreamingDefaultChunkSize;
+        self->_maxReadAhead = kIQStreamingDefaultMaxReadAhead;
+        self->items = [[NSMutableDictionary alloc] init];
         @synchronized(caches) {
             if([caches objectForKey:name]) {
                 [NSException raise:@"CacheAlreadyExists" format:@"The cache %@ is already instantiated", name];
@@ -59,33 +165,588 @@ static NSMutableDictionary* caches = nil;
             }
             [caches setObject:[NSValue valueWithNonretainedObject:self] forKey:name];
         }
+        [[NSFileManager defaultManager] createDirectoryAtPath:_localPath withIntermediateDirectories:YES attributes:nil error:nil];
     }
     return self;
 }
 
 - (void) dealloc
 {
+    server.started = NO;
     @synchronized(caches) {
         [caches removeObjectForKey:_name];
     }
 }
 
+- (IQTransferManager*) transferManager
+{
+    @synchronized(self) {
+        if(!_transferManager) {
+            // The cache keeps the media itself. With ignoreCache left at NO, transfers reload without
+            // NSURLCache, so the chunks are not stored twice.
+            _transferManager = [[IQTransferManager alloc] init];
+        }
+        return _transferManager;
+    }
+}
+
 - (IQStreamingCachedItem*) cachedItemAtURL:(NSURL*)url
 {
-    return [[IQStreamingCachedItem alloc] initWithURL:url cache:self];
+    NSString* key = IQStreamingKey(url);
+    @synchronized(self) {
+        IQStreamingCachedItem* item = [items objectForKey:key];
+        if(!item) {
+            item = [[IQStreamingCachedItem alloc] initWithURL:url key:key cache:self];
+            [items setObject:item forKey:key];
+        }
+        return item;
+    }
+}
+
+/**
+ The item with the given key, also one that has not been used in this session but has media on
+ disk from an earlier one.
+ */
+- (IQStreamingCachedItem*) _itemForKey:(NSString*)key
+{
+    @synchronized(self) {
+        IQStreamingCachedItem* item = [items objectForKey:key];
+        if(item) return item;
+    }
+    NSString* metadataPath = [[_localPath stringByAppendingPathComponent:key] stringByAppendingPathExtension:@"plist"];
+    NSDictionary* metadata = [NSDictionary dictionaryWithContentsOfFile:metadataPath];
+    NSString* url = [metadata objectForKey:@"url"];
+    return url ? [self cachedItemAtURL:[NSURL URLWithString:url]] : nil;
+}
+
+- (NSURL*) _localURLForItem:(IQStreamingCachedItem*)item
+{
+    @synchronized(self) {
+        if(!server) {
+            server = [[IQHTTPServer alloc] initWithAddress:@"127.0.0.1" port:0];
+            server.runLoop = [NSRunLoop mainRunLoop];
+            __weak IQStreamingMediaCache* weakSelf = self;
+            [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/([0-9a-f]{40})(/.*)?" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+                IQStreamingCachedItem* item = [weakSelf _itemForKey:[request valueForUrlPatternGroup:1]];
+                if(!item) {
+                    request.statusCode = 404;
+                    [request done];
+                    return;
+                }
+                [item _serve:request];
+            }];
+        }
+        if(!server.started) {
+            server.started = YES;
+            if(!server.started) {
+                NSLog(@"Unable to start the streaming media server: %@", server.lastError);
+                return nil;
+            }
+        }
+    }
+    // Keep the file name, players look at the extension
+    NSString* name = [item.url.lastPathComponent stringByAddingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+    if(name.length == 0 || [name isEqualToString:@"/"]) name = @"media";
+    return [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/%@/%@", server.port, item->key, name]];
 }
 @end
 
 @implementation IQStreamingCachedItem
 
-- (id) initWithURL:(NSURL*)url cache:(IQStreamingMediaCache*)cache
+- (id) initWithURL:(NSURL*)url key:(NSString*)itemKey cache:(IQStreamingMediaCache*)cache
 {
     self = [super init];
     if(self) {
         self->_url = url;
         self->_cache = cache;
+        self->_length = -1;
+        self->key = itemKey;
+        NSString* base = [cache.localPath stringByAppendingPathComponent:itemKey];
+        self->dataPath = [base stringByAppendingPathExtension:@"data"];
+        self->metadataPath = [base stringByAppendingPathExtension:@"plist"];
+        self->fd = -1;
+        self->chunkSize = cache.chunkSize;
+        self->chunkMap = [[NSMutableData alloc] init];
+        self->fetches = [[NSMutableDictionary alloc] init];
+        self->waiters = [[NSMutableDictionary alloc] init];
+        self->lengthWaiters = [[NSMutableArray alloc] init];
+        self->readAhead = kIQStreamingInitialReadAhead;
+        self->lastRead = NSNotFound;
+        [self _loadMetadata];
     }
     return self;
 }
 
+- (void) dealloc
+{
+    if(fd >= 0) close(fd);
+}
+
+- (void) _loadMetadata
+{
+    NSDictionary* metadata = [NSDictionary dictionaryWithContentsOfFile:metadataPath];
+    if(![[metadata objectForKey:@"url"] isEqualToString:_url.absoluteString]) {
+        return;
+    }
+    fd = open(dataPath.fileSystemRepresentation, O_RDWR);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        return;
+    }
+    NSNumber* length = [metadata objectForKey:@"length"];
+    _length = length ? length.longLongValue : -1;
+    NSData* chunks = [metadata objectForKey:@"chunks"];
+    NSUInteger storedChunkSize = [[metadata objectForKey:@"chunkSize"] unsignedIntegerValue];
+    if(chunks && storedChunkSize > 0) {
+        chunkSize = storedChunkSize;
+        [chunkMap setData:chunks];
+    }
+    validator = [metadata objectForKey:@"validator"];
+    contentType = [metadata objectForKey:@"contentType"];
+    // Chunks that end past the end of the data file have been lost
+    for(NSUInteger chunk = 0; chunk < chunkMap.length * 8; chunk++) {
+        long long chunkEnd = (long long)(chunk + 1) * chunkSize;
+        if(_length >= 0) chunkEnd = MIN(chunkEnd, _length);
+        if(chunkEnd > st.st_size) {
+            ((uint8_t*)chunkMap.mutableBytes)[chunk / 8] &= ~(1 << (chunk % 8));
+        }
+    }
+}
+
+- (void) _saveMetadata
+{
+    NSMutableDictionary* metadata = [NSMutableDictionary dictionary];
+    [metadata setObject:_url.absoluteString forKey:@"url"];
+    [metadata setObject:[NSNumber numberWithUnsignedInteger:chunkSize] forKey:@"chunkSize"];
+    [metadata setObject:chunkMap forKey:@"chunks"];
+    if(_length >= 0) [metadata setObject:[NSNumber numberWithLongLong:_length] forKey:@"length"];
+    if(validator) [metadata setObject:validator forKey:@"validator"];
+    if(contentType) [metadata setObject:contentType forKey:@"contentType"];
+    NSData* data = [NSPropertyListSerialization dataWithPropertyList:metadata format:NSPropertyListBinaryFormat_v1_0 options:0 error:nil];
+    [data writeToFile:metadataPath atomically:YES];
+}
+
+- (NSURL*) localURL
+{
+    return [_cache _localURLForItem:self];
+}
+
+- (NSUInteger) _chunkCount
+{
+    return _length < 0 ? NSUIntegerMax : (NSUInteger)((_length + chunkSize - 1) / chunkSize);
+}
+
+- (BOOL) _hasChunk:(NSUInteger)chunk
+{
+    return chunk / 8 < chunkMap.length && (((const uint8_t*)chunkMap.bytes)[chunk / 8] & (1 << (chunk % 8)));
+}
+
+- (long long) cachedLength
+{
+    long long total = 0;
+    NSUInteger count = MIN(self._chunkCount, chunkMap.length * 8);
+    for(NSUInteger chunk = 0; chunk < count; chunk++) {
+        if([self _hasChunk:chunk]) {
+            long long start = (long long)chunk * chunkSize;
+            total += _length < 0 ? chunkSize : MIN((long long)chunkSize, _length - start);
+        }
+    }
+    return total;
+}
+
+- (BOOL) isComplete
+{
+    return _length >= 0 && self.cachedLength == _length;
+}
+
+- (_IQChunkFetch*) _fetchOfChunk:(NSUInteger)chunk
+{
+    return wholeFetch ? wholeFetch : [fetches objectForKey:[NSNumber numberWithUnsignedInteger:chunk]];
+}
+
+#pragma mark - Fetching
+
+/**
+ Fetches the chunks from the given one that are neither on disk nor being fetched, up to count
+ chunks or the next chunk that is. Returns the last chunk fetched, or NSNotFound.
+ */
+- (NSUInteger) _fetchFrom:(NSUInteger)first count:(NSUInteger)count priority:(IQTransferPriority)priority
+{
+    NSUInteger end = MIN(first + count, self._chunkCount);
+    if(first >= end || [self _hasChunk:first] || [self _fetchOfChunk:first]) {
+        return NSNotFound;
+    }
+    if(fd < 0) {
+        fd = open(dataPath.fileSystemRepresentation, O_RDWR | O_CREAT, 0644);
+        if(fd < 0) return NSNotFound;
+    }
+    NSUInteger last = first;
+    while(last + 1 < end && ![self _hasChunk:last + 1] && ![self _fetchOfChunk:last + 1]) {
+        last++;
+    }
+    _IQChunkFetch* fetch = [[_IQChunkFetch alloc] init];
+    fetch->first = first;
+    fetch->last = last;
+    fetch->offset = (long long)first * chunkSize;
+    for(NSUInteger chunk = first; chunk <= last; chunk++) {
+        [fetches setObject:fetch forKey:[NSNumber numberWithUnsignedInteger:chunk]];
+    }
+    IQTransferItem* transfer = [_cache.transferManager downloadDataProgressivelyFromURL:_url handler:^BOOL(NSData *data) {
+        return [self _fetch:fetch received:data];
+    } done:^{
+        [self _fetchEnded:fetch error:NO];
+    } errorHandler:^(NSError *error) {
+        [self _fetchEnded:fetch error:YES];
+    }];
+    long long lastByte = (long long)(last + 1) * chunkSize - 1;
+    if(_length >= 0) lastByte = MIN(lastByte, _length - 1);
+    [transfer setValue:[NSString stringWithFormat:@"bytes=%lld-%lld", fetch->offset, lastByte] forRequestHeaderField:@"Range"];
+    [transfer setValue:@"identity" forRequestHeaderField:@"Accept-Encoding"];
+    if(validator) {
+        // Changed media is sent whole (status 200), replacing the chunks on disk
+        [transfer setValue:validator forRequestHeaderField:@"If-Range"];
+    }
+    transfer.priority = priority;
+    transfer.ignoreErrorStatusCodes = NO;
+    transfer.deliveryQueue = [NSOperationQueue mainQueue];
+    fetch->transfer = transfer;
+    return last;
+}
+
+static BOOL IQStreamingParseContentRange(NSString* value, long long* first, long long* total)
+{
+    NSScanner* scanner = [NSScanner scannerWithString:value];
+    long long last;
+    if(![scanner scanString:@"bytes" intoString:NULL] || ![scanner scanLongLong:first] || ![scanner scanString:@"-" intoString:NULL] || ![scanner scanLongLong:&last] || ![scanner scanString:@"/" intoString:NULL]) {
+        return NO;
+    }
+    if(![scanner scanLongLong:total]) *total = -1;
+    return YES;
+}
+
+- (void) _fetchStarted:(_IQChunkFetch*)fetch
+{
+    IQTransferItem* transfer = fetch->transfer;
+    NSString* etag = [transfer valueForResponseHeaderField:@"ETag"];
+    NSString* responseValidator = (etag.length > 0 && ![etag hasPrefix:@"W/"]) ? etag : [transfer valueForResponseHeaderField:@"Last-Modified"];
+    if(transfer.statusCode == 206) {
+        long long first, total;
+        if(!IQStreamingParseContentRange([transfer valueForResponseHeaderField:@"Content-Range"], &first, &total) || first != fetch->offset) {
+            [self _fetchEnded:fetch error:YES];
+            return;
+        }
+        if(total >= 0) [self _setLength:total];
+    } else {
+        // The whole media, because it changed or because the origin does not do ranges
+        if(!validator || ![validator isEqualToString:responseValidator]) {
+            [self _resetForFetch:fetch];
+        }
+        [fetches removeAllObjects];
+        wholeFetch = fetch;
+        fetch->offset = 0;
+        fetch->first = 0;
+        fetch->last = NSUIntegerMax;
+        NSString* length = [transfer valueForResponseHeaderField:@"Content-Length"];
+        if(length) [self _setLength:length.longLongValue];
+    }
+    if(!validator) validator = responseValidator;
+    NSString* type = [transfer valueForResponseHeaderField:@"Content-Type"];
+    if(type) contentType = type;
+}
+
+- (BOOL) _fetch:(_IQChunkFetch*)fetch received:(NSData*)data
+{
+    IQTransferItem* transfer = fetch->transfer;
+    if(transfer.statusCode >= 300) {
+        // The error handler follows
+        return YES;
+    }
+    if(!fetch->started) {
+        fetch->started = YES;
+        [self _fetchStarted:fetch];
+        if([self _fetchOfChunk:fetch->first] != fetch) {
+            return NO;
+        }
+    }
+    if(pwrite(fd, data.bytes, data.length, fetch->offset) != (ssize_t)data.length) {
+        [self _fetchEnded:fetch error:YES];
+        return NO;
+    }
+    long long start = fetch->offset;
+    fetch->offset += data.length;
+    for(NSUInteger chunk = (NSUInteger)(start / chunkSize); (long long)(chunk + 1) * chunkSize <= fetch->offset; chunk++) {
+        [self _chunkArrived:chunk];
+    }
+    if(_length >= 0 && fetch->offset >= _length && _length > 0) {
+        [self _chunkArrived:(NSUInteger)((_length - 1) / chunkSize)];
+    }
+    return YES;
+}
+
+- (void) _chunkArrived:(NSUInteger)chunk
+{
+    if(chunk / 8 >= chunkMap.length) {
+        [chunkMap setLength:chunk / 8 + 1];
+    }
+    ((uint8_t*)chunkMap.mutableBytes)[chunk / 8] |= 1 << (chunk % 8);
+    NSNumber* index = [NSNumber numberWithUnsignedInteger:chunk];
+    [fetches removeObjectForKey:index];
+    NSArray* handlers = [waiters objectForKey:index];
+    [waiters removeObjectForKey:index];
+    for(IQStreamingWaiter handler in handlers) {
+        handler(YES);
+    }
+}
+
+- (void) _setLength:(long long)length
+{
+    if(_length >= 0) return;
+    _length = length;
+    NSArray* handlers = [lengthWaiters copy];
+    [lengthWaiters removeAllObjects];
+    for(IQStreamingWaiter handler in handlers) {
+        handler(YES);
+    }
+}
+
+/**
+ Ends a fetch, and fails the waiters of the chunks it did not deliver.
+ */
+- (void) _fetchEnded:(_IQChunkFetch*)fetch error:(BOOL)error
+{
+    if(wholeFetch == fetch) {
+        wholeFetch = nil;
+        if(!error && _length < 0) {
+            // Media of unknown length, sent until the connection closed
+            if(fetch->offset > 0 && fetch->offset % chunkSize) {
+                [self _chunkArrived:(NSUInteger)(fetch->offset / chunkSize)];
+            }
+            [self _setLength:fetch->offset];
+        }
+    }
+    NSMutableArray* failed = [NSMutableArray array];
+    for(NSNumber* index in [fetches allKeysForObject:fetch]) {
+        [fetches removeObjectForKey:index];
+    }
+    for(NSNumber* index in waiters.allKeys) {
+        if(![self _hasChunk:index.unsignedIntegerValue] && ![self _fetchOfChunk:index.unsignedIntegerValue]) {
+            [failed addObjectsFromArray:[waiters objectForKey:index]];
+            [waiters removeObjectForKey:index];
+        }
+    }
+    if(_length < 0 && !wholeFetch && fetches.count == 0) {
+        [failed addObjectsFromArray:lengthWaiters];
+        [lengthWaiters removeAllObjects];
+    }
+    [self _saveMetadata];
+    for(IQStreamingWaiter handler in failed) {
+        handler(NO);
+    }
+}
+
+/**
+ Forgets the media on disk after it changed at the origin, keeping only the given fetch.
+ */
+- (void) _resetForFetch:(_IQChunkFetch*)fetch
+{
+    for(_IQChunkFetch* other in [NSSet setWithArray:fetches.allValues]) {
+        if(other != fetch) [other->transfer cancel];
+    }
+    [fetches removeAllObjects];
+    [chunkMap setLength:0];
+    ftruncate(fd, 0);
+    _length = -1;
+    validator = nil;
+    generation++;
+}
+
+/**
+ Cancels the read-ahead that a seek made useless: the low priority fetches that nobody waits
+ for and that are not within read-ahead of the new position.
+ */
+- (void) _cancelReadAheadAround:(NSUInteger)chunk
+{
+    for(_IQChunkFetch* fetch in [NSSet setWithArray:fetches.allValues]) {
+        if(fetch->transfer.priority != IQTransferPriorityLow || (fetch->last >= chunk && fetch->first <= chunk + readAhead)) {
+            continue;
+        }
+        BOOL waitedFor = NO;
+        for(NSNumber* index in [fetches allKeysForObject:fetch]) {
+            waitedFor = waitedFor || [waiters objectForKey:index] != nil;
+        }
+        if(!waitedFor) {
+            [fetch->transfer cancel];
+            [self _fetchEnded:fetch error:YES];
+        }
+    }
+}
+
+#pragma mark - Serving
+
+/**
+ Calls the handler when the chunk is on disk, fetching it with high priority. If the chunk
+ follows the last one read, playback has caught up with read-ahead, so read-ahead grows.
+ */
+- (void) _whenChunkAvailable:(NSUInteger)chunk handler:(IQStreamingWaiter)handler
+{
+    if([self _hasChunk:chunk]) {
+        handler(YES);
+        return;
+    }
+    NSNumber* index = [NSNumber numberWithUnsignedInteger:chunk];
+    NSMutableArray* handlers = [waiters objectForKey:index];
+    if(!handlers) {
+        handlers = [NSMutableArray array];
+        [waiters setObject:handlers forKey:index];
+    }
+    [handlers addObject:[handler copy]];
+    if(lastRead != NSNotFound && chunk == lastRead + 1) {
+        NSUInteger maxReadAhead = MAX(_cache.maxReadAhead / chunkSize, 1);
+        readAhead = MIN(readAhead * 2, maxReadAhead);
+    } else if(lastRead != NSNotFound && chunk != lastRead) {
+        // A seek, fetch only what is needed to continue from there
+        readAhead = kIQStreamingInitialReadAhead;
+    }
+    _IQChunkFetch* fetch = [self _fetchOfChunk:chunk];
+    if(fetch) {
+        fetch->transfer.priority = IQTransferPriorityHigh;
+    } else if([self _fetchFrom:chunk count:readAhead + 1 priority:IQTransferPriorityHigh] == NSNotFound) {
+        [waiters removeObjectForKey:index];
+        handler(NO);
+    }
+}
+
+/**
+ Called when the player reads from a chunk. Keeps read-ahead chunks following it on disk or on
+ their way, and starts over with a small read-ahead after a seek.
+ */
+- (void) _didRead:(NSUInteger)chunk
+{
+    if(lastRead != NSNotFound && chunk != lastRead && chunk != lastRead + 1) {
+        readAhead = kIQStreamingInitialReadAhead;
+        [self _cancelReadAheadAround:chunk];
+    }
+    lastRead = chunk;
+    NSUInteger end = MIN(chunk + 1 + readAhead, self._chunkCount);
+    for(NSUInteger next = chunk + 1; next < end; next++) {
+        NSUInteger last = [self _fetchFrom:next count:end - next priority:IQTransferPriorityLow];
+        if(last != NSNotFound) next = last;
+    }
+}
+
+- (void) _serve:(IQHTTPServerRequest*)request
+{
+    if(_length < 0) {
+        // The response headers need the length, which comes with the first response from the
+        // origin. Fetch the chunk the player asks for, so that a seek does not wait for the start.
+        [lengthWaiters addObject:[^(BOOL available) {
+            if(available) [self _serve:request];
+            else [request cancel];
+        } copy]];
+        NSString* range = [request valueForRequestHeaderField:@"Range"];
+        long long start = [range hasPrefix:@"bytes="] ? [[range substringFromIndex:6] longLongValue] : 0;
+        NSUInteger chunk = (NSUInteger)(MAX(start, 0) / chunkSize);
+        while([self _hasChunk:chunk]) chunk++;
+        if(![self _fetchOfChunk:chunk] && [self _fetchFrom:chunk count:readAhead + 1 priority:IQTransferPriorityHigh] == NSNotFound) {
+            [lengthWaiters removeLastObject];
+            [request cancel];
+        }
+        return;
+    }
+    long long first = 0, last = _length - 1;
+    NSString* range = [request valueForRequestHeaderField:@"Range"];
+    BOOL partial = NO;
+    if(range && _length > 0 && [range hasPrefix:@"bytes="] && [range rangeOfString:@","].location == NSNotFound) {
+        NSString* spec = [range substringFromIndex:6];
+        NSRange dash = [spec rangeOfString:@"-"];
+        if(dash.location != NSNotFound) {
+            NSString* from = [spec substringToIndex:dash.location];
+            NSString* to = [spec substringFromIndex:dash.location + 1];
+            if(from.length == 0) {
+                // The last bytes
+                first = MAX(_length - to.longLongValue, 0);
+                if(to.longLongValue <= 0) first = _length;
+            } else {
+                first = from.longLongValue;
+                if(to.length > 0) last = MIN(to.longLongValue, _length - 1);
+            }
+            if(first >= _length || last < first) {
+                request.statusCode = 416;
+                [request setValue:[NSString stringWithFormat:@"bytes */%lld", _length] forResponseHeaderField:@"Content-Range"];
+                [request done];
+                return;
+            }
+            partial = YES;
+        }
+    }
+    if(partial) {
+        request.statusCode = 206;
+        [request setValue:[NSString stringWithFormat:@"bytes %lld-%lld/%lld", first, last, _length] forResponseHeaderField:@"Content-Range"];
+    }
+    [request setValue:contentType ? contentType : @"application/octet-stream" forResponseHeaderField:@"Content-Type"];
+    [request setValue:@"bytes" forResponseHeaderField:@"Accept-Ranges"];
+    [request setValue:[NSString stringWithFormat:@"%lld", last - first + 1] forResponseHeaderField:@"Content-Length"];
+    if([request.method isEqualToString:@"HEAD"] || _length == 0) {
+        [request done];
+        return;
+    }
+    _IQStreamingResponse* response = [[_IQStreamingResponse alloc] init];
+    response->request = request;
+    response->item = self;
+    response->position = first;
+    response->end = last;
+    response->generation = generation;
+    response->chunk = NSNotFound;
+    request.writableHandler = ^(IQHTTPServerRequest* r) {
+        [response pump];
+    };
+    [response pump];
+}
+
+@end
+
+@implementation _IQStreamingResponse
+
+- (void) pump
+{
+    IQHTTPServerRequest* r = request;
+    if(!r || waiting) return;
+    if(generation != item->generation) {
+        // The media changed at the origin during the response
+        [r cancel];
+        return;
+    }
+    NSUInteger chunkSize = item->chunkSize;
+    while(position <= end && !r.writeBufferFull) {
+        NSUInteger current = (NSUInteger)(position / chunkSize);
+        if(![item _hasChunk:current]) {
+            waiting = YES;
+            [item _whenChunkAvailable:current handler:^(BOOL available) {
+                waiting = NO;
+                if(available) [self pump];
+                else [request cancel];
+            }];
+            return;
+        }
+        if(current != chunk) {
+            chunk = current;
+            [item _didRead:current];
+        }
+        long long chunkEnd = (long long)(current + 1) * chunkSize - 1;
+        size_t length = (size_t)MIN(MIN(chunkEnd, end) - position + 1, kIQStreamingReadSize);
+        void* buffer = malloc(length);
+        ssize_t count = pread(item->fd, buffer, length, position);
+        if(count <= 0) {
+            free(buffer);
+            [r cancel];
+            return;
+        }
+        [r writeData:[NSData dataWithBytesNoCopy:buffer length:count freeWhenDone:YES]];
+        position += count;
+    }
+    if(position > end) {
+        [r done];
+    }
+}
+
 @end
@@ -20,11 +20,13 @@
 #import "IQSerialization.h"
 #import "IQProgressAgregator.h"
 #import "IQMIMEType.h"
+#import "IQHTTPClient.h"
 
 #define kIQTransferManagerErrorDomain @"kIQTransferManagerErrorDomain"
 
 #define kIQTransferCannotWriteFileHandle -1101
 #define kIQTransferCannotOpenOutputFile -1102
+#define kIQTransferUnexpectedRange -1103
 
 typedef void (^IQGenericCallback)();
 typedef BOOL (^IQDataHandler)(NSData* data);
@@ -32,9 +34,36 @@ typedef void (^IQResultHandler)(NSData* result);
 typedef void (^IQErrorHandler)(NSError* error);
 typedef void (^IQStringHandler)(NSString* string);
 typedef void (^IQDictionaryHandler)(NSDictionary* dictionary);
+typedef void (^IQElementHandler)(id element);
+
+typedef enum {
+    /**
+     Prefetching and other bulk transfers that nobody is waiting for.
+     */
+    IQTransferPriorityLow = 0,
+    IQTransferPriorityNormal,
+    /**
+     Transfers that the user is waiting for.
+     */
+    IQTransferPriorityHigh
+} IQTransferPriority;
+
+#define kIQTransferPriorityCount 3
 
 @interface IQTransferItem : NSObject <IQProgressible>
 - (void)startImmediately;
+/**
+ Cancels the transfer. None of its handlers are called after this.
+ */
+- (void)cancel;
+/**
+ Queued transfers are started in priority order. Within a priority, hosts take turns, so that a
+ long queue of transfers from one host does not hold up transfers from the others. May be changed
+ while the transfer is queued.
+ 
+ Default is IQTransferPriorityNormal.
+ */
+@property (nonatomic) IQTransferPriority priority;
 /**
  If set to YES, protocol status codes indicating an error will not result in the 
  error handler being called. Instead, the data associated with the status will be
@@ -44,6 +73,10 @@ typedef void (^IQDictionaryHandler)(NSDictionary* dictionary);
 @property (nonatomic) BOOL ignoreErrorStatusCodes;
 @property (nonatomic) BOOL followRedirects;
 
+/**
+ The status code of the response, or 0 before the response has been received.
+ */
+@property (nonatomic, readonly) NSInteger statusCode;
 @property (nonatomic, readonly) IQMIMEType* contentType;
 @property (nonatomic, retain) IQMIMEType* postDataContentType;
 - (NSString*) valueForResponseHeaderField:(NSString*)field;
@@ -56,6 +89,21 @@ typedef void (^IQDictionaryHandler)(NSDictionary* dictionary);
 @property (nonatomic, retain) NSInputStream* requestBodyStream;
 @property (nonatomic, retain) NSString* requestMethod;
 
+/**
+ The number of response bytes the transfer manager has copied after receiving them: into the
+ result buffer of downloadDataFromURL: and the other methods returning the whole response, or
+ into the write batches of downloadFromURL:toPath:. The result buffer is sized from the
+ Content-Length of the response, so this normally equals the response size; more means the
+ buffer had to grow.
+ */
+@property (nonatomic, readonly) long long bytesCopied;
+
+/**
+ The queue the handlers of this transfer are called on. Default is the deliveryQueue of the
+ IQTransferManager. Must be set before the transfer starts.
+ */
+@property (nonatomic, retain) NSOperationQueue* deliveryQueue;
+
 /**
  Blocks execution until this item transfer has finished.
  
@@ -73,6 +121,23 @@ typedef void (^IQDictionaryHandler)(NSDictionary* dictionary);
 - (IQTransferItem*) postData:(NSData*)postData andDownloadProgressivelyFromURL:(NSURL*)url  handler:(IQDataHandler)progressiveHandler done:(IQGenericCallback)doneHandler errorHandler:(IQErrorHandler)errorHandler;
 - (IQTransferItem*) downloadFromURL:(NSURL*)url toFile:(NSFileHandle*)file done:(IQGenericCallback)doneHandler errorHandler:(IQErrorHandler)errorHandler;
 - (IQTransferItem*) downloadFromURL:(NSURL*)url toPath:(NSString*)path done:(IQGenericCallback)doneHandler errorHandler:(IQErrorHandler)errorHandler;
+/**
+ Like downloadFromURL:toPath:done:errorHandler:, but a failed download leaves what it got in the
+ file, along with the validator of the response (its ETag or Last-Modified date) in a file with
+ ".resume" appended to the path. Downloading the same URL to the same path again requests only
+ the rest of the file (using Range and If-Range), or all of it if it has changed on the server.
+ */
+- (IQTransferItem*) resumableDownloadFromURL:(NSURL*)url toPath:(NSString*)path done:(IQGenericCallback)doneHandler errorHandler:(IQErrorHandler)errorHandler;
+/**
+ Downloads a large file in up to the given number of byte ranges (of at least 1 MB each) at
+ the same time, written directly to their place in the file. The returned transfer gets the
+ beginning of the file, and adds the transfers of the other segments once it knows the size of
+ the file. Cancelling it cancels the whole download. Servers that do not support ranges send the
+ whole file to the first transfer instead.
+ 
+ The handlers are called once, for the whole download. The file is removed if it fails.
+ */
+- (IQTransferItem*) downloadFromURL:(NSURL*)url toPath:(NSString*)path segments:(NSUInteger)segments done:(IQGenericCallback)doneHandler errorHandler:(IQErrorHandler)errorHandler;
 
 - (void) setDefaultValue:(NSString*)value forRequestHeaderField:(NSString *)field;
 
@@ -95,6 +160,21 @@ typedef void (^IQDictionaryHandler)(NSDictionary* dictionary);
  Serialize and post an object and download and deserialize the response.
  */
 - (IQTransferItem*) postObject:(id)object format:(IQSerializationFormat)postFormat andDownloadDictionaryFromURL:(NSURL*)url handler:(IQDictionaryHandler)handler format:(IQSerializationFormat)responseFormat errorHandler:(IQErrorHandler)errorHandler;
+/**
+ Download and deserialize an object, parsing it while it is being received instead of collecting
+ the whole response first. Only JSON can be parsed this way; other formats are decoded once the
+ response is complete, like downloadDictionaryFromURL:handler:format:errorHandler: does.
+ */
+- (IQTransferItem*) downloadDictionaryProgressivelyFromURL:(NSURL*)url handler:(IQDictionaryHandler)handler format:(IQSerializationFormat)format errorHandler:(IQErrorHandler)errorHandler;
+/**
+ Serialize and post an object and deserialize the response while it is being received.
+ */
+- (IQTransferItem*) postObject:(id)object format:(IQSerializationFormat)postFormat andDownloadDictionaryProgressivelyFromURL:(NSURL*)url handler:(IQDictionaryHandler)handler format:(IQSerializationFormat)responseFormat errorHandler:(IQErrorHandler)errorHandler;
+/**
+ Download a JSON array and pass each element to the handler as soon as it has been parsed, so a
+ large feed is never held in memory as a whole. The done handler is called after the last element.
+ */
+- (IQTransferItem*) downloadArrayElementsFromURL:(NSURL*)url handler:(IQElementHandler)handler done:(IQGenericCallback)doneHandler errorHandler:(IQErrorHandler)errorHandler;
 
 /**
  Post the dictionary as a form-encoded data and download the raw response.
@@ -129,6 +209,48 @@ typedef void (^IQDictionaryHandler)(NSDictionary* dictionary);
  */
 @property (nonatomic) NSTimeInterval timeoutInterval;
 
+/**
+ The client used for plain http transfers. It keeps connections open between transfers to the
+ same host, so that many small transfers do not each pay for a new TCP connection. Transfers it
+ cannot handle (such as https) use NSURLConnection.
+ 
+ Default is nil, which means NSURLConnection is used for all transfers.
+ */
+@property (nonatomic, retain) IQHTTPClient* httpClient;
+
+/**
+ The maximum number of transfers in progress at the same time.
+ 
+ Default is 0, which means 6 on WiFi and 3 otherwise, or the connection limit of the httpClient
+ (times its pipeline depth when pipelining) if one is set.
+ */
+@property (nonatomic) NSUInteger maxConcurrentTransfers;
+
+/**
+ If YES, a GET transfer that is started while an identical one (same URL and request headers) is
+ waiting for its response does not go to the network. It receives the response of the other
+ transfer as it arrives instead.
+ 
+ Default is YES.
+ */
+@property (nonatomic) BOOL coalesceRequests;
+
+/**
+ The queue that handlers of new transfers are called on. The handlers of one transfer are called
+ in order, one at a time, also on a concurrent queue. Responses are deserialized on a background
+ queue before the handler is called. The doneHandler of the manager is called on the delivery
+ queue of the transfer that completed last.
+ 
+ Default is nil, which means the main queue.
+ */
+@property (nonatomic, retain) NSOperationQueue* deliveryQueue;
+
+/**
+ The run loop of the thread that transfer managers run their connections on. Pass it to
+ -[IQHTTPClient initWithRunLoop:] to keep the socket work of the client off the main thread too.
+ */
++ (NSRunLoop*) networkRunLoop;
+
 /**
  YES if the transfer manager is currently processing network request(s).
  */
@@ -19,9 +19,25 @@
 #import "IQTransferManager.h"
 #import "IQReachableStatus.h"
 #import "IQMIMEType.h"
+#import "IQJSONStreamParser.h"
+#import <fcntl.h>
+
+#define kIQTransferMaxRedirects 10
+// Result buffers are sized from Content-Length, up to this limit (beyond it they grow as needed)
+#define kIQTransferMaxPresize (64*1024*1024)
+#define kIQTransferInitialBodyCapacity 16384
+// File downloads are written in batches of this size, at most kIQTransferMaxPendingWrites at a time
+#define kIQTransferWriteBatchSize (256*1024)
+#define kIQTransferMaxPendingWrites 4
+// Segmented downloads fetch this much first, to learn the size of the file
+#define kIQTransferFirstSegmentSize (256*1024)
+#define kIQTransferMinSegmentSize (1024*1024)
 
 static NSMutableSet* activeTransferManagers = nil;
 
+typedef id (^IQTransferDecoder)(IQTransferItem* item, NSData* result, NSError** error);
+typedef void (^IQTransferChunkDecoder)(IQTransferItem* item, NSData* data);
+
 @interface IQTransferItem () {
 @private
     IQTransferManager* manager;
@@ -29,39 +45,520 @@ static NSMutableSet* activeTransferManagers = nil;
     NSDictionary* responseHeaders;
     NSMutableURLRequest* request;
     BOOL started, done;
+    IQHTTPClientTask* clientTask;
+    NSURLConnection* urlConnection;
+    int redirects;
+    BOOL hasResponse, receivedData;
+    // Set once the final handler has been called
+    BOOL finished;
+    NSOperation* lastDelivery;
+    // The response body collected for the resultHandler
+    uint8_t* body;
+    size_t bodyLength, bodyCapacity;
+    // Runs the chunkDecoder, and then the resultDecoder, in order
+    dispatch_queue_t decodeQueue;
+@public
+    // Scheduling state, guarded by the manager
+    NSString* hostKey;
+    BOOL queued;
+    // Set on a transfer that receives the response of an identical transfer (its primary)
+    IQTransferItem* primary;
+    NSMutableArray* followers;
 }
 - (id) initWithURL:(NSURL*)url manager:(IQTransferManager*)mgr;
 - (void)_start;
+- (void)_stopNetwork;
+- (void)_markCancelled;
+- (NSString*)_coalescingKey;
+- (BOOL)_canCoalesceWith:(IQTransferItem*)item;
+- (void)_addFollower:(IQTransferItem*)item;
+- (void)_addBytesCopied:(long long)count;
+- (void)_deliverElement:(id)element;
 
 @property (nonatomic, copy) IQDataHandler dataHandler;
 @property (nonatomic, copy) IQGenericCallback doneHandler;
 @property (nonatomic, copy) IQErrorHandler errorHandler;
+// Called with the whole response body, which the transfer collects in a single buffer
+@property (nonatomic, copy) IQResultHandler resultHandler;
+// If set, turns the response body into an object on a background queue, which is passed to the objectHandler
+@property (nonatomic, copy) IQTransferDecoder resultDecoder;
+@property (nonatomic, copy) void (^objectHandler)(id object);
+// If set, is given each piece of the response body on a background queue as it arrives instead of
+// collecting the body, and the resultDecoder is called with a nil body after the last piece
+@property (nonatomic, copy) IQTransferChunkDecoder chunkDecoder;
+// Called with each element the chunkDecoder passes to _deliverElement:
+@property (nonatomic, copy) IQElementHandler elementHandler;
+// Called after the transfer has been cancelled with cancel
+@property (nonatomic, copy) IQGenericCallback cancelHandler;
 @property (nonatomic, readonly) long long size;
 @property (nonatomic, readonly) long long progress;
 @property (nonatomic) NSTimeInterval timeoutInterval;
 @end
 
+/**
+ Writes a download to a file. Data is gathered into batches that are written with pwrite on a
+ background queue, so the thread receiving the data does not wait for the disk (unless the disk
+ falls kIQTransferMaxPendingWrites batches behind).
+ */
+@interface _IQFileSink : NSObject {
+    int fd;
+    off_t offset;
+    NSMutableData* batch;
+    dispatch_semaphore_t pendingWrites;
+    volatile int writeError;
+}
+- (id) initWithPath:(NSString*)path;
+- (id) initWithPath:(NSString*)path offset:(off_t)start truncate:(BOOL)truncate;
+- (void) preallocate:(long long)length;
+- (BOOL) writeData:(NSData*)data;
+- (BOOL) finish;
+- (void) close;
+@property (nonatomic, readonly) NSError* error;
+@property (nonatomic, readonly) long long bytesCopied;
+@end
+
+static dispatch_queue_t IQTransferIOQueue()
+{
+    static dispatch_queue_t queue;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        queue = dispatch_queue_create("IQTransferManager.io", DISPATCH_QUEUE_SERIAL);
+    });
+    return queue;
+}
+
+static int IQTransferWriteFully(int fd, const uint8_t* bytes, size_t length, off_t offset)
+{
+    while(length > 0) {
+        ssize_t n = pwrite(fd, bytes, length, offset);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return errno;
+        }
+        bytes += n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+@implementation _IQFileSink
+@synthesize bytesCopied;
+
+- (id) initWithPath:(NSString*)path
+{
+    return [self initWithPath:path offset:0 truncate:YES];
+}
+
+/**
+ Opens the file for writing from start. If truncate is YES, anything after start is removed (a
+ resumed download continues after what it already has). Otherwise the rest of the file is left
+ as it is, so that several sinks can write different parts of one file.
+ */
+- (id) initWithPath:(NSString*)path offset:(off_t)start truncate:(BOOL)truncate
+{
+    self = [super init];
+    if(self) {
+        fd = open([path fileSystemRepresentation], O_WRONLY | O_CREAT, 0644);
+        if(fd < 0) {
+            return nil;
+        }
+        if(truncate && ftruncate(fd, start) != 0) {
+            close(fd);
+            fd = -1;
+            return nil;
+        }
+        offset = start;
+        pendingWrites = dispatch_semaphore_create(kIQTransferMaxPendingWrites);
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    [self close];
+}
+
+/**
+ Reserves space for the whole file (of the given total length) up front, contiguous if possible,
+ so that it does not fragment as it grows.
+ */
+- (void) preallocate:(long long)length
+{
+    length -= offset;
+    if(length <= 0 || fd < 0) return;
+#ifdef F_PREALLOCATE
+    fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, length, 0};
+    if(fcntl(fd, F_PREALLOCATE, &store) == -1) {
+        store.fst_flags = F_ALLOCATEALL;
+        fcntl(fd, F_PREALLOCATE, &store);
+    }
+#endif
+}
+
+- (void) _write:(NSData*)data
+{
+    dispatch_semaphore_wait(pendingWrites, DISPATCH_TIME_FOREVER);
+    off_t at = offset;
+    offset += data.length;
+    int file = fd;
+    dispatch_async(IQTransferIOQueue(), ^{
+        if(!writeError) {
+            int error = IQTransferWriteFully(file, data.bytes, data.length, at);
+            if(error) {
+                writeError = error;
+            }
+        }
+        dispatch_semaphore_signal(pendingWrites);
+    });
+}
+
+/**
+ Queues data for writing. Returns NO if an earlier write has failed.
+ */
+- (BOOL) writeData:(NSData*)data
+{
+    if(writeError || fd < 0) {
+        return NO;
+    }
+    if(batch.length == 0 && data.length >= kIQTransferWriteBatchSize) {
+        // Large enough to be written as it is
+        [self _write:data];
+        return YES;
+    }
+    if(!batch) {
+        batch = [NSMutableData dataWithCapacity:kIQTransferWriteBatchSize];
+    }
+    [batch appendData:data];
+    bytesCopied += data.length;
+    if(batch.length >= kIQTransferWriteBatchSize) {
+        [self _write:batch];
+        batch = nil;
+    }
+    return YES;
+}
+
+/**
+ Writes what is left and waits for all writes to complete. Returns NO if a write failed.
+ */
+- (BOOL) finish
+{
+    if(batch.length > 0 && fd >= 0) {
+        [self _write:batch];
+    }
+    batch = nil;
+    dispatch_sync(IQTransferIOQueue(), ^{});
+    return writeError == 0;
+}
+
+- (void) close
+{
+    if(fd >= 0) {
+        // Writes still queued refer to the file descriptor
+        dispatch_sync(IQTransferIOQueue(), ^{});
+        close(fd);
+        fd = -1;
+    }
+}
+
+- (NSError*) error
+{
+    NSString* description = writeError ? [NSString stringWithUTF8String:strerror(writeError)] : @"Unable to write output file";
+    return [NSError errorWithDomain:kIQTransferManagerErrorDomain code:kIQTransferCannotWriteFileHandle userInfo:[NSDictionary dictionaryWithObject:description forKey:NSLocalizedDescriptionKey]];
+}
+
+@end
+
+static NSError* IQTransferError(NSInteger code, NSString* description)
+{
+    return [NSError errorWithDomain:kIQTransferManagerErrorDomain code:code userInfo:[NSDictionary dictionaryWithObject:description forKey:NSLocalizedDescriptionKey]];
+}
+
+/**
+ Parses a Content-Range response header, such as "bytes 100-199/1000". first and last are -1 if
+ the range is "*" (the reply to an unsatisfiable range), and total is -1 if it is "*" (unknown).
+ */
+static BOOL IQTransferParseContentRange(NSString* value, long long* first, long long* last, long long* total)
+{
+    if(![value hasPrefix:@"bytes "]) {
+        return NO;
+    }
+    NSScanner* scanner = [NSScanner scannerWithString:[value substringFromIndex:6]];
+    if([scanner scanString:@"*" intoString:NULL]) {
+        *first = *last = -1;
+    } else if(![scanner scanLongLong:first] || ![scanner scanString:@"-" intoString:NULL] || ![scanner scanLongLong:last] || *last < *first) {
+        return NO;
+    }
+    if(![scanner scanString:@"/" intoString:NULL]) {
+        return NO;
+    }
+    if([scanner scanString:@"*" intoString:NULL]) {
+        *total = -1;
+    } else if(![scanner scanLongLong:total]) {
+        return NO;
+    }
+    return YES;
+}
+
+/**
+ The validator to send in If-Range to get more of the same response: its ETag if that is a strong
+ one (weak ones are not allowed in If-Range), otherwise its Last-Modified date.
+ */
+static NSString* IQTransferRangeValidator(IQTransferItem* item)
+{
+    NSString* etag = [item valueForResponseHeaderField:@"ETag"];
+    if(etag.length > 0 && ![etag hasPrefix:@"W/"]) {
+        return etag;
+    }
+    NSString* modified = [item valueForResponseHeaderField:@"Last-Modified"];
+    return modified.length > 0 ? modified : nil;
+}
+
+/**
+ A download split into byte ranges that are transferred in parallel (see
+ downloadFromURL:toPath:segments:done:errorHandler:). Each segment writes its part of the file
+ with its own _IQFileSink. The first segment learns the size of the file and adds the others.
+ */
+@interface _IQSegmentedDownload : NSObject {
+@public
+    NSString* path;
+    NSUInteger segments;
+    // The transfers of all segments, until the download is over
+    NSMutableArray* items;
+    NSUInteger remaining;
+    BOOL over;
+    IQGenericCallback doneHandler;
+    IQErrorHandler errorHandler;
+}
+- (void) addItem:(IQTransferItem*)item;
+- (void) segmentDone;
+- (void) failWithError:(NSError*)error;
+- (void) cancel;
+@end
+
+@implementation _IQSegmentedDownload
+
+- (void) addItem:(IQTransferItem*)item
+{
+    @synchronized(self) {
+        if(!items) {
+            items = [NSMutableArray arrayWithCapacity:segments + 1];
+        }
+        [items addObject:item];
+        remaining++;
+    }
+}
+
+- (void) segmentDone
+{
+    IQGenericCallback handler = nil;
+    @synchronized(self) {
+        if(over || --remaining > 0) return;
+        over = YES;
+        items = nil;
+        handler = doneHandler;
+    }
+    if(handler) {
+        handler();
+    }
+}
+
+/**
+ Cancels all segments and removes the file. Returns NO if the download was already over.
+ */
+- (BOOL) _stop
+{
+    NSArray* stopped = nil;
+    @synchronized(self) {
+        if(over) return NO;
+        over = YES;
+        stopped = items;
+        items = nil;
+    }
+    for(IQTransferItem* item in stopped) {
+        [item cancel];
+    }
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+    return YES;
+}
+
+- (void) failWithError:(NSError*)error
+{
+    if([self _stop] && errorHandler) {
+        errorHandler(error);
+    }
+}
+
+- (void) cancel
+{
+    [self _stop];
+}
+
+@end
+
+/**
+ Transfers waiting to be started. Each priority has a FIFO per host, and the hosts take turns.
+ Removal is lazy: a removed (or re-prioritized) transfer stays in its FIFO and is skipped when it
+ comes up, so removing is O(1).
+ */
+@interface _IQTransferQueue : NSObject {
+@public
+    NSUInteger count;
+    NSMutableArray* hostOrder[kIQTransferPriorityCount];
+    NSMutableDictionary* hostQueues[kIQTransferPriorityCount];
+}
+- (void) addItem:(IQTransferItem*)item;
+- (void) removeItem:(IQTransferItem*)item;
+- (IQTransferItem*) nextItem;
+@end
+
+@implementation _IQTransferQueue
+
+- (id) init
+{
+    self = [super init];
+    if(self) {
+        for(int i = 0; i < kIQTransferPriorityCount; i++) {
+            hostOrder[i] = [NSMutableArray arrayWithCapacity:1];
+            hostQueues[i] = [NSMutableDictionary dictionaryWithCapacity:1];
+        }
+    }
+    return self;
+}
+
+/**
+ Adds a transfer at the end of the FIFO of its host and priority. Adding a queued transfer again
+ (after changing its priority) moves it.
+ */
+- (void) addItem:(IQTransferItem*)item
+{
+    IQTransferPriority priority = MIN(MAX(item.priority, 0), kIQTransferPriorityCount-1);
+    NSMutableArray* items = hostQueues[priority][item->hostKey];
+    if(!items) {
+        items = [NSMutableArray arrayWithCapacity:4];
+        hostQueues[priority][item->hostKey] = items;
+        [hostOrder[priority] addObject:item->hostKey];
+    }
+    [items addObject:item];
+    if(!item->queued) {
+        item->queued = YES;
+        count++;
+    }
+}
+
+- (void) removeItem:(IQTransferItem*)item
+{
+    if(item->queued) {
+        item->queued = NO;
+        count--;
+    }
+}
+
+- (IQTransferItem*) nextItem
+{
+    for(int priority = kIQTransferPriorityCount-1; priority >= 0; priority--) {
+        NSMutableArray* hosts = hostOrder[priority];
+        while(hosts.count > 0) {
+            NSString* host = hosts[0];
+            [hosts removeObjectAtIndex:0];
+            NSMutableArray* items = hostQueues[priority][host];
+            IQTransferItem* found = nil;
+            while(items.count > 0 && !found) {
+                IQTransferItem* item = items[0];
+                [items removeObjectAtIndex:0];
+                if(item->queued && MIN(MAX(item.priority, 0), kIQTransferPriorityCount-1) == priority) {
+                    found = item;
+                }
+            }
+            // The host goes to the back of the line
+            if(items.count > 0) {
+                [hosts addObject:host];
+            } else {
+                [hostQueues[priority] removeObjectForKey:host];
+            }
+            if(found) {
+                [self removeItem:found];
+                return found;
+            }
+        }
+    }
+    return nil;
+}
+
+@end
+
 @interface IQTransferManager () {
-    NSMutableArray* queue;
+    _IQTransferQueue* queue;
     NSMutableSet* progress;
+    // Transfers receiving the response of an identical transfer
+    NSMutableSet* coalesced;
+    // URL -> transfers in progress that can still take followers
+    NSMutableDictionary* coalescing;
     NSMutableDictionary* defaultHeaders;
 }
 
 - (void)_transferCompleted:(IQTransferItem*)item;
+- (void)_cancelTransfer:(IQTransferItem*)item;
+- (void)_requeueTransfer:(IQTransferItem*)item;
+- (void)_endCoalescing:(IQTransferItem*)item;
 - (void)_startTransfer:(IQTransferItem*)transfer;
 - (void)_checkStart;
 - (int)_maxConcurrent;
+- (IQTransferItem*)_downloadFromURL:(NSURL*)url toPath:(NSString*)path resumable:(BOOL)resumable done:(IQGenericCallback)done errorHandler:(IQErrorHandler)errorHandler;
+- (IQTransferItem*)_segmentOf:(_IQSegmentedDownload*)download url:(NSURL*)url from:(long long)from to:(long long)to validator:(NSString*)validator;
+- (void)_addSegmentsOf:(_IQSegmentedDownload*)download url:(NSURL*)url from:(long long)from total:(long long)total validator:(NSString*)validator like:(IQTransferItem*)first;
++ (NSThread*)_networkThread;
 @end
 
 @implementation IQTransferManager
-@synthesize paused, ignoreErrorStatusCodes, timeoutInterval, followRedirects, doneHandler;
+@synthesize paused, ignoreErrorStatusCodes, timeoutInterval, followRedirects, doneHandler, httpClient, maxConcurrentTransfers, coalesceRequests, deliveryQueue;
+
+static NSThread* networkThread = nil;
+static NSRunLoop* networkRunLoop = nil;
+
++ (void) _networkThreadMain:(dispatch_semaphore_t)started
+{
+    @autoreleasepool {
+        [[NSThread currentThread] setName:@"IQTransferManager"];
+        networkRunLoop = [NSRunLoop currentRunLoop];
+        // The run loop needs a source, or it returns immediately
+        [networkRunLoop addPort:[NSMachPort port] forMode:NSDefaultRunLoopMode];
+        dispatch_semaphore_signal(started);
+    }
+    while(true) {
+        @autoreleasepool {
+            [networkRunLoop run];
+        }
+    }
+}
+
++ (NSThread*) _networkThread
+{
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        dispatch_semaphore_t started = dispatch_semaphore_create(0);
+        networkThread = [[NSThread alloc] initWithTarget:self selector:@selector(_networkThreadMain:) object:started];
+        [networkThread start];
+        dispatch_semaphore_wait(started, DISPATCH_TIME_FOREVER);
+    });
+    return networkThread;
+}
+
++ (NSRunLoop*) networkRunLoop
+{
+    [self _networkThread];
+    return networkRunLoop;
+}
 
 - (id) init
 {
     self = [super init];
     if(self) {
-        queue = [NSMutableArray arrayWithCapacity:4];
+        queue = [_IQTransferQueue new];
         progress = [NSMutableSet set];
+        coalesced = [NSMutableSet set];
+        coalescing = [NSMutableDictionary dictionaryWithCapacity:4];
+        coalesceRequests = YES;
         timeoutInterval = 10.0;
         ignoreErrorStatusCodes = NO;
         followRedirects = YES;
@@ -73,7 +570,7 @@ static NSMutableSet* activeTransferManagers = nil;
 {
     while(true) {
         @synchronized(self) {
-            if(queue.count == 0 && progress.count == 0) return;
+            if(queue->count == 0 && progress.count == 0 && coalesced.count == 0) return;
         }
         [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
     }
@@ -82,81 +579,46 @@ static NSMutableSet* activeTransferManagers = nil;
 - (BOOL) isBusy
 {
     @synchronized(self) {
-        return !(queue.count == 0 && progress.count == 0);
+        return !(queue->count == 0 && progress.count == 0 && coalesced.count == 0);
     }
 }
 
 - (IQTransferItem*) postData:(NSData*)postData andDownloadProgressivelyFromURL:(NSURL*)url  handler:(IQDataHandler)progressiveHandler done:(IQGenericCallback)done errorHandler:(IQErrorHandler)errorHandler
 {
-    IQTransferItem* item = [self downloadDataProgressivelyFromURL:url handler:progressiveHandler done:done errorHandler:errorHandler];
+    IQTransferItem* item = [self _itemWithURL:url];
+    item.dataHandler = progressiveHandler;
+    item.doneHandler = done;
+    item.errorHandler = errorHandler;
     item.requestMethod = @"POST";
     item.requestBody = postData;
-    return item;
+    return [self _enqueueTransfer:item];
 }
 
 - (IQTransferItem*) downloadDataProgressivelyFromURL:(NSURL*)url handler:(IQDataHandler)progressiveHandler done:(IQGenericCallback)done errorHandler:(IQErrorHandler)errorHandler
 {
-    IQTransferItem* item = [[IQTransferItem alloc] initWithURL:url manager:self];
+    IQTransferItem* item = [self _itemWithURL:url];
     item.dataHandler = progressiveHandler;
     item.doneHandler = done;
     item.errorHandler = errorHandler;
-    item.timeoutInterval = timeoutInterval;
-    item.ignoreErrorStatusCodes = self.ignoreErrorStatusCodes;
-    item.followRedirects = self.followRedirects;
-    if(defaultHeaders) {
-        for(NSString* key in defaultHeaders.keyEnumerator) {
-            [item setValue:defaultHeaders[key] forRequestHeaderField:key];
-        }
-    }
-    @synchronized(self) {
-        [queue addObject:item];
-        if(activeTransferManagers == nil) {
-            activeTransferManagers = [NSMutableSet setWithCapacity:1];
-        }
-        [activeTransferManagers addObject:self];
-    }
-    dispatch_async(dispatch_get_main_queue(), ^{
-        [self _checkStart];
-    });
-    return item;
+    return [self _enqueueTransfer:item];
 }
 
 - (IQTransferItem*) downloadDataFromURL:(NSURL*)url handler:(IQResultHandler)handler errorHandler:(IQErrorHandler)errorHandler
 {
-    __block NSData* data = nil;
-    __block BOOL isMutable = NO;
-    return [self downloadDataProgressivelyFromURL:url handler:^(NSData *result) {
-        if(data == nil) {
-            data = result;
-        } else {
-            if(!isMutable) data = [data mutableCopy];
-            [(NSMutableData*)data appendData:result];
-        }
-        return YES;
-    } done:^{
-        if(handler) {
-            handler(data);
-        }
-    } errorHandler:errorHandler];
+    IQTransferItem* item = [self _itemWithURL:url];
+    item.resultHandler = handler;
+    item.errorHandler = errorHandler;
+    return [self _enqueueTransfer:item];
 }
 
 - (IQTransferItem*) postData:(NSData*)postData andDownloadDataFromURL:(NSURL*)url handler:(IQResultHandler)handler errorHandler:(IQErrorHandler)errorHandler
 {
-    __block NSData* data = nil;
-    __block BOOL isMutable = NO;
-    return [self postData:postData andDownloadProgressivelyFromURL:url handler:^(NSData *result) {
-        if(data == nil) {
-            data = result;
-        } else {
-            if(!isMutable) data = [data mutableCopy];
-            [(NSMutableData*)data appendData:result];
-        }
-        return YES;
-    } done:^{
-        if(handler) {
-            handler(data);
-        }
-    } errorHandler:errorHandler];
+    IQTransferItem* item = [self _itemWithURL:url];
+    item.resultHandler = handler;
+    item.errorHandler = errorHandler;
+    item.requestMethod = @"POST";
+    item.requestBody = postData;
+    return [self _enqueueTransfer:item];
 }
 
 - (IQTransferItem*) postForm:(NSDictionary*)formData andDownloadDataFromURL:(NSURL*)url handler:(IQResultHandler)handler errorHandler:(IQErrorHandler)errorHandler
@@ -196,82 +658,343 @@ static NSMutableSet* activeTransferManagers = nil;
 
 - (IQTransferItem*) downloadFromURL:(NSURL*)url toPath:(NSString*)path done:(IQGenericCallback)done errorHandler:(IQErrorHandler)errorHandler
 {
-    __block NSFileHandle* file = nil;
-    return [self downloadDataProgressivelyFromURL:url handler:^(NSData *result) {
-        if(!file) {
-            file = [NSFileHandle fileHandleForWritingAtPath:path];
-            if(!file) {
-                if([[NSFileManager defaultManager] createFileAtPath:path contents:nil attributes:nil]) {
-                    file = [NSFileHandle fileHandleForWritingAtPath:path];
+    return [self _downloadFromURL:url toPath:path resumable:NO done:done errorHandler:errorHandler];
+}
+
+- (IQTransferItem*) resumableDownloadFromURL:(NSURL*)url toPath:(NSString*)path done:(IQGenericCallback)done errorHandler:(IQErrorHandler)errorHandler
+{
+    return [self _downloadFromURL:url toPath:path resumable:YES done:done errorHandler:errorHandler];
+}
+
+- (IQTransferItem*) _downloadFromURL:(NSURL*)url toPath:(NSString*)path resumable:(BOOL)resumable done:(IQGenericCallback)done errorHandler:(IQErrorHandler)errorHandler
+{
+    IQTransferItem* item = [self _itemWithURL:url];
+    // The validator of a partial file is kept next to it
+    NSString* resumePath = [path stringByAppendingString:@".resume"];
+    long long resumeOffset = 0;
+    if(resumable) {
+        NSDictionary* state = [NSDictionary dictionaryWithContentsOfFile:resumePath];
+        NSString* validator = state[@"validator"];
+        long long partial = [[[NSFileManager defaultManager] attributesOfItemAtPath:path error:nil] fileSize];
+        if(validator && partial > 0 && [state[@"url"] isEqualToString:url.absoluteString]) {
+            // The server sends the rest if the file is unchanged, otherwise all of it
+            resumeOffset = partial;
+            [item setValue:[NSString stringWithFormat:@"bytes=%lld-", partial] forRequestHeaderField:@"Range"];
+            [item setValue:validator forRequestHeaderField:@"If-Range"];
+            [item setValue:@"identity" forRequestHeaderField:@"Accept-Encoding"];
+        }
+    }
+    __weak IQTransferItem* weakItem = item;
+    __block _IQFileSink* sink = nil;
+    // Closes the file. A failed download is removed, unless it can be resumed later.
+    void (^closeSink)(BOOL) = ^(BOOL failed) {
+        if(sink) {
+            if(failed && resumable) {
+                [sink finish];
+            }
+            [weakItem _addBytesCopied:sink.bytesCopied];
+            [sink close];
+            sink = nil;
+            if(failed && !resumable) {
+                [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+            }
+        }
+        if(!failed && resumable) {
+            [[NSFileManager defaultManager] removeItemAtPath:resumePath error:nil];
+        }
+    };
+    item.dataHandler = ^(NSData *result) {
+        if(!sink) {
+            if(weakItem.statusCode >= 300 && !weakItem.ignoreErrorStatusCodes) {
+                // The body of an error response is not the file, the error handler is called at the end
+                return YES;
+            }
+            off_t start = 0;
+            if(weakItem.statusCode == 206) {
+                long long first, last, total;
+                if(!IQTransferParseContentRange([weakItem valueForResponseHeaderField:@"Content-Range"], &first, &last, &total) || first != resumeOffset) {
+                    [[NSFileManager defaultManager] removeItemAtPath:resumePath error:nil];
+                    if(errorHandler) {
+                        errorHandler(IQTransferError(kIQTransferUnexpectedRange, @"The server sent an unexpected part of the file"));
+                    }
+                    return NO;
+                }
+                start = first;
+            }
+            if(resumable) {
+                NSString* validator = IQTransferRangeValidator(weakItem);
+                if(validator) {
+                    [@{@"url": url.absoluteString, @"validator": validator} writeToFile:resumePath atomically:YES];
+                } else {
+                    [[NSFileManager defaultManager] removeItemAtPath:resumePath error:nil];
                 }
             }
-            if(!file) {
+            sink = [[_IQFileSink alloc] initWithPath:path offset:start truncate:YES];
+            if(!sink) {
                 if(errorHandler) {
-                    errorHandler([NSError errorWithDomain:kIQTransferManagerErrorDomain code:kIQTransferCannotOpenOutputFile userInfo:[NSDictionary dictionaryWithObject:@"Unable to open output file" forKey:NSLocalizedDescriptionKey]]);
+                    errorHandler(IQTransferError(kIQTransferCannotOpenOutputFile, @"Unable to open output file"));
                 }
                 return NO;
             }
+            [sink preallocate:start + weakItem.size];
         }
-        @try {
-            [file writeData:result];
-            return YES;
+        if(![sink writeData:result]) {
+            NSError* error = sink.error;
+            closeSink(YES);
+            if(errorHandler) {
+                errorHandler(error);
+            }
+            return NO;
         }
-        @catch (NSException *exception) {
+        return YES;
+    };
+    item.doneHandler = ^{
+        // Wait for the last batches to reach the file
+        if(sink && ![sink finish]) {
+            NSError* error = sink.error;
+            closeSink(YES);
             if(errorHandler) {
-                errorHandler([NSError errorWithDomain:kIQTransferManagerErrorDomain code:kIQTransferCannotWriteFileHandle userInfo:[NSDictionary dictionaryWithObject:[exception description] forKey:NSLocalizedDescriptionKey]]);
+                errorHandler(error);
             }
-            if(file) {
-                [file closeFile];
-                [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+            return;
+        }
+        closeSink(NO);
+        if(done) {
+            done();
+        }
+    };
+    item.errorHandler = ^(NSError* err) {
+        if(resumable && [err.domain isEqualToString:kIQTransferManagerErrorDomain] && err.code == 416) {
+            long long first, last, total;
+            if(IQTransferParseContentRange([weakItem valueForResponseHeaderField:@"Content-Range"], &first, &last, &total) && total == resumeOffset) {
+                // The partial file was complete already
+                closeSink(NO);
+                if(done) {
+                    done();
+                }
+                return;
             }
-            return NO;
+            // The partial file does not fit the file on the server, start over next time
+            [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+            [[NSFileManager defaultManager] removeItemAtPath:resumePath error:nil];
         }
-    } done:done errorHandler:^(NSError* err) {
+        // The partial file is complete before the handler could try again
+        closeSink(YES);
         if(errorHandler) {
             errorHandler(err);
         }
-        if(file) {
-            [file closeFile];
-            [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+    };
+    return [self _enqueueTransfer:item];
+}
+
+- (IQTransferItem*) downloadFromURL:(NSURL*)url toPath:(NSString*)path segments:(NSUInteger)segments done:(IQGenericCallback)done errorHandler:(IQErrorHandler)errorHandler
+{
+    if(segments <= 1) {
+        return [self downloadFromURL:url toPath:path done:done errorHandler:errorHandler];
+    }
+    _IQSegmentedDownload* download = [_IQSegmentedDownload new];
+    download->path = path;
+    download->segments = segments;
+    download->doneHandler = done;
+    download->errorHandler = errorHandler;
+    // The size of the file is not known yet, so the first request is for the first segment only
+    IQTransferItem* item = [self _segmentOf:download url:url from:0 to:kIQTransferFirstSegmentSize-1 validator:nil];
+    item.cancelHandler = ^{
+        [download cancel];
+    };
+    return [self _enqueueTransfer:item];
+}
+
+/**
+ Creates the transfer of bytes from-to (inclusive) of a segmented download. The first segment
+ also accepts the whole file, from servers that do not support ranges. Once it knows the size of
+ the file, it adds transfers for the rest of it.
+ */
+- (IQTransferItem*) _segmentOf:(_IQSegmentedDownload*)download url:(NSURL*)url from:(long long)from to:(long long)to validator:(NSString*)validator
+{
+    IQTransferItem* item = [self _itemWithURL:url];
+    [item setValue:[NSString stringWithFormat:@"bytes=%lld-%lld", from, to] forRequestHeaderField:@"Range"];
+    [item setValue:@"identity" forRequestHeaderField:@"Accept-Encoding"];
+    if(validator) {
+        // A segment of a changed file gets all of the file (status 200) instead, which fails the download
+        [item setValue:validator forRequestHeaderField:@"If-Range"];
+    }
+    [download addItem:item];
+    __weak IQTransferItem* weakItem = item;
+    __block _IQFileSink* sink = nil;
+    void (^closeSink)() = ^{
+        if(sink) {
+            [weakItem _addBytesCopied:sink.bytesCopied];
+            [sink close];
+            sink = nil;
         }
-    }];
+    };
+    item.dataHandler = ^(NSData *result) {
+        if(!sink) {
+            IQTransferItem* strongItem = weakItem;
+            if(strongItem.statusCode >= 300 && !strongItem.ignoreErrorStatusCodes) {
+                return YES;
+            }
+            long long first, last, total = -1;
+            if(strongItem.statusCode == 206) {
+                if(!IQTransferParseContentRange([strongItem valueForResponseHeaderField:@"Content-Range"], &first, &last, &total) || first != from || last > to || (from > 0 && last != to)) {
+                    [download failWithError:IQTransferError(kIQTransferUnexpectedRange, @"The server sent an unexpected part of the file")];
+                    return NO;
+                }
+            } else if(from > 0) {
+                [download failWithError:IQTransferError(kIQTransferUnexpectedRange, @"The file changed during the download")];
+                return NO;
+            }
+            // Only the first segment creates the file, the others start after it has been sized
+            sink = [[_IQFileSink alloc] initWithPath:download->path offset:from truncate:(from == 0)];
+            if(!sink) {
+                [download failWithError:IQTransferError(kIQTransferCannotOpenOutputFile, @"Unable to open output file")];
+                return NO;
+            }
+            if(from == 0) {
+                [sink preallocate:total > 0 ? total : strongItem.size];
+                if(total > last + 1) {
+                    [self _addSegmentsOf:download url:url from:last + 1 total:total validator:IQTransferRangeValidator(strongItem) like:strongItem];
+                }
+            }
+        }
+        if(![sink writeData:result]) {
+            NSError* error = sink.error;
+            closeSink();
+            [download failWithError:error];
+            return NO;
+        }
+        return YES;
+    };
+    item.doneHandler = ^{
+        if(sink && ![sink finish]) {
+            NSError* error = sink.error;
+            closeSink();
+            [download failWithError:error];
+            return;
+        }
+        closeSink();
+        [download segmentDone];
+    };
+    item.errorHandler = ^(NSError* err) {
+        closeSink();
+        [download failWithError:err];
+    };
+    return item;
+}
+
+/**
+ Splits bytes from-(total-1) of a segmented download into segments, at most one per wanted
+ connection and none smaller than kIQTransferMinSegmentSize.
+ */
+- (void) _addSegmentsOf:(_IQSegmentedDownload*)download url:(NSURL*)url from:(long long)from total:(long long)total validator:(NSString*)validator like:(IQTransferItem*)first
+{
+    long long length = total - from;
+    long long count = MIN((long long)download->segments, (length + kIQTransferMinSegmentSize - 1) / kIQTransferMinSegmentSize);
+    long long segmentSize = (length + count - 1) / count;
+    for(long long start = from; start < total; start += segmentSize) {
+        IQTransferItem* item = [self _segmentOf:download url:url from:start to:MIN(start + segmentSize, total) - 1 validator:validator];
+        item.priority = first.priority;
+        item.deliveryQueue = first.deliveryQueue;
+        [self _enqueueTransfer:item];
+    }
 }
 
 - (IQTransferItem*) downloadStringFromURL:(NSURL*)url handler:(IQStringHandler)handler errorHandler:(IQErrorHandler)errorHandler
 {
-    __block IQTransferItem* ret = nil;
-    ret = [self downloadDataFromURL:url handler:^(NSData *result) {
-        IQMIMEType* mt = ret.contentType;
+    IQTransferItem* item = [self _itemWithURL:url];
+    item.resultDecoder = ^id(IQTransferItem* item, NSData* result, NSError** error) {
+        IQMIMEType* mt = item.contentType;
         NSStringEncoding enc = NSUTF8StringEncoding;
         if(mt) {
             enc = mt.encoding;
             if(!enc) enc = NSISOLatin1StringEncoding;
         }
-        if(handler) {
-            handler([[NSString alloc] initWithData:result encoding:enc]);
+        return [[NSString alloc] initWithData:result encoding:enc];
+    };
+    item.objectHandler = handler;
+    item.errorHandler = errorHandler;
+    return [self _enqueueTransfer:item];
+}
+
+static IQTransferDecoder IQTransferDictionaryDecoder(IQSerializationFormat format)
+{
+    return ^id(IQTransferItem* item, NSData* result, NSError** error) {
+        IQSerialization* ser = [IQSerialization new];
+        NSDictionary* dict = [ser dictionaryFromData:result format:format];
+        if(!dict) {
+            *error = ser.error;
+        }
+        return dict;
+    };
+}
+
+- (IQTransferItem*) downloadDictionaryFromURL:(NSURL*)url handler:(IQDictionaryHandler)handler format:(IQSerializationFormat)format errorHandler:(IQErrorHandler)errorHandler
+{
+    IQTransferItem* item = [self _itemWithURL:url];
+    item.resultDecoder = IQTransferDictionaryDecoder(format);
+    item.objectHandler = handler;
+    item.errorHandler = errorHandler;
+    return [self _enqueueTransfer:item];
+}
+
+/**
+ Parses a JSON response as it arrives, so the body is never collected in one buffer. Elements of a
+ top-level array go to the elementHandler of the transfer, if it has one. Other formats cannot be
+ parsed before they are complete (a binary plist keeps its offset table at the end), and are
+ decoded as usual.
+ */
+static void IQTransferSetStreamingDecoder(IQTransferItem* item, IQSerializationFormat format, Class rootClass)
+{
+    if(format != IQSerializationFormatJSON) {
+        item.resultDecoder = IQTransferDictionaryDecoder(format);
+        return;
+    }
+    IQJSONStreamParser* parser = [IQJSONStreamParser new];
+    if(item.elementHandler) {
+        __weak IQTransferItem* weakItem = item;
+        parser.elementHandler = ^(id element) {
+            [weakItem _deliverElement:element];
+        };
+    }
+    item.chunkDecoder = ^(IQTransferItem* item, NSData* data) {
+        [parser appendData:data];
+    };
+    item.resultDecoder = ^id(IQTransferItem* item, NSData* result, NSError** error) {
+        if(![parser finish]) {
+            *error = parser.error;
+            return nil;
+        }
+        id object = parser.result;
+        if(![object isKindOfClass:rootClass]) {
+            NSString* description = [NSString stringWithFormat:@"The JSON text is not an %@.", rootClass == [NSArray class] ? @"array" : @"object"];
+            *error = [NSError errorWithDomain:NSCocoaErrorDomain code:3840 userInfo:[NSDictionary dictionaryWithObject:description forKey:NSLocalizedDescriptionKey]];
+            return nil;
         }
-    } errorHandler:errorHandler];
-    return ret;
+        return object;
+    };
 }
 
-- (IQTransferItem*) downloadDictionaryFromURL:(NSURL*)url handler:(IQDictionaryHandler)handler format:(IQSerializationFormat)format errorHandler:(IQErrorHandler)errorHandler
+- (IQTransferItem*) downloadDictionaryProgressivelyFromURL:(NSURL*)url handler:(IQDictionaryHandler)handler format:(IQSerializationFormat)format errorHandler:(IQErrorHandler)errorHandler
 {
-    return [self downloadDataFromURL:url handler:^(NSData *result) {
-        IQSerialization* ser = [IQSerialization new];
-        NSDictionary* dict = [ser dictionaryFromData:result format:format];
-        if(!dict) {
-            if(errorHandler) {
-                errorHandler(ser.error);
-            }
-        } else {
-            if(handler) {
-                handler(dict);
-            }
-        }
-    } errorHandler:errorHandler];
+    IQTransferItem* item = [self _itemWithURL:url];
+    IQTransferSetStreamingDecoder(item, format, [NSDictionary class]);
+    item.objectHandler = handler;
+    item.errorHandler = errorHandler;
+    return [self _enqueueTransfer:item];
 }
 
-- (IQTransferItem*) postObject:(id)object format:(IQSerializationFormat)postFormat andDownloadDictionaryFromURL:(NSURL*)url handler:(IQDictionaryHandler)handler format:(IQSerializationFormat)responseFormat errorHandler:(IQErrorHandler)errorHandler
+- (IQTransferItem*) downloadArrayElementsFromURL:(NSURL*)url handler:(IQElementHandler)handler done:(IQGenericCallback)doneHandler errorHandler:(IQErrorHandler)errorHandler
+{
+    IQTransferItem* item = [self _itemWithURL:url];
+    item.elementHandler = handler;
+    IQTransferSetStreamingDecoder(item, IQSerializationFormatJSON, [NSArray class]);
+    item.doneHandler = doneHandler;
+    item.errorHandler = errorHandler;
+    return [self _enqueueTransfer:item];
+}
+
+- (IQTransferItem*) _itemPostingObject:(id)object format:(IQSerializationFormat)postFormat toURL:(NSURL*)url errorHandler:(IQErrorHandler)errorHandler
 {
     IQSerialization* ser = [IQSerialization new];
     NSData* postData = [ser serializeObject:object format:postFormat flags:IQSerializationFlagsDefault];
@@ -281,25 +1004,39 @@ static NSMutableSet* activeTransferManagers = nil;
         }
         return nil;
     }
-    IQTransferItem* item = [self postData:postData andDownloadDataFromURL:url handler:^(NSData *result) {        
-        NSDictionary* dict = [ser dictionaryFromData:result format:responseFormat];
-        if(!dict) {
-            if(errorHandler) {
-                errorHandler(ser.error);
-            }
-        } else {
-            if(handler) {
-                handler(dict);
-            }
-        }
-    } errorHandler:errorHandler];
+    IQTransferItem* item = [self _itemWithURL:url];
+    item.requestMethod = @"POST";
+    item.requestBody = postData;
     IQMIMEType* type = [IQMIMEType MIMETypeForSerializationFormat:postFormat];
     if(type) {
         [item setValue:type.RFCString forRequestHeaderField:@"Content-Type"];
     }
+    item.errorHandler = errorHandler;
     return item;
 }
 
+- (IQTransferItem*) postObject:(id)object format:(IQSerializationFormat)postFormat andDownloadDictionaryFromURL:(NSURL*)url handler:(IQDictionaryHandler)handler format:(IQSerializationFormat)responseFormat errorHandler:(IQErrorHandler)errorHandler
+{
+    IQTransferItem* item = [self _itemPostingObject:object format:postFormat toURL:url errorHandler:errorHandler];
+    if(!item) {
+        return nil;
+    }
+    item.resultDecoder = IQTransferDictionaryDecoder(responseFormat);
+    item.objectHandler = handler;
+    return [self _enqueueTransfer:item];
+}
+
+- (IQTransferItem*) postObject:(id)object format:(IQSerializationFormat)postFormat andDownloadDictionaryProgressivelyFromURL:(NSURL*)url handler:(IQDictionaryHandler)handler format:(IQSerializationFormat)responseFormat errorHandler:(IQErrorHandler)errorHandler
+{
+    IQTransferItem* item = [self _itemPostingObject:object format:postFormat toURL:url errorHandler:errorHandler];
+    if(!item) {
+        return nil;
+    }
+    IQTransferSetStreamingDecoder(item, responseFormat, [NSDictionary class]);
+    item.objectHandler = handler;
+    return [self _enqueueTransfer:item];
+}
+
 - (void) setDefaultValue:(NSString*)value forRequestHeaderField:(NSString *)field
 {
     if(defaultHeaders == nil && value) {
@@ -314,8 +1051,54 @@ static NSMutableSet* activeTransferManagers = nil;
 
 #pragma mark - Internal methods
 
+/**
+ Creates a transfer with the defaults of this manager. It is started with _enqueueTransfer: once
+ it has been set up.
+ */
+- (IQTransferItem*)_itemWithURL:(NSURL*)url
+{
+    IQTransferItem* item = [[IQTransferItem alloc] initWithURL:url manager:self];
+    item.timeoutInterval = timeoutInterval;
+    item.ignoreErrorStatusCodes = self.ignoreErrorStatusCodes;
+    item.followRedirects = self.followRedirects;
+    item.deliveryQueue = deliveryQueue;
+    if(defaultHeaders) {
+        for(NSString* key in defaultHeaders.keyEnumerator) {
+            [item setValue:defaultHeaders[key] forRequestHeaderField:key];
+        }
+    }
+    return item;
+}
+
+- (IQTransferItem*)_enqueueTransfer:(IQTransferItem*)item
+{
+    @synchronized(self) {
+        [queue addItem:item];
+        if(activeTransferManagers == nil) {
+            activeTransferManagers = [NSMutableSet setWithCapacity:1];
+        }
+        [activeTransferManagers addObject:self];
+    }
+    // Started later on the main queue, so that the caller can still set up the request
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [self _checkStart];
+    });
+    return item;
+}
+
 - (int)_maxConcurrent
 {
+    if(maxConcurrentTransfers > 0) {
+        return (int)maxConcurrentTransfers;
+    }
+    if(httpClient) {
+        // Transfers beyond the connection limits wait in the client, where they can be pipelined
+        NSUInteger count = httpClient.maxConnections;
+        if(httpClient.pipeliningEnabled) {
+            count *= MAX(httpClient.maxPipelineDepth, 1);
+        }
+        return (int)count;
+    }
     if([IQReachableStatus currentReachability] == IQNetworkWiFi) {
         return 6;
     } else {
@@ -326,12 +1109,15 @@ static NSMutableSet* activeTransferManagers = nil;
 - (void)_checkStart
 {
     @synchronized(self) {
-        while(queue.count > 0 && progress.count < [self _maxConcurrent]) {
-            IQTransferItem* item = [queue objectAtIndex:0];
-            [queue removeObjectAtIndex:0];
-            [self _startTransfer:item];
+        if(paused) return;
+        while(queue->count > 0 && progress.count < [self _maxConcurrent]) {
+            IQTransferItem* item = [queue nextItem];
+            if(!item) break;
+            if(![self _coalesceTransfer:item]) {
+                [self _startTransfer:item];
+            }
         }
-        if(!queue.count) {
+        if(!queue->count) {
             [activeTransferManagers removeObject:self];
         }
     }
@@ -341,8 +1127,9 @@ static NSMutableSet* activeTransferManagers = nil;
 {
     @synchronized(self) {
         [progress removeObject:item];
+        [coalesced removeObject:item];
         [self _checkStart];
-        if(progress.count == 0 && queue.count == 0 && doneHandler) {
+        if(progress.count == 0 && queue->count == 0 && coalesced.count == 0 && doneHandler) {
             doneHandler();
         }
         [IQProgressAgregator progressChangedForObject:item];
@@ -352,12 +1139,96 @@ static NSMutableSet* activeTransferManagers = nil;
 - (void)_startTransfer:(IQTransferItem*)item
 {
     @synchronized(self) {
-        [progress addObject:item];
+        [queue removeItem:item];
+        // A cancelled transfer is only started to fetch the response for its followers
+        if(!item.isDone) {
+            [progress addObject:item];
+        }
+        if(coalesceRequests) {
+            NSString* key = [item _coalescingKey];
+            if(key) {
+                NSMutableArray* primaries = coalescing[key];
+                if(!primaries) {
+                    primaries = [NSMutableArray arrayWithCapacity:1];
+                    coalescing[key] = primaries;
+                }
+                [primaries addObject:item];
+            }
+        }
         [item _start];
         [IQProgressAgregator progressChangedForObject:item];
     }
 }
 
+/**
+ Attaches a transfer to an identical one that is waiting for its response, if there is one.
+ */
+- (BOOL)_coalesceTransfer:(IQTransferItem*)item
+{
+    if(!coalesceRequests) return NO;
+    NSString* key = [item _coalescingKey];
+    if(!key) return NO;
+    for(IQTransferItem* candidate in coalescing[key]) {
+        if([candidate _canCoalesceWith:item]) {
+            // A cancelled transfer only passes the response on to its own followers
+            if(!item.isDone) {
+                [coalesced addObject:item];
+            }
+            [candidate _addFollower:item];
+            [IQProgressAgregator progressChangedForObject:item];
+            return YES;
+        }
+    }
+    return NO;
+}
+
+- (void)_endCoalescing:(IQTransferItem*)item
+{
+    @synchronized(self) {
+        NSString* key = [item _coalescingKey];
+        NSMutableArray* primaries = key ? coalescing[key] : nil;
+        if(primaries) {
+            [primaries removeObjectIdenticalTo:item];
+            if(primaries.count == 0) {
+                [coalescing removeObjectForKey:key];
+            }
+        }
+    }
+}
+
+- (void)_requeueTransfer:(IQTransferItem*)item
+{
+    @synchronized(self) {
+        if(item->queued) {
+            [queue addItem:item];
+        }
+    }
+}
+
+- (void)_cancelTransfer:(IQTransferItem*)item
+{
+    @synchronized(self) {
+        if(item.isDone) return;
+        [item _markCancelled];
+        IQTransferItem* primary = item->primary;
+        if(primary) {
+            [primary->followers removeObjectIdenticalTo:item];
+            if(primary.isDone && primary->followers.count == 0) {
+                [primary _stopNetwork];
+            }
+        } else if(item->followers.count == 0) {
+            // A transfer with followers keeps going (or stays queued) on their behalf
+            if(item->queued) {
+                [queue removeItem:item];
+            } else {
+                [self _endCoalescing:item];
+                [item _stopNetwork];
+            }
+        }
+        [self _transferCompleted:item];
+    }
+}
+
 - (void)setPaused:(BOOL)newPaused
 {
     if(paused && !newPaused) {
@@ -373,7 +1244,8 @@ static NSMutableSet* activeTransferManagers = nil;
 
 @implementation IQTransferItem
 @synthesize size, progress, ignoreErrorStatusCodes;
-@synthesize dataHandler, doneHandler, errorHandler, followRedirects;
+@synthesize dataHandler, doneHandler, errorHandler, resultHandler, resultDecoder, objectHandler, chunkDecoder, elementHandler, cancelHandler, deliveryQueue;
+@synthesize followRedirects, priority, bytesCopied;
 
 - (id) initWithURL:(NSURL*)url manager:(IQTransferManager*)mgr
 {
@@ -385,6 +1257,8 @@ static NSMutableSet* activeTransferManagers = nil;
         }
         request = [[NSMutableURLRequest alloc] initWithURL:url cachePolicy:cachePolicy timeoutInterval:mgr.timeoutInterval];
         manager = mgr;
+        priority = IQTransferPriorityNormal;
+        hostKey = url.host ? [url.host lowercaseString] : @"";
     }
     return self;
 }
@@ -394,22 +1268,279 @@ static NSMutableSet* activeTransferManagers = nil;
     [manager _startTransfer:self];
 }
 
+- (void)dealloc
+{
+    free(body);
+}
+
+- (void)cancel
+{
+    IQGenericCallback handler = cancelHandler;
+    [manager _cancelTransfer:self];
+    if(handler) {
+        handler();
+    }
+}
+
+- (void)setPriority:(IQTransferPriority)newPriority
+{
+    @synchronized(manager) {
+        if(priority != newPriority) {
+            priority = newPriority;
+            [manager _requeueTransfer:self];
+        }
+    }
+}
+
 - (void)_start
 {
-    if(![NSThread isMainThread]) {
-        dispatch_async(dispatch_get_main_queue(), ^{
-            [NSURLConnection connectionWithRequest:request delegate:self];
-        });
+    IQHTTPClient* client = manager.httpClient;
+    if(client && [IQHTTPClient canHandleRequest:request]) {
+        [self _startWithClient:client request:request];
     } else {
-        [NSURLConnection connectionWithRequest:request delegate:self];
+        [self _startConnectionWithRequest:request];
+    }
+}
+
+- (void)_startConnectionWithRequest:(NSURLRequest*)req
+{
+    // Connections are scheduled on the network thread, handlers are called on the delivery queue
+    [self performSelector:@selector(_openConnection:) onThread:[IQTransferManager _networkThread] withObject:req waitUntilDone:NO];
+}
+
+- (void)_openConnection:(NSURLRequest*)req
+{
+    urlConnection = [NSURLConnection connectionWithRequest:req delegate:self];
+}
+
+/**
+ Stops receiving the response. Called once nobody (neither this transfer nor its followers) wants
+ it anymore.
+ */
+- (void)_stopNetwork
+{
+    [clientTask cancel];
+    [urlConnection performSelector:@selector(cancel) onThread:[IQTransferManager _networkThread] withObject:nil waitUntilDone:NO];
+}
+
+- (void)_markCancelled
+{
+    done = YES;
+    finished = YES;
+    dataHandler = nil;
+    doneHandler = nil;
+    errorHandler = nil;
+    resultHandler = nil;
+    objectHandler = nil;
+    elementHandler = nil;
+    cancelHandler = nil;
+}
+
+#pragma mark - Delivery
+
+/**
+ Calls a handler on the delivery queue. The handlers of a transfer are called in order, one at a
+ time, even if the queue is concurrent.
+ */
+- (void)_deliver:(dispatch_block_t)block
+{
+    NSOperationQueue* queue = deliveryQueue;
+    if(!queue) {
+        if([NSThread isMainThread]) {
+            block();
+        } else {
+            dispatch_async(dispatch_get_main_queue(), block);
+        }
+        return;
+    }
+    NSBlockOperation* operation = [NSBlockOperation blockOperationWithBlock:block];
+    @synchronized(self) {
+        if(lastDelivery && !lastDelivery.isFinished) {
+            [operation addDependency:lastDelivery];
+        }
+        lastDelivery = operation;
+    }
+    [queue addOperation:operation];
+}
+
+- (void)_deliverElement:(id)element
+{
+    [self _deliver:^{
+        if(elementHandler) {
+            elementHandler(element);
+        }
+    }];
+}
+
+/**
+ Delivers the final handler. The transfer counts as in progress until then.
+ */
+- (void)_finish:(dispatch_block_t)block
+{
+    [self _deliver:^{
+        [manager _transferCompleted:self];
+        block();
+        finished = YES;
+    }];
+}
+
+/**
+ Called on the delivery queue when a data handler returns NO.
+ */
+- (void)_handlerStopped
+{
+    @synchronized(manager) {
+        if(done) return;
+        [self _markCancelled];
+        if([self _followers].count == 0) {
+            [self _stopNetwork];
+        }
+    }
+    [manager _transferCompleted:self];
+}
+
+- (void)_addBytesCopied:(long long)count
+{
+    bytesCopied += count;
+}
+
+#pragma mark - Result buffer
+
+/**
+ Sizes the result buffer for the announced length of the response, so that the body is copied
+ into it exactly once.
+ */
+- (void)_reserveBody
+{
+    size_t capacity = (size > 0 && size <= kIQTransferMaxPresize) ? (size_t)size : kIQTransferInitialBodyCapacity;
+    if(capacity > bodyCapacity) {
+        free(body);
+        body = malloc(capacity);
+        bodyCapacity = capacity;
+    }
+    bodyLength = 0;
+}
+
+- (void)_appendBody:(NSData*)data
+{
+    size_t length = data.length;
+    if(bodyLength + length > bodyCapacity) {
+        // Content-Length was missing or wrong. realloc may have to move what has been received.
+        bodyCapacity = MAX(bodyCapacity * 2, bodyLength + length);
+        body = realloc(body, bodyCapacity);
+        bytesCopied += bodyLength;
+    }
+    memcpy(body + bodyLength, data.bytes, length);
+    bodyLength += length;
+    bytesCopied += length;
+}
+
+- (NSData*)_takeBody
+{
+    if(bodyLength == 0) {
+        return nil;
+    }
+    NSData* result = [NSData dataWithBytesNoCopy:body length:bodyLength freeWhenDone:YES];
+    body = NULL;
+    bodyLength = bodyCapacity = 0;
+    return result;
+}
+
+#pragma mark - Coalescing
+
+/**
+ Transfers with the same key may share a response: GET requests without a body, keyed by URL.
+ */
+- (NSString*)_coalescingKey
+{
+    NSString* method = request.HTTPMethod;
+    if((method && ![method isEqualToString:@"GET"]) || request.HTTPBody || request.HTTPBodyStream) {
+        return nil;
+    }
+    return request.URL.absoluteString;
+}
+
+- (BOOL)_canCoalesceWith:(IQTransferItem*)item
+{
+    if(receivedData || followRedirects != item.followRedirects) {
+        return NO;
+    }
+    NSDictionary* headers = request.allHTTPHeaderFields;
+    NSDictionary* otherHeaders = item->request.allHTTPHeaderFields;
+    return (headers.count == 0 && otherHeaders.count == 0) || [headers isEqualToDictionary:otherHeaders];
+}
+
+- (void)_addFollower:(IQTransferItem*)item
+{
+    if(!followers) {
+        followers = [NSMutableArray arrayWithCapacity:1];
+    }
+    [followers addObject:item];
+    item->primary = self;
+    if(hasResponse) {
+        [item _didReceiveResponseWithStatusCode:statusCode headers:responseHeaders];
+    }
+}
+
+- (NSArray*)_followers
+{
+    @synchronized(manager) {
+        return followers.count > 0 ? [followers copy] : nil;
+    }
+}
+
+- (void)_startWithClient:(IQHTTPClient*)client request:(NSURLRequest*)req
+{
+    __block NSURLRequest* redirect = nil;
+    clientTask = [client sendRequest:req responseHandler:^(NSInteger code, NSDictionary *headers) {
+        redirect = [self _redirectForRequest:req statusCode:code headers:headers];
+        if(!redirect) {
+            [self _didReceiveResponseWithStatusCode:code headers:headers];
+        }
+    } dataHandler:^BOOL(NSData *data) {
+        // The body of a redirect response is not interesting
+        return redirect ? YES : [self _didReceiveData:data];
+    } completionHandler:^(NSError *error) {
+        if(error) {
+            [self _didFailWithError:error];
+        } else if(!redirect) {
+            [self _didFinishLoading];
+        } else if([IQHTTPClient canHandleRequest:redirect]) {
+            [self _startWithClient:client request:redirect];
+        } else {
+            [self _startConnectionWithRequest:redirect];
+        }
+    }];
+}
+
+/**
+ Returns the request to send instead if a response is a redirect that should be followed (as
+ NSURLConnection would), otherwise nil.
+ */
+- (NSURLRequest*)_redirectForRequest:(NSURLRequest*)req statusCode:(NSInteger)code headers:(NSDictionary*)headers
+{
+    if(!followRedirects || redirects >= kIQTransferMaxRedirects) return nil;
+    if(code != 301 && code != 302 && code != 303 && code != 307 && code != 308) return nil;
+    NSString* location = headers[@"Location"];
+    NSURL* url = location ? [NSURL URLWithString:location relativeToURL:req.URL] : nil;
+    if(!url) return nil;
+    redirects++;
+    NSMutableURLRequest* next = [req mutableCopy];
+    next.URL = url;
+    if(code == 303 || (code <= 302 && [req.HTTPMethod isEqualToString:@"POST"])) {
+        next.HTTPMethod = @"GET";
+        next.HTTPBody = nil;
+        next.HTTPBodyStream = nil;
+        [next setValue:nil forHTTPHeaderField:@"Content-Type"];
     }
+    return next;
 }
 
 - (void) waitUntilDone
 {
     while(true) {
         @synchronized(self) {
-            if(done) return;
+            if(finished) return;
         }
         [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
     }
@@ -419,23 +1550,19 @@ static NSMutableSet* activeTransferManagers = nil;
 
 - (void)connection:(NSURLConnection *)connection didReceiveResponse:(NSHTTPURLResponse *)response
 {
-    statusCode = (int)response.statusCode;
-    size = [[response.allHeaderFields objectForKey:@"Content-Length"] longLongValue];
-    responseHeaders = response.allHeaderFields;
+    [self _didReceiveResponseWithStatusCode:response.statusCode headers:response.allHeaderFields];
 }
 
 - (void)connection:(NSURLConnection *)connection didReceiveData:(NSData *)data
 {
-    if(!dataHandler(data)) {
+    if(![self _didReceiveData:data]) {
         [connection cancel];
     }
-    progress += data.length;
 }
 
 - (void)connection:(NSURLConnection *)connection didFailWithError:(NSError *)error
 {
-    [manager _transferCompleted:self];
-    errorHandler(error);
+    [self _didFailWithError:error];
     [connection cancel];
 }
 
@@ -450,9 +1577,104 @@ static NSMutableSet* activeTransferManagers = nil;
 
 - (void)connectionDidFinishLoading:(NSURLConnection *)connection
 {
+    [self _didFinishLoading];
+}
+
+#pragma mark - Transfer events (from NSURLConnection or IQHTTPClient)
+
+- (void)_didReceiveResponseWithStatusCode:(NSInteger)code headers:(NSDictionary*)headers
+{
+    statusCode = (int)code;
+    size = [[headers objectForKey:@"Content-Length"] longLongValue];
+    responseHeaders = headers;
+    hasResponse = YES;
+    // The size is known now
+    [IQProgressAgregator progressChangedForObject:self];
+    if(resultHandler || (resultDecoder && !chunkDecoder)) {
+        [self _reserveBody];
+    }
+    for(IQTransferItem* follower in [self _followers]) {
+        [follower _didReceiveResponseWithStatusCode:code headers:headers];
+    }
+}
+
+- (BOOL)_didReceiveData:(NSData*)data
+{
+    if(!receivedData) {
+        // Followers that join now would miss the start of the body
+        receivedData = YES;
+        [manager _endCoalescing:self];
+    }
+    for(IQTransferItem* follower in [self _followers]) {
+        if(![follower _didReceiveData:data]) {
+            @synchronized(manager) {
+                [followers removeObjectIdenticalTo:follower];
+            }
+        }
+    }
+    if(!done) {
+        if(chunkDecoder) {
+            [self _decodeChunk:data];
+        } else if(resultHandler || resultDecoder) {
+            [self _appendBody:data];
+        }
+        progress += data.length;
+        [IQProgressAgregator progressible:self didTransferBytes:data.length];
+        if(dataHandler) {
+            [self _deliver:^{
+                IQDataHandler handler = dataHandler;
+                if(handler && !handler(data)) {
+                    // The handler gave up on the transfer
+                    [self _handlerStopped];
+                }
+            }];
+        }
+    }
+    return !done || [self _followers].count > 0;
+}
+
+/**
+ Passes a piece of the body to the chunk decoder, so decoding overlaps the transfer.
+ */
+- (void)_decodeChunk:(NSData*)data
+{
+    if(!ignoreErrorStatusCodes && statusCode != 200 && statusCode != 206) {
+        // The body of an error response is not what the decoder expects
+        return;
+    }
+    if(!decodeQueue) {
+        decodeQueue = dispatch_queue_create("IQTransferItem.decode", DISPATCH_QUEUE_SERIAL);
+    }
+    IQTransferChunkDecoder decoder = chunkDecoder;
+    dispatch_async(decodeQueue, ^{
+        decoder(self, data);
+    });
+}
+
+- (void)_didFailWithError:(NSError*)error
+{
+    [manager _endCoalescing:self];
+    for(IQTransferItem* follower in [self _followers]) {
+        [follower _didFailWithError:error];
+    }
+    if(done) return;
     done = YES;
-    [manager _transferCompleted:self];
-    if(!ignoreErrorStatusCodes && statusCode != 200) {
+    [self _finish:^{
+        if(errorHandler) {
+            errorHandler(error);
+        }
+    }];
+}
+
+- (void)_didFinishLoading
+{
+    [manager _endCoalescing:self];
+    for(IQTransferItem* follower in [self _followers]) {
+        [follower _didFinishLoading];
+    }
+    if(done) return;
+    done = YES;
+    if(!ignoreErrorStatusCodes && statusCode != 200 && statusCode != 206) {
         NSString* str = nil;
         switch(statusCode) {
             case 401:
@@ -474,13 +1696,45 @@ static NSMutableSet* activeTransferManagers = nil;
                 str = [NSString stringWithFormat:@"Error #%d", statusCode];
         }
         NSError* err = [NSError errorWithDomain:kIQTransferManagerErrorDomain code:statusCode userInfo:[NSDictionary dictionaryWithObject:str forKey:NSLocalizedDescriptionKey]];
-        if(errorHandler) {
-            errorHandler(err);
-        }
+        [self _finish:^{
+            if(errorHandler) {
+                errorHandler(err);
+            }
+        }];
+    } else if(resultDecoder) {
+        // Decoding can take a while, keep it off both the network thread and the delivery queue.
+        // A chunk decoder has its own queue, where it finishes after the pieces it was given.
+        NSData* result = chunkDecoder ? nil : [self _takeBody];
+        IQTransferDecoder decoder = resultDecoder;
+        dispatch_queue_t queue = decodeQueue ? decodeQueue : dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+        dispatch_async(queue, ^{
+            NSError* error = nil;
+            id object = decoder(self, result, &error);
+            [self _finish:^{
+                if(!object && error) {
+                    if(errorHandler) {
+                        errorHandler(error);
+                    }
+                } else {
+                    if(objectHandler) {
+                        objectHandler(object);
+                    }
+                    if(doneHandler) {
+                        doneHandler();
+                    }
+                }
+            }];
+        });
     } else {
-        if(doneHandler) {
-            doneHandler();
-        }
+        NSData* result = resultHandler ? [self _takeBody] : nil;
+        [self _finish:^{
+            if(resultHandler) {
+                resultHandler(result);
+            }
+            if(doneHandler) {
+                doneHandler();
+            }
+        }];
     }
 }
 
@@ -504,6 +1758,11 @@ static NSMutableSet* activeTransferManagers = nil;
     [request setValue:value forHTTPHeaderField:field];
 }
 
+- (NSInteger) statusCode
+{
+    return statusCode;
+}
+
 - (IQMIMEType*) contentType
 {
     NSString* ct = [self valueForResponseHeaderField:@"Content-Type"];
@@ -588,4 +1847,14 @@ static NSMutableSet* activeTransferManagers = nil;
     return done;
 }
 
+- (long long) totalBytes
+{
+    return size;
+}
+
+- (long long) bytesDone
+{
+    return progress;
+}
+
 @end
\ No newline at end of file
@@ -0,0 +1,196 @@
+//
+//  IQHTTPClientTests.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "IQNetworking.h"
+
+#import <XCTest/XCTest.h>
+
+@interface IQHTTPClientTests : XCTestCase
+@end
+
+@implementation IQHTTPClientTests
+
+- (IQHTTPServer*) startServer
+{
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/item/([0-9]+)" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeString:[request valueForUrlPatternGroup:1]];
+        [request done];
+    }];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/echo" options:0 error:nil] method:@"POST" callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request readRequestBody:^(IQHTTPServerRequest *request, NSData *data) {
+            [request writeData:data];
+            [request done];
+        } atomic:YES];
+    }];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/slow" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        // The rest of the body is written later, so the response is sent with chunked encoding
+        [request writeString:@"first,"];
+        CFRunLoopTimerRef timer = CFRunLoopTimerCreateWithHandler(NULL, CFAbsoluteTimeGetCurrent() + 0.1, 0, 0, 0, ^(CFRunLoopTimerRef timer) {
+            [request writeString:@"second"];
+            [request done];
+        });
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopCommonModes);
+        CFRelease(timer);
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    return server;
+}
+
+- (NSURL*) URLForPath:(NSString*)path server:(IQHTTPServer*)server
+{
+    return [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d%@", server.port, path]];
+}
+
+- (void) testConnectionReuse
+{
+    IQHTTPServer* server = [self startServer];
+    IQTransferManager* tm = [IQTransferManager new];
+    tm.httpClient = [IQHTTPClient new];
+    __block int completed = 0;
+    for(int i = 0; i < 50; i++) {
+        NSString* expected = [NSString stringWithFormat:@"%d", i];
+        [tm downloadStringFromURL:[self URLForPath:[@"/item/" stringByAppendingString:expected] server:server] handler:^(NSString *string) {
+            XCTAssertEqualObjects(string, expected);
+            completed++;
+        } errorHandler:^(NSError *error) {
+            XCTFail(@"Failed with error %@", error);
+        }];
+    }
+    [tm waitUntilEmpty];
+    XCTAssertEqual(completed, 50);
+    XCTAssertTrue(tm.httpClient.connectionsOpened <= tm.httpClient.maxConnectionsPerHost, @"Connections should be reused, %lu were opened", (unsigned long)tm.httpClient.connectionsOpened);
+    server.started = NO;
+}
+
+- (void) testPipelining
+{
+    IQHTTPServer* server = [self startServer];
+    IQTransferManager* tm = [IQTransferManager new];
+    IQHTTPClient* client = [IQHTTPClient new];
+    client.maxConnectionsPerHost = 1;
+    client.pipeliningEnabled = YES;
+    tm.httpClient = client;
+    
+    // Requests are only pipelined once the connection is known to be kept alive
+    [tm downloadStringFromURL:[self URLForPath:@"/item/0" server:server] handler:nil errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    
+    NSMutableArray* results = [NSMutableArray arrayWithCapacity:20];
+    for(int i = 1; i <= 20; i++) {
+        [tm downloadStringFromURL:[self URLForPath:[NSString stringWithFormat:@"/item/%d", i] server:server] handler:^(NSString *string) {
+            [results addObject:string];
+        } errorHandler:^(NSError *error) {
+            XCTFail(@"Failed with error %@", error);
+        }];
+    }
+    [tm waitUntilEmpty];
+    NSMutableArray* expected = [NSMutableArray arrayWithCapacity:20];
+    for(int i = 1; i <= 20; i++) {
+        [expected addObject:[NSString stringWithFormat:@"%d", i]];
+    }
+    XCTAssertEqualObjects(results, expected, @"Responses should arrive in request order");
+    XCTAssertEqual((int)client.connectionsOpened, 1);
+    server.started = NO;
+}
+
+- (void) testPostAndChunkedResponse
+{
+    IQHTTPServer* server = [self startServer];
+    IQTransferManager* tm = [IQTransferManager new];
+    tm.httpClient = [IQHTTPClient new];
+    [tm postData:[@"payload" dataUsingEncoding:NSUTF8StringEncoding] andDownloadDataFromURL:[self URLForPath:@"/echo" server:server] handler:^(NSData *result) {
+        XCTAssertEqualObjects([[NSString alloc] initWithData:result encoding:NSUTF8StringEncoding], @"payload");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm downloadStringFromURL:[self URLForPath:@"/slow" server:server] handler:^(NSString *string) {
+        XCTAssertEqualObjects(string, @"first,second");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm downloadStringFromURL:[self URLForPath:@"/missing" server:server] handler:^(NSString *string) {
+        XCTFail(@"Expected 404 error");
+    } errorHandler:^(NSError *error) {
+        XCTAssertEqual((int)error.code, 404);
+    }];
+    [tm waitUntilEmpty];
+    server.started = NO;
+}
+
+- (void) testServerClosesIdleConnection
+{
+    IQHTTPServer* server = [self startServer];
+    server.keepAliveTimeout = 0.2;
+    IQTransferManager* tm = [IQTransferManager new];
+    IQHTTPClient* client = [IQHTTPClient new];
+    client.maxConnectionsPerHost = 1;
+    tm.httpClient = client;
+    [tm downloadStringFromURL:[self URLForPath:@"/item/1" server:server] handler:nil errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    
+    // The server closes the idle connection, and the client opens a new one for the next request
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.5]];
+    [tm downloadStringFromURL:[self URLForPath:@"/item/2" server:server] handler:^(NSString *string) {
+        XCTAssertEqualObjects(string, @"2");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    XCTAssertEqual((int)client.connectionsOpened, 2);
+    server.started = NO;
+}
+
+- (void) testCancelQueuedRequest
+{
+    IQHTTPServer* server = [self startServer];
+    IQHTTPClient* client = [IQHTTPClient new];
+    client.maxConnectionsPerHost = 1;
+    NSMutableArray* completed = [NSMutableArray array];
+    [client sendRequest:[NSURLRequest requestWithURL:[self URLForPath:@"/slow" server:server]] responseHandler:nil dataHandler:nil completionHandler:^(NSError *error) {
+        XCTAssertNil(error);
+        [completed addObject:@"slow"];
+    }];
+    
+    // The next requests wait for the only connection, so the first of them is cancelled while queued
+    IQHTTPClientTask* queued = [client sendRequest:[NSURLRequest requestWithURL:[self URLForPath:@"/item/1" server:server]] responseHandler:^(NSInteger statusCode, NSDictionary *headers) {
+        XCTFail(@"A cancelled request should get no callbacks");
+    } dataHandler:nil completionHandler:^(NSError *error) {
+        XCTFail(@"A cancelled request should get no callbacks");
+    }];
+    [client sendRequest:[NSURLRequest requestWithURL:[self URLForPath:@"/item/2" server:server]] responseHandler:nil dataHandler:nil completionHandler:^(NSError *error) {
+        XCTAssertNil(error);
+        [completed addObject:@"2"];
+    }];
+    [queued cancel];
+    
+    NSDate* deadline = [NSDate dateWithTimeIntervalSinceNow:5];
+    while(completed.count < 2 && [deadline timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    }
+    XCTAssertEqualObjects(completed, (@[@"slow", @"2"]));
+    XCTAssertEqual((int)client.connectionsOpened, 1);
+    server.started = NO;
+}
+
+@end
@@ -0,0 +1,196 @@
+//
+//  IQHTTPParserTests.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "IQHTTPParser.h"
+
+#import <XCTest/XCTest.h>
+#if TARGET_OS_IPHONE
+#import <CFNetwork/CFNetwork.h>
+#else
+#import <CoreServices/CoreServices.h>
+#endif
+
+static const char* kTypicalRequest =
+    "GET /api/items/1234?format=json HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8080\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_8_2) AppleWebKit/536.26.17 (KHTML, like Gecko)\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-us\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Cookie: session=0123456789abcdef; theme=dark\r\n"
+    "If-None-Match: \"abc-123\"\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+#define kIQHTTPParserBenchmarkIterations 20000
+
+@interface IQHTTPParserTests : XCTestCase
+@end
+
+@implementation IQHTTPParserTests {
+    IQHTTPHeaderField fields[kIQHTTPParserDefaultMaxHeaderCount];
+    IQHTTPParser parser;
+}
+
+- (void) setUp
+{
+    [super setUp];
+    IQHTTPParserInit(&parser, fields, kIQHTTPParserDefaultMaxHeaderCount, kIQHTTPParserDefaultMaxHeaderSize);
+}
+
+- (NSString*) stringForSpan:(IQHTTPSpan)span inBuffer:(const char*)buffer
+{
+    return [[NSString alloc] initWithBytes:buffer+span.offset length:span.length encoding:NSUTF8StringEncoding];
+}
+
+- (NSString*) valueForField:(const char*)name inBuffer:(const char*)buffer
+{
+    NSUInteger i = IQHTTPParserFindField(parser.fields, parser.fieldCount, (const uint8_t*)buffer, name, strlen(name), 0);
+    if(i == NSNotFound) return nil;
+    return [self stringForSpan:parser.fields[i].value inBuffer:buffer];
+}
+
+- (void) testParseRequest
+{
+    size_t length = strlen(kTypicalRequest);
+    XCTAssertEqual(IQHTTPParserExecute(&parser, (const uint8_t*)kTypicalRequest, length), IQHTTPParserHeadComplete);
+    XCTAssertEqual(parser.position, length, @"Head length should cover the entire request");
+    XCTAssertEqualObjects([self stringForSpan:parser.method inBuffer:kTypicalRequest], @"GET");
+    XCTAssertEqualObjects([self stringForSpan:parser.target inBuffer:kTypicalRequest], @"/api/items/1234?format=json");
+    XCTAssertEqual(parser.versionMajor, 1);
+    XCTAssertEqual(parser.versionMinor, 1);
+    XCTAssertEqual((int)parser.fieldCount, 9);
+    XCTAssertEqualObjects([self valueForField:"host" inBuffer:kTypicalRequest], @"127.0.0.1:8080");
+    XCTAssertEqualObjects([self valueForField:"IF-NONE-MATCH" inBuffer:kTypicalRequest], @"\"abc-123\"");
+    XCTAssertNil([self valueForField:"Range" inBuffer:kTypicalRequest]);
+    XCTAssertEqual(parser.contentLength, -1LL);
+    XCTAssertTrue(parser.keepAlive);
+}
+
+- (void) testParseIncrementally
+{
+    // Feed the request one byte at a time, as a slow client would
+    size_t length = strlen(kTypicalRequest);
+    for(size_t i = 1; i < length; i++) {
+        XCTAssertEqual(IQHTTPParserExecute(&parser, (const uint8_t*)kTypicalRequest, i), IQHTTPParserNeedMoreData, @"Head reported complete at %d bytes", (int)i);
+    }
+    XCTAssertEqual(IQHTTPParserExecute(&parser, (const uint8_t*)kTypicalRequest, length), IQHTTPParserHeadComplete);
+    XCTAssertEqual((int)parser.fieldCount, 9);
+    XCTAssertEqualObjects([self valueForField:"Cookie" inBuffer:kTypicalRequest], @"session=0123456789abcdef; theme=dark");
+}
+
+- (void) testParseFraming
+{
+    const char* request = "\r\nPOST /upload HTTP/1.0\nContent-Length:  42 \nConnection: Keep-Alive\n\nbody";
+    XCTAssertEqual(IQHTTPParserExecute(&parser, (const uint8_t*)request, strlen(request)), IQHTTPParserHeadComplete);
+    XCTAssertEqualObjects([self stringForSpan:parser.method inBuffer:request], @"POST");
+    XCTAssertEqual(parser.contentLength, 42LL);
+    XCTAssertTrue(parser.keepAlive);
+    XCTAssertEqual(parser.position, strlen(request)-4, @"Body should not be part of the head");
+
+    IQHTTPParserReset(&parser);
+    request = "PUT / HTTP/1.1\r\nContent-Length: 10\r\nTransfer-Encoding: gzip, chunked\r\nConnection: close\r\n\r\n";
+    XCTAssertEqual(IQHTTPParserExecute(&parser, (const uint8_t*)request, strlen(request)), IQHTTPParserHeadComplete);
+    XCTAssertTrue(parser.chunked);
+    XCTAssertEqual(parser.contentLength, -1LL, @"Transfer-Encoding should override Content-Length");
+    XCTAssertFalse(parser.keepAlive);
+}
+
+- (void) testParseErrors
+{
+    const char* bad[] = {
+        "GET /\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost localhost\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost : localhost\r\n\r\n",
+        "GET / HTTP/1.1\r\nX-Folded: a\r\n b\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 12a\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n",
+    };
+    for(int i = 0; i < sizeof(bad)/sizeof(bad[0]); i++) {
+        IQHTTPParserReset(&parser);
+        XCTAssertEqual(IQHTTPParserExecute(&parser, (const uint8_t*)bad[i], strlen(bad[i])), IQHTTPParserBadRequest, @"Request %d should be rejected", i);
+    }
+
+    IQHTTPParserInit(&parser, fields, 4, 64);
+    const char* many = "GET / HTTP/1.1\r\nA: 1\r\nB: 2\r\nC: 3\r\nD: 4\r\nE: 5\r\n\r\n";
+    XCTAssertEqual(IQHTTPParserExecute(&parser, (const uint8_t*)many, strlen(many)), IQHTTPParserTooManyHeaders);
+    IQHTTPParserReset(&parser);
+    XCTAssertEqual(IQHTTPParserExecute(&parser, (const uint8_t*)kTypicalRequest, strlen(kTypicalRequest)), IQHTTPParserHeaderTooLarge);
+}
+
+#pragma mark - Benchmarks
+
+/**
+ Baseline: the way IQHTTPServer used to read requests, appending each line to a CFHTTPMessage and
+ then copying the header values out of it.
+ */
+- (void) testPerformanceCFHTTPMessage
+{
+    const char* request = kTypicalRequest;
+    [self measureBlock:^{
+        for(int i = 0; i < kIQHTTPParserBenchmarkIterations; i++) {
+            @autoreleasepool {
+                CFHTTPMessageRef msg = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, TRUE);
+                const char* line = request;
+                while(!CFHTTPMessageIsHeaderComplete(msg)) {
+                    const char* nl = strchr(line, '\n');
+                    CFHTTPMessageAppendBytes(msg, (const UInt8*)line, nl-line+1);
+                    line = nl+1;
+                }
+                CFStringRef method = CFHTTPMessageCopyRequestMethod(msg);
+                CFURLRef url = CFHTTPMessageCopyRequestURL(msg);
+                CFStringRef host = CFHTTPMessageCopyHeaderFieldValue(msg, CFSTR("Host"));
+                CFStringRef etag = CFHTTPMessageCopyHeaderFieldValue(msg, CFSTR("If-None-Match"));
+                if(method) CFRelease(method);
+                if(url) CFRelease(url);
+                if(host) CFRelease(host);
+                if(etag) CFRelease(etag);
+                CFRelease(msg);
+            }
+        }
+    }];
+}
+
+- (void) testPerformanceIQHTTPParser
+{
+    const uint8_t* request = (const uint8_t*)kTypicalRequest;
+    size_t length = strlen(kTypicalRequest);
+    [self measureBlock:^{
+        IQHTTPHeaderField benchmarkFields[kIQHTTPParserDefaultMaxHeaderCount];
+        IQHTTPParser p;
+        IQHTTPParserInit(&p, benchmarkFields, kIQHTTPParserDefaultMaxHeaderCount, kIQHTTPParserDefaultMaxHeaderSize);
+        for(int i = 0; i < kIQHTTPParserBenchmarkIterations; i++) {
+            @autoreleasepool {
+                IQHTTPParserReset(&p);
+                // Same access pattern as the baseline: the head arrives line by line
+                const uint8_t* nl = request;
+                while(IQHTTPParserExecute(&p, request, nl-request) == IQHTTPParserNeedMoreData) {
+                    nl = memchr(nl, '\n', length-(nl-request))+1;
+                }
+                NSString* target = [[NSString alloc] initWithBytes:request+p.target.offset length:p.target.length encoding:NSUTF8StringEncoding];
+                NSUInteger host = IQHTTPParserFindField(p.fields, p.fieldCount, request, "Host", 4, 0);
+                NSUInteger etag = IQHTTPParserFindField(p.fields, p.fieldCount, request, "If-None-Match", 13, 0);
+                NSString* hostValue = [[NSString alloc] initWithBytes:request+p.fields[host].value.offset length:p.fields[host].value.length encoding:NSUTF8StringEncoding];
+                NSString* etagValue = [[NSString alloc] initWithBytes:request+p.fields[etag].value.offset length:p.fields[etag].value.length encoding:NSUTF8StringEncoding];
+                (void)target; (void)hostValue; (void)etagValue;
+            }
+        }
+    }];
+}
+
+@end
@@ -0,0 +1,196 @@
+//
+//  IQHTTPRouteTests.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "IQNetworking.h"
+
+#import <XCTest/XCTest.h>
+
+#define kIQHTTPRouteBenchmarkIterations 1000
+
+// Route lookup is internal to the server, but it is what the benchmarks below measure
+@interface IQHTTPServer (RouteTests)
+- (id) _handlerForResource:(NSString*)resource method:(NSString*)method result:(NSTextCheckingResult**)result allowedMethods:(NSMutableSet*)allowedMethods;
+@end
+
+@interface IQHTTPRouteTests : XCTestCase
+@end
+
+@implementation IQHTTPRouteTests
+
+- (NSRegularExpression*) pattern:(NSString*)pattern
+{
+    return [NSRegularExpression regularExpressionWithPattern:pattern options:0 error:nil];
+}
+
+- (NSString*) routeResource:(NSString*)resource method:(NSString*)method server:(IQHTTPServer*)server result:(NSTextCheckingResult**)result
+{
+    id handler = [server _handlerForResource:resource method:method result:result allowedMethods:[NSMutableSet set]];
+    return [[handler valueForKey:@"regexp"] pattern];
+}
+
+- (void) testRouteSelection
+{
+    IQHTTPServer* server = [IQHTTPServer new];
+    IQHTTPRequestCallback cb = ^(IQHTTPServerRequest *request, NSInteger sequence) {};
+    [server addURLPattern:[self pattern:@"/items/([0-9]+)"] callback:cb];
+    [server addURLPattern:[self pattern:@"/items/new"] callback:cb];
+    [server addURLPattern:[self pattern:@"/items?/(.*)"] callback:cb];
+    [server addURLPattern:[self pattern:@"/files\\.d/(.+)"] callback:cb];
+    [server addURLPattern:[self pattern:@".*\\.png"] callback:cb];
+    [server addURLPattern:[self pattern:@"/a|/b"] callback:cb];
+
+    NSTextCheckingResult* result = nil;
+    XCTAssertEqualObjects([self routeResource:@"/items/42" method:@"GET" server:server result:&result], @"/items/([0-9]+)");
+    XCTAssertEqualObjects([@"/items/42" substringWithRange:[result rangeAtIndex:1]], @"42", @"Capture groups should be available");
+    XCTAssertEqualObjects([self routeResource:@"/items/new" method:@"GET" server:server result:&result], @"/items/new");
+    // Optional characters are not part of the literal prefix
+    XCTAssertEqualObjects([self routeResource:@"/item/x" method:@"GET" server:server result:&result], @"/items?/(.*)");
+    XCTAssertEqualObjects([self routeResource:@"/items/x" method:@"GET" server:server result:&result], @"/items?/(.*)");
+    XCTAssertEqualObjects([self routeResource:@"/files.d/a.txt" method:@"GET" server:server result:&result], @"/files\\.d/(.+)");
+    XCTAssertNil([self routeResource:@"/filesXd/a.txt" method:@"GET" server:server result:&result]);
+    // Patterns without a literal prefix are still matched, in the order they were added
+    XCTAssertEqualObjects([self routeResource:@"/other/42.png" method:@"GET" server:server result:&result], @".*\\.png");
+    XCTAssertEqualObjects([self routeResource:@"/files.d/a.png" method:@"GET" server:server result:&result], @"/files\\.d/(.+)");
+    XCTAssertEqualObjects([self routeResource:@"/b" method:@"GET" server:server result:&result], @"/a|/b");
+    XCTAssertNil([self routeResource:@"/other" method:@"GET" server:server result:&result]);
+}
+
+- (void) testMethodRouting
+{
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[self pattern:@"/things"] method:@"GET" callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeString:@"list"];
+        [request done];
+    }];
+    [server addURLPattern:[self pattern:@"/things"] method:@"POST" callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeString:@"created"];
+        [request done];
+    }];
+    [server addURLPattern:[self pattern:@"/readonly"] method:@"GET" callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+
+    IQTransferManager* tm = [IQTransferManager new];
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/things", server.port]];
+    [tm downloadStringFromURL:url handler:^(NSString *string) {
+        XCTAssertEqualObjects(string, @"list");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm postData:[@"x" dataUsingEncoding:NSUTF8StringEncoding] andDownloadDataFromURL:url handler:^(NSData *result) {
+        XCTAssertEqualObjects([[NSString alloc] initWithData:result encoding:NSUTF8StringEncoding], @"created");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/readonly", server.port]];
+    [tm postData:[@"x" dataUsingEncoding:NSUTF8StringEncoding] andDownloadDataFromURL:url handler:^(NSData *result) {
+        XCTFail(@"Expected 405 error");
+    } errorHandler:^(NSError *error) {
+        XCTAssertEqual(405, (int)error.code, @"Expected 405 error");
+    }];
+    [tm waitUntilEmpty];
+
+    server.started = NO;
+}
+
+#pragma mark - Benchmarks
+
+- (IQHTTPServer*) serverWithRoutes:(NSUInteger)count
+{
+    IQHTTPServer* server = [IQHTTPServer new];
+    IQHTTPRequestCallback cb = ^(IQHTTPServerRequest *request, NSInteger sequence) {};
+    for(NSUInteger i = 0; i < count; i++) {
+        [server addURLPattern:[self pattern:[NSString stringWithFormat:@"/api/v1/resource%lu/([0-9]+)", (unsigned long)i]] callback:cb];
+    }
+    return server;
+}
+
+/**
+ Routes requests for the last added pattern, the worst case for a linear scan.
+ */
+- (void) measureRoutes:(NSUInteger)count
+{
+    IQHTTPServer* server = [self serverWithRoutes:count];
+    NSString* resource = [NSString stringWithFormat:@"/api/v1/resource%lu/42", (unsigned long)count-1];
+    [self measureBlock:^{
+        for(int i = 0; i < kIQHTTPRouteBenchmarkIterations; i++) {
+            @autoreleasepool {
+                NSTextCheckingResult* result = nil;
+                id handler = [server _handlerForResource:resource method:@"GET" result:&result allowedMethods:nil];
+                XCTAssertNotNil(handler);
+            }
+        }
+    }];
+}
+
+/**
+ Baseline: the linear regular expression scan used before the route index.
+ */
+- (void) measureLinearRoutes:(NSUInteger)count
+{
+    NSMutableArray* patterns = [NSMutableArray arrayWithCapacity:count];
+    for(NSUInteger i = 0; i < count; i++) {
+        [patterns addObject:[self pattern:[NSString stringWithFormat:@"/api/v1/resource%lu/([0-9]+)", (unsigned long)i]]];
+    }
+    NSString* resource = [NSString stringWithFormat:@"/api/v1/resource%lu/42", (unsigned long)count-1];
+    NSRange range = NSMakeRange(0, resource.length);
+    [self measureBlock:^{
+        for(int i = 0; i < kIQHTTPRouteBenchmarkIterations; i++) {
+            @autoreleasepool {
+                for(NSRegularExpression* regexp in patterns) {
+                    NSTextCheckingResult* result = [regexp firstMatchInString:resource options:NSMatchingAnchored range:range];
+                    if(result && result.range.length == resource.length) break;
+                }
+            }
+        }
+    }];
+}
+
+- (void) testPerformanceRoute10
+{
+    [self measureRoutes:10];
+}
+
+- (void) testPerformanceRoute100
+{
+    [self measureRoutes:100];
+}
+
+- (void) testPerformanceRoute1000
+{
+    [self measureRoutes:1000];
+}
+
+- (void) testPerformanceLinearRoute10
+{
+    [self measureLinearRoutes:10];
+}
+
+- (void) testPerformanceLinearRoute100
+{
+    [self measureLinearRoutes:100];
+}
+
+- (void) testPerformanceLinearRoute1000
+{
+    [self measureLinearRoutes:1000];
+}
+
+@end
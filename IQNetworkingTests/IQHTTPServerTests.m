@@ -19,6 +19,9 @@
 #import "IQNetworking.h"
 
 #import <XCTest/XCTest.h>
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
 
 @interface IQHTTPServerTests : XCTestCase
 @end
@@ -165,4 +168,683 @@
     server.started = NO;
 }
 
+- (void)testServeWithWorkers
+{
+    // Serve requests from a pool of worker threads instead of the current run loop
+    IQHTTPServer* server = [[IQHTTPServer alloc] initWithAddress:nil port:0 workers:4];
+    NSMutableSet* threads = [NSMutableSet set];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/hello" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        @synchronized(threads) {
+            [threads addObject:[NSValue valueWithNonretainedObject:[NSThread currentThread]]];
+        }
+        [request writeString:@"wörld"];
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    XCTAssertEqual((int)server.workerCount, 4, @"Wrong worker count");
+    
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/hello", server.port]];
+    IQTransferManager* tm = [IQTransferManager new];
+    
+    __block int counter = 0;
+    for(int i = 0; i < 8; i++) {
+        [tm downloadStringFromURL:url handler:^(NSString *string) {
+            XCTAssertEqualObjects(string, @"wörld", @"Expected 'wörld'");
+            counter ++;
+        } errorHandler:^(NSError *error) {
+            XCTFail(@"Failed with error %@", error);
+        }];
+    }
+    
+    [tm waitUntilEmpty];
+    
+    XCTAssertEqual(8, counter, @"Expected 8 completed requests, but was %d", counter);
+    XCTAssertFalse([threads containsObject:[NSValue valueWithNonretainedObject:[NSThread mainThread]]], @"Request was served on the main thread");
+    
+    [server closeAllConnectionsForce:YES];
+    server.started = NO;
+}
+
+- (void)testServeStaticFiles
+{
+    NSString* dir = [NSTemporaryDirectory() stringByAppendingPathComponent:@"iqhttpserver_static"];
+    [[NSFileManager defaultManager] createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:nil];
+    [@"Hello, static world!" writeToFile:[dir stringByAppendingPathComponent:@"hello.txt"] atomically:YES encoding:NSUTF8StringEncoding error:nil];
+    
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/static/(.+)" options:0 error:nil] directory:dir];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    IQTransferManager* tm = [IQTransferManager new];
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/static/hello.txt", server.port]];
+    
+    // Plain GET
+    __block NSString* etag = nil;
+    __block IQTransferItem* item = nil;
+    item = [tm downloadStringFromURL:url handler:^(NSString *string) {
+        XCTAssertEqualObjects(string, @"Hello, static world!", @"Unexpected file contents");
+        XCTAssertEqualObjects(item.contentType.subtype, @"plain", @"Expected a text/plain content type");
+        etag = [item valueForResponseHeaderField:@"ETag"];
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    XCTAssertNotNil(etag, @"Expected an ETag");
+    
+    // Conditional GET
+    item = [tm downloadStringFromURL:url handler:^(NSString *string) {
+        XCTFail(@"Expected a 304 response");
+    } errorHandler:^(NSError *error) {
+        XCTAssertEqual(304, (int)error.code, @"Expected a 304 status code");
+    }];
+    [item setValue:etag forRequestHeaderField:@"If-None-Match"];
+    [tm waitUntilEmpty];
+    
+    // Range request
+    item = [tm downloadStringFromURL:url handler:^(NSString *string) {
+        XCTAssertEqualObjects(string, @"static", @"Unexpected range contents");
+        XCTAssertEqualObjects([item valueForResponseHeaderField:@"Content-Range"], @"bytes 7-12/20", @"Unexpected Content-Range");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    item.ignoreErrorStatusCodes = YES;
+    [item setValue:@"bytes=7-12" forRequestHeaderField:@"Range"];
+    [tm waitUntilEmpty];
+    
+    // Missing files and attempts to escape the directory
+    url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/static/..%%2Fsecret.txt", server.port]];
+    [tm downloadStringFromURL:url handler:^(NSString *string) {
+        XCTFail(@"Expected 404 error");
+    } errorHandler:^(NSError *error) {
+        XCTAssertEqual(404, (int)error.code, @"Expected 404 error");
+    }];
+    [tm waitUntilEmpty];
+    
+    server.started = NO;
+    [[NSFileManager defaultManager] removeItemAtPath:dir error:nil];
+}
+
+/**
+ Connects a blocking socket to the server, without sending anything.
+ */
+- (int) connectRawSocketToPort:(UInt16)port
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval timeout = {5, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ Reads from a socket until the server closes the connection, the timeout expires or the expected
+ number of bytes has been received. The reading is done on another thread while the current run
+ loop runs, since that is where the server accepts connections.
+ */
+- (NSString*) readRawResponseFromSocket:(int)sock expectedLength:(NSUInteger)expectedLength
+{
+    NSMutableData* response = [NSMutableData data];
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        char buf[4096];
+        while(response.length < expectedLength) {
+            ssize_t len = recv(sock, buf, sizeof(buf), 0);
+            if(len <= 0) break;
+            [response appendBytes:buf length:len];
+        }
+        dispatch_semaphore_signal(done);
+    });
+    while(dispatch_semaphore_wait(done, DISPATCH_TIME_NOW) != 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+    }
+    return [[NSString alloc] initWithData:response encoding:NSUTF8StringEncoding];
+}
+
+/**
+ Sends raw bytes to the server and reads until the server closes the connection, the timeout expires
+ or the expected number of bytes has been received.
+ */
+- (NSString*) exchangeRawRequest:(NSString*)request port:(UInt16)port expectedLength:(NSUInteger)expectedLength
+{
+    int sock = [self connectRawSocketToPort:port];
+    if(sock < 0) {
+        return nil;
+    }
+    NSData* data = [request dataUsingEncoding:NSUTF8StringEncoding];
+    send(sock, data.bytes, data.length, 0);
+    NSString* response = [self readRawResponseFromSocket:sock expectedLength:expectedLength];
+    close(sock);
+    return response;
+}
+
+- (void)testPipelining
+{
+    // The first request is slow to respond, the following two are fast. All three are sent at once.
+    IQHTTPServer* server = [[IQHTTPServer alloc] initWithAddress:nil port:0 workers:1];
+    NSMutableArray* handled = [NSMutableArray array];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/slow" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        CFRunLoopTimerRef timer = CFRunLoopTimerCreateWithHandler(NULL, CFAbsoluteTimeGetCurrent()+0.2, 0, 0, 0, ^(CFRunLoopTimerRef t) {
+            [handled addObject:@"slow"];
+            [request writeString:@"slow"];
+            [request done];
+        });
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopCommonModes);
+        CFRelease(timer);
+    }];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/fast/([0-9])" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        NSString* body = [@"fast" stringByAppendingString:[request valueForUrlPatternGroup:1]];
+        [handled addObject:body];
+        [request writeString:body];
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    NSString* requests = @"GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                          "GET /fast/1 HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                          "GET /fast/2 HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    NSString* response = [self exchangeRawRequest:requests port:server.port expectedLength:NSUIntegerMax];
+    XCTAssertNotNil(response, @"No response");
+    
+    // Handlers run as soon as the requests arrive...
+    XCTAssertEqualObjects(handled, (@[@"fast1", @"fast2", @"slow"]), @"Pipelined requests were not handled concurrently");
+    // ...but the responses are sent in request order
+    NSRange slow = [response rangeOfString:@"\r\n\r\nslow"];
+    NSRange fast1 = [response rangeOfString:@"\r\n\r\nfast1"];
+    NSRange fast2 = [response rangeOfString:@"\r\n\r\nfast2"];
+    XCTAssertTrue(slow.length > 0 && fast1.length > 0 && fast2.length > 0, @"Missing responses in %@", response);
+    XCTAssertTrue(slow.location < fast1.location && fast1.location < fast2.location, @"Responses out of order: %@", response);
+    XCTAssertEqual((int)[response componentsSeparatedByString:@"HTTP/1.1 200"].count, 4, @"Expected three responses");
+    
+    server.started = NO;
+}
+
+- (void)testPipelinedHead
+{
+    IQHTTPServer* server = [[IQHTTPServer alloc] initWithAddress:nil port:0 workers:1];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/hello" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        // Written for HEAD too, only its length is sent
+        [request writeString:@"hello world"];
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    NSString* requests = @"HEAD /missing HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                          "HEAD /hello HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                          "GET /hello HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    NSString* response = [self exchangeRawRequest:requests port:server.port expectedLength:NSUIntegerMax];
+    NSArray* responses = [response componentsSeparatedByString:@"HTTP/1.1 "];
+    XCTAssertEqual((int)responses.count, 4, @"Unexpected responses %@", response);
+    if(responses.count != 4) return;
+    XCTAssertTrue([responses[1] hasPrefix:@"404"] && [responses[1] hasSuffix:@"\r\n\r\n"], @"The 404 to HEAD should have no body: %@", responses[1]);
+    XCTAssertTrue([responses[2] hasPrefix:@"200"] && [responses[2] hasSuffix:@"\r\n\r\n"], @"The HEAD response should have no body: %@", responses[2]);
+    XCTAssertTrue([responses[2] rangeOfString:@"Content-Length: 11\r\n"].length > 0, @"The HEAD response should have the length of the GET response: %@", responses[2]);
+    XCTAssertTrue([responses[3] hasPrefix:@"200"] && [responses[3] hasSuffix:@"\r\n\r\nhello world"], @"Unexpected GET response %@", responses[3]);
+    
+    server.started = NO;
+}
+
+- (void)testWriteBackpressure
+{
+    // Stream a large response without buffering more than writeBufferLimit (plus one chunk)
+    const NSUInteger total = 4*1024*1024;
+    NSMutableData* pattern = [NSMutableData dataWithLength:64*1024];
+    for(NSUInteger i = 0; i < pattern.length; i++) {
+        ((uint8_t*)pattern.mutableBytes)[i] = (uint8_t)i;
+    }
+    NSData* chunk = [pattern copy];
+    __block NSUInteger peakBuffered = 0;
+    
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/large" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        __block NSUInteger sent = 0;
+        request.writeBufferLimit = 256*1024;
+        [request setValue:@"application/octet-stream" forResponseHeaderField:@"Content-Type"];
+        [request setValue:[NSString stringWithFormat:@"%lu", (unsigned long)total] forResponseHeaderField:@"Content-Length"];
+        IQHTTPWritableHandler pump = ^(IQHTTPServerRequest *r) {
+            while(!r.writeBufferFull && sent < total) {
+                [r writeData:chunk];
+                sent += chunk.length;
+                peakBuffered = MAX(peakBuffered, r.bufferedLength);
+            }
+            if(sent == total) {
+                [r done];
+            }
+        };
+        request.writableHandler = pump;
+        pump(request);
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    IQTransferManager* tm = [IQTransferManager new];
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/large", server.port]];
+    __block NSData* result = nil;
+    [tm downloadDataFromURL:url handler:^(NSData *data) {
+        result = data;
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    
+    XCTAssertEqual((int)result.length, (int)total, @"Unexpected response length");
+    XCTAssertEqualObjects([result subdataWithRange:NSMakeRange(total-chunk.length, chunk.length)], chunk, @"Unexpected response contents");
+    XCTAssertTrue(peakBuffered <= 256*1024 + chunk.length, @"Buffered %lu bytes", (unsigned long)peakBuffered);
+    
+    server.started = NO;
+}
+
+- (void)testChunkedResponse
+{
+    // The response is completed asynchronously, so its length is not known when the headers are sent
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/stream" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeString:@"Hello, "];
+        CFRunLoopTimerRef timer = CFRunLoopTimerCreateWithHandler(NULL, CFAbsoluteTimeGetCurrent()+0.1, 0, 0, 0, ^(CFRunLoopTimerRef t) {
+            [request writeString:@"chunked world"];
+            [request done];
+        });
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopCommonModes);
+        CFRelease(timer);
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    IQTransferManager* tm = [IQTransferManager new];
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/stream", server.port]];
+    __block IQTransferItem* item = nil;
+    item = [tm downloadStringFromURL:url handler:^(NSString *string) {
+        XCTAssertEqualObjects(string, @"Hello, chunked world", @"Unexpected response");
+        XCTAssertEqualObjects([item valueForResponseHeaderField:@"Transfer-Encoding"], @"chunked", @"Expected a chunked response");
+        XCTAssertNil([item valueForResponseHeaderField:@"Connection"], @"The connection should be kept alive");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    
+    server.started = NO;
+}
+
+- (void)testChunkedRequestBody
+{
+    IQHTTPServer* server = [[IQHTTPServer alloc] initWithAddress:nil port:0 workers:1];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/upload" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        XCTAssertEqual(request.requestBodyLength, -1LL, @"The body length should be unknown");
+        [request readRequestBody:^(IQHTTPServerRequest *request, NSData *data) {
+            [request writeData:data];
+            [request done];
+        } atomic:YES];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    NSString* requests = @"POST /upload HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n"
+                          "6\r\nchunky\r\n8;name=value\r\n uploads\r\n0\r\nX-Trailer: yes\r\n\r\n"
+                          "POST /upload HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n"
+                          "0\r\n\r\n";
+    NSString* response = [self exchangeRawRequest:requests port:server.port expectedLength:NSUIntegerMax];
+    // The body is echoed from the body reader, after the first callback, so the responses are chunked as well
+    XCTAssertTrue([response rangeOfString:@"\r\ne\r\nchunky uploads\r\n0\r\n\r\n"].length > 0, @"Unexpected response %@", response);
+    XCTAssertEqual((int)[response componentsSeparatedByString:@"HTTP/1.1 200"].count, 3, @"Expected two responses in %@", response);
+    XCTAssertTrue([response hasSuffix:@"\r\n\r\n0\r\n\r\n"], @"Missing response to the empty upload in %@", response);
+    
+    server.started = NO;
+}
+
+- (void)testCompression
+{
+    NSMutableString* json = [NSMutableString stringWithString:@"["];
+    for(int i = 0; i < 500; i++) {
+        [json appendFormat:@"%@{\"id\":%d,\"name\":\"item %d\"}", i > 0 ? @"," : @"", i, i];
+    }
+    [json appendString:@"]"];
+    IQHTTPServer* server = [[IQHTTPServer alloc] initWithAddress:nil port:0 workers:1];
+    server.compressionEnabled = YES;
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/json" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request setValue:@"application/json" forResponseHeaderField:@"Content-Type"];
+        [request writeString:json];
+        [request done];
+    }];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/small" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeString:@"too small to compress"];
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    // The URL loading system asks for gzip and decodes the response
+    IQTransferManager* tm = [IQTransferManager new];
+    __block IQTransferItem* item = nil;
+    item = [tm downloadStringFromURL:[NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/json", server.port]] handler:^(NSString *string) {
+        XCTAssertEqualObjects(string, json, @"Unexpected response");
+        XCTAssertEqualObjects([item valueForResponseHeaderField:@"Content-Encoding"], @"gzip", @"Expected a compressed response");
+        XCTAssertEqualObjects([item valueForResponseHeaderField:@"Vary"], @"Accept-Encoding", @"Expected a Vary header");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    
+    // Clients that do not ask for compression, and small responses, get the body as it is
+    NSString* requests = @"GET /json HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                          "GET /small HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip\r\nConnection: close\r\n\r\n";
+    NSString* response = [self exchangeRawRequest:requests port:server.port expectedLength:NSUIntegerMax];
+    XCTAssertTrue([response rangeOfString:json].length > 0, @"Expected an uncompressed response");
+    XCTAssertTrue([response hasSuffix:@"\r\n\r\ntoo small to compress"], @"Expected an uncompressed response in %@", response);
+    XCTAssertTrue([response rangeOfString:@"Content-Encoding"].length == 0, @"Unexpected Content-Encoding in %@", response);
+    
+    server.started = NO;
+}
+
+- (void)testCompressedStaticFiles
+{
+    NSString* dir = [NSTemporaryDirectory() stringByAppendingPathComponent:@"iqhttpserver_gzip"];
+    NSString* cache = [dir stringByAppendingPathComponent:@"cache"];
+    NSString* files = [dir stringByAppendingPathComponent:@"files"];
+    [[NSFileManager defaultManager] removeItemAtPath:dir error:nil];
+    [[NSFileManager defaultManager] createDirectoryAtPath:files withIntermediateDirectories:YES attributes:nil error:nil];
+    NSString* first = [@"" stringByPaddingToLength:4096 withString:@"first file " startingAtIndex:0];
+    NSString* second = [@"" stringByPaddingToLength:4096 withString:@"second file " startingAtIndex:0];
+    [first writeToFile:[files stringByAppendingPathComponent:@"first.txt"] atomically:YES encoding:NSUTF8StringEncoding error:nil];
+    [second writeToFile:[files stringByAppendingPathComponent:@"second.txt"] atomically:YES encoding:NSUTF8StringEncoding error:nil];
+    
+    IQHTTPServer* server = [IQHTTPServer new];
+    server.compressionEnabled = YES;
+    server.compressedFileCacheDirectory = cache;
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/static/(.+)" options:0 error:nil] directory:files];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    IQTransferManager* tm = [IQTransferManager new];
+    __block IQTransferItem* item = nil;
+    for(int i = 0; i < 2; i++) {
+        item = [tm downloadStringFromURL:[NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/static/first.txt", server.port]] handler:^(NSString *string) {
+            XCTAssertEqualObjects(string, first, @"Unexpected file contents");
+            XCTAssertEqualObjects([item valueForResponseHeaderField:@"Content-Encoding"], @"gzip", @"Expected a compressed response");
+        } errorHandler:^(NSError *error) {
+            XCTFail(@"Failed with error %@", error);
+        }];
+        [tm waitUntilEmpty];
+    }
+    // The file was compressed once
+    NSArray* cached = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:cache error:nil];
+    XCTAssertEqual((int)cached.count, 1, @"Expected one compressed file in %@", cached);
+    
+    // A precompressed sibling is preferred. Pass off the compressed first file as the second one to tell them apart.
+    [[NSFileManager defaultManager] copyItemAtPath:[cache stringByAppendingPathComponent:cached.firstObject] toPath:[files stringByAppendingPathComponent:@"second.txt.gz"] error:nil];
+    item = [tm downloadStringFromURL:[NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/static/second.txt", server.port]] handler:^(NSString *string) {
+        XCTAssertEqualObjects(string, first, @"Expected the precompressed file");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    XCTAssertEqual((int)[[NSFileManager defaultManager] contentsOfDirectoryAtPath:cache error:nil].count, 1, @"The precompressed file should not be compressed again");
+    
+    server.started = NO;
+    [[NSFileManager defaultManager] removeItemAtPath:dir error:nil];
+}
+
+- (void)testMetrics
+{
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/hello" options:0 error:nil] method:@"GET" callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeString:@"world"];
+        [request done];
+    }];
+    [server addMetricsURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/metrics" options:0 error:nil]];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    IQTransferManager* tm = [IQTransferManager new];
+    for(int i = 0; i < 3; i++) {
+        [tm downloadStringFromURL:[NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/hello", server.port]] handler:^(NSString *string) {
+            XCTAssertEqualObjects(string, @"world", @"Unexpected response");
+        } errorHandler:^(NSError *error) {
+            XCTFail(@"Failed with error %@", error);
+        }];
+    }
+    [tm downloadStringFromURL:[NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/missing", server.port]] handler:^(NSString *string) {
+        XCTFail(@"Request should not have succeeded");
+    } errorHandler:^(NSError *error) {
+    }];
+    [tm waitUntilEmpty];
+    
+    IQHTTPServerMetrics* metrics = server.metrics;
+    XCTAssertEqual((int)metrics.routes.count, 3, @"Expected two patterns and the unrouted requests");
+    IQHTTPServerRouteMetrics* hello = metrics.routes[0];
+    XCTAssertEqualObjects(hello.pattern, @"/hello", @"Unexpected pattern");
+    XCTAssertEqualObjects(hello.method, @"GET", @"Unexpected method");
+    XCTAssertEqual((int)hello.requestCount, 3, @"Unexpected request count");
+    XCTAssertTrue(hello.bytesReceived > 3 * 20, @"Request heads were not counted");
+    XCTAssertTrue(hello.bytesSent > 3 * 5, @"Responses were not counted");
+    XCTAssertTrue([hello durationAtPercentile:50] > 0, @"No latency recorded");
+    XCTAssertTrue([hello timeToFirstByteAtPercentile:100] <= [hello durationAtPercentile:100], @"First byte after the last");
+    IQHTTPServerRouteMetrics* unrouted = metrics.routes[2];
+    XCTAssertNil(unrouted.pattern, @"Unrouted requests should have no pattern");
+    XCTAssertEqual((int)unrouted.requestCount, 1, @"The 404 was not counted");
+    XCTAssertEqual((int)metrics.activeConnectionCount, 0, @"No request is in progress");
+    XCTAssertEqual((int)metrics.bufferedOutputBytes, 0, @"Nothing should be buffered");
+    
+    __block NSString* text = nil;
+    [tm downloadStringFromURL:[NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/metrics", server.port]] handler:^(NSString *string) {
+        text = string;
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    XCTAssertTrue([text rangeOfString:@"iqhttp_requests_total{route=\"/hello\",method=\"GET\"} 3\n"].length > 0, @"Missing request count in %@", text);
+    XCTAssertTrue([text rangeOfString:@"iqhttp_request_duration_seconds_count{route=\"/hello\",method=\"GET\"} 3\n"].length > 0, @"Missing histogram in %@", text);
+    XCTAssertTrue([text rangeOfString:@"# TYPE iqhttp_connections gauge"].length > 0, @"Missing connection gauge in %@", text);
+    
+    server.started = NO;
+}
+
+- (void)testResponseCache
+{
+    IQHTTPServer* server = [IQHTTPServer new];
+    __block int calls = 0;
+    IQHTTPResponseCache* cache = [[IQHTTPResponseCache alloc] initWithTimeToLive:0.5];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/cached" options:0 error:nil] method:@"GET" cache:cache callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        calls++;
+        [request writeString:[NSString stringWithFormat:@"response %d", calls]];
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    IQTransferManager* tm = [IQTransferManager new];
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/cached", server.port]];
+    for(int i = 0; i < 3; i++) {
+        [tm downloadStringFromURL:url handler:^(NSString *string) {
+            XCTAssertEqualObjects(string, @"response 1", @"Unexpected response");
+        } errorHandler:^(NSError *error) {
+            XCTFail(@"Failed with error %@", error);
+        }];
+        [tm waitUntilEmpty];
+    }
+    XCTAssertEqual(calls, 1, @"The callback should only be called once");
+    XCTAssertEqual((int)cache.missCount, 1, @"Unexpected miss count");
+    XCTAssertEqual((int)cache.hitCount, 2, @"Unexpected hit count");
+    
+    // The response expires
+    [NSThread sleepForTimeInterval:0.6];
+    [tm downloadStringFromURL:url handler:^(NSString *string) {
+        XCTAssertEqualObjects(string, @"response 2", @"Expired response was served");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    XCTAssertEqual(calls, 2, @"The callback should be called after expiry");
+    
+    // A different query is a different resource
+    [tm downloadStringFromURL:[NSURL URLWithString:@"?a=1" relativeToURL:url] handler:^(NSString *string) {
+        XCTAssertEqualObjects(string, @"response 3", @"Unexpected response");
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    [tm waitUntilEmpty];
+    XCTAssertEqual(calls, 3, @"The query should be part of the key");
+    
+    server.started = NO;
+}
+
+/**
+ Checks that a raw response consists of the given number of complete responses with the body.
+ */
+- (void) assertResponse:(NSString*)response containsResponses:(int)count withBody:(NSString*)body
+{
+    NSArray* responses = [response componentsSeparatedByString:@"HTTP/1.1 200 "];
+    XCTAssertEqual((int)responses.count, count + 1, @"Unexpected responses %@", response);
+    XCTAssertEqualObjects(responses[0], @"", @"Unexpected data before the response: %@", response);
+    for(NSUInteger i = 1; i < responses.count; i++) {
+        NSString* message = responses[i];
+        XCTAssertTrue([message hasSuffix:[@"\r\n\r\n" stringByAppendingString:body]], @"Malformed response %@", message);
+        XCTAssertTrue([message rangeOfString:[NSString stringWithFormat:@"Content-Length: %lu\r\n", (unsigned long)body.length]].length > 0, @"Malformed response %@", message);
+    }
+}
+
+- (void)testResponseCacheCollapsesMisses
+{
+    IQHTTPServer* server = [[IQHTTPServer alloc] initWithAddress:nil port:0 workers:1];
+    __block int calls = 0;
+    IQHTTPResponseCache* cache = [[IQHTTPResponseCache alloc] initWithTimeToLive:10];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/cached" options:0 error:nil] method:@"GET" cache:cache callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        calls++;
+        // Respond later, so that the other requests arrive while the response is being produced
+        CFRunLoopTimerRef timer = CFRunLoopTimerCreateWithHandler(NULL, CFAbsoluteTimeGetCurrent() + 0.2, 0, 0, 0, ^(CFRunLoopTimerRef t) {
+            [request setValue:@"11" forResponseHeaderField:@"Content-Length"];
+            [request writeString:@"cached body"];
+            [request done];
+        });
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopCommonModes);
+        CFRelease(timer);
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    // Two pipelined misses on one connection
+    NSString* requests = @"GET /cached?1 HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                          "GET /cached?1 HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    NSString* response = [self exchangeRawRequest:requests port:server.port expectedLength:NSUIntegerMax];
+    XCTAssertEqual(calls, 1, @"The callback should only be called once for pipelined misses");
+    [self assertResponse:response containsResponses:2 withBody:@"cached body"];
+    
+    // Two concurrent misses on separate connections
+    int first = [self connectRawSocketToPort:server.port];
+    int second = [self connectRawSocketToPort:server.port];
+    XCTAssertTrue(first >= 0 && second >= 0, @"Failed to connect");
+    const char* request = "GET /cached?2 HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    send(first, request, strlen(request), 0);
+    send(second, request, strlen(request), 0);
+    NSString* firstResponse = [self readRawResponseFromSocket:first expectedLength:NSUIntegerMax];
+    NSString* secondResponse = [self readRawResponseFromSocket:second expectedLength:NSUIntegerMax];
+    close(first);
+    close(second);
+    XCTAssertEqual(calls, 2, @"The callback should only be called once for concurrent misses");
+    [self assertResponse:firstResponse containsResponses:1 withBody:@"cached body"];
+    [self assertResponse:secondResponse containsResponses:1 withBody:@"cached body"];
+    XCTAssertEqual((int)cache.missCount, 2, @"Unexpected miss count");
+    
+    server.started = NO;
+}
+
+- (void)testConnectionLimits
+{
+    IQHTTPServer* server = [[IQHTTPServer alloc] initWithAddress:nil port:0 workers:1];
+    server.maxConnections = 1;
+    server.requestHeaderTimeout = 0.5;
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/hello" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeString:@"world"];
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    // The first connection takes the only place and sends nothing
+    int idle = [self connectRawSocketToPort:server.port];
+    XCTAssertTrue(idle >= 0, @"Failed to connect");
+    // The refused connection is answered right away, even with a request the server does not read
+    int refused = [self connectRawSocketToPort:server.port];
+    const char* request = "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    send(refused, request, strlen(request), 0);
+    NSString* response = [self readRawResponseFromSocket:refused expectedLength:NSUIntegerMax];
+    close(refused);
+    XCTAssertTrue([response hasPrefix:@"HTTP/1.1 503"], @"Expected the connection to be refused, got %@", response);
+    XCTAssertEqual((int)server.metrics.rejectedConnectionCount, 1, @"The refused connection was not counted");
+    
+    // The head timeout closes the idle connection, which makes room for another
+    response = [self readRawResponseFromSocket:idle expectedLength:NSUIntegerMax];
+    close(idle);
+    XCTAssertEqualObjects(response, @"", @"The idle connection should be closed without a response");
+    XCTAssertEqual((int)server.metrics.timedOutConnectionCount, 1, @"The timeout was not counted");
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    response = [self exchangeRawRequest:@"GET /hello HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n" port:server.port expectedLength:NSUIntegerMax];
+    XCTAssertTrue([response hasPrefix:@"HTTP/1.1 200"] && [response hasSuffix:@"world"], @"Unexpected response %@", response);
+    
+    server.started = NO;
+}
+
+- (void)testRequestBodySpooling
+{
+    IQHTTPServer* server = [[IQHTTPServer alloc] initWithAddress:nil port:0 workers:1];
+    server.requestBodyMemoryLimit = 16;
+    __block NSString* spoolPath = nil;
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/spool" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request spoolRequestBody:^(IQHTTPServerRequest *request, IQHTTPRequestBody *body) {
+            spoolPath = body.path;
+            [request writeString:[NSString stringWithFormat:@"%llu %@ %@", body.length, body.path ? @"file" : @"memory",
+                                  [[NSString alloc] initWithData:body.data encoding:NSUTF8StringEncoding]]];
+            [request done];
+        }];
+    }];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/form" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        NSMutableString* result = [NSMutableString string];
+        [request readMultipartRequestBody:^IQMultipartPartReader(NSDictionary *headers) {
+            NSString* name = [IQMultipartParser parametersOfHeaderValue:headers[@"content-disposition"]][@"name"];
+            __block NSUInteger size = 0;
+            return ^(NSData* data) {
+                if(data) {
+                    size += data.length;
+                } else {
+                    [result appendFormat:@"%@=%lu;", name, (unsigned long)size];
+                }
+            };
+        } completion:^(IQHTTPServerRequest *request, BOOL valid) {
+            [request writeString:valid ? result : @"invalid"];
+            [request done];
+        }];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    
+    NSString* response = [self exchangeRawRequest:@"POST /spool HTTP/1.1\r\nHost: localhost\r\nContent-Length: 5\r\nConnection: close\r\n\r\nsmall" port:server.port expectedLength:NSUIntegerMax];
+    XCTAssertTrue([response hasSuffix:@"5 memory small"], @"Unexpected response %@", response);
+    response = [self exchangeRawRequest:@"POST /spool HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n"
+                "10\r\n0123456789abcdef\r\n10\r\nwritten to disk!\r\n0\r\n\r\n" port:server.port expectedLength:NSUIntegerMax];
+    XCTAssertTrue([response hasSuffix:@"32 file 0123456789abcdefwritten to disk!"], @"Unexpected response %@", response);
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    XCTAssertNotNil(spoolPath, @"The large body should have been written to a file");
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:spoolPath], @"The temporary file should be removed with the body");
+    
+    NSString* form = @"--xyz\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\n123\r\n"
+                      "--xyz\r\nContent-Disposition: form-data; name=\"b\"; filename=\"b.bin\"\r\n\r\n123456789\r\n--xyz--\r\n";
+    NSString* request = [NSString stringWithFormat:@"POST /form HTTP/1.1\r\nHost: localhost\r\nContent-Type: multipart/form-data; boundary=xyz\r\n"
+                         "Content-Length: %lu\r\nConnection: close\r\n\r\n%@", (unsigned long)form.length, form];
+    response = [self exchangeRawRequest:request port:server.port expectedLength:NSUIntegerMax];
+    XCTAssertTrue([response hasSuffix:@"a=3;b=9;"], @"Unexpected response %@", response);
+    
+    server.started = NO;
+}
+
 @end
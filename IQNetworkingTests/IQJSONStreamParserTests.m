@@ -0,0 +1,94 @@
+//
+//  IQJSONStreamParserTests.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "IQJSONStreamParser.h"
+
+#import <XCTest/XCTest.h>
+
+static const char* kDocument =
+    " {\"name\": \"caf\\u00e9 \\\"\\/\\\\\\n\", \"emoji\": \"\\ud83d\\ude00\", \"lone\": \"\\ud83dx\",\n"
+    "  \"numbers\": [0, -12, 3.25, 1e3, -0.5E-2],\n"
+    "  \"literals\": [true, false, null], \"empty\": {}, \"nested\": [[], [{}]]} ";
+
+@interface IQJSONStreamParserTests : XCTestCase
+@end
+
+@implementation IQJSONStreamParserTests
+
+/**
+ Parses a text fed in pieces of the given size, and returns the result or nil if it failed.
+ */
+- (id) parse:(const char*)text pieceSize:(NSUInteger)pieceSize parser:(IQJSONStreamParser*)parser
+{
+    size_t length = strlen(text);
+    for(size_t offset = 0; offset < length; offset += pieceSize) {
+        if(![parser appendBytes:text + offset length:MIN(pieceSize, length - offset)]) {
+            return nil;
+        }
+    }
+    return [parser finish] ? parser.result : nil;
+}
+
+- (void) testParseDocument
+{
+    // Every split of the text must give the same result, including splits inside tokens
+    NSDictionary* expected = [NSJSONSerialization JSONObjectWithData:[NSData dataWithBytes:kDocument length:strlen(kDocument)] options:0 error:nil];
+    for(NSUInteger pieceSize = 1; pieceSize <= strlen(kDocument); pieceSize++) {
+        NSDictionary* result = [self parse:kDocument pieceSize:pieceSize parser:[IQJSONStreamParser new]];
+        XCTAssertEqualObjects(result[@"name"], @"caf\u00e9 \"/\\\n", @"Unexpected string with pieces of %d", (int)pieceSize);
+        XCTAssertEqualObjects(result[@"emoji"], expected[@"emoji"], @"Unexpected surrogate pair with pieces of %d", (int)pieceSize);
+        XCTAssertEqualObjects(result[@"lone"], @"\ufffdx", @"Unexpected lone surrogate with pieces of %d", (int)pieceSize);
+        XCTAssertEqualObjects(result[@"numbers"], expected[@"numbers"], @"Unexpected numbers with pieces of %d", (int)pieceSize);
+        XCTAssertEqualObjects(result[@"literals"], expected[@"literals"]);
+        XCTAssertEqualObjects(result[@"nested"], expected[@"nested"]);
+        XCTAssertEqualObjects(result[@"empty"], @{});
+    }
+    XCTAssertEqualObjects([self parse:"42" pieceSize:1 parser:[IQJSONStreamParser new]], @42, @"A number may end the text");
+}
+
+- (void) testElementHandler
+{
+    const char* text = "[{\"a\": [1]}, 2, \"three\"]";
+    for(NSUInteger pieceSize = 1; pieceSize <= strlen(text); pieceSize++) {
+        NSMutableArray* elements = [NSMutableArray array];
+        IQJSONStreamParser* parser = [IQJSONStreamParser new];
+        parser.elementHandler = ^(id element) {
+            [elements addObject:element];
+        };
+        NSArray* result = [self parse:text pieceSize:pieceSize parser:parser];
+        XCTAssertEqualObjects(result, @[], @"The elements should not be kept");
+        NSArray* expected = @[@{@"a": @[@1]}, @2, @"three"];
+        XCTAssertEqualObjects(elements, expected, @"Unexpected elements with pieces of %d", (int)pieceSize);
+    }
+}
+
+- (void) testMalformedText
+{
+    const char* texts[] = { "", "[1,]", "{\"a\" 1}", "{1: 2}", "[01]", "[1.]", "[-]", "tru", "nul1",
+        "\"a\tb\"", "\"\\x\"", "[1] 2", "[1}", "{\"a\": 1", "\"\xff\"" };
+    for(size_t i = 0; i < sizeof(texts) / sizeof(*texts); i++) {
+        IQJSONStreamParser* parser = [IQJSONStreamParser new];
+        XCTAssertNil([self parse:texts[i] pieceSize:2 parser:parser], @"'%s' should not parse", texts[i]);
+        XCTAssertEqual(parser.error.code, (NSInteger)3840);
+    }
+    IQJSONStreamParser* parser = [IQJSONStreamParser new];
+    parser.maxDepth = 3;
+    XCTAssertNil([self parse:"[[[[]]]]" pieceSize:8 parser:parser], @"The nesting limit should apply");
+}
+
+@end
@@ -20,6 +20,8 @@
 
 #import <XCTest/XCTest.h>
 
+#define kIQMIMEBenchmarkIterations 20000
+
 @interface IQNetworkingTests : XCTestCase
 @end
 
@@ -62,4 +64,102 @@
     XCTAssertEqual((long)mime.encoding, (long)NSUTF16StringEncoding, @"Encoding was not latin-2");
 }
 
+- (void)testQuotedParameters
+{
+    IQMIMEType* mime = [IQMIMEType MIMETypeWithRFCString:@"Multipart/Form-Data; Boundary=\"a;b \\\"c\\\"\"; charset=utf-8;"];
+    XCTAssertEqualObjects(mime.type, @"multipart", @"Wrong MIME main type");
+    XCTAssertEqualObjects(mime.subtype, @"form-data", @"Wrong MIME subtype");
+    XCTAssertEqualObjects([mime valueForParameter:@"boundary"], @"a;b \"c\"", @"Wrong quoted parameter value");
+    XCTAssertEqualObjects([mime valueForParameter:@"charset"], @"utf-8", @"Wrong parameter after a quoted one");
+    XCTAssertEqualObjects([[IQMIMEType MIMETypeWithRFCString:mime.RFCString] valueForParameter:@"boundary"], @"a;b \"c\"", @"Quoted values should survive a round trip");
+    XCTAssertNil([IQMIMEType MIMETypeWithRFCString:@"text/plain; charset=\"utf-8"], @"An unterminated quoted string should be rejected");
+    XCTAssertNil([IQMIMEType MIMETypeWithRFCString:@"text"], @"A type without subtype should be rejected");
+}
+
+- (void)testInterning
+{
+    IQMIMEType* json = [IQMIMEType MIMETypeWithRFCString:@"application/json; charset=utf-8"];
+    XCTAssertTrue(json == [IQMIMEType MIMETypeWithRFCString:@"application/json; charset=utf-8"], @"Common types should be shared");
+    IQMIMEType* other = [IQMIMEType MIMETypeWithRFCString:@"application/vnd.example+json"];
+    XCTAssertTrue(other == [IQMIMEType MIMETypeWithRFCString:@"application/vnd.example+json"], @"Parsed types should be interned");
+    XCTAssertTrue(json == [json copy], @"Copies of immutable types should be shared");
+    IQMutableMIMEType* mutable = [IQMutableMIMEType MIMETypeWithRFCString:@"application/json; charset=utf-8"];
+    mutable.encoding = NSISOLatin1StringEncoding;
+    XCTAssertEqual((long)json.encoding, (long)NSUTF8StringEncoding, @"Mutable types must not change the shared ones");
+}
+
+- (void)testAcceptNegotiation
+{
+    NSString* accept = @"text/html;level=1, application/json;q=0.9, text/*;q=0.5, */*;q=0.1, image/png;q=0";
+    NSArray* ranges = [IQMIMEType MIMETypesWithAcceptHeader:accept];
+    XCTAssertEqualObjects([ranges valueForKey:@"RFCString"], (@[@"text/html", @"application/json", @"text/*", @"*/*"]));
+    
+    IQMIMEType* html = [IQMIMEType MIMETypeWithRFCString:@"text/html"];
+    IQMIMEType* json = [IQMIMEType MIMETypeWithRFCString:@"application/json"];
+    IQMIMEType* plain = [IQMIMEType MIMETypeWithRFCString:@"text/plain"];
+    IQMIMEType* png = [IQMIMEType MIMETypeWithRFCString:@"image/png"];
+    XCTAssertEqual([IQMIMEType preferredMIMETypeAmong:@[json, html] forAcceptHeader:accept], html);
+    XCTAssertEqual([IQMIMEType preferredMIMETypeAmong:@[plain, json] forAcceptHeader:accept], json);
+    XCTAssertEqual([IQMIMEType preferredMIMETypeAmong:@[png, plain] forAcceptHeader:accept], plain);
+    XCTAssertNil([IQMIMEType preferredMIMETypeAmong:@[png] forAcceptHeader:accept], @"q=0 should rule a type out");
+    XCTAssertEqual([IQMIMEType preferredMIMETypeAmong:@[png, json] forAcceptHeader:nil], png, @"No Accept header should accept anything");
+    XCTAssertEqual([IQMIMEType preferredMIMETypeAmong:@[json, html] forAcceptHeader:@"APPLICATION/JSON"], json, @"Media ranges are case insensitive");
+}
+
+#pragma mark - Benchmarks
+
+/**
+ Baseline: the way IQMIMEType used to parse, splitting the string and trimming every piece.
+ */
+- (void)testPerformanceSplittingParser
+{
+    NSArray* strings = @[@"application/json; charset=utf-8", @"text/html", @"application/vnd.example+json; version=2"];
+    [self measureBlock:^{
+        for(int i = 0; i < kIQMIMEBenchmarkIterations; i++) {
+            @autoreleasepool {
+                NSString* string = [strings objectAtIndex:i % strings.count];
+                NSCharacterSet* whitespace = [NSCharacterSet whitespaceAndNewlineCharacterSet];
+                NSMutableDictionary* params = [NSMutableDictionary dictionary];
+                NSString* type = nil, *subtype = nil;
+                for(NSString* chunk in [[string stringByTrimmingCharactersInSet:whitespace] componentsSeparatedByString:@";"]) {
+                    if(!type) {
+                        NSArray* t = [chunk componentsSeparatedByString:@"/"];
+                        type = [[[t objectAtIndex:0] stringByTrimmingCharactersInSet:whitespace] lowercaseString];
+                        subtype = [[[t objectAtIndex:1] stringByTrimmingCharactersInSet:whitespace] lowercaseString];
+                    } else {
+                        NSArray* t = [chunk componentsSeparatedByString:@"="];
+                        [params setValue:[[t objectAtIndex:1] stringByTrimmingCharactersInSet:whitespace] forKey:[[[t objectAtIndex:0] stringByTrimmingCharactersInSet:whitespace] lowercaseString]];
+                    }
+                }
+                (void)subtype;
+            }
+        }
+    }];
+}
+
+- (void)testPerformanceInternedParser
+{
+    NSArray* strings = @[@"application/json; charset=utf-8", @"text/html", @"application/vnd.example+json; version=2"];
+    [self measureBlock:^{
+        for(int i = 0; i < kIQMIMEBenchmarkIterations; i++) {
+            @autoreleasepool {
+                IQMIMEType* mime = [IQMIMEType MIMETypeWithRFCString:[strings objectAtIndex:i % strings.count]];
+                (void)mime;
+            }
+        }
+    }];
+}
+
+- (void)testPerformanceAcceptNegotiation
+{
+    NSString* accept = @"text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8";
+    NSArray* available = @[[IQMIMEType MIMETypeWithRFCString:@"application/json"], [IQMIMEType MIMETypeWithRFCString:@"application/xml"]];
+    [self measureBlock:^{
+        for(int i = 0; i < kIQMIMEBenchmarkIterations; i++) {
+            IQMIMEType* mime = [IQMIMEType preferredMIMETypeAmong:available forAcceptHeader:accept];
+            (void)mime;
+        }
+    }];
+}
+
 @end
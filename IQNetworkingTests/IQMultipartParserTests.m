@@ -0,0 +1,104 @@
+//
+//  IQMultipartParserTests.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "IQMultipartParser.h"
+
+#import <XCTest/XCTest.h>
+
+static const char* kFormData =
+    "This is the preamble\r\n"
+    "--AaB03x\r\n"
+    "Content-Disposition: form-data; name=\"field\"\r\n"
+    "\r\n"
+    "value\r\n"
+    "--AaB03x\r\n"
+    "content-disposition: form-data; name=\"file\"; filename=\"a \\\"b\\\".txt\"\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+    "line 1\r\n--AaB03 is not a boundary\r\n\r\r\n-\r\n--\r\n"
+    "--AaB03x--\r\n"
+    "This is the epilogue\r\n";
+
+@interface IQMultipartParserTests : XCTestCase
+@end
+
+@implementation IQMultipartParserTests
+
+/**
+ Parses a body fed in pieces of the given size, and returns the headers and contents of the parts.
+ */
+- (NSArray*) partsOfBody:(const char*)body boundary:(NSString*)boundary pieceSize:(NSUInteger)pieceSize complete:(BOOL*)complete
+{
+    NSMutableArray* parts = [NSMutableArray array];
+    IQMultipartParser* parser = [[IQMultipartParser alloc] initWithBoundary:boundary partHandler:^IQMultipartPartReader(NSDictionary *headers) {
+        NSMutableData* content = [NSMutableData data];
+        [parts addObject:@[headers, content]];
+        return ^(NSData* data) {
+            if(data) {
+                [content appendData:data];
+            }
+        };
+    }];
+    size_t length = strlen(body);
+    for(size_t offset = 0; offset < length; offset += pieceSize) {
+        if(![parser appendBytes:body + offset length:MIN(pieceSize, length - offset)]) {
+            return nil;
+        }
+    }
+    *complete = parser.isComplete;
+    return parts;
+}
+
+- (void) testParseFormData
+{
+    // Every split of the body must give the same result, including splits inside a boundary
+    for(NSUInteger pieceSize = 1; pieceSize <= strlen(kFormData); pieceSize++) {
+        BOOL complete = NO;
+        NSArray* parts = [self partsOfBody:kFormData boundary:@"AaB03x" pieceSize:pieceSize complete:&complete];
+        XCTAssertTrue(complete, @"The closing boundary was not found with pieces of %d", (int)pieceSize);
+        XCTAssertEqual((int)parts.count, 2, @"Unexpected number of parts with pieces of %d", (int)pieceSize);
+        if(parts.count != 2) return;
+        XCTAssertEqualObjects([[NSString alloc] initWithData:parts[0][1] encoding:NSUTF8StringEncoding], @"value");
+        XCTAssertEqualObjects([[NSString alloc] initWithData:parts[1][1] encoding:NSUTF8StringEncoding], @"line 1\r\n--AaB03 is not a boundary\r\n\r\r\n-\r\n--",
+                              @"Unexpected content with pieces of %d", (int)pieceSize);
+        XCTAssertEqualObjects(parts[1][0][@"content-type"], @"text/plain");
+    }
+}
+
+- (void) testHeaderParameters
+{
+    BOOL complete = NO;
+    NSArray* parts = [self partsOfBody:kFormData boundary:@"AaB03x" pieceSize:1024 complete:&complete];
+    NSDictionary* parameters = [IQMultipartParser parametersOfHeaderValue:parts[1][0][@"content-disposition"]];
+    XCTAssertEqualObjects(parameters[@"name"], @"file");
+    XCTAssertEqualObjects(parameters[@"filename"], @"a \"b\".txt");
+    XCTAssertEqualObjects([IQMultipartParser boundaryForContentType:@"multipart/form-data; boundary=\"AaB03x\""], @"AaB03x");
+    XCTAssertNil([IQMultipartParser boundaryForContentType:@"application/x-www-form-urlencoded"]);
+}
+
+- (void) testMalformedBody
+{
+    BOOL complete = NO;
+    XCTAssertNil([self partsOfBody:"--AaB03x\r\nNo colon here\r\n\r\ndata\r\n--AaB03x--" boundary:@"AaB03x" pieceSize:7 complete:&complete], @"A header line without a colon should fail");
+    XCTAssertNil([self partsOfBody:"--AaB03xjunk\r\n\r\n" boundary:@"AaB03x" pieceSize:3 complete:&complete], @"A boundary must end the line");
+    NSArray* parts = [self partsOfBody:"--AaB03x\r\n\r\ntruncated" boundary:@"AaB03x" pieceSize:5 complete:&complete];
+    XCTAssertEqual((int)parts.count, 1);
+    XCTAssertFalse(complete, @"A body without the closing boundary is not complete");
+}
+
+@end
@@ -416,4 +416,89 @@
     
 }
 
+- (void)testStateIsSavedAndReloaded
+{
+    IQNetworkSynchronizedFolder* folder = [IQNetworkSynchronizedFolder folderWithName:@"test" inParent:testFolder];
+    folder.cacheFileNaming = ^NSString*(NSURL* url) {
+        return [@"saved_" stringByAppendingString:url.lastPathComponent];
+    };
+    for(int i = 0; i < 1000; i++) {
+        [folder addFileWithURL:[self URLForResource:[NSString stringWithFormat:@"file%d", i]]];
+    }
+    [folder waitUntilSynchronized];
+    
+    // The entries are found by URL, with the names they were saved with
+    IQNetworkSynchronizedFolder* reloaded = [IQNetworkSynchronizedFolder folderWithName:@"test" inParent:testFolder];
+    for(int i = 0; i < 1000; i += 111) {
+        IQNetworkSynchronizedFile* file = [reloaded addFileWithURL:[self URLForResource:[NSString stringWithFormat:@"file%d", i]]];
+        XCTAssertEqualObjects(file.path.lastPathComponent, ([NSString stringWithFormat:@"saved_file%d", i]));
+    }
+    XCTAssertEqual(0, serverRequests, @"Expected no request");
+}
+
+- (void)testBulkRevalidation
+{
+    NSString* modified = @"Sat, 01 Jun 2013 12:00:00 GMT";
+    __block int notModified = 0;
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/file([0-9]+)" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        if([[request valueForRequestHeaderField:@"If-Modified-Since"] isEqualToString:modified]) {
+            notModified++;
+            [request setStatusCode:304];
+        } else {
+            [request setValue:modified forResponseHeaderField:@"Last-Modified"];
+            [request writeString:[request valueForUrlPatternGroup:1]];
+        }
+        [request done];
+    }];
+    IQNetworkSynchronizedFolder* folder = [IQNetworkSynchronizedFolder folderWithName:@"test" inParent:testFolder];
+    for(int i = 0; i < 10; i++) {
+        [folder addFileWithURL:[self URLForResource:[NSString stringWithFormat:@"file%d", i]]];
+    }
+    [folder addFileWithURL:[self URLForResource:@"missing"]];
+    
+    __block NSArray* summary = nil;
+    [folder refresh:NO maxConcurrent:3 completion:^(NSUInteger unchanged, NSUInteger updated, NSUInteger failed) {
+        summary = @[@(unchanged), @(updated), @(failed)];
+    }];
+    [folder waitUntilSynchronized];
+    XCTAssertEqualObjects(summary, (@[@0, @10, @1]), @"Expected all files but the missing one to be downloaded");
+    
+    // The second time, the server can tell that nothing has changed
+    summary = nil;
+    [folder refresh:NO maxConcurrent:3 completion:^(NSUInteger unchanged, NSUInteger updated, NSUInteger failed) {
+        summary = @[@(unchanged), @(updated), @(failed)];
+    }];
+    [folder waitUntilSynchronized];
+    XCTAssertEqualObjects(summary, (@[@10, @0, @1]), @"Expected the files to be unchanged");
+    XCTAssertEqual(10, notModified, @"Expected If-Modified-Since to be sent");
+}
+
+- (void)testEvictionKeepsFolderWithinSize
+{
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/sized([0-9]+)" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeData:[NSMutableData dataWithLength:1000]];
+        [request done];
+    }];
+    IQNetworkSynchronizedFolder* folder = [IQNetworkSynchronizedFolder folderWithName:@"test" inParent:testFolder];
+    folder.maxSize = 2500;
+    NSMutableArray* files = [NSMutableArray array];
+    for(int i = 0; i < 3; i++) {
+        [files addObject:[folder addFileWithURL:[self URLForResource:[NSString stringWithFormat:@"sized%d", i]]]];
+    }
+    [files[0] setPinned:YES];
+    
+    [folder refresh:NO maxConcurrent:1 completion:nil];
+    [folder waitUntilSynchronized];
+    
+    XCTAssertTrue(folder.size <= 2500, @"Expected the folder to be evicted down to its limit");
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:[files[0] path]], @"Pinned files should be kept");
+    int remaining = 0;
+    for(IQNetworkSynchronizedFile* file in files) {
+        if([[NSFileManager defaultManager] fileExistsAtPath:file.path]) {
+            remaining++;
+        }
+    }
+    XCTAssertEqual(2, remaining, @"Expected one file to be evicted");
+}
+
 @end
@@ -0,0 +1,164 @@
+//
+//  IQStreamingMediaCacheTests.m
+//  IQNetworking for iOS and Mac OS X
+//
+//  Copyright 2012 Rickard Petzäll, EvolvIQ
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "IQHTTPServer.h"
+#import "IQTransferManager.h"
+#import "IQStreamingMediaCache.h"
+
+@interface IQStreamingMediaCacheTests : XCTestCase {
+    IQHTTPServer* origin;
+    NSData* content;
+    NSMutableArray* ranges;
+    NSString* parent;
+}
+@end
+
+@implementation IQStreamingMediaCacheTests
+
+- (void)setUp
+{
+    [super setUp];
+    NSMutableData* data = [NSMutableData dataWithLength:10000];
+    for(NSUInteger i = 0; i < data.length; i++) {
+        ((uint8_t*)data.mutableBytes)[i] = (uint8_t)(i / 7);
+    }
+    content = data;
+    ranges = [NSMutableArray array];
+    parent = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IQStreamingMediaCacheTests"];
+    [[NSFileManager defaultManager] removeItemAtPath:parent error:nil];
+    
+    NSData* media = content;
+    NSMutableArray* requested = ranges;
+    origin = [IQHTTPServer new];
+    [origin addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/media/movie.mp4" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        NSString* range = [request valueForRequestHeaderField:@"Range"];
+        [requested addObject:range ? range : @""];
+        [request setValue:@"\"v1\"" forResponseHeaderField:@"ETag"];
+        [request setValue:@"video/mp4" forResponseHeaderField:@"Content-Type"];
+        long long first = 0, last = (long long)media.length - 1;
+        if([range hasPrefix:@"bytes="]) {
+            NSArray* bounds = [[range substringFromIndex:6] componentsSeparatedByString:@"-"];
+            first = [bounds[0] longLongValue];
+            if([bounds[1] length] > 0) {
+                last = MIN([bounds[1] longLongValue], last);
+            }
+            request.statusCode = 206;
+            [request setValue:[NSString stringWithFormat:@"bytes %lld-%lld/%lu", first, last, (unsigned long)media.length] forResponseHeaderField:@"Content-Range"];
+        }
+        [request writeData:[media subdataWithRange:NSMakeRange((NSUInteger)first, (NSUInteger)(last - first + 1))]];
+        [request done];
+    }];
+    origin.started = YES;
+    XCTAssertTrue(origin.started, @"Server failed to start");
+}
+
+- (void)tearDown
+{
+    origin.started = NO;
+    [[NSFileManager defaultManager] removeItemAtPath:parent error:nil];
+    [super tearDown];
+}
+
+- (IQStreamingMediaCache*) cacheWithName:(NSString*)name
+{
+    IQStreamingMediaCache* cache = [[IQStreamingMediaCache alloc] initWithName:name parent:parent];
+    cache.chunkSize = 1000;
+    cache.maxReadAhead = 4000;
+    return cache;
+}
+
+- (NSData*) play:(IQStreamingCachedItem*)item range:(NSString*)range status:(NSInteger*)status
+{
+    IQTransferManager* tm = [IQTransferManager new];
+    tm.ignoreErrorStatusCodes = YES;
+    __block NSData* result = nil;
+    IQTransferItem* transfer = [tm downloadDataFromURL:item.localURL handler:^(NSData *data) {
+        result = data;
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Failed with error %@", error);
+    }];
+    if(range) {
+        [transfer setValue:range forRequestHeaderField:@"Range"];
+    }
+    [tm waitUntilEmpty];
+    if(status) *status = transfer.statusCode;
+    // Let read-ahead finish
+    [item.cache.transferManager waitUntilEmpty];
+    return result;
+}
+
+- (void)testPlaybackAndReplay
+{
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/media/movie.mp4", origin.port]];
+    @autoreleasepool {
+        IQStreamingMediaCache* cache = [self cacheWithName:@"playback"];
+        IQStreamingCachedItem* item = [cache cachedItemAtURL:url];
+        XCTAssertTrue(item == [cache cachedItemAtURL:url], @"The same URL should give the same item");
+        XCTAssertTrue([item.localURL.path hasSuffix:@"/movie.mp4"], @"The local URL should keep the file name");
+        
+        // Playback starts with the first chunk and two chunks of read-ahead
+        NSInteger status = 0;
+        NSData* start = [self play:item range:@"bytes=0-999" status:&status];
+        XCTAssertEqual((int)status, 206);
+        XCTAssertEqualObjects(start, [content subdataWithRange:NSMakeRange(0, 1000)]);
+        XCTAssertEqualObjects(ranges, (@[@"bytes=0-2999"]));
+        XCTAssertEqual(item.length, 10000ll);
+        
+        // Playing on fetches the rest
+        NSData* all = [self play:item range:nil status:&status];
+        XCTAssertEqual((int)status, 200);
+        XCTAssertEqualObjects(all, content);
+        XCTAssertTrue(item.isComplete, @"All of the media should be on disk");
+    }
+    
+    // A replay, also by a new cache using the same directory, is served from disk
+    [ranges removeAllObjects];
+    IQStreamingMediaCache* cache = [self cacheWithName:@"playback"];
+    IQStreamingCachedItem* item = [cache cachedItemAtURL:url];
+    XCTAssertEqualObjects([self play:item range:nil status:NULL], content);
+    XCTAssertEqualObjects([self play:item range:@"bytes=9500-" status:NULL], [content subdataWithRange:NSMakeRange(9500, 500)]);
+    XCTAssertEqual((int)ranges.count, 0, @"A replay should not go to the origin");
+}
+
+- (void)testSeekFetchesOnlyWhatIsNeeded
+{
+    IQStreamingMediaCache* cache = [self cacheWithName:@"seek"];
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/media/movie.mp4", origin.port]];
+    IQStreamingCachedItem* item = [cache cachedItemAtURL:url];
+    
+    NSInteger status = 0;
+    NSData* data = [self play:item range:@"bytes=7500-7999" status:&status];
+    XCTAssertEqual((int)status, 206);
+    XCTAssertEqualObjects(data, [content subdataWithRange:NSMakeRange(7500, 500)]);
+    XCTAssertEqualObjects(ranges, (@[@"bytes=7000-9999"]));
+    XCTAssertEqual(item.cachedLength, 3000ll);
+    
+    // Seeking back fetches from the new position only
+    data = [self play:item range:@"bytes=2000-2499" status:NULL];
+    XCTAssertEqualObjects(data, [content subdataWithRange:NSMakeRange(2000, 500)]);
+    XCTAssertEqualObjects(ranges.lastObject, @"bytes=2000-4999");
+    XCTAssertEqual(item.cachedLength, 6000ll);
+    
+    // Ranges the origin never sent are unsatisfiable locally too
+    [self play:item range:@"bytes=10000-" status:&status];
+    XCTAssertEqual((int)status, 416);
+}
+
+@end
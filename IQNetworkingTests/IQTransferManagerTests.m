@@ -17,6 +17,7 @@
 //
 
 #import "IQTransferManager.h"
+#import "IQHTTPServer.h"
 
 #import <XCTest/XCTest.h>
 
@@ -67,4 +68,377 @@
     XCTAssertEqual(2, counter, @"Expected 2 completed requests, but was %d", counter);
 }
 
+- (IQHTTPServer*) startServerRecordingRequests:(NSMutableArray*)requests
+{
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/item/([0-9]+)" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [requests addObject:[request valueForUrlPatternGroup:1]];
+        // Respond a little later, so that the transfers queued meanwhile have to wait
+        CFRunLoopTimerRef timer = CFRunLoopTimerCreateWithHandler(NULL, CFAbsoluteTimeGetCurrent() + 0.05, 0, 0, 0, ^(CFRunLoopTimerRef timer) {
+            [request writeString:[request valueForUrlPatternGroup:1]];
+            [request done];
+        });
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopCommonModes);
+        CFRelease(timer);
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    return server;
+}
+
+- (NSURL*) URLForItem:(int)item server:(IQHTTPServer*)server
+{
+    return [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/item/%d", server.port, item]];
+}
+
+- (void)testPriorityAndCancel
+{
+    NSMutableArray* requests = [NSMutableArray array];
+    IQHTTPServer* server = [self startServerRecordingRequests:requests];
+    IQTransferManager* tm = [IQTransferManager new];
+    tm.maxConcurrentTransfers = 1;
+    // Transfers are started in the background, so hold them until all have been queued
+    tm.paused = YES;
+    
+    IQTransferItem* cancelled = nil;
+    for(int i = 1; i <= 3; i++) {
+        IQTransferItem* item = [tm downloadStringFromURL:[self URLForItem:i server:server] handler:^(NSString *string) {
+            XCTAssertFalse([string isEqualToString:@"2"], @"Cancelled transfer should not complete");
+        } errorHandler:^(NSError *error) {
+            XCTFail(@"HTTP request failed");
+        }];
+        item.priority = IQTransferPriorityLow;
+        if(i == 2) cancelled = item;
+    }
+    IQTransferItem* urgent = [tm downloadStringFromURL:[self URLForItem:9 server:server] handler:nil errorHandler:^(NSError *error) {
+        XCTFail(@"HTTP request failed");
+    }];
+    urgent.priority = IQTransferPriorityHigh;
+    [cancelled cancel];
+    tm.paused = NO;
+    
+    [tm waitUntilEmpty];
+    
+    NSArray* expected = @[@"9", @"1", @"3"];
+    XCTAssertEqualObjects(requests, expected, @"High priority transfers should go first, cancelled ones not at all");
+    server.started = NO;
+}
+
+- (void)testCoalescing
+{
+    NSMutableArray* requests = [NSMutableArray array];
+    IQHTTPServer* server = [self startServerRecordingRequests:requests];
+    IQTransferManager* tm = [IQTransferManager new];
+    
+    __block int counter = 0;
+    for(int i = 0; i < 5; i++) {
+        [tm downloadStringFromURL:[self URLForItem:7 server:server] handler:^(NSString *string) {
+            XCTAssertEqualObjects(string, @"7");
+            counter++;
+        } errorHandler:^(NSError *error) {
+            XCTFail(@"HTTP request failed");
+        }];
+    }
+    
+    [tm waitUntilEmpty];
+    
+    XCTAssertEqual(5, counter, @"Every transfer should get the response");
+    XCTAssertEqual(1, (int)requests.count, @"Identical transfers should share one request");
+    server.started = NO;
+}
+
+- (void)testDeliveryQueue
+{
+    NSMutableArray* requests = [NSMutableArray array];
+    IQHTTPServer* server = [self startServerRecordingRequests:requests];
+    IQTransferManager* tm = [IQTransferManager new];
+    tm.deliveryQueue = [NSOperationQueue new];
+    
+    NSMutableArray* events = [NSMutableArray array];
+    [tm downloadDataProgressivelyFromURL:[self URLForItem:5 server:server] handler:^BOOL(NSData *data) {
+        XCTAssertFalse([NSThread isMainThread], @"Handlers should be called on the delivery queue");
+        [events addObject:@"data"];
+        return YES;
+    } done:^{
+        XCTAssertFalse([NSThread isMainThread], @"Handlers should be called on the delivery queue");
+        [events addObject:@"done"];
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"HTTP request failed");
+    }];
+    [tm downloadDictionaryFromURL:[self URLForItem:6 server:server] handler:^(NSDictionary *dictionary) {
+        XCTAssertFalse([NSThread isMainThread], @"Handlers should be called on the delivery queue");
+    } format:IQSerializationFormatJSON errorHandler:^(NSError *error) {
+        // The server does not respond with JSON
+        XCTAssertFalse([NSThread isMainThread], @"Handlers should be called on the delivery queue");
+    }];
+    
+    [tm waitUntilEmpty];
+    
+    XCTAssertEqualObjects(events.lastObject, @"done", @"The done handler should be called after the data handler");
+    XCTAssertEqual(2, (int)requests.count);
+    server.started = NO;
+}
+
+- (IQHTTPServer*) startServerWithContent:(NSData*)content recordingRanges:(NSMutableArray*)ranges
+{
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/ranged" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        NSString* range = [request valueForRequestHeaderField:@"Range"];
+        NSString* ifRange = [request valueForRequestHeaderField:@"If-Range"];
+        [ranges addObject:range ? range : @""];
+        [request setValue:@"\"v1\"" forResponseHeaderField:@"ETag"];
+        long long first = 0, last = (long long)content.length - 1;
+        if([range hasPrefix:@"bytes="] && (!ifRange || [ifRange isEqualToString:@"\"v1\""])) {
+            NSArray* bounds = [[range substringFromIndex:6] componentsSeparatedByString:@"-"];
+            first = [bounds[0] longLongValue];
+            if([bounds[1] length] > 0) {
+                last = MIN([bounds[1] longLongValue], last);
+            }
+            request.statusCode = 206;
+            [request setValue:[NSString stringWithFormat:@"bytes %lld-%lld/%lu", first, last, (unsigned long)content.length] forResponseHeaderField:@"Content-Range"];
+        }
+        [request writeData:[content subdataWithRange:NSMakeRange((NSUInteger)first, (NSUInteger)(last - first + 1))]];
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    return server;
+}
+
+- (NSData*) patternedDataOfLength:(NSUInteger)length
+{
+    NSMutableData* content = [NSMutableData dataWithLength:length];
+    for(NSUInteger i = 0; i < content.length; i += 1000) {
+        ((uint8_t*)content.mutableBytes)[i] = (uint8_t)(i / 1000);
+    }
+    return content;
+}
+
+- (void)testResumableDownload
+{
+    NSData* content = [self patternedDataOfLength:100000];
+    NSMutableArray* ranges = [NSMutableArray array];
+    IQHTTPServer* server = [self startServerWithContent:content recordingRanges:ranges];
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/ranged", server.port]];
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IQTransferManagerTests-resume"];
+    NSString* resumePath = [path stringByAppendingString:@".resume"];
+    IQTransferManager* tm = [IQTransferManager new];
+    
+    // An interrupted download of the same version continues where it was
+    [[content subdataWithRange:NSMakeRange(0, 30000)] writeToFile:path atomically:YES];
+    [@{@"url": url.absoluteString, @"validator": @"\"v1\""} writeToFile:resumePath atomically:YES];
+    [tm resumableDownloadFromURL:url toPath:path done:nil errorHandler:^(NSError *error) {
+        XCTFail(@"HTTP request failed");
+    }];
+    [tm waitUntilEmpty];
+    XCTAssertEqualObjects([NSData dataWithContentsOfFile:path], content);
+    XCTAssertEqualObjects(ranges.lastObject, @"bytes=30000-");
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:resumePath], @"The validator should be removed when the download is complete");
+    
+    // One of another version is downloaded from the start
+    [[NSData dataWithBytes:"stale" length:5] writeToFile:path atomically:YES];
+    [@{@"url": url.absoluteString, @"validator": @"\"v0\""} writeToFile:resumePath atomically:YES];
+    [tm resumableDownloadFromURL:url toPath:path done:nil errorHandler:^(NSError *error) {
+        XCTFail(@"HTTP request failed");
+    }];
+    [tm waitUntilEmpty];
+    XCTAssertEqualObjects([NSData dataWithContentsOfFile:path], content);
+    
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+    server.started = NO;
+}
+
+- (void)testSegmentedDownload
+{
+    NSData* content = [self patternedDataOfLength:3*1024*1024 + 12345];
+    NSMutableArray* ranges = [NSMutableArray array];
+    IQHTTPServer* server = [self startServerWithContent:content recordingRanges:ranges];
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/ranged", server.port]];
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IQTransferManagerTests-segmented"];
+    IQTransferManager* tm = [IQTransferManager new];
+    
+    __block BOOL completed = NO;
+    [tm downloadFromURL:url toPath:path segments:3 done:^{
+        completed = YES;
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"HTTP request failed");
+    }];
+    [tm waitUntilEmpty];
+    
+    XCTAssertTrue(completed);
+    XCTAssertEqualObjects([NSData dataWithContentsOfFile:path], content);
+    XCTAssertEqual(4, (int)ranges.count, @"Expected the first segment and three more");
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+    server.started = NO;
+}
+
+- (void)testLargeDownloadCopiesOnce
+{
+    NSMutableData* content = [NSMutableData dataWithLength:3*1024*1024];
+    for(NSUInteger i = 0; i < content.length; i += 4096) {
+        ((uint8_t*)content.mutableBytes)[i] = (uint8_t)(i / 4096);
+    }
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/large" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeData:content];
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/large", server.port]];
+    IQTransferManager* tm = [IQTransferManager new];
+    
+    IQTransferItem* memoryItem = [tm downloadDataFromURL:url handler:^(NSData *result) {
+        XCTAssertEqualObjects(result, content);
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"HTTP request failed");
+    }];
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IQTransferManagerTests-large"];
+    IQTransferItem* fileItem = [tm downloadFromURL:url toPath:path done:^{
+        XCTAssertEqualObjects([NSData dataWithContentsOfFile:path], content);
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"HTTP request failed");
+    }];
+    [tm waitUntilEmpty];
+    
+    XCTAssertEqual((long long)content.length, memoryItem.bytesCopied, @"The result buffer should be sized from Content-Length");
+    XCTAssertTrue(fileItem.bytesCopied <= (long long)content.length, @"File downloads should copy each byte at most once");
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+    server.started = NO;
+}
+
+- (void)testDecodedDownloadsArePresized
+{
+    NSMutableString* json = [NSMutableString stringWithString:@"{\"text\": \""];
+    while(json.length < 256*1024) {
+        [json appendString:@"0123456789abcdef"];
+    }
+    [json appendString:@"\"}"];
+    NSData* content = [json dataUsingEncoding:NSUTF8StringEncoding];
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/json" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeData:content];
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    IQTransferManager* tm = [IQTransferManager new];
+    
+    // Different URLs, so that the transfers are not coalesced
+    NSURL* stringURL = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/json?string", server.port]];
+    IQTransferItem* stringItem = [tm downloadStringFromURL:stringURL handler:^(NSString *string) {
+        XCTAssertEqual(string.length, json.length);
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"HTTP request failed");
+    }];
+    NSURL* dictionaryURL = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/json?dictionary", server.port]];
+    IQTransferItem* dictionaryItem = [tm downloadDictionaryFromURL:dictionaryURL handler:^(NSDictionary *dictionary) {
+        XCTAssertNotNil(dictionary[@"text"]);
+    } format:IQSerializationFormatJSON errorHandler:^(NSError *error) {
+        XCTFail(@"HTTP request failed");
+    }];
+    [tm waitUntilEmpty];
+    
+    XCTAssertEqual((long long)content.length, stringItem.bytesCopied, @"The string download should be sized from Content-Length");
+    XCTAssertEqual((long long)content.length, dictionaryItem.bytesCopied, @"The dictionary download should be sized from Content-Length");
+    server.started = NO;
+}
+
+- (void)testProgressAggregation
+{
+    NSData* content = [self patternedDataOfLength:2*1024*1024];
+    IQHTTPServer* server = [self startServerWithContent:content recordingRanges:[NSMutableArray array]];
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/ranged", server.port]];
+    IQTransferManager* tm = [IQTransferManager new];
+    tm.coalesceRequests = NO;
+    IQProgressAgregator* aggregator = [IQProgressAgregator new];
+    aggregator.updateInterval = 0.05;
+    __block int notifications = 0;
+    id observer = [[NSNotificationCenter defaultCenter] addObserverForName:kIQProgressAggregatorProgressChanged object:aggregator queue:nil usingBlock:^(NSNotification *note) {
+        XCTAssertTrue([NSThread isMainThread], @"Progress should be posted on the main thread");
+        XCTAssertTrue(aggregator.bytesDone <= 4*(long long)content.length, @"Bytes were counted twice");
+        notifications++;
+    }];
+    
+    __block int blocks = 0;
+    for(int i = 0; i < 4; i++) {
+        IQTransferItem* item = [tm downloadDataProgressivelyFromURL:url handler:^BOOL(NSData *data) {
+            blocks++;
+            return YES;
+        } done:nil errorHandler:^(NSError *error) {
+            XCTFail(@"HTTP request failed");
+        }];
+        [aggregator addProgressible:item];
+    }
+    XCTAssertTrue(aggregator.working);
+    [tm waitUntilEmpty];
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.2]];
+    
+    // Completed transfers leave the totals, and progress is posted at a fixed rate rather than per block
+    XCTAssertFalse(aggregator.working);
+    XCTAssertEqual(aggregator.totalBytes, 0ll);
+    XCTAssertEqual(aggregator.bytesDone, 0ll);
+    XCTAssertEqual(aggregator.throughput, 0.0);
+    XCTAssertTrue(notifications > 0, @"No progress was posted");
+    XCTAssertTrue(notifications < blocks, @"%d notifications for %d blocks", notifications, blocks);
+    [[NSNotificationCenter defaultCenter] removeObserver:observer];
+    server.started = NO;
+}
+
+- (void)testStreamingJSON
+{
+    IQHTTPServer* server = [IQHTTPServer new];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/feed" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request setValue:@"application/json" forResponseHeaderField:@"Content-Type"];
+        [request writeString:@"[{\"id\": 0}"];
+        for(int i = 1; i < 1000; i++) {
+            [request writeString:[NSString stringWithFormat:@", {\"id\": %d, \"name\": \"item %d\"}", i, i]];
+        }
+        [request writeString:@"]"];
+        [request done];
+    }];
+    [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/object" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
+        [request writeString:@"{\"list\": [1, 2.5, true, null], \"text\": \"caf\\u00e9\"}"];
+        [request done];
+    }];
+    server.started = YES;
+    XCTAssertTrue(server.started, @"Server failed to start");
+    IQTransferManager* tm = [IQTransferManager new];
+    
+    NSMutableArray* events = [NSMutableArray array];
+    NSURL* feed = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/feed", server.port]];
+    [tm downloadArrayElementsFromURL:feed handler:^(id element) {
+        [events addObject:[element objectForKey:@"id"]];
+    } done:^{
+        [events addObject:@"done"];
+    } errorHandler:^(NSError *error) {
+        XCTFail(@"Streaming the array failed: %@", error);
+    }];
+    __block NSDictionary* object = nil;
+    NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%d/object", server.port]];
+    [tm downloadDictionaryProgressivelyFromURL:url handler:^(NSDictionary *dictionary) {
+        object = dictionary;
+    } format:IQSerializationFormatJSON errorHandler:^(NSError *error) {
+        XCTFail(@"Streaming the object failed: %@", error);
+    }];
+    __block NSError* rootError = nil;
+    [tm downloadDictionaryProgressivelyFromURL:feed handler:^(NSDictionary *dictionary) {
+        XCTFail(@"An array is not a dictionary");
+    } format:IQSerializationFormatJSON errorHandler:^(NSError *error) {
+        rootError = error;
+    }];
+    
+    [tm waitUntilEmpty];
+    
+    // The elements arrive in order, before the done handler
+    XCTAssertEqual((int)events.count, 1001);
+    XCTAssertEqualObjects(events[999], @999);
+    XCTAssertEqualObjects(events.lastObject, @"done");
+    XCTAssertEqualObjects(object[@"text"], @"caf\u00e9");
+    XCTAssertEqualObjects(object[@"list"][1], @2.5);
+    XCTAssertEqualObjects(object[@"list"][3], [NSNull null]);
+    XCTAssertNotNil(rootError, @"A root that is not an object should fail");
+    server.started = NO;
+}
+
 @end
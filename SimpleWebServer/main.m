@@ -25,7 +25,7 @@ int main(int argc, const char * argv[])
     //[server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@".+" options:0 error:nil] directory:@"."];
     [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/[^v]+" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
         //NSLog(@"Got request :%@ %lld", request, request.requestBodyLength);
-        if(request.requestBodyLength > 0) {
+        if(request.requestBodyLength != 0) {
             //[request writeString:@"Hej POST!"];
             [request readRequestBody:^(IQHTTPServerRequest *request, NSData *data) {
                 NSLog(@"Did read request body: %ld", data.length);
@@ -39,7 +39,6 @@ int main(int argc, const char * argv[])
     }];
     IQTransferManager* mgr = [[IQTransferManager alloc] init];
     [server addURLPattern:[NSRegularExpression regularExpressionWithPattern:@"/v" options:0 error:nil] callback:^(IQHTTPServerRequest *request, NSInteger sequence) {
-        request.writeBufferLimit = 100*1024*1024;
         NSLog(@"Got request, starting download");
         [request setValue:[request valueForRequestHeaderField:@"Content-Type"] forResponseHeaderField:@"Content-Type"];
         [request setValue:[request valueForRequestHeaderField:@"Content-Length"] forResponseHeaderField:@"Content-Length"];